@@ -37,6 +37,7 @@
 #include <stdlib.h>
 #include <poll.h>
 #include <string.h>
+#include <stdarg.h>
 #include <time.h>
 #include <errno.h>
 
@@ -44,12 +45,34 @@
 #include "zmalloc.h"
 #include "config.h"
 
+/* Use io_uring when compiled with it, see aeEnableIoUring(). */
+static int ae_io_uring_enabled = 0;
+
+/* Receives the errors the multiplexing layer recovered from, see
+ * aeSetApiErrorProc(). */
+static aeApiErrorProc *ae_api_error_proc = NULL;
+
+#if defined(HAVE_EPOLL) && defined(HAVE_IO_URING) && !defined(HAVE_EVPORT)
+static void aeReportApiError(const char *fmt, ...) {
+    char msg[256];
+    va_list ap;
+
+    if (ae_api_error_proc == NULL) return;
+    va_start(ap, fmt);
+    vsnprintf(msg, sizeof(msg), fmt, ap);
+    va_end(ap);
+    ae_api_error_proc(msg);
+}
+#endif
+
 /* Include the best multiplexing layer supported by this system.
  * The following should be ordered by performances, descending. */
 #ifdef HAVE_EVPORT
 #include "ae_evport.c"
 #else
-    #ifdef HAVE_EPOLL
+    #if defined(HAVE_EPOLL) && defined(HAVE_IO_URING)
+    #include "ae_iouring.c"
+    #elif defined(HAVE_EPOLL)
     #include "ae_epoll.c"
     #else
         #ifdef HAVE_KQUEUE
@@ -546,6 +569,20 @@ char *aeGetApiName(void) {
     return aeApiName();
 }
 
+/* Use io_uring instead of epoll for the event loops created from now on,
+ * if Redis was compiled with io_uring support (USE_IO_URING=yes) and the
+ * kernel supports it. Otherwise epoll is silently used. */
+void aeEnableIoUring(int enable) {
+    ae_io_uring_enabled = enable;
+}
+
+/* Set the function called to report the errors of the multiplexing layer
+ * that don't stop the event loop, for instance io_uring failing and the
+ * event loop switching to epoll. */
+void aeSetApiErrorProc(aeApiErrorProc *proc) {
+    ae_api_error_proc = proc;
+}
+
 void aeSetBeforeSleepProc(aeEventLoop *eventLoop, aeBeforeSleepProc *beforesleep) {
     eventLoop->beforesleep = beforesleep;
 }
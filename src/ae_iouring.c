@@ -0,0 +1,366 @@
+/* Linux io_uring based ae.c module, with epoll fallback.
+ *
+ * Instead of calling epoll_ctl() every time the interest set of a file
+ * descriptor changes, changes are just recorded and turned into one-shot
+ * poll requests, that are submitted in batch, together with the wait for
+ * completions, by aeApiPoll(). Every completion is a fired event: the poll
+ * request of the descriptor is armed again by the next aeApiPoll() call if
+ * the descriptor is still registered, so the semantic is level triggered
+ * exactly like the one of the other implementations.
+ *
+ * Note that this is only a polling backend: it saves the epoll_ctl() calls
+ * and merges the submission with the wait, but the reads and the writes of
+ * the clients are still performed by connection.c with a system call each,
+ * so their per-event cost is not removed. Batched read/write requests with
+ * registered buffers would need the connection layer to submit the I/O
+ * itself and are not implemented.
+ *
+ * io_uring is only used if enabled with aeEnableIoUring() before creating
+ * the event loop, and if the kernel supports it. Otherwise the epoll
+ * implementation is used. If io_uring fails later, the event loop switches
+ * to epoll, registering again all the file descriptors.
+ *
+ * Copyright (c) 2026, the redis-analysis contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+
+#include <liburing.h>
+
+/* The epoll implementation is included with renamed symbols, to be used
+ * as fallback. */
+#define aeApiState aeEpollState
+#define aeApiCreate aeEpollCreate
+#define aeApiResize aeEpollResize
+#define aeApiFree aeEpollFree
+#define aeApiAddEvent aeEpollAddEvent
+#define aeApiDelEvent aeEpollDelEvent
+#define aeApiPoll aeEpollPoll
+#define aeApiName aeEpollName
+#include "ae_epoll.c"
+#undef aeApiState
+#undef aeApiCreate
+#undef aeApiResize
+#undef aeApiFree
+#undef aeApiAddEvent
+#undef aeApiDelEvent
+#undef aeApiPoll
+#undef aeApiName
+
+#define AE_URING_ENTRIES 1024
+#define AE_URING_IGNORE ((uint64_t)-1) /* user_data of cancel requests. */
+
+/* The first event loop created decides if io_uring is used: -1 means it
+ * was not decided yet. */
+static int ae_uring_active = -1;
+static int ae_uring_loops = 0; /* Event loops using io_uring. */
+
+typedef struct aeApiState {
+    struct io_uring ring;
+    int *armed;         /* Mask of the poll request armed for every fd. */
+    unsigned *gen;      /* Generation of the last poll request of every fd. */
+    int *changed;       /* Fds whose poll request may need an update. */
+    char *ischanged;
+    int numchanged;
+} aeApiState;
+
+/* The user data of poll requests is the fd and a generation number, so
+ * that the completions of requests that were replaced, or that refer to a
+ * closed fd that was reused, can be ignored. */
+static uint64_t aeUringUserData(aeApiState *state, int fd) {
+    return ((uint64_t)state->gen[fd] << 32) | (uint32_t)fd;
+}
+
+static int aeUringCreate(aeEventLoop *eventLoop) {
+    aeApiState *state = zcalloc(sizeof(aeApiState));
+    int setsize = eventLoop->setsize;
+
+    if (io_uring_queue_init(AE_URING_ENTRIES, &state->ring, 0) < 0) {
+        zfree(state);
+        return -1;
+    }
+    state->armed = zcalloc(sizeof(int)*setsize);
+    state->gen = zcalloc(sizeof(unsigned)*setsize);
+    state->changed = zmalloc(sizeof(int)*setsize);
+    state->ischanged = zcalloc(setsize);
+    eventLoop->apidata = state;
+    ae_uring_loops++;
+    return 0;
+}
+
+static int aeApiCreate(aeEventLoop *eventLoop) {
+    if (ae_uring_active == -1) {
+        ae_uring_active = ae_io_uring_enabled &&
+                          aeUringCreate(eventLoop) == 0;
+        if (ae_uring_active) return 0;
+    } else if (ae_uring_active) {
+        return aeUringCreate(eventLoop);
+    }
+    return aeEpollCreate(eventLoop);
+}
+
+static int aeApiResize(aeEventLoop *eventLoop, int setsize) {
+    if (!ae_uring_active) return aeEpollResize(eventLoop,setsize);
+
+    aeApiState *state = eventLoop->apidata;
+    int oldsize = eventLoop->setsize;
+
+    state->armed = zrealloc(state->armed, sizeof(int)*setsize);
+    state->gen = zrealloc(state->gen, sizeof(unsigned)*setsize);
+    state->changed = zrealloc(state->changed, sizeof(int)*setsize);
+    state->ischanged = zrealloc(state->ischanged, setsize);
+    for (int j = oldsize; j < setsize; j++) {
+        state->armed[j] = AE_NONE;
+        state->gen[j] = 0;
+        state->ischanged[j] = 0;
+    }
+    return 0;
+}
+
+static void aeUringFree(aeApiState *state) {
+    io_uring_queue_exit(&state->ring);
+    zfree(state->armed);
+    zfree(state->gen);
+    zfree(state->changed);
+    zfree(state->ischanged);
+    zfree(state);
+    ae_uring_loops--;
+}
+
+static void aeApiFree(aeEventLoop *eventLoop) {
+    if (!ae_uring_active) {
+        aeEpollFree(eventLoop);
+        return;
+    }
+
+    aeUringFree(eventLoop->apidata);
+}
+
+static void aeUringSetChanged(aeApiState *state, int fd) {
+    if (state->ischanged[fd]) return;
+    state->ischanged[fd] = 1;
+    state->changed[state->numchanged++] = fd;
+}
+
+/* Registration is deferred to aeApiPoll(), that will find the new mask
+ * in eventLoop->events[fd].mask. */
+static int aeApiAddEvent(aeEventLoop *eventLoop, int fd, int mask) {
+    if (!ae_uring_active) return aeEpollAddEvent(eventLoop,fd,mask);
+    aeUringSetChanged(eventLoop->apidata,fd);
+    return 0;
+}
+
+static void aeApiDelEvent(aeEventLoop *eventLoop, int fd, int delmask) {
+    if (!ae_uring_active) {
+        aeEpollDelEvent(eventLoop,fd,delmask);
+        return;
+    }
+    aeUringSetChanged(eventLoop->apidata,fd);
+}
+
+/* Make room for 'n' submission queue entries, submitting the queued ones
+ * if needed. On error the negative errno of io_uring_submit() is returned:
+ * the entries already queued stay in the submission queue, and are
+ * submitted by the next successful io_uring_enter(). */
+static int aeUringReserveSqes(aeApiState *state, unsigned n) {
+    while (io_uring_sq_space_left(&state->ring) < n) {
+        int ret = io_uring_submit(&state->ring);
+        if (ret == -EINTR) continue;
+        if (ret < 0) return ret;
+        if (ret == 0) return -EAGAIN;
+    }
+    return 0;
+}
+
+/* Queue the requests needed to make the poll requests of the changed fds
+ * match the events they are registered for. On error the negative errno
+ * is returned, and the fds not handled yet are left in the changed list. */
+static int aeUringQueueChanges(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+    int j, err = 0;
+
+    for (j = 0; j < state->numchanged; j++) {
+        int fd = state->changed[j];
+        int mask = eventLoop->events[fd].mask & (AE_READABLE|AE_WRITABLE);
+        struct io_uring_sqe *sqe;
+
+        if (state->armed[fd] != mask) {
+            unsigned needed = (state->armed[fd] != AE_NONE) +
+                              (mask != AE_NONE);
+            if ((err = aeUringReserveSqes(state,needed)) < 0) break;
+        }
+        state->ischanged[fd] = 0;
+        if (state->armed[fd] == mask) continue;
+
+        if (state->armed[fd] != AE_NONE) {
+            sqe = io_uring_get_sqe(&state->ring);
+            io_uring_prep_poll_remove(sqe, aeUringUserData(state,fd));
+            io_uring_sqe_set_data64(sqe, AE_URING_IGNORE);
+        }
+        state->gen[fd]++;
+        state->armed[fd] = mask;
+        if (mask != AE_NONE) {
+            unsigned pollmask = 0;
+            if (mask & AE_READABLE) pollmask |= POLLIN;
+            if (mask & AE_WRITABLE) pollmask |= POLLOUT;
+            sqe = io_uring_get_sqe(&state->ring);
+            io_uring_prep_poll_add(sqe, fd, pollmask);
+            io_uring_sqe_set_data64(sqe, aeUringUserData(state,fd));
+        }
+    }
+    state->numchanged -= j;
+    memmove(state->changed, state->changed+j, sizeof(int)*state->numchanged);
+    return err;
+}
+
+/* Switch the event loop to epoll, registering there all the fds with the
+ * events they are registered for. This is only possible if no other event
+ * loop is using io_uring, since the implementation in use is global.
+ * Return 0 on success, -1 if the event loop keeps using io_uring. */
+static int aeUringFallback(aeEventLoop *eventLoop) {
+    aeApiState *state = eventLoop->apidata;
+
+    if (ae_uring_loops != 1 || aeEpollCreate(eventLoop) == -1) {
+        eventLoop->apidata = state;
+        return -1;
+    }
+    aeEpollState *epstate = eventLoop->apidata;
+    for (int fd = 0; fd <= eventLoop->maxfd; fd++) {
+        int mask = eventLoop->events[fd].mask;
+        struct epoll_event ee = {0};
+
+        if (mask == AE_NONE) continue;
+        if (mask & AE_READABLE) ee.events |= EPOLLIN;
+        if (mask & AE_WRITABLE) ee.events |= EPOLLOUT;
+        ee.data.fd = fd;
+        if (epoll_ctl(epstate->epfd,EPOLL_CTL_ADD,fd,&ee) == -1)
+            aeReportApiError("epoll_ctl() failed registering fd %d: %s",
+                fd, strerror(errno));
+    }
+    aeUringFree(state);
+    ae_uring_active = 0;
+    return 0;
+}
+
+/* Handle an unexpected io_uring error: switch to epoll if possible,
+ * otherwise arm again the poll requests of all the fds, since we can't
+ * know which of them reached the kernel. The replaced requests that
+ * were submitted anyway are ignored thanks to the generation number.
+ * Return 0 if the event loop switched to epoll. */
+static int aeUringHandleError(aeEventLoop *eventLoop, const char *call,
+                              int err)
+{
+    aeApiState *state = eventLoop->apidata;
+
+    if (aeUringFallback(eventLoop) == 0) {
+        aeReportApiError("%s failed: %s. Switched to epoll.",
+            call, strerror(-err));
+        return 0;
+    }
+    aeReportApiError("%s failed: %s. Poll requests will be submitted again.",
+        call, strerror(-err));
+    for (int fd = 0; fd <= eventLoop->maxfd; fd++) {
+        if (state->armed[fd] == AE_NONE) continue;
+        state->armed[fd] = AE_NONE;
+        aeUringSetChanged(state,fd);
+    }
+    return -1;
+}
+
+static int aeApiPoll(aeEventLoop *eventLoop, struct timeval *tvp) {
+    if (!ae_uring_active) return aeEpollPoll(eventLoop,tvp);
+
+    aeApiState *state = eventLoop->apidata;
+    struct io_uring_cqe *cqe;
+    unsigned head, seen = 0;
+    int numevents = 0, err;
+    const char *call = "io_uring_submit()";
+
+    err = aeUringQueueChanges(eventLoop);
+
+    /* Submit the queued requests and wait for completions with a single
+     * system call. */
+    if (err == 0) {
+        if (tvp) {
+            struct __kernel_timespec ts;
+            ts.tv_sec = tvp->tv_sec;
+            ts.tv_nsec = tvp->tv_usec * 1000;
+            err = io_uring_submit_and_wait_timeout(&state->ring, &cqe, 1,
+                                                   &ts, NULL);
+        } else {
+            err = io_uring_submit_and_wait(&state->ring, 1);
+        }
+        call = "io_uring_submit_and_wait()";
+        if (err == -ETIME || err == -EINTR) err = 0;
+    }
+
+    /* -EBUSY means the completion queue overflowed: the requests stay in
+     * the submission queue, and reaping the completions below makes room
+     * for them, so they are submitted by the next call. Other errors are
+     * not expected, and we can't tell what reached the kernel. */
+    if (err < 0 && err != -EBUSY && err != -EAGAIN) {
+        if (aeUringHandleError(eventLoop,call,err) == 0)
+            return aeEpollPoll(eventLoop,tvp);
+    }
+
+    io_uring_for_each_cqe(&state->ring, head, cqe) {
+        uint64_t data = io_uring_cqe_get_data64(cqe);
+        int fd = (int)(uint32_t)data;
+        int mask = 0;
+
+        seen++;
+        /* A stale completion may refer to an fd beyond the current set
+         * size, if aeApiResize() shrank the arrays after it was closed. */
+        if (data == AE_URING_IGNORE || fd >= eventLoop->setsize ||
+            (unsigned)(data >> 32) != state->gen[fd]) continue;
+
+        /* Poll requests are one-shot: arm it again next time. */
+        state->armed[fd] = AE_NONE;
+        aeUringSetChanged(state,fd);
+
+        /* The poll request itself failed: report it like POLLERR, so that
+         * the handlers try to use the fd and notice the error, instead of
+         * waiting forever for an event that will never fire. */
+        if (cqe->res < 0) {
+            mask = AE_WRITABLE|AE_READABLE;
+        } else {
+            if (cqe->res & POLLIN) mask |= AE_READABLE;
+            if (cqe->res & POLLOUT) mask |= AE_WRITABLE;
+            if (cqe->res & POLLERR) mask |= AE_WRITABLE|AE_READABLE;
+            if (cqe->res & POLLHUP) mask |= AE_WRITABLE|AE_READABLE;
+        }
+        eventLoop->fired[numevents].fd = fd;
+        eventLoop->fired[numevents].mask = mask;
+        numevents++;
+    }
+    io_uring_cq_advance(&state->ring, seen);
+    return numevents;
+}
+
+static char *aeApiName(void) {
+    return ae_uring_active == 1 ? "io_uring" : aeEpollName();
+}
@@ -0,0 +1,297 @@
+/* Keyed hash function based on the AES-NI instructions.
+ *
+ * SipHash 1-2, that we use for the hash tables, costs a few cycles for
+ * every byte of the key, that is a visible part of the CPU time spent in
+ * commands accessing keys of some tens of bytes. This function instead
+ * consumes 16 bytes with a single AES round, that modern CPUs execute in
+ * a few cycles, using two independent lanes so that the latency of the
+ * rounds of one lane is hidden by the other.
+ *
+ * Like SipHash the function is keyed with the 128 bit random seed of the
+ * hash tables, so the attacker can't compute colliding keys offline: every
+ * input block goes through two AES rounds keyed with the seed before it
+ * is mixed with the next one, and the result goes through three more
+ * rounds. This is the same construction of other AES based hash functions
+ * used for hash tables, however note that, unlike SipHash, it is not a
+ * cryptographic PRF with a security proof.
+ *
+ * So the function is only as flood resistant as the AES construction is
+ * against adaptive attacks, where the attacker observes the behavior of
+ * the server to guess the collisions, and nobody proved it matches SipHash
+ * there. For this reason SipHash stays the default, and this function is
+ * only used for the keyspace when "hash-function aeshash" is configured,
+ * which is refused at startup if the CPU does not support AES-NI.
+ *
+ * Copyright (c) 2026, the redis-analysis contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+#include "fmacros.h"
+#include <stdint.h>
+#include <string.h>
+#include "aeshash.h"
+
+uint64_t siphash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+uint64_t siphash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k);
+
+#ifdef HAVE_AESHASH
+
+#include <cpuid.h>
+#include <emmintrin.h>
+#include <wmmintrin.h>
+
+#define AESHASH_TARGET __attribute__((target("aes,sse2")))
+#define AESHASH_INLINE static inline __attribute__((always_inline)) AESHASH_TARGET
+
+/* Return non zero if the CPU supports the AES-NI instructions. */
+int aeshashAvailable(void) {
+    unsigned int eax, ebx, ecx, edx;
+
+    if (!__get_cpuid(1,&eax,&ebx,&ecx,&edx)) return 0;
+    return (ecx & bit_AES) != 0;
+}
+
+/* Same as siptlw() in siphash.c, for 16 bytes at a time: A-Z are turned
+ * into a-z, everything else is left as it is. Bytes >= 128 are negative
+ * for the signed comparisons, so they are never touched. */
+AESHASH_INLINE __m128i aeshashToLower(__m128i v) {
+    __m128i ge = _mm_cmpgt_epi8(v,_mm_set1_epi8('A'-1));
+    __m128i le = _mm_cmplt_epi8(v,_mm_set1_epi8('Z'+1));
+    __m128i upper = _mm_and_si128(ge,le);
+    return _mm_add_epi8(v,_mm_and_si128(upper,_mm_set1_epi8('a'-'A')));
+}
+
+AESHASH_INLINE __m128i aeshashLoad(const uint8_t *p, int nocase) {
+    __m128i v = _mm_loadu_si128((const __m128i*)p);
+    return nocase ? aeshashToLower(v) : v;
+}
+
+/* Load the 'len' bytes at 'p', with len < 16, without reading past the
+ * end of the input. Like for the last block of longer inputs the loads may
+ * overlap, and for less than 4 bytes some byte may be repeated: the length
+ * is part of the state, so for a given length every input is still loaded
+ * in a different way. */
+AESHASH_INLINE __m128i aeshashLoadShort(const uint8_t *p, size_t len,
+                                        int nocase)
+{
+    uint64_t lo, hi;
+    uint32_t lo32, hi32;
+    __m128i v;
+
+    if (len >= 8) {
+        memcpy(&lo,p,8);
+        memcpy(&hi,p+len-8,8);
+    } else if (len >= 4) {
+        memcpy(&lo32,p,4);
+        memcpy(&hi32,p+len-4,4);
+        lo = lo32;
+        hi = hi32;
+    } else if (len) {
+        lo = ((uint64_t)p[0] << 16) | ((uint64_t)p[len/2] << 8) | p[len-1];
+        hi = 0;
+    } else {
+        lo = hi = 0;
+    }
+    v = _mm_set_epi64x((long long)hi,(long long)lo);
+    return nocase ? aeshashToLower(v) : v;
+}
+
+/* Consume one 16 bytes block: it is mixed into the state and goes through
+ * two rounds, that are enough for every input bit to affect all the bits
+ * of the state. */
+AESHASH_INLINE __m128i aeshashMix(__m128i s, __m128i block, __m128i k0,
+                                  __m128i k1)
+{
+    s = _mm_aesenc_si128(_mm_xor_si128(s,block),k0);
+    return _mm_aesenc_si128(s,k1);
+}
+
+AESHASH_INLINE uint64_t aeshashGeneric(const uint8_t *in, const size_t inlen,
+                                       const uint8_t *k, int nocase)
+{
+    const uint8_t *p = in;
+    size_t left = inlen;
+    __m128i k0, k1, s0, s1, a, b;
+
+    /* The second lane uses a different key, derived from the seed, so that
+     * swapping the content of the two lanes changes the result. */
+    k0 = _mm_loadu_si128((const __m128i*)k);
+    k1 = _mm_aesenc_si128(k0,_mm_set_epi64x(0x243f6a8885a308d3LL,
+                                            0x13198a2e03707344LL));
+    s0 = _mm_xor_si128(k0,_mm_set_epi64x(0,(long long)inlen));
+    s1 = k1;
+
+    while (left > 32) {
+        s0 = aeshashMix(s0,aeshashLoad(p,nocase),k0,k1);
+        s1 = aeshashMix(s1,aeshashLoad(p+16,nocase),k1,k0);
+        p += 32;
+        left -= 32;
+    }
+
+    /* The last 1 to 32 bytes. The blocks are loaded so that they end with
+     * the input, overlapping the bytes already consumed if needed: since
+     * the length is part of the state this does not cause collisions. */
+    if (left > 16) {
+        a = aeshashLoad(p,nocase);
+        b = aeshashLoad(in+inlen-16,nocase);
+    } else if (inlen >= 16) {
+        a = aeshashLoad(in+inlen-16,nocase);
+        b = _mm_setzero_si128();
+    } else {
+        a = aeshashLoadShort(in,inlen,nocase);
+        b = _mm_setzero_si128();
+    }
+    s0 = aeshashMix(s0,a,k0,k1);
+    s1 = aeshashMix(s1,b,k1,k0);
+
+    /* Finalization: merge the lanes and make every bit of the result
+     * depend on every bit of the state. */
+    s0 = _mm_aesenc_si128(s0,s1);
+    s0 = _mm_aesenc_si128(s0,k1);
+    s0 = _mm_aesenc_si128(s0,k0);
+    return (uint64_t)_mm_cvtsi128_si64(s0) ^
+           (uint64_t)_mm_cvtsi128_si64(_mm_unpackhi_epi64(s0,s0));
+}
+
+AESHASH_TARGET uint64_t aeshash(const uint8_t *in, const size_t inlen,
+                                const uint8_t *k)
+{
+    return aeshashGeneric(in,inlen,k,0);
+}
+
+AESHASH_TARGET uint64_t aeshash_nocase(const uint8_t *in, const size_t inlen,
+                                       const uint8_t *k)
+{
+    return aeshashGeneric(in,inlen,k,1);
+}
+
+#else /* !HAVE_AESHASH */
+
+int aeshashAvailable(void) {
+    return 0;
+}
+
+uint64_t aeshash(const uint8_t *in, const size_t inlen, const uint8_t *k) {
+    return siphash(in,inlen,k);
+}
+
+uint64_t aeshash_nocase(const uint8_t *in, const size_t inlen,
+                        const uint8_t *k)
+{
+    return siphash_nocase(in,inlen,k);
+}
+
+#endif
+
+#ifdef REDIS_TEST
+#include <stdio.h>
+#include <time.h>
+
+#define UNUSED(x) (void)(x)
+
+static long long aeshashTestNsec(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC,&ts);
+    return (long long)ts.tv_sec*1000000000LL + ts.tv_nsec;
+}
+
+/* Return the average nanoseconds needed to hash a key of 'len' bytes. */
+static double aeshashBenchmark(uint64_t (*hash)(const uint8_t*,
+                               const size_t, const uint8_t*),
+                               const uint8_t *buf, size_t len,
+                               const uint8_t *seed)
+{
+    const long iterations = 2000000;
+    uint64_t acc = 0;
+    long long start = aeshashTestNsec();
+
+    /* The result of every call is used as part of the next key, so that
+     * the calls can't run in parallel, like it happens for the lookups of
+     * the keys of a command. */
+    for (long j = 0; j < iterations; j++)
+        acc += hash(buf+(acc&7),len,seed);
+    long long elapsed = aeshashTestNsec()-start;
+    if (acc == 42) printf("."); /* Don't let the compiler drop the loop. */
+    return (double)elapsed/iterations;
+}
+
+int aeshashTest(int argc, char *argv[]) {
+    uint8_t buf[512+8], seed[16], seed2[16];
+    size_t sizes[] = {8,16,24,32,40,48,64,80,100,128,256,512};
+    int fails = 0;
+
+    UNUSED(argc);
+    UNUSED(argv);
+
+    for (int j = 0; j < 16; j++) {
+        seed[j] = j;
+        seed2[j] = j+1;
+    }
+    for (size_t j = 0; j < sizeof(buf); j++) buf[j] = (j*31)&0xff;
+
+    if (!aeshashAvailable()) {
+        printf("AES-NI not available, SipHash is used instead.\n");
+        return 0;
+    }
+
+    /* Every input bit, the length and the seed must affect the result. */
+    for (size_t len = 0; len <= 100; len++) {
+        uint64_t h = aeshash(buf,len,seed);
+        if (h == aeshash(buf,len+1,seed)) fails++;
+        if (h == aeshash(buf,len,seed2)) fails++;
+        for (size_t bit = 0; bit < len*8; bit++) {
+            buf[bit/8] ^= 1<<(bit%8);
+            if (h == aeshash(buf,len,seed)) fails++;
+            buf[bit/8] ^= 1<<(bit%8);
+        }
+    }
+    if (fails) printf("aeshash() collisions on single bit changes: %d\n",fails);
+
+    /* The case insensitive variant must ignore the case of A-Z only. */
+    const char *lower = "hello world, this is a long enough key: 0123456789";
+    const char *upper = "HELLO WORLD, THIS IS A LONG ENOUGH KEY: 0123456789";
+    size_t len = strlen(lower);
+    for (size_t j = 0; j <= len; j++) {
+        if (aeshash((uint8_t*)lower,j,seed) !=
+            aeshash_nocase((uint8_t*)upper,j,seed)) fails++;
+        if (aeshash_nocase((uint8_t*)lower,j,seed) !=
+            aeshash_nocase((uint8_t*)upper,j,seed)) fails++;
+    }
+    if (aeshash((uint8_t*)"\xc1",1,seed) ==
+        aeshash_nocase((uint8_t*)"\xe1",1,seed)) fails++;
+
+    printf("%-10s %12s %12s\n","key size","siphash ns","aeshash ns");
+    for (size_t j = 0; j < sizeof(sizes)/sizeof(sizes[0]); j++) {
+        printf("%-10zu %12.2f %12.2f\n", sizes[j],
+            aeshashBenchmark(siphash,buf,sizes[j],seed),
+            aeshashBenchmark(aeshash,buf,sizes[j],seed));
+    }
+
+    printf("aeshash test: %s\n", fails ? "FAILED" : "OK");
+    return fails != 0;
+}
+#endif
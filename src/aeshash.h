@@ -0,0 +1,24 @@
+#ifndef __AESHASH_H
+#define __AESHASH_H
+
+#include <stdint.h>
+#include <stddef.h>
+
+/* The AES-NI instructions are only used on x86_64, with compilers that
+ * support enabling them per function, so that the rest of the server is
+ * still compiled for the baseline CPU. The actual CPU support is checked
+ * at runtime by aeshashAvailable(). */
+#if defined(__x86_64__) && !defined(NO_AESHASH) && \
+    (defined(__clang__) || (defined(__GNUC__) && __GNUC__ >= 5))
+#define HAVE_AESHASH 1
+#endif
+
+int aeshashAvailable(void);
+uint64_t aeshash(const uint8_t *in, const size_t inlen, const uint8_t *k);
+uint64_t aeshash_nocase(const uint8_t *in, const size_t inlen, const uint8_t *k);
+
+#ifdef REDIS_TEST
+int aeshashTest(int argc, char *argv[]);
+#endif
+
+#endif
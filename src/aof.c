@@ -669,7 +669,9 @@ struct client *createAOFClient(void) {
     c->querybuf_peak = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argv_cache_len = 0;
     c->bufpos = 0;
+    c->buf = NULL;
     c->flags = 0;
     c->btype = BLOCKED_NONE;
     /* We set the fake client as a slave waiting for the synchronization
@@ -940,6 +942,9 @@ int rioWriteBulkObject(rio *r, robj *obj) {
         return rioWriteBulkLongLong(r,(long)obj->ptr);
     } else if (sdsEncodedObject(obj)) {
         return rioWriteBulkString(r,obj->ptr,sdslen(obj->ptr));
+    } else if (obj->encoding == OBJ_ENCODING_INLINE) {
+        char *s = inlineStringPtr(obj);
+        return rioWriteBulkString(r,s,strlen(s));
     } else {
         serverPanic("Unknown string encoding");
     }
@@ -1001,6 +1006,32 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
         }
+    } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = o->ptr;
+        unsigned char *p = lpFirst(lp);
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vll;
+
+        while (p != NULL) {
+            vstr = lpGetValue(p,&vlen,&vll);
+            if (count == 0) {
+                int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
+                    AOF_REWRITE_ITEMS_PER_CMD : items;
+
+                if (rioWriteBulkCount(r,'*',2+cmd_items) == 0) return 0;
+                if (rioWriteBulkString(r,"SADD",4) == 0) return 0;
+                if (rioWriteBulkObject(r,key) == 0) return 0;
+            }
+            if (vstr != NULL) {
+                if (rioWriteBulkString(r,(char*)vstr,vlen) == 0) return 0;
+            } else {
+                if (rioWriteBulkLongLong(r,vll) == 0) return 0;
+            }
+            p = lpNext(lp,p);
+            if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
+            items--;
+        }
     } else if (o->encoding == OBJ_ENCODING_HT) {
         dictIterator *di = dictGetIterator(o->ptr);
         dictEntry *de;
@@ -1031,7 +1062,7 @@ int rewriteSetObject(rio *r, robj *key, robj *o) {
 int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
     long long count = 0, items = zsetLength(o);
 
-    if (o->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (o->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = o->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1039,13 +1070,13 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
         long long vll;
         double score;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         while (eptr != NULL) {
-            serverAssert(ziplistGet(eptr,&vstr,&vlen,&vll));
+            vstr = lpGetValue(eptr,&vlen,&vll);
             score = zzlGetScore(sptr);
 
             if (count == 0) {
@@ -1073,7 +1104,7 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
 
         while((de = dictNext(di)) != NULL) {
             sds ele = dictGetKey(de);
-            double *score = dictGetVal(de);
+            double score = dictGetDoubleVal(de);
 
             if (count == 0) {
                 int cmd_items = (items > AOF_REWRITE_ITEMS_PER_CMD) ?
@@ -1083,7 +1114,7 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
                 if (rioWriteBulkString(r,"ZADD",4) == 0) return 0;
                 if (rioWriteBulkObject(r,key) == 0) return 0;
             }
-            if (rioWriteBulkDouble(r,*score) == 0) return 0;
+            if (rioWriteBulkDouble(r,score) == 0) return 0;
             if (rioWriteBulkString(r,ele,sdslen(ele)) == 0) return 0;
             if (++count == AOF_REWRITE_ITEMS_PER_CMD) count = 0;
             items--;
@@ -1102,12 +1133,12 @@ int rewriteSortedSetObject(rio *r, robj *key, robj *o) {
  *
  * The function returns 0 on error, non-zero on success. */
 static int rioWriteHashIteratorCursor(rio *r, hashTypeIterator *hi, int what) {
-    if (hi->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (hi->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *vstr = NULL;
         unsigned int vlen = UINT_MAX;
         long long vll = LLONG_MAX;
 
-        hashTypeCurrentFromZiplist(hi, what, &vstr, &vlen, &vll);
+        hashTypeCurrentFromListpack(hi, what, &vstr, &vlen, &vll);
         if (vstr)
             return rioWriteBulkString(r, (char*)vstr, vlen);
         else
@@ -1349,7 +1380,7 @@ int rewriteAppendOnlyFileRio(rio *aof) {
             o = dictGetVal(de);
             initStaticStringObject(key,keystr);
 
-            expiretime = getExpire(db,&key);
+            expiretime = dbEntryGetExpire(de);
 
             /* Save the key and associated value */
             if (o->type == OBJ_STRING) {
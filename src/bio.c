@@ -85,8 +85,12 @@ struct bio_job {
 
 void *bioProcessBackgroundJobs(void *arg);
 void lazyfreeFreeObjectFromBioThread(robj *o);
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2);
+void lazyfreeFreeDatabaseFromBioThread(dict *ht, expireIndex *expires);
 void lazyfreeFreeSlotsMapFromBioThread(rax *rt);
+void lazyfreeFreeInternedValuesFromBioThread(dict *d);
+void dictAllocTableFromBioThread(void *job);
+void backgroundRehashFromBioThread(void);
+void zsetStoreFromBioThread(void *job);
 
 /* Make sure we have enough stack to perform all the things we do in the
  * main thread. */
@@ -164,6 +168,15 @@ void *bioProcessBackgroundJobs(void *arg) {
     case BIO_LAZY_FREE:
         redis_set_thread_title("bio_lazy_free");
         break;
+    case BIO_HT_ALLOC:
+        redis_set_thread_title("bio_ht_alloc");
+        break;
+    case BIO_REHASH:
+        redis_set_thread_title("bio_rehash");
+        break;
+    case BIO_ZSET_STORE:
+        redis_set_thread_title("bio_zset_store");
+        break;
     }
 
     redisSetCpuAffinity(server.bio_cpulist);
@@ -205,14 +218,23 @@ void *bioProcessBackgroundJobs(void *arg) {
         } else if (type == BIO_LAZY_FREE) {
             /* What we free changes depending on what arguments are set:
              * arg1 -> free the object at pointer.
-             * arg2 & arg3 -> free two dictionaries (a Redis DB).
-             * only arg3 -> free the skiplist. */
+             * arg2 & arg3 -> free a Redis DB: main dict + expire index.
+             * only arg2 -> free evicted interned values.
+             * only arg3 -> free the radix tree (slots map or prefix index). */
             if (job->arg1)
                 lazyfreeFreeObjectFromBioThread(job->arg1);
             else if (job->arg2 && job->arg3)
                 lazyfreeFreeDatabaseFromBioThread(job->arg2,job->arg3);
+            else if (job->arg2)
+                lazyfreeFreeInternedValuesFromBioThread(job->arg2);
             else if (job->arg3)
                 lazyfreeFreeSlotsMapFromBioThread(job->arg3);
+        } else if (type == BIO_HT_ALLOC) {
+            dictAllocTableFromBioThread(job->arg1);
+        } else if (type == BIO_REHASH) {
+            backgroundRehashFromBioThread();
+        } else if (type == BIO_ZSET_STORE) {
+            zsetStoreFromBioThread(job->arg1);
         } else {
             serverPanic("Wrong job type in bioProcessBackgroundJobs().");
         }
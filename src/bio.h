@@ -42,6 +42,9 @@ void bioKillThreads(void);
 #define BIO_CLOSE_FILE    0 /* Deferred close(2) syscall. */
 #define BIO_AOF_FSYNC     1 /* Deferred AOF fsync. */
 #define BIO_LAZY_FREE     2 /* Deferred objects freeing. */
-#define BIO_NUM_OPS       3
+#define BIO_HT_ALLOC      3 /* Deferred hash tables allocation. */
+#define BIO_REHASH        4 /* Rehashing while the main thread sleeps. */
+#define BIO_ZSET_STORE    5 /* Deferred ZUNIONSTORE/ZINTERSTORE computation. */
+#define BIO_NUM_OPS       6
 
 #endif
@@ -514,6 +514,9 @@ unsigned char *getObjectReadOnlyString(robj *o, long *len, char *llbuf) {
     if (o && o->encoding == OBJ_ENCODING_INT) {
         p = (unsigned char*) llbuf;
         if (len) *len = ll2string(llbuf,LONG_STR_SIZE,(long)o->ptr);
+    } else if (o && o->encoding == OBJ_ENCODING_INLINE) {
+        p = (unsigned char*) inlineStringPtr(o);
+        if (len) *len = strlen((char*)p);
     } else if (o) {
         p = (unsigned char*) o->ptr;
         if (len) *len = sdslen(o->ptr);
@@ -581,6 +584,10 @@ void getbitCommand(client *c) {
     if (sdsEncodedObject(o)) {
         if (byte < sdslen(o->ptr))
             bitval = ((uint8_t*)o->ptr)[byte] & (1 << bit);
+    } else if (o->encoding == OBJ_ENCODING_INLINE) {
+        char *s = inlineStringPtr(o);
+        if (byte < strlen(s))
+            bitval = ((uint8_t*)s)[byte] & (1 << bit);
     } else {
         if (byte < (size_t)ll2string(llbuf,sizeof(llbuf),(long)o->ptr))
             bitval = llbuf[byte] & (1 << bit);
@@ -153,6 +153,8 @@ void unblockClient(client *c) {
     } else if (c->btype == BLOCKED_MODULE) {
         if (moduleClientIsBlockedOnKeys(c)) unblockClientWaitingData(c);
         unblockClientFromModule(c);
+    } else if (c->btype == BLOCKED_ZSETSTORE) {
+        unblockClientFromZsetStore(c);
     } else {
         serverPanic("Unknown btype in unblockClient().");
     }
@@ -97,6 +97,14 @@
 #define redis_fsync fsync
 #endif
 
+/* Define redis_prefetch() to a hint to load in the cache the memory at the
+ * given address, if the compiler supports it. */
+#if defined(__GNUC__) || defined(__clang__)
+#define redis_prefetch(addr) __builtin_prefetch(addr)
+#else
+#define redis_prefetch(addr) ((void)(addr))
+#endif
+
 /* Define rdb_fsync_range to sync_file_range() on Linux, otherwise we use
  * the plain fsync() call. */
 #ifdef __linux__
@@ -39,6 +39,9 @@
  *----------------------------------------------------------------------------*/
 
 int keyIsExpired(redisDb *db, robj *key);
+static int expireKeyIfNeeded(redisDb *db, robj *key, mstime_t when);
+static robj *lookupKeyReadEntry(redisDb *db, robj *key, dictEntry *de,
+                                int flags);
 
 /* Update LFU when an object is accessed.
  * Firstly, decrement the counter if the decrement time is reached.
@@ -49,28 +52,52 @@ void updateLFU(robj *val) {
     val->lru = (LFUGetTimeInMinutes()<<8) | counter;
 }
 
+/* Return the value of a keyspace entry, updating its access time. */
+static robj *lookupKeyEntry(dictEntry *de, int flags) {
+    robj *val = dictGetVal(de);
+
+    /* Update the access time for the ageing algorithm.
+     * Don't do it if we have a saving child, as this will trigger
+     * a copy on write madness. */
+    if (!hasActiveChildProcess() && !(flags & LOOKUP_NOTOUCH)){
+        if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
+            updateLFU(val);
+        } else if (io_thread_stats) {
+            /* See ioThreadStats.touched. */
+            ioThreadStats *st = io_thread_stats;
+            if (st->numtouched == st->touched_size) {
+                st->touched_size = st->touched_size ? st->touched_size*2 : 64;
+                st->touched = zrealloc(st->touched,
+                                       sizeof(robj*)*st->touched_size);
+            }
+            st->touched[st->numtouched++] = val;
+        } else {
+            val->lru = LRU_CLOCK();
+        }
+    }
+    return val;
+}
+
 /* Low level key lookup API, not actually called directly from commands
  * implementations that should instead rely on lookupKeyRead(),
  * lookupKeyWrite() and lookupKeyReadWithFlags(). */
 robj *lookupKey(redisDb *db, robj *key, int flags) {
     dictEntry *de = dictFind(db->dict,key->ptr);
-    if (de) {
-        robj *val = dictGetVal(de);
-
-        /* Update the access time for the ageing algorithm.
-         * Don't do it if we have a saving child, as this will trigger
-         * a copy on write madness. */
-        if (!hasActiveChildProcess() && !(flags & LOOKUP_NOTOUCH)){
-            if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
-                updateLFU(val);
-            } else {
-                val->lru = LRU_CLOCK();
-            }
-        }
-        return val;
-    } else {
-        return NULL;
-    }
+    return de ? lookupKeyEntry(de,flags) : NULL;
+}
+
+/* Update the keyspace hits/misses stats. When the lookup is performed by a
+ * command executed in the context of an I/O thread the counters of the
+ * thread are used instead, since the main thread is the only one allowed
+ * to write the global stats. */
+static inline void statKeyspaceHit(void) {
+    if (io_thread_stats) io_thread_stats->keyspace_hits++;
+    else server.stat_keyspace_hits++;
+}
+
+static inline void statKeyspaceMiss(void) {
+    if (io_thread_stats) io_thread_stats->keyspace_misses++;
+    else server.stat_keyspace_misses++;
 }
 
 /* Lookup a key for read operations, or return NULL if the key is not found
@@ -96,14 +123,22 @@ robj *lookupKey(redisDb *db, robj *key, int flags) {
  * correctly report a key is expired on slaves even if the master is lagging
  * expiring our key via DELs in the replication link. */
 robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
-    robj *val;
+    return lookupKeyReadEntry(db,key,dictFind(db->dict,key->ptr),flags);
+}
 
-    if (expireIfNeeded(db,key) == 1) {
+/* The part of lookupKeyReadWithFlags() after the dictionary lookup: 'de' is
+ * the entry of 'key', or NULL if the key does not exist. */
+static robj *lookupKeyReadEntry(redisDb *db, robj *key, dictEntry *de,
+                                int flags)
+{
+    /* The expire time is stored in the entry itself, so the key is looked
+     * up a single time even if it is volatile. */
+    if (de && expireKeyIfNeeded(db,key,dbEntryGetExpire(de)) == 1) {
         /* Key expired. If we are in the context of a master, expireIfNeeded()
          * returns 0 only when the key does not exist at all, so it's safe
          * to return NULL ASAP. */
         if (server.masterhost == NULL) {
-            server.stat_keyspace_misses++;
+            statKeyspaceMiss();
             notifyKeyspaceEvent(NOTIFY_KEY_MISS, "keymiss", key, db->id);
             return NULL;
         }
@@ -125,19 +160,18 @@ robj *lookupKeyReadWithFlags(redisDb *db, robj *key, int flags) {
             server.current_client->cmd &&
             server.current_client->cmd->flags & CMD_READONLY)
         {
-            server.stat_keyspace_misses++;
+            statKeyspaceMiss();
             notifyKeyspaceEvent(NOTIFY_KEY_MISS, "keymiss", key, db->id);
             return NULL;
         }
     }
-    val = lookupKey(db,key,flags);
-    if (val == NULL) {
-        server.stat_keyspace_misses++;
+    if (de == NULL) {
+        statKeyspaceMiss();
         notifyKeyspaceEvent(NOTIFY_KEY_MISS, "keymiss", key, db->id);
+        return NULL;
     }
-    else
-        server.stat_keyspace_hits++;
-    return val;
+    statKeyspaceHit();
+    return lookupKeyEntry(de,flags);
 }
 
 /* Like lookupKeyReadWithFlags(), but does not use any flag, which is the
@@ -146,14 +180,71 @@ robj *lookupKeyRead(redisDb *db, robj *key) {
     return lookupKeyReadWithFlags(db,key,LOOKUP_NONE);
 }
 
+/* Like lookupKeyRead() for 'count' keys at once, storing the value of
+ * keys[j] in vals[j]. Commands accessing many keys, like MGET, spend most
+ * of their time waiting for the cache misses of the lookups: looking up
+ * the keys with dictFindBatch() makes such misses overlap. */
+void lookupKeysRead(redisDb *db, robj **keys, int count, robj **vals) {
+    const void *names[DICT_BATCH_SIZE];
+    dictEntry *des[DICT_BATCH_SIZE];
+    int j, n;
+
+    while (count > 0) {
+        n = count < DICT_BATCH_SIZE ? count : DICT_BATCH_SIZE;
+        for (j = 0; j < n; j++) names[j] = keys[j]->ptr;
+        dictFindBatch(db->dict,names,des,n);
+        for (j = 0; j < n; j++)
+            if (des[j]) redis_prefetch(dictGetVal(des[j]));
+
+        for (j = 0; j < n; j++) {
+            unsigned long size = dictSize(db->dict);
+            long long dirty = server.dirty;
+
+            vals[j] = lookupKeyReadEntry(db,keys[j],des[j],LOOKUP_NONE);
+
+            /* Expiring the key, or a module reacting to the keyspace
+             * events, may have deleted entries we already looked up, for
+             * instance when the same key is repeated: in such a case the
+             * remaining keys are looked up again. */
+            if (dictSize(db->dict) != size || server.dirty != dirty)
+                dictFindBatch(db->dict,names+j+1,des+j+1,n-j-1);
+        }
+        keys += n;
+        vals += n;
+        count -= n;
+    }
+}
+
+/* Prefetch the dictionary buckets and entries of 'count' keys, taking one
+ * every 'step' elements of 'keys', like the keys of the MSET arguments.
+ * Used before accessing many keys with operations that can't use
+ * lookupKeysRead(). */
+void dbPrefetchKeys(redisDb *db, robj **keys, int count, int step) {
+    const void *names[DICT_BATCH_SIZE];
+    int j, n;
+
+    if (count < 2) return; /* Nothing to overlap. */
+    while (count > 0) {
+        n = count < DICT_BATCH_SIZE ? count : DICT_BATCH_SIZE;
+        for (j = 0; j < n; j++) names[j] = keys[j*step]->ptr;
+        dictPrefetchKeys(db->dict,names,n);
+        keys += n*step;
+        count -= n;
+    }
+}
+
 /* Lookup a key for write operations, and as a side effect, if needed, expires
  * the key if its TTL is reached.
  *
  * Returns the linked value object if the key exists or NULL if the key
  * does not exist in the specified DB. */
 robj *lookupKeyWriteWithFlags(redisDb *db, robj *key, int flags) {
-    expireIfNeeded(db,key);
-    return lookupKey(db,key,flags);
+    dictEntry *de = dictFind(db->dict,key->ptr);
+
+    /* In masters an expired key is deleted, while slaves still return it. */
+    if (de && expireKeyIfNeeded(db,key,dbEntryGetExpire(de)) == 1 &&
+        server.masterhost == NULL) return NULL;
+    return de ? lookupKeyEntry(de,flags) : NULL;
 }
 
 robj *lookupKeyWrite(redisDb *db, robj *key) {
@@ -177,29 +268,35 @@ robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply) {
  *
  * The program is aborted if the key already exists. */
 void dbAdd(redisDb *db, robj *key, robj *val) {
-    sds copy = sdsdup(key->ptr);
-    int retval = dictAdd(db->dict, copy, val);
+    /* The key name is copied inside the entry, see dbDictType. */
+    dictEntry *de = dictAddRaw(db->dict, key->ptr, NULL);
 
-    serverAssertWithInfo(NULL,key,retval == DICT_OK);
+    serverAssertWithInfo(NULL,key,de != NULL);
+    if (val->refcount == OBJ_INTERNED_REFCOUNT) retainInternedValue(val);
+    dictSetVal(db->dict, de, val);
     signalKeyAsReady(db, key, val->type);
     if (server.cluster_enabled) slotToKeyAdd(key->ptr);
+    if (db->prefix_index) prefixIndexAdd(db,key->ptr);
 }
 
 /* This is a special version of dbAdd() that is used only when loading
- * keys from the RDB file: the key is passed as an SDS string that is
- * retained by the function (and not freed by the caller).
+ * keys from the RDB file: the key is passed as an SDS string, that is
+ * copied inside the entry like dbAdd() does, so it is still up to the
+ * caller to free it.
  *
  * Moreover this function will not abort if the key is already busy, to
  * give more control to the caller, nor will signal the key as ready
  * since it is not useful in this context.
  *
- * The function returns 1 if the key was added to the database, taking
- * ownership of the SDS string, otherwise 0 is returned, and is up to the
- * caller to free the SDS string. */
+ * The function returns 1 if the key was added to the database, otherwise
+ * 0 is returned. */
 int dbAddRDBLoad(redisDb *db, sds key, robj *val) {
-    int retval = dictAdd(db->dict, key, val);
-    if (retval != DICT_OK) return 0;
+    dictEntry *de = dictAddRaw(db->dict, key, NULL);
+    if (de == NULL) return 0;
+    if (val->refcount == OBJ_INTERNED_REFCOUNT) retainInternedValue(val);
+    dictSetVal(db->dict, de, val);
     if (server.cluster_enabled) slotToKeyAdd(key);
+    if (db->prefix_index) prefixIndexAdd(db,key);
     return 1;
 }
 
@@ -217,9 +314,14 @@ void dbOverwrite(redisDb *db, robj *key, robj *val) {
     if (server.maxmemory_policy & MAXMEMORY_FLAG_LFU) {
         val->lru = old->lru;
     }
+    if (val->refcount == OBJ_INTERNED_REFCOUNT) retainInternedValue(val);
     dictSetVal(db->dict, de, val);
 
-    if (server.lazyfree_lazy_server_del) {
+    /* Interned values are released by the destructor of the values, that
+     * counts the keys referencing them. */
+    if (server.lazyfree_lazy_server_del &&
+        old->refcount != OBJ_INTERNED_REFCOUNT)
+    {
         freeObjAsync(old);
         dictSetVal(db->dict, &auxentry, NULL);
     }
@@ -267,7 +369,7 @@ int dbExists(redisDb *db, robj *key) {
 robj *dbRandomKey(redisDb *db) {
     dictEntry *de;
     int maxtries = 100;
-    int allvolatile = dictSize(db->dict) == dictSize(db->expires);
+    int allvolatile = dictSize(db->dict) == expireIndexSize(db->expires);
 
     while(1) {
         sds key;
@@ -278,7 +380,7 @@ robj *dbRandomKey(redisDb *db) {
 
         key = dictGetKey(de);
         keyobj = createStringObject(key,sdslen(key));
-        if (dictFind(db->expires,key)) {
+        if (dbEntryGetExpire(de) != -1) {
             if (allvolatile && server.masterhost && --maxtries == 0) {
                 /* If the DB is composed only of keys with an expire set,
                  * it could happen that all the keys are already logically
@@ -301,11 +403,12 @@ robj *dbRandomKey(redisDb *db) {
 
 /* Delete a key, value, and associated expiration entry if any, from the DB */
 int dbSyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
-    if (dictDelete(db->dict,key->ptr) == DICT_OK) {
+    dictEntry *de = dictUnlink(db->dict,key->ptr);
+    if (de) {
+        if (dbEntryHasExpire(de)) expireIndexRemove(db,de);
+        dictFreeUnlinkedEntry(db->dict,de);
         if (server.cluster_enabled) slotToKeyDel(key->ptr);
+        if (db->prefix_index) prefixIndexDel(db,key->ptr);
         return 1;
     } else {
         return 0;
@@ -408,11 +511,17 @@ long long emptyDbGeneric(redisDb *dbarray, int dbnum, int flags, void(callback)(
 
     for (int j = startdb; j <= enddb; j++) {
         removed += dictSize(dbarray[j].dict);
+        dictCancelExpandJobs(dbarray[j].dict);
         if (async) {
             emptyDbAsync(&dbarray[j]);
         } else {
+            expireIndexRelease(dbarray[j].expires);
+            dbarray[j].expires = expireIndexCreate();
+            if (dbarray[j].prefix_index) {
+                raxFree(dbarray[j].prefix_index);
+                dbarray[j].prefix_index = raxNew();
+            }
             dictEmpty(dbarray[j].dict,callback);
-            dictEmpty(dbarray[j].expires,callback);
         }
     }
 
@@ -559,6 +668,7 @@ void flushallCommand(client *c) {
 void delGenericCommand(client *c, int lazy) {
     int numdel = 0, j;
 
+    dbPrefetchKeys(c->db,c->argv+1,c->argc-1,1);
     for (j = 1; j < c->argc; j++) {
         expireIfNeeded(c->db,c->argv[j]);
         int deleted  = lazy ? dbAsyncDelete(c->db,c->argv[j]) :
@@ -586,10 +696,14 @@ void unlinkCommand(client *c) {
  * Return value is the number of keys existing. */
 void existsCommand(client *c) {
     long long count = 0;
-    int j;
-
-    for (j = 1; j < c->argc; j++) {
-        if (lookupKeyRead(c->db,c->argv[j])) count++;
+    robj *vals[DICT_BATCH_SIZE];
+    int j, k, n;
+
+    for (j = 1; j < c->argc; j += n) {
+        n = c->argc-j < DICT_BATCH_SIZE ? c->argc-j : DICT_BATCH_SIZE;
+        lookupKeysRead(c->db,c->argv+j,n,vals);
+        for (k = 0; k < n; k++)
+            if (vals[k]) count++;
     }
     addReplyLongLong(c,count);
 }
@@ -624,6 +738,32 @@ void randomkeyCommand(client *c) {
     decrRefCount(key);
 }
 
+/* Return the length of the literal prefix of the glob-style pattern 'pat',
+ * that is, the bytes all the strings matching the pattern start with. */
+static size_t patternLiteralPrefixLen(const char *pat, size_t patlen) {
+    size_t j;
+
+    for (j = 0; j < patlen; j++) {
+        if (pat[j] == '*' || pat[j] == '?' || pat[j] == '[' || pat[j] == '\\')
+            break;
+    }
+    return j;
+}
+
+/* Helper for keysCommand(): reply with the key if it is not expired.
+ * Returns 1 if the key was emitted, otherwise 0. */
+static int keysAddReplyKey(client *c, const char *key, size_t len) {
+    robj *keyobj = createStringObject(key,len);
+    int emitted = 0;
+
+    if (!keyIsExpired(c->db,keyobj)) {
+        addReplyBulk(c,keyobj);
+        emitted = 1;
+    }
+    decrRefCount(keyobj);
+    return emitted;
+}
+
 void keysCommand(client *c) {
     dictIterator *di;
     dictEntry *de;
@@ -631,26 +771,175 @@ void keysCommand(client *c) {
     int plen = sdslen(pattern), allkeys;
     unsigned long numkeys = 0;
     void *replylen = addReplyDeferredLen(c);
+    size_t prelen;
+
+    /* If the pattern starts with a literal prefix, the prefix index, when
+     * enabled, allows to visit just the keys having that prefix. */
+    if (c->db->prefix_index &&
+        (prelen = patternLiteralPrefixLen(pattern,plen)) != 0)
+    {
+        raxIterator ri;
+
+        raxStart(&ri,c->db->prefix_index);
+        raxSeek(&ri,">=",(unsigned char*)pattern,prelen);
+        while (raxNext(&ri)) {
+            if (ri.key_len < prelen || memcmp(ri.key,pattern,prelen) != 0)
+                break;
+            if (stringmatchlen(pattern,plen,(char*)ri.key,ri.key_len,0))
+                numkeys += keysAddReplyKey(c,(char*)ri.key,ri.key_len);
+        }
+        raxStop(&ri);
+        setDeferredArrayLen(c,replylen,numkeys);
+        return;
+    }
 
     di = dictGetSafeIterator(c->db->dict);
     allkeys = (pattern[0] == '*' && plen == 1);
     while((de = dictNext(di)) != NULL) {
         sds key = dictGetKey(de);
-        robj *keyobj;
 
-        if (allkeys || stringmatchlen(pattern,plen,key,sdslen(key),0)) {
-            keyobj = createStringObject(key,sdslen(key));
-            if (!keyIsExpired(c->db,keyobj)) {
-                addReplyBulk(c,keyobj);
-                numkeys++;
-            }
-            decrRefCount(keyobj);
-        }
+        if (allkeys || stringmatchlen(pattern,plen,key,sdslen(key),0))
+            numkeys += keysAddReplyKey(c,key,sdslen(key));
     }
     dictReleaseIterator(di);
     setDeferredArrayLen(c,replylen,numkeys);
 }
 
+/* Return the length of the longest common prefix of the keys of 'db' having
+ * the prefix 'prefix', or 0 if there are no such keys. Since the keys are
+ * sorted, it is the common prefix of the first and the last of them. */
+static size_t prefixIndexCommonPrefixLen(redisDb *db, const char *prefix,
+                                         size_t prelen)
+{
+    raxIterator ri;
+    size_t lcp = 0;
+
+    raxStart(&ri,db->prefix_index);
+    raxSeek(&ri,">=",(unsigned char*)prefix,prelen);
+    if (raxNext(&ri) && ri.key_len >= prelen &&
+        memcmp(ri.key,prefix,prelen) == 0)
+    {
+        sds first = sdsnewlen(ri.key,ri.key_len);
+        sds end = sdsnewlen(prefix,prelen);
+
+        /* The last key is the one before the smallest string greater than
+         * all the strings having the prefix, if any. */
+        while (sdslen(end) && (unsigned char)end[sdslen(end)-1] == 0xff)
+            sdssetlen(end,sdslen(end)-1);
+        if (sdslen(end)) {
+            end[sdslen(end)-1]++;
+            raxSeek(&ri,"<",(unsigned char*)end,sdslen(end));
+        } else {
+            raxSeek(&ri,"$",NULL,0);
+        }
+        raxNext(&ri);
+        while (lcp < sdslen(first) && lcp < ri.key_len &&
+               (unsigned char)first[lcp] == ri.key[lcp]) lcp++;
+        sdsfree(first);
+        sdsfree(end);
+    }
+    raxStop(&ri);
+    return lcp;
+}
+
+/* Collect into 'keys' the keys of 'db' having the prefix 'prefix' using the
+ * prefix index, for SCAN with a MATCH pattern starting with that literal
+ * prefix. The next cursor is returned.
+ *
+ * The keys are visited in lexicographic order, so the cursor is the start of
+ * the next key to return, after the longest common prefix of the keys having
+ * 'prefix' (that is often longer than 'prefix', like "user:session:" for the
+ * pattern "user:*"). From the least significant byte, the cursor contains the
+ * number of key bytes it holds, how many bytes the common prefix is longer
+ * than 'prefix', and up to sizeof(long)-2 key bytes. If the common prefix
+ * gets shorter, because keys with a different prefix were added, the
+ * iteration restarts, returning some key again.
+ *
+ * The cursor can't address keys starting with the same bytes, so such keys
+ * are returned by the same call, even when they are more than 'count'. To
+ * bound the work done by a single call, if more than 'count' times
+ * PREFIX_INDEX_MAX_RUN keys are collected this way, the iteration goes on
+ * scanning the whole dictionary from the start, with a cursor having
+ * PREFIX_INDEX_CURSOR_DICT as least significant byte and the dictScan()
+ * cursor in the other bytes: keys may be returned again, as SCAN allows,
+ * but none is missed. */
+#define PREFIX_INDEX_CURSOR_BYTES (sizeof(unsigned long)-2)
+#define PREFIX_INDEX_CURSOR_DICT 0xff
+#define PREFIX_INDEX_MAX_EXTRA 255
+#define PREFIX_INDEX_MAX_RUN 10
+static unsigned long prefixIndexScan(redisDb *db, const char *prefix,
+                                     size_t prelen, unsigned long cursor,
+                                     long count, list *keys)
+{
+    unsigned char last[PREFIX_INDEX_CURSOR_BYTES];
+    size_t startlen = cursor & 0xff, extra = (cursor >> 8) & 0xff;
+    size_t lastlen = 0, baselen, j;
+    raxIterator ri;
+    long emitted = 0;
+
+    baselen = prefixIndexCommonPrefixLen(db,prefix,prelen);
+    if (baselen == 0) return 0;
+    if (baselen > prelen+PREFIX_INDEX_MAX_EXTRA)
+        baselen = prelen+PREFIX_INDEX_MAX_EXTRA;
+    if (startlen > PREFIX_INDEX_CURSOR_BYTES || baselen < prelen+extra) {
+        /* Invalid cursor, or the common prefix got shorter: restart. */
+        cursor = 0;
+    }
+
+    raxStart(&ri,db->prefix_index);
+    if (cursor == 0) {
+        raxSeek(&ri,">=",(unsigned char*)prefix,prelen);
+    } else {
+        /* The common prefix can't be read from the cursor, but if it is
+         * not shorter, the first key having the prefix starts with it. */
+        raxSeek(&ri,">=",(unsigned char*)prefix,prelen);
+        raxNext(&ri);
+        sds seek = sdsnewlen(ri.key,prelen+extra);
+        for (j = 0; j < startlen; j++) {
+            unsigned char c = (cursor >> ((PREFIX_INDEX_CURSOR_BYTES+1-j)*8));
+            seek = sdscatlen(seek,&c,1);
+        }
+        raxSeek(&ri,">=",(unsigned char*)seek,sdslen(seek));
+        sdsfree(seek);
+    }
+
+    cursor = 0;
+    while (raxNext(&ri)) {
+        if (ri.key_len < prelen || memcmp(ri.key,prefix,prelen) != 0) break;
+
+        unsigned char *rest = ri.key+baselen;
+        size_t restlen = ri.key_len-baselen;
+        if (restlen > PREFIX_INDEX_CURSOR_BYTES)
+            restlen = PREFIX_INDEX_CURSOR_BYTES;
+
+        /* Stop before this key if enough keys were collected, and the key
+         * can be addressed by the cursor. It can't be the first key having
+         * the prefix, so 'restlen' is not zero and the cursor is not 0. */
+        if (emitted >= count &&
+            !(restlen == lastlen && memcmp(rest,last,restlen) == 0))
+        {
+            cursor = restlen | ((baselen-prelen) << 8);
+            for (j = 0; j < restlen; j++)
+                cursor |= (unsigned long)rest[j] <<
+                          ((PREFIX_INDEX_CURSOR_BYTES+1-j)*8);
+            break;
+        }
+
+        /* Too many keys the cursor can't tell apart: fall back to the
+         * dictionary scan. */
+        if (emitted >= count*PREFIX_INDEX_MAX_RUN) {
+            cursor = PREFIX_INDEX_CURSOR_DICT;
+            break;
+        }
+        memcpy(last,rest,restlen);
+        lastlen = restlen;
+        listAddNodeTail(keys,createStringObject((char*)ri.key,ri.key_len));
+        emitted++;
+    }
+    raxStop(&ri);
+    return cursor;
+}
+
 /* This callback is used by scanGenericCommand in order to collect elements
  * returned by the dictionary iterator into a list. */
 void scanCallback(void *privdata, const dictEntry *de) {
@@ -673,7 +962,7 @@ void scanCallback(void *privdata, const dictEntry *de) {
     } else if (o->type == OBJ_ZSET) {
         sds sdskey = dictGetKey(de);
         key = createStringObject(sdskey,sdslen(sdskey));
-        val = createStringObjectFromLongDouble(*(double*)dictGetVal(de),0);
+        val = createStringObjectFromLongDouble(dictGetDoubleVal(de),0);
     } else {
         serverPanic("Type not handled in SCAN callback.");
     }
@@ -720,6 +1009,8 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
     sds pat = NULL;
     sds typename = NULL;
     int patlen = 0, use_pattern = 0;
+    size_t prelen = 0;
+    int prefix_fallback = 0;
     dict *ht;
 
     /* Object must be NULL (to iterate keys names), or the type of the object
@@ -767,15 +1058,29 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
 
     /* Step 2: Iterate the collection.
      *
-     * Note that if the object is encoded with a ziplist, intset, or any other
+     * Note that if the object is encoded with a listpack, intset, or any other
      * representation that is not a hash table, we are sure that it is also
      * composed of a small number of elements. So to avoid taking state we
      * just return everything inside the object in a single call, setting the
      * cursor to zero to signal the end of the iteration. */
 
+    /* If the pattern starts with a literal prefix, the prefix index, when
+     * enabled, allows to visit just the keys having that prefix. Note that
+     * in this case the cursor has a different meaning, see
+     * prefixIndexScan(). */
+    if (o == NULL && use_pattern && c->db->prefix_index)
+        prelen = patternLiteralPrefixLen(pat,patlen);
+    if (prelen && (cursor & 0xff) == PREFIX_INDEX_CURSOR_DICT) {
+        prefix_fallback = 1;
+        prelen = 0;
+        cursor >>= 8;
+    }
+
     /* Handle the case of a hash table. */
     ht = NULL;
-    if (o == NULL) {
+    if (prelen) {
+        cursor = prefixIndexScan(c->db,pat,prelen,cursor,count,keys);
+    } else if (o == NULL) {
         ht = c->db->dict;
     } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_HT) {
         ht = o->ptr;
@@ -788,7 +1093,9 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         count *= 2; /* We return key / value for this type. */
     }
 
-    if (ht) {
+    if (prelen) {
+        /* Already collected by prefixIndexScan(). */
+    } else if (ht) {
         void *privdata[2];
         /* We set the max number of iterations to ten times the specified
          * COUNT, so if the hash table is in a pathological state (very
@@ -806,25 +1113,29 @@ void scanGenericCommand(client *c, robj *o, unsigned long cursor) {
         } while (cursor &&
               maxiterations-- &&
               listLength(keys) < (unsigned long)count);
-    } else if (o->type == OBJ_SET) {
+        if (prefix_fallback && cursor)
+            cursor = (cursor << 8) | PREFIX_INDEX_CURSOR_DICT;
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_INTSET) {
         int pos = 0;
         int64_t ll;
 
         while(intsetGet(o->ptr,pos++,&ll))
             listAddNodeTail(keys,createStringObjectFromLongLong(ll));
         cursor = 0;
-    } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+    } else if (o->type == OBJ_SET || o->type == OBJ_HASH ||
+               o->type == OBJ_ZSET)
+    {
+        unsigned char *p = lpSeek(o->ptr,0);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
 
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             listAddNodeTail(keys,
                 (vstr != NULL) ? createStringObject((char*)vstr,vlen) :
                                  createStringObjectFromLongLong(vll));
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
         }
         cursor = 0;
     } else {
@@ -1111,13 +1422,13 @@ int dbSwapDatabases(long id1, long id2) {
      * remain in the same DB they were. */
     db1->dict = db2->dict;
     db1->expires = db2->expires;
+    db1->prefix_index = db2->prefix_index;
     db1->avg_ttl = db2->avg_ttl;
-    db1->expires_cursor = db2->expires_cursor;
 
     db2->dict = aux.dict;
     db2->expires = aux.expires;
+    db2->prefix_index = aux.prefix_index;
     db2->avg_ttl = aux.avg_ttl;
-    db2->expires_cursor = aux.expires_cursor;
 
     /* Now we need to handle clients blocked on lists: as an effect
      * of swapping the two DBs, a client that was waiting for list
@@ -1166,11 +1477,249 @@ void swapdbCommand(client *c) {
  * Expires API
  *----------------------------------------------------------------------------*/
 
+/* The expire time of a key is stored in its keyspace entry, while db->expires
+ * is an index of the keys having an expire, ordered by expire time, used
+ * by the active expire cycle and the volatile eviction policies.
+ *
+ * The index doesn't keep the keys sorted: every key is linked, through the
+ * dbEntryExpire slot of its entry, in the list of a bucket of expire times,
+ * and only the buckets are sorted, in a radix tree. The keys expiring in the
+ * current period of EXPIRE_INDEX_COARSE_MS milliseconds (or already expired)
+ * go in fine buckets of EXPIRE_INDEX_FINE_MS milliseconds, while the others
+ * go in coarse buckets of a whole period, that the active expire cycle moves
+ * to the fine buckets when their period starts. This way the index costs
+ * the two list pointers for every key, plus a small number of buckets: one
+ * for every period where some key expires, and a few hundreds for the
+ * current one.
+ *
+ * The elements of the radix tree are EXPIRE_INDEX_KEYLEN bytes: the start
+ * time of the bucket, big endian and with the sign bit flipped so that the
+ * radix tree order is the numerical order, followed by the bucket kind, so
+ * that a coarse bucket comes before the fine buckets of the same period. */
+#define EXPIRE_INDEX_FINE_MS (1LL<<5)
+#define EXPIRE_INDEX_COARSE_MS (1LL<<16)
+#define EXPIRE_BUCKET_COARSE 0
+#define EXPIRE_BUCKET_FINE 1
+
+static void expireIndexKey(unsigned char *buf, long long when, int kind) {
+    long long span = (kind == EXPIRE_BUCKET_FINE) ? EXPIRE_INDEX_FINE_MS :
+                                                    EXPIRE_INDEX_COARSE_MS;
+    uint64_t t = (uint64_t)(when & ~(span-1)) ^ (1ULL<<63);
+
+    for (int j = 7; j >= 0; j--) {
+        buf[j] = t & 0xff;
+        t >>= 8;
+    }
+    buf[8] = kind;
+}
+
+/* Return the start time of the bucket of an element of the index. */
+static long long expireIndexKeyTime(unsigned char *buf) {
+    uint64_t t = 0;
+
+    for (int j = 0; j < 8; j++) t = (t << 8) | buf[j];
+    return (long long)(t ^ (1ULL<<63));
+}
+
+expireIndex *expireIndexCreate(void) {
+    expireIndex *ei = zmalloc(sizeof(*ei));
+
+    ei->buckets = raxNew();
+    ei->size = 0;
+    return ei;
+}
+
+/* Free the index. The keyspace entries are not accessed, so they may be
+ * already freed. */
+void expireIndexRelease(expireIndex *ei) {
+    raxFreeWithCallback(ei->buckets,zfree);
+    zfree(ei);
+}
+
+/* Add the entry to the expires index, with its current expire time. */
+void expireIndexInsert(redisDb *db, dictEntry *de) {
+    dbEntryExpire *e = dbEntryExpireSlot(de);
+    unsigned char buf[EXPIRE_INDEX_KEYLEN];
+    expireBucket *b;
+    int kind;
+
+    kind = (e->when & ~(EXPIRE_INDEX_COARSE_MS-1)) <= mstime() ?
+           EXPIRE_BUCKET_FINE : EXPIRE_BUCKET_COARSE;
+    expireIndexKey(buf,e->when,kind);
+    b = raxFind(db->expires->buckets,buf,sizeof(buf));
+    if (b == raxNotFound) {
+        b = zmalloc(sizeof(*b));
+        b->head = NULL;
+        raxInsert(db->expires->buckets,buf,sizeof(buf),b,NULL);
+    }
+    e->next = b->head;
+    e->pprev = &b->head;
+    if (b->head) dbEntryExpireSlot(b->head)->pprev = &e->next;
+    b->head = de;
+    db->expires->size++;
+}
+
+/* Remove the entry from the expires index. */
+void expireIndexRemove(redisDb *db, dictEntry *de) {
+    dbEntryExpire *e = dbEntryExpireSlot(de);
+
+    *e->pprev = e->next;
+    if (e->next) {
+        dbEntryExpireSlot(e->next)->pprev = e->pprev;
+    } else {
+        /* The entry was the last of its list, and possibly the only one:
+         * in that case the bucket is now empty, and is released. */
+        unsigned char buf[EXPIRE_INDEX_KEYLEN];
+        int kind;
+
+        for (kind = EXPIRE_BUCKET_COARSE; kind <= EXPIRE_BUCKET_FINE; kind++) {
+            expireIndexKey(buf,e->when,kind);
+            expireBucket *b = raxFind(db->expires->buckets,buf,sizeof(buf));
+            if (b != raxNotFound && &b->head == e->pprev) {
+                raxRemove(db->expires->buckets,buf,sizeof(buf),NULL);
+                zfree(b);
+                break;
+            }
+        }
+    }
+    db->expires->size--;
+}
+
+/* Update the expires index after the entry of a key with an expire was
+ * moved to 'de', like the defragger does. */
+void expireIndexMoveEntry(dictEntry *de) {
+    dbEntryExpire *e = dbEntryExpireSlot(de);
+
+    *e->pprev = de;
+    if (e->next) dbEntryExpireSlot(e->next)->pprev = &e->next;
+}
+
+/* Fill 'des' with up to 'count' entries of keys having an expire. If
+ * 'soonest' is true the keys of the first buckets are returned, that expire
+ * first up to the bucket granularity, otherwise the keys are sampled at
+ * random, so the same key may be returned multiple times. Returns the
+ * number of entries stored in 'des'. */
+int expireIndexGetSomeKeys(redisDb *db, dictEntry **des, int count,
+                           int soonest)
+{
+    raxIterator ri;
+    int stored = 0;
+
+    if (expireIndexSize(db->expires) == 0) return 0;
+    raxStart(&ri,db->expires->buckets);
+    raxSeek(&ri,"^",NULL,0);
+    if (soonest) {
+        while (stored < count && raxNext(&ri)) {
+            dictEntry *de = ((expireBucket*)ri.data)->head;
+            while (stored < count && de) {
+                des[stored++] = de;
+                de = expireIndexNext(de);
+            }
+        }
+    } else {
+        /* raxRandomWalk() starts from the current node of the iterator,
+         * so the iterator must be positioned first. Then a random key of
+         * the first ones of the bucket is picked. */
+        while (stored < count && raxRandomWalk(&ri,0)) {
+            dictEntry *de = ((expireBucket*)ri.data)->head;
+            int steps = random() % 8;
+            while (steps-- && expireIndexNext(de)) de = expireIndexNext(de);
+            des[stored++] = de;
+        }
+    }
+    raxStop(&ri);
+    return stored;
+}
+
+/* Return the start time of the first fine bucket of the index, that is a
+ * lower bound of the expire time of the keys in the fine buckets, or -1 if
+ * there are no fine buckets. Coarse buckets are skipped: their start time
+ * says nothing about the expire time of their keys, that may be up to
+ * EXPIRE_INDEX_COARSE_MS milliseconds later. Fine buckets only exist for
+ * periods already started at 'now', so the scan stops at the first coarse
+ * bucket of a future period. */
+long long expireIndexFirstFineTime(redisDb *db, long long now) {
+    raxIterator ri;
+    long long t = -1;
+
+    raxStart(&ri,db->expires->buckets);
+    raxSeek(&ri,"^",NULL,0);
+    while (raxNext(&ri)) {
+        long long start = expireIndexKeyTime(ri.key);
+        if (ri.key[8] == EXPIRE_BUCKET_FINE) {
+            t = start;
+            break;
+        }
+        if (start > now) break;
+    }
+    raxStop(&ri);
+    return t;
+}
+
+/* Return the first key of the first bucket of the index if some key of the
+ * bucket may be already expired at 'now', otherwise NULL: no key of the
+ * index is expired. '*coarse' is set to 1 if the bucket is a coarse one,
+ * whose keys not yet expired should be moved to the fine buckets removing
+ * them from the index and adding them again. */
+dictEntry *expireIndexFirstDue(redisDb *db, long long now, int *coarse) {
+    raxIterator ri;
+    dictEntry *de = NULL;
+
+    raxStart(&ri,db->expires->buckets);
+    raxSeek(&ri,"^",NULL,0);
+    if (raxNext(&ri) && expireIndexKeyTime(ri.key) < now) {
+        de = ((expireBucket*)ri.data)->head;
+        *coarse = ri.key[8] == EXPIRE_BUCKET_COARSE;
+    }
+    raxStop(&ri);
+    return de;
+}
+
+/* Store the expire time 'when' in the keyspace entry 'de', growing the
+ * entry to make room for it if the key had no expire, and return the
+ * new address of the entry. The caller should remove the entry from the
+ * expires index before, and add it again after. */
+static dictEntry *dbEntrySetExpire(redisDb *db, dictEntry *de, long long when) {
+    if (!dbEntryHasExpire(de)) {
+        sds key = dictGetKey(de);
+        int hdrlen = sdsHdrSize(key[-1]);
+        size_t keysize = hdrlen+sdslen(key)+1;
+
+        de = dictReallocEntry(db->dict,de,
+                              sizeof(*de)+sizeof(dbEntryExpire)+keysize);
+        memmove((char*)dictMetadata(de)+sizeof(dbEntryExpire),dictMetadata(de),
+                keysize);
+        de->key = (char*)dictMetadata(de)+sizeof(dbEntryExpire)+hdrlen;
+    }
+    dbEntryExpireSlot(de)->when = when;
+    return de;
+}
+
+/* Remove the expire slot from the keyspace entry 'de' of a key with an
+ * expire, shrinking the entry, and return its new address. */
+static dictEntry *dbEntryRemoveExpire(redisDb *db, dictEntry *de) {
+    sds key = dictGetKey(de);
+    int hdrlen = sdsHdrSize(key[-1]);
+    size_t keysize = hdrlen+sdslen(key)+1;
+
+    memmove(dictMetadata(de),(char*)dictMetadata(de)+sizeof(dbEntryExpire),
+            keysize);
+    de = dictReallocEntry(db->dict,de,sizeof(*de)+keysize);
+    de->key = (char*)dictMetadata(de)+hdrlen;
+    return de;
+}
+
 int removeExpire(redisDb *db, robj *key) {
+    dictEntry *kde;
+
     /* An expire may only be removed if there is a corresponding entry in the
      * main dict. Otherwise, the key will never be freed. */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictDelete(db->expires,key->ptr) == DICT_OK;
+    kde = dictFind(db->dict,key->ptr);
+    serverAssertWithInfo(NULL,key,kde != NULL);
+    if (!dbEntryHasExpire(kde)) return 0;
+    expireIndexRemove(db,kde);
+    dbEntryRemoveExpire(db,kde);
+    return 1;
 }
 
 /* Set an expire to the specified key. If the expire is set in the context
@@ -1178,13 +1727,13 @@ int removeExpire(redisDb *db, robj *key) {
  * to NULL. The 'when' parameter is the absolute unix time in milliseconds
  * after which the key will no longer be considered valid. */
 void setExpire(client *c, redisDb *db, robj *key, long long when) {
-    dictEntry *kde, *de;
+    dictEntry *kde;
 
-    /* Reuse the sds from the main dict in the expire dict */
     kde = dictFind(db->dict,key->ptr);
     serverAssertWithInfo(NULL,key,kde != NULL);
-    de = dictAddOrFind(db->expires,dictGetKey(kde));
-    dictSetSignedIntegerVal(de,when);
+    if (dbEntryHasExpire(kde)) expireIndexRemove(db,kde);
+    kde = dbEntrySetExpire(db,kde,when);
+    expireIndexInsert(db,kde);
 
     int writable_slave = server.masterhost && server.repl_slave_ro == 0;
     if (c && writable_slave && !(c->flags & CLIENT_MASTER))
@@ -1197,13 +1746,9 @@ long long getExpire(redisDb *db, robj *key) {
     dictEntry *de;
 
     /* No expire? return ASAP */
-    if (dictSize(db->expires) == 0 ||
-       (de = dictFind(db->expires,key->ptr)) == NULL) return -1;
-
-    /* The entry was found in the expire dict, this means it should also
-     * be present in the main dict (safety check). */
-    serverAssertWithInfo(NULL,key,dictFind(db->dict,key->ptr) != NULL);
-    return dictGetSignedIntegerVal(de);
+    if (expireIndexSize(db->expires) == 0 ||
+       (de = dictFind(db->dict,key->ptr)) == NULL) return -1;
+    return dbEntryGetExpire(de);
 }
 
 /* Propagate expires into slaves and the AOF file.
@@ -1228,9 +1773,8 @@ void propagateExpire(redisDb *db, robj *key, int lazy) {
     decrRefCount(argv[1]);
 }
 
-/* Check if the key is expired. */
-int keyIsExpired(redisDb *db, robj *key) {
-    mstime_t when = getExpire(db,key);
+/* Check if a key with the specified expire time is expired. */
+static int expireTimeIsReached(mstime_t when) {
     mstime_t now;
 
     if (when < 0) return 0; /* No expire for this key */
@@ -1266,6 +1810,11 @@ int keyIsExpired(redisDb *db, robj *key) {
     return now > when;
 }
 
+/* Check if the key is expired. */
+int keyIsExpired(redisDb *db, robj *key) {
+    return expireTimeIsReached(getExpire(db,key));
+}
+
 /* This function is called when we are going to perform some operation
  * in a given key, but such key may be already logically expired even if
  * it still exists in the database. The main way this function is called
@@ -1286,7 +1835,13 @@ int keyIsExpired(redisDb *db, robj *key) {
  * The return value of the function is 0 if the key is still valid,
  * otherwise the function returns 1 if the key is expired. */
 int expireIfNeeded(redisDb *db, robj *key) {
-    if (!keyIsExpired(db,key)) return 0;
+    return expireKeyIfNeeded(db,key,getExpire(db,key));
+}
+
+/* Like expireIfNeeded() but with the expire time of the key already known,
+ * for callers that already have the keyspace entry of the key. */
+static int expireKeyIfNeeded(redisDb *db, robj *key, mstime_t when) {
+    if (!expireTimeIsReached(when)) return 0;
 
     /* If we are running in the context of a slave, instead of
      * evicting the expired key from the database, we return ASAP:
@@ -1680,6 +2235,25 @@ void slotToKeyDel(sds key) {
     slotToKeyUpdateKey(key,0);
 }
 
+/* Prefix index API. When keyspace-prefix-index is enabled, the keys of each
+ * database are also stored in the radix tree db->prefix_index, without
+ * values, so that KEYS and SCAN can visit only the keys having the literal
+ * prefix of their pattern, in lexicographic order. The keyspace is still
+ * db->dict: lookups, RANDOMKEY and everything else don't use the index.
+ *
+ * This is a secondary index, not a compressed encoding of the keyspace:
+ * every key is stored both in the dict and in the radix tree, so memory
+ * grows, by less than the size of the keys when they share long prefixes
+ * since the tree stores the common prefixes once. The option trades that
+ * memory for KEYS and SCAN by prefix that don't visit the whole dict. */
+void prefixIndexAdd(redisDb *db, sds key) {
+    raxInsert(db->prefix_index,(unsigned char*)key,sdslen(key),NULL,NULL);
+}
+
+void prefixIndexDel(redisDb *db, sds key) {
+    raxRemove(db->prefix_index,(unsigned char*)key,sdslen(key),NULL);
+}
+
 void slotToKeyFlush(void) {
     raxFree(server.cluster->slots_to_keys);
     server.cluster->slots_to_keys = raxNew();
@@ -122,7 +122,8 @@ robj *activeDefragStringOb(robj* ob, long *defragged) {
                 ret->ptr = (void*)((intptr_t)ret + ofs);
                 (*defragged)++;
             }
-        } else if (ob->encoding!=OBJ_ENCODING_INT) {
+        } else if (ob->encoding!=OBJ_ENCODING_INT &&
+                   ob->encoding!=OBJ_ENCODING_INLINE) {
             serverPanic("Unknown string encoding");
         }
     }
@@ -197,61 +198,56 @@ void zslUpdateNode(zskiplist *zsl, zskiplistNode *oldnode, zskiplistNode *newnod
 }
 
 /* Defrag helper for sorted set.
- * Update the robj pointer, defrag the skiplist struct and return the new score
- * reference. We may not access oldele pointer (not even the pointer stored in
- * the skiplist), as it was already freed. Newele may be null, in which case we
- * only need to defrag the skiplist, but not update the obj pointer.
- * When return value is non-NULL, it is the score reference that must be updated
- * in the dict record. */
-double *zslDefrag(zskiplist *zsl, double score, sds oldele, sds newele) {
+ * Defrag the SDS string of the element 'ele', and the skiplist node holding
+ * it when the element is the first one of the node, so that every node is
+ * handled once. Returns the new SDS string, that the dict key must be set
+ * to, or NULL if it was not moved. The number of moved allocations is added
+ * to '*defragged'. */
+sds zslDefrag(zskiplist *zsl, double score, sds ele, long *defragged) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *newx;
+    zskiplistEntry *entries;
+    unsigned int pos;
+    sds newele;
     int i;
-    sds ele = newele? newele: oldele;
 
-    /* find the skiplist node referring to the object that was moved,
-     * and all pointers that need to be updated if we'll end up moving the skiplist node. */
+    /* find the skiplist node holding the element, and all pointers that need
+     * to be updated if we'll end up moving the skiplist node. */
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
         while (x->level[i].forward &&
-            x->level[i].forward->ele != oldele && /* make sure not to access the
-                                                     ->obj pointer if it matches
-                                                     oldele */
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                sdscmp(x->level[i].forward->ele,ele) < 0)))
+            (zslNodeLast(x->level[i].forward)->score < score ||
+                (zslNodeLast(x->level[i].forward)->score == score &&
+                sdscmp(zslNodeLast(x->level[i].forward)->ele,ele) < 0)))
             x = x->level[i].forward;
         update[i] = x;
     }
 
-    /* update the robj pointer inside the skip list record. */
     x = x->level[0].forward;
-    serverAssert(x && score == x->score && x->ele==oldele);
-    if (newele)
-        x->ele = newele;
-
-    /* try to defrag the skiplist record itself */
-    newx = activeDefragAlloc(x);
-    if (newx) {
+    serverAssert(x != NULL);
+    entries = zslNodeEntries(x);
+    for (pos = 0; pos < x->count && entries[pos].ele != ele; pos++);
+    serverAssert(pos < x->count && score == entries[pos].score);
+
+    /* defrag the element string, then the skiplist record itself. */
+    if ((newele = activeDefragSds(ele))) {
+        (*defragged)++;
+        entries[pos].ele = newele;
+    }
+    if (pos == 0 && (newx = activeDefragAlloc(x))) {
+        (*defragged)++;
         zslUpdateNode(zsl, x, newx, update);
-        return &newx->score;
     }
-    return NULL;
+    return newele;
 }
 
 /* Defrag helpler for sorted set.
- * Defrag a single dict entry key name, and corresponding skiplist struct */
+ * Defrag a single dict entry, and corresponding skiplist struct */
 long activeDefragZsetEntry(zset *zs, dictEntry *de) {
     sds newsds;
-    double* newscore;
     long defragged = 0;
     sds sdsele = dictGetKey(de);
-    if ((newsds = activeDefragSds(sdsele)))
-        defragged++, de->key = newsds;
-    newscore = zslDefrag(zs->zsl, *(double*)dictGetVal(de), sdsele, newsds);
-    if (newscore) {
-        dictSetVal(zs->dict, de, newscore);
-        defragged++;
-    }
+    newsds = zslDefrag(zs->zsl, dictGetDoubleVal(de), sdsele, &defragged);
+    if (newsds) de->key = newsds;
     return defragged;
 }
 
@@ -799,23 +795,12 @@ long defragStream(redisDb *db, dictEntry *kde) {
  * all the various pointers it has. Returns a stat of how many pointers were
  * moved. */
 long defragKey(redisDb *db, dictEntry *de) {
-    sds keysds = dictGetKey(de);
     robj *newob, *ob;
     unsigned char *newzl;
     long defragged = 0;
-    sds newsds;
 
-    /* Try to defrag the key name. */
-    newsds = activeDefragSds(keysds);
-    if (newsds)
-        defragged++, de->key = newsds;
-    if (dictSize(db->expires)) {
-         /* Dirty code:
-          * I can't search in db->expires for that key after i already released
-          * the pointer it holds it won't be able to do the string compare */
-        uint64_t hash = dictGetHash(db->dict, de->key);
-        replaceSateliteDictKeyPtrAndOrDefragDictEntry(db->expires, keysds, newsds, hash, &defragged);
-    }
+    /* The key name is embedded in the entry, that was already moved, if
+     * needed, by defragKeyspaceBucketCallback(). */
 
     /* Try to defrag robj and / or string value. */
     ob = dictGetVal(de);
@@ -842,11 +827,14 @@ long defragKey(redisDb *db, dictEntry *de) {
             intset *newis, *is = ob->ptr;
             if ((newis = activeDefragAlloc(is)))
                 defragged++, ob->ptr = newis;
+        } else if (ob->encoding == OBJ_ENCODING_LISTPACK) {
+            if ((newzl = activeDefragAlloc(ob->ptr)))
+                defragged++, ob->ptr = newzl;
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (ob->type == OBJ_ZSET) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_SKIPLIST) {
@@ -855,7 +843,7 @@ long defragKey(redisDb *db, dictEntry *de) {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (ob->type == OBJ_HASH) {
-        if (ob->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (ob->encoding == OBJ_ENCODING_LISTPACK) {
             if ((newzl = activeDefragAlloc(ob->ptr)))
                 defragged++, ob->ptr = newzl;
         } else if (ob->encoding == OBJ_ENCODING_HT) {
@@ -898,6 +886,27 @@ void defragDictBucketCallback(void *privdata, dictEntry **bucketref) {
     }
 }
 
+/* Defrag scan callback for the buckets of the main db dictionary. The key
+ * names are embedded in the entries, so when an entry is moved its key
+ * pointer must be updated, as well as the expires index, that links the
+ * entries of the keys with an expire. */
+void defragKeyspaceBucketCallback(void *privdata, dictEntry **bucketref) {
+    UNUSED(privdata);
+
+    while(*bucketref) {
+        dictEntry *de = *bucketref, *newde;
+        size_t keyoffset = (char*)dictGetKey(de) - (char*)de;
+
+        if ((newde = activeDefragAlloc(de))) {
+            newde->key = (char*)newde + keyoffset;
+            *bucketref = newde;
+            if (dbEntryHasExpire(newde))
+                expireIndexMoveEntry(newde);
+        }
+        bucketref = &(*bucketref)->next;
+    }
+}
+
 /* Utility function to get the fragmentation ratio from jemalloc.
  * It is critical to do that by comparing only heap maps that belong to
  * jemalloc, and skip ones the jemalloc keeps as spare. Since we use this
@@ -1154,7 +1163,7 @@ void activeDefragCycle(void) {
                 break; /* this will exit the function and we'll continue on the next cycle */
             }
 
-            cursor = dictScan(db->dict, cursor, defragScanCallback, defragDictBucketCallback, db);
+            cursor = dictScan(db->dict, cursor, defragScanCallback, defragKeyspaceBucketCallback, db);
 
             /* Once in 16 scan iterations, 512 pointer reallocations. or 64 keys
              * (if we have a lot of pointers in one hash bucket or rehasing),
@@ -34,6 +34,7 @@
  */
 
 #include "fmacros.h"
+#include "config.h"
 
 #include <stdio.h>
 #include <stdlib.h>
@@ -62,6 +63,14 @@
 static int dict_can_resize = 1;
 static unsigned int dict_force_resize_ratio = 5;
 
+/* Using dictEnableRehashStep() / dictDisableRehashStep() we make possible to
+ * stop the incremental rehashing performed as a side effect of lookups and
+ * updates, for all the dictionaries at once. This is used while I/O threads
+ * execute read only commands: as long as the main thread is waiting for them
+ * dictFind() and friends are guaranteed to never modify the hash tables, so
+ * the same dictionary can be safely accessed by multiple readers. */
+static int dict_can_rehash_step = 1;
+
 /* -------------------------- private prototypes ---------------------------- */
 
 static int _dictExpandIfNeeded(dict *ht);
@@ -69,6 +78,15 @@ static unsigned long _dictNextPower(unsigned long size);
 static long _dictKeyIndex(dict *ht, const void *key, uint64_t hash, dictEntry **existing);
 static int _dictInit(dict *ht, dictType *type, void *privDataPtr);
 
+/* Every entry stores the full hash of its key: lookups compare it before
+ * comparing the keys, so walking a chain does not touch the memory of the
+ * keys that can't match, which for the keyspace is one cache miss saved for
+ * every colliding entry. The same hash is used to move the entries during
+ * rehashing without hashing the keys again. */
+#define dictEntryMatchesKey(d, he, key, h) \
+    ((he)->hash == (h) && \
+     ((key) == (he)->key || dictCompareKeys(d, key, (he)->key)))
+
 /* -------------------------- hash functions -------------------------------- */
 
 static uint8_t dict_hash_function_seed[16];
@@ -156,7 +174,6 @@ int dictExpand(dict *d, unsigned long size)
     if (dictIsRehashing(d) || d->ht[0].used > size)
         return DICT_ERR;
 
-    dictht n; /* the new hash table */
     //HashTable的容量一定是2的倍数
     unsigned long realsize = _dictNextPower(size);
 
@@ -164,10 +181,25 @@ int dictExpand(dict *d, unsigned long size)
     if (realsize == d->ht[0].size) return DICT_ERR;
 
     /* Allocate the new hash table and initialize all pointers to NULL */
-    n.size = realsize;
-    n.sizemask = realsize-1;
     //分配空间
-    n.table = zcalloc(realsize*sizeof(dictEntry*));
+    return dictExpandWithTable(d, zcalloc(realsize*sizeof(dictEntry*)),
+                               realsize);
+}
+
+/* Like dictExpand(), but uses a table of 'size' buckets already allocated
+ * and zeroed by the caller, so that big tables can be allocated in a
+ * different thread. 'size' must be a power of two. On error the table is
+ * not used and the caller should free it. */
+int dictExpandWithTable(dict *d, dictEntry **table, unsigned long size)
+{
+    if (dictIsRehashing(d) || d->ht[0].used > size ||
+        size == d->ht[0].size || (size & (size-1)))
+        return DICT_ERR;
+
+    dictht n; /* the new hash table */
+    n.size = size;
+    n.sizemask = size-1;
+    n.table = table;
     n.used = 0;
 
     /* Is this the first initialization? If so it's not really a rehashing
@@ -220,7 +252,7 @@ int dictRehash(dict *d, int n) {
 
             nextde = de->next;
             /* Get the index in the new hash table */
-            h = dictHashKey(d, de->key) & d->ht[1].sizemask;
+            h = de->hash & d->ht[1].sizemask;
             de->next = d->ht[1].table[h];
             d->ht[1].table[h] = de;
             d->ht[0].used--;
@@ -279,7 +311,7 @@ int dictRehashMilliseconds(dict *d, int ms) {
  * dictionary so that the hash table automatically migrates from H1 to H2
  * while it is actively used. */
 static void _dictRehashStep(dict *d) {
-    if (d->iterators == 0) dictRehash(d,1);
+    if (d->iterators == 0 && dict_can_rehash_step) dictRehash(d,1);
 }
 
 /* Add an element to the target hash table */
@@ -316,6 +348,8 @@ int dictAdd(dict *d, void *key, void *val)
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
 {
     long index;
+    uint64_t hash;
+    size_t keysize;
     dictEntry *entry;
     dictht *ht;
 
@@ -325,7 +359,8 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
     /* Get the index of the new element, or -1 if
      * the element already exists. */
     //获取要插入HashTable的索引，并且插入，如果key重复了，则返回NULL
-    if ((index = _dictKeyIndex(d, key, dictHashKey(d,key), existing)) == -1)
+    hash = dictHashKey(d,key);
+    if ((index = _dictKeyIndex(d, key, hash, existing)) == -1)
         return NULL;
 
     /* Allocate the memory and store the new entry.
@@ -333,13 +368,19 @@ dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing)
      * system it is more likely that recently added entries are accessed
      * more frequently. */
     ht = dictIsRehashing(d) ? &d->ht[1] : &d->ht[0];
-    entry = zmalloc(sizeof(*entry));
+    keysize = d->type->keyEmbedLen ? d->type->keyEmbedLen(key) : 0;
+    entry = zmalloc(sizeof(*entry) + keysize);
     entry->next = ht->table[index];
+    entry->hash = hash;
     ht->table[index] = entry;
     ht->used++;
 
-    /* Set the hash entry fields. */
-    dictSetKey(d, entry, key);
+    /* Set the hash entry fields. Embedded keys are copied right after the
+     * entry, so that key and entry share the same allocation. */
+    if (keysize)
+        entry->key = d->type->keyEmbed(dictMetadata(entry),key);
+    else
+        dictSetKey(d, entry, key);
     return entry;
 }
 
@@ -384,6 +425,29 @@ dictEntry *dictAddOrFind(dict *d, void *key) {
     return entry ? entry : existing;
 }
 
+/* Resize the allocation of the entry 'de' to 'size' bytes, that must include
+ * the embedded key if any, and return the new address of the entry, that
+ * is also updated in the hash table. The space after the entry is preserved
+ * up to 'size' bytes like zrealloc() does: moving the embedded key and
+ * updating its pointer, as any other reference to the entry, is up to the
+ * caller. No iterator should be pointing to the entry. */
+//调整节点的大小 用于在节点中保存调用者的数据 返回新的节点地址
+dictEntry *dictReallocEntry(dict *d, dictEntry *de, size_t size) {
+    dictEntry **ref = NULL;
+    int table;
+
+    /* The entries store their hash, so the bucket is found without
+     * hashing the key again. */
+    for (table = 0; table <= 1; table++) {
+        ref = &d->ht[table].table[de->hash & d->ht[table].sizemask];
+        while (*ref && *ref != de) ref = &(*ref)->next;
+        if (*ref || !dictIsRehashing(d)) break;
+    }
+    assert(ref && *ref == de);
+    *ref = zrealloc(de,size);
+    return *ref;
+}
+
 /* Search and remove an element. This is an helper function for
  * dictDelete() and dictUnlink(), please check the top comment
  * of those functions. */
@@ -403,7 +467,7 @@ static dictEntry *dictGenericDelete(dict *d, const void *key, int nofree) {
         he = d->ht[table].table[idx];
         prevHe = NULL;
         while(he) {
-            if (key==he->key || dictCompareKeys(d, key, he->key)) {
+            if (dictEntryMatchesKey(d, he, key, h)) {
                 /* Unlink the element from the list */
                 if (prevHe)
                     prevHe->next = he->next;
@@ -505,19 +569,17 @@ void dictRelease(dict *d)
 }
 
 
-dictEntry *dictFind(dict *d, const void *key)
+static inline dictEntry *_dictFindWithHash(dict *d, const void *key,
+                                            uint64_t h)
 {
     dictEntry *he;
-    uint64_t h, idx, table;
+    uint64_t idx, table;
 
-    if (dictSize(d) == 0) return NULL; /* dict is empty */
-    if (dictIsRehashing(d)) _dictRehashStep(d);
-    h = dictHashKey(d, key);
     for (table = 0; table <= 1; table++) {
         idx = h & d->ht[table].sizemask;
         he = d->ht[table].table[idx];
         while(he) {
-            if (key==he->key || dictCompareKeys(d, key, he->key))
+            if (dictEntryMatchesKey(d, he, key, h))
                 return he;
             he = he->next;
         }
@@ -526,6 +588,82 @@ dictEntry *dictFind(dict *d, const void *key)
     return NULL;
 }
 
+dictEntry *dictFind(dict *d, const void *key)
+{
+    if (dictSize(d) == 0) return NULL; /* dict is empty */
+    if (dictIsRehashing(d)) _dictRehashStep(d);
+    return _dictFindWithHash(d, key, dictHashKey(d, key));
+}
+
+/* Hash the 'count' keys, with count <= DICT_BATCH_SIZE, and prefetch the
+ * buckets they map to, then the first entry of every bucket. The loads of
+ * the different keys are independent, so the CPU can serve their cache
+ * misses in parallel, while a lookup at a time waits for every miss. */
+static void _dictPrefetchBatch(dict *d, const void **keys, uint64_t *hashes,
+                               int count)
+{
+    int j, table;
+
+    for (j = 0; j < count; j++) {
+        hashes[j] = dictHashKey(d, keys[j]);
+        for (table = 0; table <= 1; table++) {
+            redis_prefetch(&d->ht[table].table[hashes[j] &
+                                                d->ht[table].sizemask]);
+            if (!dictIsRehashing(d)) break;
+        }
+    }
+    for (j = 0; j < count; j++) {
+        for (table = 0; table <= 1; table++) {
+            dictEntry *he = d->ht[table].table[hashes[j] &
+                                                d->ht[table].sizemask];
+            if (he) redis_prefetch(he);
+            if (!dictIsRehashing(d)) break;
+        }
+    }
+}
+
+/* Lookup 'count' keys at once, setting des[j] to the entry of keys[j], or
+ * to NULL if the key is not found. The result is the same as calling
+ * dictFind() for every key, but the memory accesses of the lookups
+ * overlap, see _dictPrefetchBatch(). */
+void dictFindBatch(dict *d, const void **keys, dictEntry **des, int count) {
+    uint64_t hashes[DICT_BATCH_SIZE];
+    int j, n;
+
+    while (count > 0) {
+        n = count < DICT_BATCH_SIZE ? count : DICT_BATCH_SIZE;
+        if (dictSize(d) == 0) {
+            for (j = 0; j < n; j++) des[j] = NULL;
+        } else {
+            /* Perform the rehashing steps dictFind() would perform before
+             * the tables are accessed. */
+            for (j = 0; j < n && dictIsRehashing(d); j++) _dictRehashStep(d);
+            _dictPrefetchBatch(d, keys, hashes, n);
+            for (j = 0; j < n; j++)
+                des[j] = _dictFindWithHash(d, keys[j], hashes[j]);
+        }
+        keys += n;
+        des += n;
+        count -= n;
+    }
+}
+
+/* Prefetch the buckets and the entries the given keys are going to use, for
+ * callers that are about to access many keys with operations, like writes,
+ * that can't be batched with dictFindBatch(). */
+void dictPrefetchKeys(dict *d, const void **keys, int count) {
+    uint64_t hashes[DICT_BATCH_SIZE];
+    int n;
+
+    if (dictSize(d) == 0) return;
+    while (count > 0) {
+        n = count < DICT_BATCH_SIZE ? count : DICT_BATCH_SIZE;
+        _dictPrefetchBatch(d, keys, hashes, n);
+        keys += n;
+        count -= n;
+    }
+}
+
 //根据key获取value
 void *dictFetchValue(dict *d, const void *key) {
     dictEntry *he;
@@ -1000,6 +1138,13 @@ static int _dictExpandIfNeeded(dict *d)
         (dict_can_resize ||
          d->ht[0].used/d->ht[0].size > dict_force_resize_ratio))
     {
+        /* The type may prefer to allocate the new table by itself: in the
+         * meantime keys are still added to the current table, unless the
+         * ratio became so high that we can't wait anymore. */
+        if (d->type->expandAsync &&
+            d->ht[0].used/d->ht[0].size <= dict_force_resize_ratio &&
+            d->type->expandAsync(d,_dictNextPower(d->ht[0].used*2)))
+            return DICT_OK;
         return dictExpand(d, d->ht[0].used*2);
     }
     return DICT_OK;
@@ -1042,7 +1187,7 @@ static long _dictKeyIndex(dict *d, const void *key, uint64_t hash, dictEntry **e
         /* Search if this slot does not already contain the given key */
         he = d->ht[table].table[idx];
         while(he) {
-            if (key==he->key || dictCompareKeys(d, key, he->key)) {
+            if (dictEntryMatchesKey(d, he, key, hash)) {
                 if (existing) *existing = he;
                 return -1;
             }
@@ -1069,6 +1214,14 @@ void dictDisableResize(void) {
     dict_can_resize = 0;
 }
 
+void dictEnableRehashStep(void) {
+    dict_can_rehash_step = 1;
+}
+
+void dictDisableRehashStep(void) {
+    dict_can_rehash_step = 0;
+}
+
 //获取key对应的hashKey
 uint64_t dictGetHash(dict *d, const void *key) {
     return dictHashKey(d, key);
@@ -1240,6 +1393,20 @@ int main(int argc, char **argv) {
     end_benchmark("Inserting");
     assert((long)dictSize(dict) == count);
 
+    /* Report the memory cost of the entries, that store the hash of their
+     * key: the size the allocator really uses is what matters, since the
+     * 8 bytes of the hash may or may not move the entry to a bigger size
+     * class. */
+    sds zero = sdsfromlonglong(0);
+    void *nohash = zmalloc(sizeof(dictEntry)-sizeof(uint64_t));
+    printf("Entry size: %zu bytes, %zu allocated (%zu without the hash)\n",
+        sizeof(dictEntry), zmalloc_size(dictFind(dict,zero)),
+        zmalloc_size(nohash));
+    zfree(nohash);
+    printf("Memory per element, including keys and tables: %.2f bytes\n",
+        (double)zmalloc_used_memory()/count);
+    sdsfree(zero);
+
     /* Wait for rehashing. */
     while (dictIsRehashing(dict)) {
         dictRehashMilliseconds(dict,100);
@@ -55,8 +55,19 @@ typedef struct dictEntry {
     } v;
     //用来解决key的hash冲突 采用拉链法来解决 next表示下一个dictEntry 
     struct dictEntry *next;  //使用链表的"头插法"让插入的时间复杂度为O(1)
+    //key的完整hash值 插入时保存下来 查找时先比较hash 不相等就不用访问key的内存
+    //rehash时也不用再计算hash 直接用它计算新表的索引
+    //节点从24字节变成32字节: jemalloc没有24字节的size class 本来就分配32字节 所以不额外占用内存
+    //但嵌入了key的节点(keyspace)大小不固定 平均多占8字节
+    //使用libc malloc时每个节点多占16字节(32字节的chunk变成48字节) 用dict-benchmark可以测量
+    uint64_t hash;
+    //节点后面的空间 如果key是嵌入的 key就保存在这里
+    //调用者可以用dictReallocEntry()扩大节点 在key的前面保存自己的数据
+    void *metadata[];
 } dictEntry;
 
+struct dict;
+
 //操作dict的一组指定类型的函数集合 可以自由指定
 typedef struct dictType {
     uint64_t (*hashFunction)(const void *key); //计算hash值
@@ -65,6 +76,15 @@ typedef struct dictType {
     int (*keyCompare)(void *privdata, const void *key1, const void *key2); //对比key
     void (*keyDestructor)(void *privdata, void *key); //销毁key
     void (*valDestructor)(void *privdata, void *obj); //销魂value
+    //下面的函数都是可选的
+    //嵌入key需要的字节数 设置了这个函数时 key会被拷贝到dictEntry的同一块内存中
+    //这样访问key不用再多一次内存跳转 也少一次内存分配 这时dict不会持有传入的key
+    size_t (*keyEmbedLen)(const void *key);
+    //把key拷贝到buf中 返回保存在dictEntry中的key指针
+    void *(*keyEmbed)(void *buf, const void *key);
+    //需要扩容到size个桶时调用 返回1表示新的哈希表由调用者在其他线程分配
+    //dict先继续以超过1:1的负载因子插入 分配好后调用dictExpandWithTable()安装
+    int (*expandAsync)(struct dict *d, unsigned long size);
 } dictType;
 
 
@@ -109,6 +129,8 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 
 /* This is the initial size of every hash table */
 #define DICT_HT_INITIAL_SIZE     4
+//dictFindBatch()一次并行查找的最大key数量
+#define DICT_BATCH_SIZE          16
 
 /* ------------------------------- Macros ------------------------------------*/
 //释放节点
@@ -160,12 +182,18 @@ typedef void (dictScanBucketFunction)(void *privdata, dictEntry **bucketref);
 #define dictSlots(d) ((d)->ht[0].size+(d)->ht[1].size)
 #define dictSize(d) ((d)->ht[0].used+(d)->ht[1].used)
 #define dictIsRehashing(d) ((d)->rehashidx != -1)
+//节点后面的空间的起始地址
+#define dictMetadata(entry) ((void*)(entry)->metadata)
+//key是否嵌入在dictEntry中
+#define dictHasEmbeddedKeys(d) ((d)->type->keyEmbed != NULL)
 
 /* API */
 //创建dict  默认HashTable设置为4
 dict *dictCreate(dictType *type, void *privDataPtr);
 //调整HashTable大小
 int dictExpand(dict *d, unsigned long size);
+//使用调用者已经分配并清零的size个桶(必须是2的幂)的表进行扩容
+int dictExpandWithTable(dict *d, dictEntry **table, unsigned long size);
 
 
 //添加kv到字典
@@ -174,6 +202,7 @@ int dictAdd(dict *d, void *key, void *val);
 //根据key判断是否在HashTable中，在则返回NULL并且设置existing为冲突节点，否则返回插入后的dictEntry 
 //这里第3个字段exisiing带出来的是如果发生hash碰撞时的节点，方便插入到后面的链表中
 dictEntry *dictAddRaw(dict *d, void *key, dictEntry **existing);
+dictEntry *dictReallocEntry(dict *d, dictEntry *de, size_t size);
 
 //调用dictAddRaw查找key，如果不存在key则添加到dict中，并且返回插入后的节点
 //否则插入失败返回发生key对应的原来节点
@@ -195,6 +224,10 @@ void dictRelease(dict *d);
 
 //查找key代表的 dictEntry节点 不存在返回NULL 
 dictEntry * dictFind(dict *d, const void *key);
+//批量查找count个key 先计算所有key的hash并预取桶和节点 再依次查找 让多个key的cache miss重叠
+void dictFindBatch(dict *d, const void **keys, dictEntry **des, int count);
+//只预取count个key会用到的桶和节点 用于无法批量查找的写操作
+void dictPrefetchKeys(dict *d, const void **keys, int count);
 //根据key获取value
 void *dictFetchValue(dict *d, const void *key);
 
@@ -230,6 +263,10 @@ void dictEmpty(dict *d, void(callback)(void*));
 void dictEnableResize(void);
 void dictDisableResize(void);
 
+//设置查找/更新操作是否顺带执行一步渐进式rehash  关闭后dictFind不会修改dict 可以被多个线程同时读取
+void dictEnableRehashStep(void);
+void dictDisableRehashStep(void);
+
 //开始rehash 传入n表示rehash的kv次数 
 int dictRehash(dict *d, int n);
 int dictRehashMilliseconds(dict *d, int ms);
@@ -159,11 +159,18 @@ void evictionPoolAlloc(void) {
  * idle time are on the left, and keys with the higher idle time on the
  * right. */
 
-void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evictionPoolEntry *pool) {
+void evictionPoolPopulate(int dbid, redisDb *db, struct evictionPoolEntry *pool) {
     int j, k, count;
     dictEntry *samples[server.maxmemory_samples];
 
-    count = dictGetSomeKeys(sampledict,samples,server.maxmemory_samples);
+    /* The volatile policies sample the keys from the expires index, that
+     * for volatile-ttl can directly provide the keys expiring first. */
+    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
+        count = dictGetSomeKeys(db->dict,samples,server.maxmemory_samples);
+    } else {
+        count = expireIndexGetSomeKeys(db,samples,server.maxmemory_samples,
+                    server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL);
+    }
     for (j = 0; j < count; j++) {
         unsigned long long idle;
         sds key;
@@ -172,14 +179,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
 
         de = samples[j];
         key = dictGetKey(de);
-
-        /* If the dictionary we are sampling from is not the main
-         * dictionary (but the expires one) we need to lookup the key
-         * again in the key dictionary to obtain the value object. */
-        if (server.maxmemory_policy != MAXMEMORY_VOLATILE_TTL) {
-            if (sampledict != keydict) de = dictFind(keydict, key);
-            o = dictGetVal(de);
-        }
+        o = dictGetVal(de);
 
         /* Calculate the idle time according to the policy. This is called
          * idle just because the code initially handled LRU, but is in fact
@@ -197,7 +197,7 @@ void evictionPoolPopulate(int dbid, dict *sampledict, dict *keydict, struct evic
             idle = 255-LFUDecrAndReturn(o);
         } else if (server.maxmemory_policy == MAXMEMORY_VOLATILE_TTL) {
             /* In this case the sooner the expire the better. */
-            idle = ULLONG_MAX - (long)dictGetVal(de);
+            idle = ULLONG_MAX - dbEntryGetExpire(de);
         } else {
             serverPanic("Unknown eviction policy in evictionPoolPopulate()");
         }
@@ -474,7 +474,6 @@ int freeMemoryIfNeeded(void) {
         sds bestkey = NULL;
         int bestdbid;
         redisDb *db;
-        dict *dict;
         dictEntry *de;
 
         if (server.maxmemory_policy & (MAXMEMORY_FLAG_LRU|MAXMEMORY_FLAG_LFU) ||
@@ -490,10 +489,10 @@ int freeMemoryIfNeeded(void) {
                  * every DB. */
                 for (i = 0; i < server.dbnum; i++) {
                     db = server.db+i;
-                    dict = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
-                            db->dict : db->expires;
-                    if ((keys = dictSize(dict)) != 0) {
-                        evictionPoolPopulate(i, dict, db->dict, pool);
+                    keys = (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) ?
+                            dictSize(db->dict) : expireIndexSize(db->expires);
+                    if (keys != 0) {
+                        evictionPoolPopulate(i, db, pool);
                         total_keys += keys;
                     }
                 }
@@ -504,13 +503,10 @@ int freeMemoryIfNeeded(void) {
                     if (pool[k].key == NULL) continue;
                     bestdbid = pool[k].dbid;
 
-                    if (server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS) {
-                        de = dictFind(server.db[pool[k].dbid].dict,
-                            pool[k].key);
-                    } else {
-                        de = dictFind(server.db[pool[k].dbid].expires,
-                            pool[k].key);
-                    }
+                    de = dictFind(server.db[pool[k].dbid].dict,
+                        pool[k].key);
+                    if (de && !(server.maxmemory_policy & MAXMEMORY_FLAG_ALLKEYS)
+                        && dbEntryGetExpire(de) == -1) de = NULL;
 
                     /* Remove the entry from the pool. */
                     if (pool[k].key != pool[k].cached)
@@ -540,10 +536,12 @@ int freeMemoryIfNeeded(void) {
             for (i = 0; i < server.dbnum; i++) {
                 j = (++next_db) % server.dbnum;
                 db = server.db+j;
-                dict = (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM) ?
-                        db->dict : db->expires;
-                if (dictSize(dict) != 0) {
-                    de = dictGetRandomKey(dict);
+                de = NULL;
+                if (server.maxmemory_policy == MAXMEMORY_ALLKEYS_RANDOM)
+                    de = dictGetRandomKey(db->dict);
+                else
+                    expireIndexGetSomeKeys(db,&de,1,0);
+                if (de) {
                     bestkey = dictGetKey(de);
                     bestdbid = j;
                     break;
@@ -42,7 +42,7 @@
 
 /* Helper function for the activeExpireCycle() function.
  * This function will try to expire the key that is stored in the hash table
- * entry 'de' of the 'expires' hash table of a Redis database.
+ * entry 'de' of the keyspace of a Redis database.
  *
  * If the key is found to be expired, it is removed from the database and
  * 1 is returned. Otherwise no operation is performed and 0 is returned.
@@ -52,11 +52,17 @@
  * The parameter 'now' is the current time in milliseconds as is passed
  * to the function to avoid too many gettimeofday() syscalls. */
 int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
-    long long t = dictGetSignedIntegerVal(de);
+    long long t = dbEntryGetExpire(de);
     if (now > t) {
         sds key = dictGetKey(de);
         robj *keyobj = createStringObject(key,sdslen(key));
 
+        /* Track how late the key is reclaimed compared to its expire. */
+        server.stat_expired_lag_sum += now-t;
+        server.stat_expired_lag_samples++;
+        if (now-t > server.stat_expired_lag_max)
+            server.stat_expired_lag_max = now-t;
+
         propagateExpire(db,keyobj,server.lazyfree_lazy_expire);
         if (server.lazyfree_lazy_expire)
             dbAsyncDelete(db,keyobj);
@@ -88,6 +94,13 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
  * cycle is the main way we collect expired cycles: this happens with
  * the "server.hz" frequency (usually 10 hertz).
  *
+ * The keys with an expire are indexed by expire time (see db->expires), so
+ * every cycle only visits the buckets of keys that may be expired, starting
+ * from the ones that expired first. Once a bucket of the current period has
+ * keys not yet expired, there is nothing more to do in this database, since
+ * the keys of the next buckets expire later. The keys of a coarse bucket
+ * that are not yet expired are moved to the fine buckets instead.
+ *
  * However the slow cycle can exit for timeout, since it used too much time.
  * For this reason the function is also invoked to perform a fast cycle
  * at every event loop cycle, in the beforeSleep() function. The fast cycle
@@ -100,25 +113,48 @@ int activeExpireCycleTryExpire(redisDb *db, dictEntry *de, long long now) {
  * "fast" expire cycle that takes no longer than EXPIRE_FAST_CYCLE_DURATION
  * microseconds, and is not repeated again before the same amount of time.
  * The cycle will also refuse to run at all if the latest slow cycle did not
- * terminate because of a time limit condition.
+ * terminate because of a time limit condition, unless some key is already
+ * expired since more than ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_LAG milliseconds:
+ * thanks to the expires index this is known cheaply, looking at the first
+ * bucket of the index of every DB.
  *
  * If type is ACTIVE_EXPIRE_CYCLE_SLOW, that normal expire cycle is
  * executed, where the time limit is a percentage of the REDIS_HZ period
- * as specified by the ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC define. In the
- * fast cycle, the check of every database is interrupted once the number
- * of already expired keys in the database is estimated to be lower than
- * a given percentage, in order to avoid doing too much work to gain too
- * little memory.
+ * as specified by the ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC define.
  *
  * The configured expire "effort" will modify the baseline parameters in
  * order to do more work in both the fast and slow expire cycles.
  */
 
 #define ACTIVE_EXPIRE_CYCLE_KEYS_PER_LOOP 20 /* Keys for each DB loop. */
+#define ACTIVE_EXPIRE_CYCLE_TTL_SAMPLES 5 /* Keys sampled for the avg TTL. */
 #define ACTIVE_EXPIRE_CYCLE_FAST_DURATION 1000 /* Microseconds. */
 #define ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC 25 /* Max % of CPU to use. */
-#define ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE 10 /* % of stale keys after which
-                                                   we do extra efforts. */
+#define ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_LAG 100 /* Ms an expired key may
+                                                   still exist before we do
+                                                   extra efforts. */
+
+/* Return how many milliseconds ago the first key that is expired but still
+ * exists expired, or 0 if no such key exists. Since the index is sorted by
+ * buckets, this is an upper bound, accurate to the size of a fine bucket.
+ *
+ * Only the fine buckets are considered: the start time of a coarse bucket
+ * would report up to a whole period of lag even if none of its keys is
+ * expired. The keys of a coarse bucket whose period started are counted
+ * once the cycle moves them to the fine buckets, that on masters happens
+ * at the next cycle. Replicas never run the cycle, so there the lag only
+ * counts keys inserted after their period started, waiting for the DEL
+ * of the master. */
+long long activeExpirePendingLag(long long now) {
+    long long lag = 0;
+
+    for (int j = 0; j < server.dbnum; j++) {
+        long long first = expireIndexFirstFineTime(server.db+j,now);
+
+        if (first != -1 && now-first > lag) lag = now-first;
+    }
+    return lag;
+}
 
 void activeExpireCycle(int type) {
     /* Adjust the running parameters according to the configured expire
@@ -132,8 +168,8 @@ void activeExpireCycle(int type) {
                                  ACTIVE_EXPIRE_CYCLE_FAST_DURATION/4*effort,
     config_cycle_slow_time_perc = ACTIVE_EXPIRE_CYCLE_SLOW_TIME_PERC +
                                   2*effort,
-    config_cycle_acceptable_stale = ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_STALE-
-                                    effort;
+    config_cycle_acceptable_lag = ACTIVE_EXPIRE_CYCLE_ACCEPTABLE_LAG/
+                                  (effort+1);
 
     /* This function has some global state in order to continue the work
      * incrementally across calls. */
@@ -151,17 +187,17 @@ void activeExpireCycle(int type) {
     if (clientsArePaused()) return;
 
     if (type == ACTIVE_EXPIRE_CYCLE_FAST) {
-        /* Don't start a fast cycle if the previous cycle did not exit
-         * for time limit, unless the percentage of estimated stale keys is
-         * too high. Also never repeat a fast cycle for the same period
-         * as the fast cycle total duration itself. */
-        if (!timelimit_exit &&
-            server.stat_expired_stale_perc < config_cycle_acceptable_stale)
-            return;
-
+        /* Never repeat a fast cycle for the same period as the fast cycle
+         * total duration itself. Also don't start a fast cycle if the
+         * previous cycle did not exit for time limit, unless there are keys
+         * expired for too much time. */
         if (start < last_fast_cycle + (long long)config_cycle_fast_duration*2)
             return;
 
+        if (!timelimit_exit &&
+            activeExpirePendingLag(start/1000) <
+            (long long)config_cycle_acceptable_lag) return;
+
         last_fast_cycle = start;
     }
 
@@ -186,15 +222,10 @@ void activeExpireCycle(int type) {
     if (type == ACTIVE_EXPIRE_CYCLE_FAST)
         timelimit = config_cycle_fast_duration; /* in microseconds. */
 
-    /* Accumulate some global stats as we expire keys, to have some idea
-     * about the number of keys that are already logically expired, but still
-     * existing inside the database. */
-    long total_sampled = 0;
-    long total_expired = 0;
-
     for (j = 0; j < dbs_per_call && timelimit_exit == 0; j++) {
-        /* Expired and checked in a single loop. */
-        unsigned long expired, sampled;
+        /* Keys checked, and whether some are not yet expired. */
+        unsigned long sampled, num;
+        int pending;
 
         redisDb *db = server.db+(current_db % server.dbnum);
 
@@ -203,85 +234,78 @@ void activeExpireCycle(int type) {
          * distribute the time evenly across DBs. */
         current_db++;
 
-        /* Continue to expire if at the end of the cycle there are still
-         * a big percentage of keys to expire, compared to the number of keys
-         * we scanned. The percentage, stored in config_cycle_acceptable_stale
-         * is not fixed, but depends on the Redis configured "expire effort". */
+        /* Continue to expire while the buckets at the head of the expires
+         * index may have expired keys. */
         do {
-            unsigned long num, slots;
             long long now, ttl_sum;
-            int ttl_samples;
+            int ttl_samples, coarse;
+            dictEntry *de;
             iteration++;
 
             /* If there is nothing to expire try next DB ASAP. */
-            if ((num = dictSize(db->expires)) == 0) {
+            if ((num = expireIndexSize(db->expires)) == 0) {
                 db->avg_ttl = 0;
                 break;
             }
-            slots = dictSlots(db->expires);
             now = mstime();
 
-            /* When there are less than 1% filled slots, sampling the key
-             * space is expensive, so stop here waiting for better times...
-             * The dictionary will be resized asap. */
-            if (num && slots > DICT_HT_INITIAL_SIZE &&
-                (num*100/slots < 1)) break;
-
-            /* The main collection cycle. Sample random keys among keys
-             * with an expire set, checking for expired ones. */
-            expired = 0;
+            /* The main collection cycle. Visit the keys of the buckets in
+             * expire time order, stopping at the first bucket with keys
+             * not yet expired. */
             sampled = 0;
+            pending = 0;
             ttl_sum = 0;
             ttl_samples = 0;
 
             if (num > config_keys_per_loop)
                 num = config_keys_per_loop;
 
-            /* Here we access the low level representation of the hash table
-             * for speed concerns: this makes this code coupled with dict.c,
-             * but it hardly changed in ten years.
-             *
-             * Note that certain places of the hash table may be empty,
-             * so we want also a stop condition about the number of
-             * buckets that we scanned. However scanning for free buckets
-             * is very fast: we are in the cache line scanning a sequential
-             * array of NULL pointers, so we can scan a lot more buckets
-             * than keys in the same time. */
-            long max_buckets = num*20;
-            long checked_buckets = 0;
-
-            while (sampled < num && checked_buckets < max_buckets) {
-                for (int table = 0; table < 2; table++) {
-                    if (table == 1 && !dictIsRehashing(db->expires)) break;
-
-                    unsigned long idx = db->expires_cursor;
-                    idx &= db->expires->ht[table].sizemask;
-                    dictEntry *de = db->expires->ht[table].table[idx];
+            while (!pending && sampled < num &&
+                   (de = expireIndexFirstDue(db,now,&coarse)) != NULL)
+            {
+                /* Deleting the keys modifies the bucket, so the next key
+                 * is fetched first. */
+                while (de && sampled < num) {
+                    dictEntry *next = expireIndexNext(de);
+
+                    sampled++;
+                    if (!activeExpireCycleTryExpire(db,de,now)) {
+                        if (coarse) {
+                            expireIndexRemove(db,de);
+                            expireIndexInsert(db,de);
+                        } else {
+                            pending = 1;
+                        }
+                    }
+                    de = next;
+                }
+            }
+
+            /* Sample a few random keys in order to estimate the average
+             * TTL of the keys yet not expired. A random walk of the index
+             * would favor the keys near its head, that expire first, so
+             * the keys are sampled from the main dictionary instead,
+             * skipping the persistent ones. When few keys are volatile most
+             * attempts fail and the estimate is just updated less often.
+             * This is done once there is nothing more to expire in the DB. */
+            if (pending || sampled < num) {
+                int attempts = ACTIVE_EXPIRE_CYCLE_TTL_SAMPLES*4;
+
+                while (ttl_samples < ACTIVE_EXPIRE_CYCLE_TTL_SAMPLES &&
+                       attempts--)
+                {
                     long long ttl;
 
-                    /* Scan the current bucket of the current table. */
-                    checked_buckets++;
-                    while(de) {
-                        /* Get the next entry now since this entry may get
-                         * deleted. */
-                        dictEntry *e = de;
-                        de = de->next;
-
-                        ttl = dictGetSignedIntegerVal(e)-now;
-                        if (activeExpireCycleTryExpire(db,e,now)) expired++;
-                        if (ttl > 0) {
-                            /* We want the average TTL of keys yet
-                             * not expired. */
-                            ttl_sum += ttl;
-                            ttl_samples++;
-                        }
-                        sampled++;
+                    de = dictGetFairRandomKey(db->dict);
+                    if (de == NULL) break;
+                    if (dbEntryGetExpire(de) == -1) continue;
+                    ttl = dbEntryGetExpire(de)-now;
+                    if (ttl > 0) {
+                        ttl_sum += ttl;
+                        ttl_samples++;
                     }
                 }
-                db->expires_cursor++;
             }
-            total_expired += expired;
-            total_sampled += sampled;
 
             /* Update the average TTL stats for this database. */
             if (ttl_samples) {
@@ -305,26 +329,14 @@ void activeExpireCycle(int type) {
                     break;
                 }
             }
-            /* We don't repeat the cycle for the current database if there are
-             * an acceptable amount of stale keys (logically expired but yet
-             * not reclaimed). */
-        } while (sampled == 0 ||
-                 (expired*100/sampled) > config_cycle_acceptable_stale);
+            /* Stop once a bucket has keys that are not yet expired: the
+             * following ones in the index expire even later. */
+        } while (!pending && sampled == num);
     }
 
     elapsed = ustime()-start;
     server.stat_expire_cycle_time_used += elapsed;
     latencyAddSampleIfNeeded("expire-cycle",elapsed/1000);
-
-    /* Update our estimate of keys existing but yet to be expired.
-     * Running average with this sample accounting for 5%. */
-    double current_perc;
-    if (total_sampled) {
-        current_perc = (double)total_expired/total_sampled;
-    } else
-        current_perc = 0;
-    server.stat_expired_stale_perc = (current_perc*0.05)+
-                                     (server.stat_expired_stale_perc*0.95);
 }
 
 /*-----------------------------------------------------------------------------
@@ -384,9 +396,11 @@ void expireSlaveKeys(void) {
         while(dbids && dbid < server.dbnum) {
             if ((dbids & 1) != 0) {
                 redisDb *db = server.db+dbid;
-                dictEntry *expire = dictFind(db->expires,keyname);
+                dictEntry *expire = dictFind(db->dict,keyname);
                 int expired = 0;
 
+                if (expire && dbEntryGetExpire(expire) == -1) expire = NULL;
+
                 if (expire &&
                     activeExpireCycleTryExpire(server.db+dbid,expire,start))
                 {
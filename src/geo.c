@@ -229,7 +229,7 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
     size_t origincount = ga->used;
     sds member;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr = NULL;
@@ -242,7 +242,7 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             return 0;
         }
 
-        sptr = ziplistNext(zl, eptr);
+        sptr = lpNext(zl, eptr);
         while (eptr) {
             score = zzlGetScore(sptr);
 
@@ -250,8 +250,7 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             if (!zslValueLteMax(score, &range))
                 break;
 
-            /* We know the element exists. ziplistGet should always succeed */
-            ziplistGet(eptr, &vstr, &vlen, &vlong);
+            vstr = lpGetValue(eptr,&vlen,&vlong);
             member = (vstr == NULL) ? sdsfromlonglong(vlong) :
                                       sdsnewlen(vstr,vlen);
             if (geoAppendIfWithinRadius(ga,lon,lat,radius,score,member)
@@ -261,9 +260,10 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zskiplistEntry *ln;
+        zskiplistPos pos;
 
-        if ((ln = zslFirstInRange(zsl, &range)) == NULL) {
+        if ((ln = zslFirstInRange(zsl, &range, &pos)) == NULL) {
             /* Nothing exists starting at our min.  No results. */
             return 0;
         }
@@ -277,7 +277,7 @@ int geoGetPointsInRange(robj *zobj, double min, double max, double lon, double l
             ele = sdsdup(ele);
             if (geoAppendIfWithinRadius(ga,lon,lat,radius,ln->score,ele)
                 == C_ERR) sdsfree(ele);
-            ln = ln->level[0].forward;
+            ln = zslNext(&pos);
         }
     }
     return ga->used - origincount;
@@ -643,20 +643,18 @@ void georadiusGeneric(client *c, int flags) {
         }
 
         for (i = 0; i < returned_items; i++) {
-            zskiplistNode *znode;
             geoPoint *gp = ga->array+i;
             gp->dist /= conversion; /* Fix according to unit. */
             double score = storedist ? gp->dist : gp->score;
             size_t elelen = sdslen(gp->member);
 
             if (maxelelen < elelen) maxelelen = elelen;
-            znode = zslInsert(zs->zsl,score,gp->member);
-            serverAssert(dictAdd(zs->dict,gp->member,&znode->score) == DICT_OK);
+            zsetInsert(zs,score,gp->member);
             gp->member = NULL;
         }
 
         if (returned_items) {
-            zsetConvertToZiplistIfNeeded(zobj,maxelelen);
+            zsetConvertToListpackIfNeeded(zobj,maxelelen);
             setKey(c,c->db,storekey,zobj);
             decrRefCount(zobj);
             notifyKeyspaceEvent(NOTIFY_ZSET,"georadiusstore",storekey,
@@ -13,6 +13,42 @@ size_t lazyfreeGetPendingObjectsCount(void) {
     return aux;
 }
 
+/* Objects whose release was deferred by decrRefCountLazyfreeSafe(). */
+static list *lazyfree_deferred_release = NULL;
+
+/* Release a reference to 'o' that the main thread took while the object was
+ * in the keyspace, like the ones of reply blocks referencing big values.
+ * After FLUSHALL ASYNC the lazyfree thread may be dropping the reference of
+ * the keyspace to the same object, and reference counts are not atomic: in
+ * that case the release is deferred until the lazyfree thread is done, see
+ * lazyfreeReleaseDeferredObjects(). The main thread is the only one queueing
+ * lazyfree jobs, so once no job is pending, none can start meanwhile. */
+void decrRefCountLazyfreeSafe(robj *o) {
+    if (lazyfreeGetPendingObjectsCount() == 0) {
+        decrRefCount(o);
+        return;
+    }
+    if (lazyfree_deferred_release == NULL)
+        lazyfree_deferred_release = listCreate();
+    listAddNodeTail(lazyfree_deferred_release,o);
+}
+
+/* Called from beforeSleep() to release the objects deferred above, once the
+ * lazyfree thread has no pending job. The objects may be big, so they are
+ * released with freeObjAsync(). */
+void lazyfreeReleaseDeferredObjects(void) {
+    listNode *ln;
+
+    if (lazyfree_deferred_release == NULL ||
+        listLength(lazyfree_deferred_release) == 0 ||
+        lazyfreeGetPendingObjectsCount() != 0) return;
+
+    while ((ln = listFirst(lazyfree_deferred_release)) != NULL) {
+        freeObjAsync(listNodeValue(ln));
+        listDelNode(lazyfree_deferred_release,ln);
+    }
+}
+
 /* Return the amount of work needed in order to free an object.
  * The return value is not always the actual number of allocations the
  * object is compoesd of, but a number proportional to it.
@@ -52,16 +88,13 @@ size_t lazyfreeGetFreeEffort(robj *obj) {
  * will be reclaimed in a different bio.c thread. */
 #define LAZYFREE_THRESHOLD 64
 int dbAsyncDelete(redisDb *db, robj *key) {
-    /* Deleting an entry from the expires dict will not free the sds of
-     * the key, because it is shared with the main dictionary. */
-    if (dictSize(db->expires) > 0) dictDelete(db->expires,key->ptr);
-
     /* If the value is composed of a few allocations, to free in a lazy way
      * is actually just slower... So under a certain limit we just free
      * the object synchronously. */
     dictEntry *de = dictUnlink(db->dict,key->ptr);
     if (de) {
         robj *val = dictGetVal(de);
+        if (dbEntryHasExpire(de)) expireIndexRemove(db,de);
         size_t free_effort = lazyfreeGetFreeEffort(val);
 
         /* If releasing the object is too much work, do it in the background
@@ -84,6 +117,7 @@ int dbAsyncDelete(redisDb *db, robj *key) {
     if (de) {
         dictFreeUnlinkedEntry(db->dict,de);
         if (server.cluster_enabled) slotToKeyDel(key->ptr);
+        if (db->prefix_index) prefixIndexDel(db,key->ptr);
         return 1;
     } else {
         return 0;
@@ -105,11 +139,20 @@ void freeObjAsync(robj *o) {
  * create a new empty set of hash tables and scheduling the old ones for
  * lazy freeing. */
 void emptyDbAsync(redisDb *db) {
-    dict *oldht1 = db->dict, *oldht2 = db->expires;
+    dict *oldht = db->dict;
+    expireIndex *oldexpires = db->expires;
     db->dict = dictCreate(&dbDictType,NULL);
-    db->expires = dictCreate(&keyptrDictType,NULL);
-    atomicIncr(lazyfree_objects,dictSize(oldht1));
-    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht1,oldht2);
+    db->expires = expireIndexCreate();
+    atomicIncr(lazyfree_objects,dictSize(oldht));
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,oldht,oldexpires);
+
+    /* The prefix index is released like the cluster slots map. */
+    if (db->prefix_index) {
+        rax *oldindex = db->prefix_index;
+        db->prefix_index = raxNew();
+        atomicIncr(lazyfree_objects,oldindex->numele);
+        bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,oldindex);
+    }
 }
 
 /* Empty the slots-keys map of Redis CLuster by creating a new empty one
@@ -124,6 +167,14 @@ void slotToKeyFlushAsync(void) {
     bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,NULL,old);
 }
 
+/* Free the interned values evicted by evictUnusedInternedValues() in the
+ * lazyfree thread, after the jobs queued before it, that may still access
+ * the values, are done. */
+void freeInternedValuesAsync(dict *d) {
+    atomicIncr(lazyfree_objects,dictSize(d));
+    bioCreateBackgroundJob(BIO_LAZY_FREE,NULL,d,NULL);
+}
+
 /* Release objects from the lazyfree thread. It's just decrRefCount()
  * updating the count of objects to release. */
 void lazyfreeFreeObjectFromBioThread(robj *o) {
@@ -136,15 +187,28 @@ void lazyfreeFreeObjectFromBioThread(robj *o) {
  * when the database was logically deleted. 'sl' is a skiplist used by
  * Redis Cluster in order to take the hash slots -> keys mapping. This
  * may be NULL if Redis Cluster is disabled. */
-void lazyfreeFreeDatabaseFromBioThread(dict *ht1, dict *ht2) {
-    size_t numkeys = dictSize(ht1);
-    dictRelease(ht1);
-    dictRelease(ht2);
+void lazyfreeFreeDatabaseFromBioThread(dict *ht, expireIndex *expires) {
+    size_t numkeys = dictSize(ht);
+    expireIndexRelease(expires);
+    dictRelease(ht);
     atomicDecr(lazyfree_objects,numkeys);
 }
 
-/* Release the skiplist mapping Redis Cluster keys to slots in the
- * lazyfree thread. */
+/* Release evicted interned values in the lazyfree thread. */
+void lazyfreeFreeInternedValuesFromBioThread(dict *d) {
+    size_t numvals = dictSize(d);
+    dictIterator *di = dictGetIterator(d);
+    dictEntry *de;
+
+    while ((de = dictNext(di)) != NULL)
+        freeInternedValue(dictGetKey(de));
+    dictReleaseIterator(di);
+    dictRelease(d);
+    atomicDecr(lazyfree_objects,numvals);
+}
+
+/* Release the radix tree mapping Redis Cluster keys to slots, or the prefix
+ * index of a database, in the lazyfree thread. */
 void lazyfreeFreeSlotsMapFromBioThread(rax *rt) {
     size_t len = rt->numele;
     raxFree(rt);
@@ -801,3 +801,163 @@ unsigned char *lpSeek(unsigned char *lp, long index) {
     }
 }
 
+
+/* Like lpGet() with a NULL 'intbuf', but with the same calling convention
+ * used by ziplistGet(): if the element is a string, the pointer to the string
+ * is returned and its length is stored in '*slen', otherwise NULL is returned
+ * and the integer value is stored in '*lval'. */
+unsigned char *lpGetValue(unsigned char *p, unsigned int *slen, long long *lval) {
+    int64_t v;
+    unsigned char *vstr = lpGet(p,&v,NULL);
+    if (vstr) {
+        *slen = v;
+    } else {
+        *lval = v;
+    }
+    return vstr;
+}
+
+/* Return 1 if the element pointed by 'p' is equal to the string 's' of
+ * length 'slen', otherwise 0 is returned. Since elements are always stored
+ * as integers when they can be represented as such, an integer element can
+ * only match a string that converts to the same integer. */
+int lpCompare(unsigned char *p, unsigned char *s, uint32_t slen) {
+    int64_t v, sval;
+    unsigned char *vstr = lpGet(p,&v,NULL);
+
+    if (vstr) return v == slen && memcmp(vstr,s,slen) == 0;
+    return lpStringToInt64((const char*)s,slen,&sval) && sval == v;
+}
+
+/* Find the element equal to the string 's' of length 'slen', starting the
+ * search at the element pointed by 'p', and skipping 'skip' elements between
+ * every comparison (so for instance a skip of 1 only compares the keys of a
+ * listpack of key/value pairs). Returns the pointer to the matching element,
+ * or NULL if it was not found.
+ *
+ * Elements are always stored with the smallest encoding able to represent
+ * them, and strings that can be represented as integers are always stored
+ * as integers, so an element is equal to 's' if and only if its encoded
+ * form is byte by byte the same as the encoded form of 's'. So 's' is
+ * encoded just once, and the elements are compared with it without being
+ * decoded: most of the elements are rejected looking at their first byte
+ * only, that is the encoding type plus the length for small strings. */
+unsigned char *lpFind(unsigned char *lp, unsigned char *p, unsigned char *s, uint32_t slen, unsigned int skip) {
+    unsigned char hdr[LP_MAX_INT_ENCODING_LEN];
+    unsigned char *payload;
+    uint64_t enclen;
+    uint32_t hdrlen, payloadlen;
+    unsigned int skipcnt = 0;
+
+    ((void) lp); /* Like in lpNext(), lp is not used for now. */
+    if (p == NULL) return NULL;
+
+    /* Integers are fully encoded in 'hdr'. For strings 'hdr' is just the
+     * encoding type and length, followed by the string itself. */
+    if (lpEncodeGetType(s,slen,hdr,&enclen) == LP_ENCODING_INT) {
+        hdrlen = enclen;
+        payload = NULL;
+        payloadlen = 0;
+    } else {
+        hdrlen = enclen-slen;
+        if (hdrlen == 1) {
+            hdr[0] = slen | LP_ENCODING_6BIT_STR;
+        } else if (hdrlen == 2) {
+            hdr[0] = (slen >> 8) | LP_ENCODING_12BIT_STR;
+            hdr[1] = slen & 0xff;
+        } else {
+            hdr[0] = LP_ENCODING_32BIT_STR;
+            hdr[1] = slen & 0xff;
+            hdr[2] = (slen >> 8) & 0xff;
+            hdr[3] = (slen >> 16) & 0xff;
+            hdr[4] = (slen >> 24) & 0xff;
+        }
+        payload = s;
+        payloadlen = slen;
+    }
+
+    while (1) {
+        if (skipcnt == 0) {
+            /* Same first byte means same encoding type, so the element is
+             * at least 'hdrlen' + 'payloadlen' bytes long. */
+            if (p[0] == hdr[0] &&
+                memcmp(p+1,hdr+1,hdrlen-1) == 0 &&
+                (payloadlen == 0 || memcmp(p+hdrlen,payload,payloadlen) == 0))
+            {
+                return p;
+            }
+            skipcnt = skip;
+        } else {
+            skipcnt--;
+        }
+        /* Inline the skip of the most common small entries: 7 bit integers
+         * and 6 bit strings, whose backlen is always a single byte. */
+        if (LP_ENCODING_IS_7BIT_UINT(p[0]))
+            p += 2;
+        else if (LP_ENCODING_IS_6BIT_STR(p[0]))
+            p += 2+LP_ENCODING_6BIT_STR_LEN(p);
+        else
+            p = lpSkip(p);
+        if (p[0] == LP_EOF) break;
+    }
+    return NULL;
+}
+
+/* Delete 'num' consecutive elements starting at the zero-based 'index'
+ * (negative indexes are handled like lpSeek() does). Unlike calling
+ * lpDelete() 'num' times, the tail of the listpack is moved and the
+ * listpack is reallocated just once. */
+unsigned char *lpDeleteRange(unsigned char *lp, long index, unsigned long num) {
+    unsigned char *first, *tail;
+    uint32_t bytes = lpGetTotalBytes(lp);
+    uint32_t numele = lpGetNumElements(lp);
+    unsigned long deleted = 0;
+
+    if (num == 0 || (first = lpSeek(lp,index)) == NULL) return lp;
+
+    tail = first;
+    while (deleted < num && tail[0] != LP_EOF) {
+        tail = lpSkip(tail);
+        deleted++;
+    }
+
+    /* Move the remaining elements and the EOF byte in place of the deleted
+     * ones, then shrink the allocation. */
+    uint32_t newbytes = bytes-(tail-first);
+    memmove(first,tail,(lp+bytes)-tail);
+    lpSetTotalBytes(lp,newbytes);
+    if (numele != LP_HDR_NUMELE_UNKNOWN)
+        lpSetNumElements(lp,numele-deleted);
+    return lp_realloc(lp,newbytes);
+}
+
+/* Print a human readable representation of the listpack to the standard
+ * output, for debugging purposes. */
+void lpRepr(unsigned char *lp) {
+    unsigned char *p, *vstr;
+    int64_t v;
+    unsigned long index = 0;
+
+    printf("{total bytes %lu} {num entries %lu}\n",
+        (unsigned long)lpBytes(lp), (unsigned long)lpLength(lp));
+    p = lpFirst(lp);
+    while (p) {
+        uint32_t enclen = lpCurrentEncodedSize(p);
+        printf("{\n\taddr 0x%08lx,\n\tindex %2lu,\n\toffset %5lu,\n"
+               "\tencoded size %5lu,\n\tbacklen size %lu,\n",
+            (unsigned long)p, index, (unsigned long)(p-lp),
+            (unsigned long)enclen, lpEncodeBacklen(NULL,enclen));
+        vstr = lpGet(p,&v,NULL);
+        if (vstr) {
+            printf("\tstring: ");
+            if (fwrite(vstr,v,1,stdout) == 0) perror("fwrite");
+            printf("\n");
+        } else {
+            printf("\tinteger: %lld\n", (long long)v);
+        }
+        printf("}\n");
+        index++;
+        p = lpNext(lp,p);
+    }
+    printf("{end}\n\n");
+}
@@ -184,6 +184,7 @@ struct RedisModuleKey {
     uint32_t zstart;        /* Start pos for positional ranges. */
     uint32_t zend;          /* End pos for positional ranges. */
     void *zcurrent;         /* Zset iterator current node. */
+    zskiplistPos zpos;      /* Position of zcurrent in a skiplist. */
     int zer;                /* Zset iterator end reached flag
                                (true if end was reached). */
 };
@@ -509,7 +510,7 @@ int moduleCreateEmptyKey(RedisModuleKey *key, int type) {
                             server.list_compress_depth);
         break;
     case REDISMODULE_KEYTYPE_ZSET:
-        obj = createZsetZiplistObject();
+        obj = createZsetListpackObject();
         break;
     case REDISMODULE_KEYTYPE_HASH:
         obj = createHashObject();
@@ -1124,8 +1125,13 @@ void RM_FreeString(RedisModuleCtx *ctx, RedisModuleString *str) {
  * into a string that lives after the callback function returns, if
  * no FreeString() call is performed.
  *
+ * Strings that are interned values of the keyspace can't be retained,
+ * since they are freed once no key references them: use
+ * RedisModule_HoldString() instead, that copies them.
+ *
  * It is possible to call this function with a NULL context. */
 void RM_RetainString(RedisModuleCtx *ctx, RedisModuleString *str) {
+    serverAssert(str->refcount != OBJ_INTERNED_REFCOUNT);
     if (ctx == NULL || !autoMemoryFreed(ctx,REDISMODULE_AM_STRING,str)) {
         /* Increment the string reference counting only if we can't
          * just remove the object from the list of objects that should
@@ -1161,7 +1167,9 @@ void RM_RetainString(RedisModuleCtx *ctx, RedisModuleString *str) {
 * It is possible to call this function with a NULL context.
  */
 RedisModuleString* RM_HoldString(RedisModuleCtx *ctx, RedisModuleString *str) {
-    if (str->refcount == OBJ_STATIC_REFCOUNT) {
+    /* Interned values are freed once no key references them. */
+    if (str->refcount == OBJ_STATIC_REFCOUNT ||
+        str->refcount == OBJ_INTERNED_REFCOUNT) {
         return RM_CreateStringFromString(ctx, str);
     }
 
@@ -1208,6 +1216,10 @@ const char *RM_StringPtrLen(const RedisModuleString *str, size_t *len) {
         if (len) *len = strlen(errmsg);
         return errmsg;
     }
+    if (str->encoding == OBJ_ENCODING_INLINE) {
+        if (len) *len = strlen(inlineStringPtr(str));
+        return inlineStringPtr(str);
+    }
     if (len) *len = sdslen(str->ptr);
     return str->ptr;
 }
@@ -1267,6 +1279,10 @@ RedisModuleString *moduleAssertUnsharedString(RedisModuleString *str) {
         /* Convert the string from integer to raw encoding. */
         str->ptr = sdsfromlonglong((long)str->ptr);
         str->encoding = OBJ_ENCODING_RAW;
+    } else if (str->encoding == OBJ_ENCODING_INLINE) {
+        /* The string is copied before 'ptr', that holds it, is set. */
+        str->ptr = sdsnew(inlineStringPtr(str));
+        str->encoding = OBJ_ENCODING_RAW;
     }
     return str;
 }
@@ -2545,14 +2561,14 @@ int zsetInitScoreRange(RedisModuleKey *key, double min, double max, int minex, i
     zrs->minex = minex;
     zrs->maxex = maxex;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInRange(key->value->ptr,zrs) :
                                 zzlLastInRange(key->value->ptr,zrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = key->value->ptr;
         zskiplist *zsl = zs->zsl;
-        key->zcurrent = first ? zslFirstInRange(zsl,zrs) :
-                                zslLastInRange(zsl,zrs);
+        key->zcurrent = first ? zslFirstInRange(zsl,zrs,&key->zpos) :
+                                zslLastInRange(zsl,zrs,&key->zpos);
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2609,14 +2625,14 @@ int zsetInitLexRange(RedisModuleKey *key, RedisModuleString *min, RedisModuleStr
      * otherwise we don't want the zlexrangespec to be freed. */
     key->ztype = REDISMODULE_ZSET_RANGE_LEX;
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         key->zcurrent = first ? zzlFirstInLexRange(key->value->ptr,zlrs) :
                                 zzlLastInLexRange(key->value->ptr,zlrs);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = key->value->ptr;
         zskiplist *zsl = zs->zsl;
-        key->zcurrent = first ? zslFirstInLexRange(zsl,zlrs) :
-                                zslLastInLexRange(zsl,zlrs);
+        key->zcurrent = first ? zslFirstInLexRange(zsl,zlrs,&key->zpos) :
+                                zslLastInLexRange(zsl,zlrs,&key->zpos);
     } else {
         serverPanic("Unsupported zset encoding");
     }
@@ -2654,17 +2670,17 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
     RedisModuleString *str;
 
     if (key->zcurrent == NULL) return NULL;
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr, *sptr;
         eptr = key->zcurrent;
-        sds ele = ziplistGetObject(eptr);
+        sds ele = lpGetObject(eptr);
         if (score) {
-            sptr = ziplistNext(key->value->ptr,eptr);
+            sptr = lpNext(key->value->ptr,eptr);
             *score = zzlGetScore(sptr);
         }
         str = createObject(OBJ_STRING,ele);
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
-        zskiplistNode *ln = key->zcurrent;
+        zskiplistEntry *ln = key->zcurrent;
         if (score) *score = ln->score;
         str = createStringObject(ln->ele,sdslen(ln->ele));
     } else {
@@ -2680,12 +2696,12 @@ RedisModuleString *RM_ZsetRangeCurrentElement(RedisModuleKey *key, double *score
 int RM_ZsetRangeNext(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->zcurrent;
         unsigned char *next;
-        next = ziplistNext(zl,eptr); /* Skip element. */
-        if (next) next = ziplistNext(zl,next); /* Skip score. */
+        next = lpNext(zl,eptr); /* Skip element. */
+        if (next) next = lpNext(zl,next); /* Skip score. */
         if (next == NULL) {
             key->zer = 1;
             return 0;
@@ -2695,7 +2711,7 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
                 /* Fetch the next element score for the
                  * range check. */
                 unsigned char *saved_next = next;
-                next = ziplistNext(zl,next); /* Skip next element. */
+                next = lpNext(zl,next); /* Skip next element. */
                 double score = zzlGetScore(next); /* Obtain the next score. */
                 if (!zslValueLteMax(score,&key->zrs)) {
                     key->zer = 1;
@@ -2712,7 +2728,8 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
             return 1;
         }
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
-        zskiplistNode *ln = key->zcurrent, *next = ln->level[0].forward;
+        zskiplistPos pos = key->zpos;
+        zskiplistEntry *next = zslNext(&pos);
         if (next == NULL) {
             key->zer = 1;
             return 0;
@@ -2730,6 +2747,7 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
                 }
             }
             key->zcurrent = next;
+            key->zpos = pos;
             return 1;
         }
     } else {
@@ -2743,12 +2761,12 @@ int RM_ZsetRangeNext(RedisModuleKey *key) {
 int RM_ZsetRangePrev(RedisModuleKey *key) {
     if (!key->ztype || !key->zcurrent) return 0; /* No active iterator. */
 
-    if (key->value->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (key->value->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = key->value->ptr;
         unsigned char *eptr = key->zcurrent;
         unsigned char *prev;
-        prev = ziplistPrev(zl,eptr); /* Go back to previous score. */
-        if (prev) prev = ziplistPrev(zl,prev); /* Back to previous ele. */
+        prev = lpPrev(zl,eptr); /* Go back to previous score. */
+        if (prev) prev = lpPrev(zl,prev); /* Back to previous ele. */
         if (prev == NULL) {
             key->zer = 1;
             return 0;
@@ -2758,7 +2776,7 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
                 /* Fetch the previous element score for the
                  * range check. */
                 unsigned char *saved_prev = prev;
-                prev = ziplistNext(zl,prev); /* Skip element to get the score.*/
+                prev = lpNext(zl,prev); /* Skip element to get the score.*/
                 double score = zzlGetScore(prev); /* Obtain the prev score. */
                 if (!zslValueGteMin(score,&key->zrs)) {
                     key->zer = 1;
@@ -2775,7 +2793,8 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
             return 1;
         }
     } else if (key->value->encoding == OBJ_ENCODING_SKIPLIST) {
-        zskiplistNode *ln = key->zcurrent, *prev = ln->backward;
+        zskiplistPos pos = key->zpos;
+        zskiplistEntry *prev = zslPrev(&pos);
         if (prev == NULL) {
             key->zer = 1;
             return 0;
@@ -2793,6 +2812,7 @@ int RM_ZsetRangePrev(RedisModuleKey *key) {
                 }
             }
             key->zcurrent = prev;
+            key->zpos = pos;
             return 1;
         }
     } else {
@@ -6435,6 +6455,11 @@ int RM_UnregisterCommandFilter(RedisModuleCtx *ctx, RedisModuleCommandFilter *fi
     return REDISMODULE_OK;
 }
 
+/* Return true if at least one module registered a command filter. */
+int moduleHasCommandFilters(void) {
+    return listLength(moduleCommandFilters) != 0;
+}
+
 void moduleCallCommandFilters(client *c) {
     if (listLength(moduleCommandFilters) == 0) return;
 
@@ -6700,8 +6725,7 @@ static void moduleScanKeyCallback(void *privdata, const dictEntry *de) {
         sds val = dictGetVal(de);
         value = createStringObject(val, sdslen(val));
     } else if (o->type == OBJ_ZSET) {
-        double *val = (double*)dictGetVal(de);
-        value = createStringObjectFromLongDouble(*val, 0);
+        value = createStringObjectFromLongDouble(dictGetDoubleVal(de), 0);
     }
 
     data->fn(data->key, field, value, data->user_data);
@@ -6796,23 +6820,40 @@ int RM_ScanKey(RedisModuleKey *key, RedisModuleScanCursor *cursor, RedisModuleSc
         cursor->cursor = 1;
         cursor->done = 1;
         ret = 0;
+    } else if (o->type == OBJ_SET && o->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *p = lpFirst(o->ptr);
+        unsigned char *vstr;
+        unsigned int vlen;
+        long long vll;
+        while(p) {
+            vstr = lpGetValue(p,&vlen,&vll);
+            robj *field = (vstr != NULL) ?
+                createStringObject((char*)vstr,vlen) :
+                createObject(OBJ_STRING,sdsfromlonglong(vll));
+            fn(key, field, NULL, privdata);
+            p = lpNext(o->ptr,p);
+            decrRefCount(field);
+        }
+        cursor->cursor = 1;
+        cursor->done = 1;
+        ret = 0;
     } else if (o->type == OBJ_HASH || o->type == OBJ_ZSET) {
-        unsigned char *p = ziplistIndex(o->ptr,0);
+        unsigned char *p = lpSeek(o->ptr,0);
         unsigned char *vstr;
         unsigned int vlen;
         long long vll;
         while(p) {
-            ziplistGet(p,&vstr,&vlen,&vll);
+            vstr = lpGetValue(p,&vlen,&vll);
             robj *field = (vstr != NULL) ?
                 createStringObject((char*)vstr,vlen) :
                 createObject(OBJ_STRING,sdsfromlonglong(vll));
-            p = ziplistNext(o->ptr,p);
-            ziplistGet(p,&vstr,&vlen,&vll);
+            p = lpNext(o->ptr,p);
+            vstr = lpGetValue(p,&vlen,&vll);
             robj *value = (vstr != NULL) ?
                 createStringObject((char*)vstr,vlen) :
                 createObject(OBJ_STRING,sdsfromlonglong(vll));
             fn(key, field, value, privdata);
-            p = ziplistNext(o->ptr,p);
+            p = lpNext(o->ptr,p);
             decrRefCount(field);
             decrRefCount(value);
         }
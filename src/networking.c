@@ -30,6 +30,8 @@
 #include "server.h"
 #include "atomicvar.h"
 #include "cluster.h"
+#include "slowlog.h"
+#include "protoscan.h"
 #include <sys/socket.h>
 #include <sys/uio.h>
 #include <math.h>
@@ -54,22 +56,66 @@ size_t getStringObjectSdsUsedMemory(robj *o) {
     switch(o->encoding) {
     case OBJ_ENCODING_RAW: return sdsZmallocSize(o->ptr);
     case OBJ_ENCODING_EMBSTR: return zmalloc_size(o)-sizeof(robj);
-    default: return 0; /* Just integer encoding for now. */
+    default: return 0; /* Integer and inline encodings. */
     }
 }
 
 /* Client.reply list dup and free methods. */
 void *dupClientReplyValue(void *o) {
     clientReplyBlock *old = o;
-    clientReplyBlock *buf = zmalloc(sizeof(clientReplyBlock) + old->size);
+    clientReplyBlock *buf;
+
+    /* The lazyfree thread may be releasing references to the referenced
+     * object (see decrRefCountLazyfreeSafe()), so in that case the object
+     * is copied instead of retained. The copy accounts for the same bytes. */
+    if (old->obj && lazyfreeGetPendingObjectsCount() != 0) {
+        size_t reflen = sdslen(old->obj->ptr);
+        buf = zmalloc(sizeof(clientReplyBlock) + reflen + old->size);
+        buf->size = reflen + old->size;
+        buf->used = reflen + old->used;
+        buf->obj = NULL;
+        memcpy(buf->buf, old->obj->ptr, reflen);
+        memcpy(buf->buf + reflen, old->buf, old->used);
+        return buf;
+    }
+
+    buf = zmalloc(sizeof(clientReplyBlock) + old->size);
     memcpy(buf, o, sizeof(clientReplyBlock) + old->size);
+    if (buf->obj) incrRefCount(buf->obj);
     return buf;
 }
 
 void freeClientReplyValue(void *o) {
+    clientReplyBlock *block = o;
+    if (block && block->obj) {
+        ioThreadStats *st = io_thread_stats;
+        if (st == NULL) {
+            decrRefCountLazyfreeSafe(block->obj);
+        } else {
+            /* See ioThreadsReleaseObjects(). */
+            if (st->numrelease == st->release_size) {
+                st->release_size = st->release_size ? st->release_size*2 : 64;
+                st->release = zrealloc(st->release,
+                                       sizeof(robj*)*st->release_size);
+            }
+            st->release[st->numrelease++] = block->obj;
+        }
+    }
     zfree(o);
 }
 
+/* Return the number of bytes the reply block 'o' has to send. */
+static size_t replyBlockLen(clientReplyBlock *o) {
+    return o->used + (o->obj ? sdslen(o->obj->ptr) : 0);
+}
+
+/* Return the number of bytes the reply block 'o' accounts for in
+ * c->reply_bytes: referenced objects are accounted as if they were copied
+ * so that output buffer limits work as usually. */
+static size_t replyBlockBytes(clientReplyBlock *o) {
+    return o->size + (o->obj ? sdslen(o->obj->ptr) : 0);
+}
+
 int listMatchObjects(void *a, void *b) {
     return equalStringObjects(a,b);
 }
@@ -109,6 +155,7 @@ client *createClient(connection *conn) {
     c->conn = conn;
     c->name = NULL;
     c->bufpos = 0;
+    c->buf = NULL;
     c->qb_pos = 0;
     c->querybuf = sdsempty();
     c->pending_querybuf = sdsempty();
@@ -116,6 +163,7 @@ client *createClient(connection *conn) {
     c->reqtype = 0;
     c->argc = 0;
     c->argv = NULL;
+    c->argv_cache_len = 0;
     c->cmd = c->lastcmd = NULL;
     c->user = DefaultUser;
     c->multibulklen = 0;
@@ -150,6 +198,7 @@ client *createClient(connection *conn) {
     c->bpop.xread_group_noack = 0;
     c->bpop.numreplicas = 0;
     c->bpop.reploffset = 0;
+    c->bpop.zset_store_job = NULL;
     c->woff = 0;
     c->watched_keys = listCreate();
     c->pubsub_channels = dictCreate(&objectKeyPointerValueDictType,NULL);
@@ -180,8 +229,13 @@ client *createClient(connection *conn) {
 void clientInstallWriteHandler(client *c) {
     /* Schedule the client to write the output buffers to the socket only
      * if not already done and, for slaves, if the slave can actually receive
-     * writes at this stage. */
-    if (!(c->flags & CLIENT_PENDING_WRITE) &&
+     * writes at this stage.
+     *
+     * Clients with a pending threaded read may be served by I/O threads,
+     * that can't touch the global list: for them the handler is installed
+     * by handleClientsWithPendingReadsUsingThreads() once the threads are
+     * done. */
+    if (!(c->flags & (CLIENT_PENDING_WRITE|CLIENT_PENDING_READ)) &&
         (c->replstate == REPL_STATE_NONE ||
          (c->replstate == SLAVE_STATE_ONLINE && !c->repl_put_online_on_ack)))
     {
@@ -241,12 +295,129 @@ int prepareClientToWrite(client *c) {
     return C_OK;
 }
 
+/* -----------------------------------------------------------------------------
+ * Client buffers pool
+ *
+ * Idle clients give back their reply buffer and their empty query buffer,
+ * see clientsCronReleaseBuffers(). The buffers are kept here, up to
+ * CLIENT_BUFFER_POOL_SIZE per kind of buffer, and handed to the next clients
+ * that need one, instead of freeing and allocating them again. Buffers can
+ * be acquired by the I/O threads, so every pool is protected by a mutex,
+ * that also protects its hits and misses stats.
+ * -------------------------------------------------------------------------- */
+
+#define CLIENT_BUFFER_POOL_SIZE 1024
+
+typedef struct clientBufferPool {
+    pthread_mutex_t mutex;
+    long long *hits, *misses;
+    int len;
+    void *items[CLIENT_BUFFER_POOL_SIZE];
+} clientBufferPool;
+
+static clientBufferPool replyBufferPool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    &server.stat_reply_buffer_pool_hits, &server.stat_reply_buffer_pool_misses,
+    0, {NULL}
+};
+
+static clientBufferPool queryBufferPool = {
+    PTHREAD_MUTEX_INITIALIZER,
+    &server.stat_query_buffer_pool_hits, &server.stat_query_buffer_pool_misses,
+    0, {NULL}
+};
+
+/* Take a buffer from the pool, or return NULL if it is empty. */
+static void *clientBufferPoolGet(clientBufferPool *pool) {
+    void *buf = NULL;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->len) {
+        buf = pool->items[--pool->len];
+        (*pool->hits)++;
+    } else {
+        (*pool->misses)++;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return buf;
+}
+
+/* Give a buffer back to the pool. Returns 0 if the pool is full, and the
+ * caller should free the buffer. */
+static int clientBufferPoolPut(clientBufferPool *pool, void *buf) {
+    int added = 0;
+
+    pthread_mutex_lock(&pool->mutex);
+    if (pool->len < CLIENT_BUFFER_POOL_SIZE) {
+        pool->items[pool->len++] = buf;
+        added = 1;
+    }
+    pthread_mutex_unlock(&pool->mutex);
+    return added;
+}
+
+/* Return the memory used by the buffers in the pools. */
+size_t getClientBufferPoolSize(void) {
+    size_t size = 0;
+
+    pthread_mutex_lock(&replyBufferPool.mutex);
+    size += (size_t)replyBufferPool.len * PROTO_REPLY_CHUNK_BYTES;
+    pthread_mutex_unlock(&replyBufferPool.mutex);
+    pthread_mutex_lock(&queryBufferPool.mutex);
+    for (int j = 0; j < queryBufferPool.len; j++)
+        size += sdsAllocSize(queryBufferPool.items[j]);
+    pthread_mutex_unlock(&queryBufferPool.mutex);
+    return size;
+}
+
+/* Make sure 'c' has a reply buffer. */
+static void acquireClientReplyBuffer(client *c) {
+    if (c->buf) return;
+    c->buf = clientBufferPoolGet(&replyBufferPool);
+    if (c->buf == NULL) c->buf = zmalloc(PROTO_REPLY_CHUNK_BYTES);
+}
+
+/* Give the reply buffer of 'c' back to the pool, if it is empty. */
+void releaseClientReplyBuffer(client *c) {
+    if (c->buf == NULL || c->bufpos) return;
+    if (!clientBufferPoolPut(&replyBufferPool,c->buf)) zfree(c->buf);
+    c->buf = NULL;
+}
+
+/* Called before reading into the query buffer of 'c': a query buffer
+ * without any room, as the ones of new clients or of clients that gave
+ * their buffer back, is replaced by one from the pool. */
+static void acquireClientQueryBuffer(client *c) {
+    if (sdsalloc(c->querybuf) != 0) return;
+
+    sds querybuf = clientBufferPoolGet(&queryBufferPool);
+    if (querybuf) {
+        sdsfree(c->querybuf);
+        c->querybuf = querybuf;
+    }
+}
+
+/* Give the query buffer of 'c' back to the pool, if it is empty. Only
+ * buffers of the usual size are pooled, bigger ones are just freed. */
+void releaseClientQueryBuffer(client *c) {
+    size_t alloc = sdsalloc(c->querybuf);
+
+    if (sdslen(c->querybuf) || alloc == 0) return;
+    if (alloc < PROTO_IOBUF_LEN || alloc > PROTO_MBULK_BIG_ARG ||
+        !clientBufferPoolPut(&queryBufferPool,c->querybuf))
+    {
+        sdsfree(c->querybuf);
+    }
+    c->querybuf = sdsempty();
+    c->qb_pos = 0;
+}
+
 /* -----------------------------------------------------------------------------
  * Low level functions to add more data to output buffers.
  * -------------------------------------------------------------------------- */
 
 int _addReplyToBuffer(client *c, const char *s, size_t len) {
-    size_t available = sizeof(c->buf)-c->bufpos;
+    size_t available = PROTO_REPLY_CHUNK_BYTES-c->bufpos;
 
     if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return C_OK;
 
@@ -257,6 +428,7 @@ int _addReplyToBuffer(client *c, const char *s, size_t len) {
     /* Check that the buffer has enough space available for this string. */
     if (len > available) return C_ERR;
 
+    acquireClientReplyBuffer(c);
     memcpy(c->buf+c->bufpos,s,len);
     c->bufpos+=len;
     return C_OK;
@@ -291,6 +463,7 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
         /* take over the allocation's internal fragmentation */
         tail->size = zmalloc_usable(tail) - sizeof(clientReplyBlock);
         tail->used = len;
+        tail->obj = NULL;
         memcpy(tail->buf, s, len);
         listAddNodeTail(c->reply, tail);
         c->reply_bytes += tail->size;
@@ -298,6 +471,39 @@ void _addReplyProtoToList(client *c, const char *s, size_t len) {
     asyncCloseClientOnOutputBufferLimitReached(c);
 }
 
+/* Add a reference to the string object 'obj' to the reply list, instead of
+ * copying it. The object will be written directly from its own memory, so
+ * it is retained until the block is released. Since the object may also be
+ * released by the lazyfree thread after a FLUSHALL ASYNC, the reference is
+ * dropped with decrRefCountLazyfreeSafe(). */
+void _addReplyObjectRefToList(client *c, robj *obj) {
+    if (c->flags & CLIENT_CLOSE_AFTER_REPLY) return;
+
+    /* Leave some room after the value, for the protocol that follows. */
+    clientReplyBlock *block =
+        zmalloc(PROTO_REPLY_REF_TAIL_BYTES + sizeof(clientReplyBlock));
+    block->size = zmalloc_usable(block) - sizeof(clientReplyBlock);
+    block->used = 0;
+    block->obj = obj;
+    incrRefCount(obj);
+    listAddNodeTail(c->reply,block);
+    c->reply_bytes += replyBlockBytes(block);
+    asyncCloseClientOnOutputBufferLimitReached(c);
+}
+
+/* Return true if the string object 'obj' is worth sending to the client
+ * by reference instead of copying it in the output buffer. This is not
+ * possible for clients whose output buffer is consumed by Redis itself
+ * (Lua, modules), and in the context of I/O threads, that can't touch the
+ * reference count of objects. */
+static int replyCanReferenceObject(client *c, robj *obj) {
+    return obj->encoding == OBJ_ENCODING_RAW &&
+           obj->refcount != OBJ_STATIC_REFCOUNT &&
+           sdslen(obj->ptr) >= PROTO_REPLY_REF_MIN_BYTES &&
+           !(c->flags & (CLIENT_LUA|CLIENT_MODULE)) &&
+           io_thread_stats == NULL;
+}
+
 /* -----------------------------------------------------------------------------
  * Higher level functions to queue data on the client output buffer.
  * The following functions are the ones that commands implementations will call.
@@ -310,6 +516,11 @@ void addReply(client *c, robj *obj) {
     if (sdsEncodedObject(obj)) {
         if (_addReplyToBuffer(c,obj->ptr,sdslen(obj->ptr)) != C_OK)
             _addReplyProtoToList(c,obj->ptr,sdslen(obj->ptr));
+    } else if (obj->encoding == OBJ_ENCODING_INLINE) {
+        char *s = inlineStringPtr(obj);
+        size_t len = strlen(s);
+        if (_addReplyToBuffer(c,s,len) != C_OK)
+            _addReplyProtoToList(c,s,len);
     } else if (obj->encoding == OBJ_ENCODING_INT) {
         /* For integer encoded strings we just convert it into a string
          * using our optimized function, and attach the resulting string
@@ -495,8 +706,8 @@ void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
     serverAssert(length >= 0);
     listNode *ln = (listNode*)node;
     clientReplyBlock *next;
-    char lenstr[128];
-    size_t lenstr_len = sprintf(lenstr, "%c%ld\r\n", prefix, length);
+    char lenstr[PROTO_HEADER_MAX_LEN];
+    size_t lenstr_len = protoWriteHeader(lenstr, prefix, length);
 
     /* Abort when *node is NULL: when the client should not accept writes
      * we return NULL in addReplyDeferredLen() */
@@ -514,6 +725,7 @@ void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
      * - It has enough room already allocated
      * - And not too large (avoid large memmove) */
     if (ln->next != NULL && (next = listNodeValue(ln->next)) &&
+        next->obj == NULL &&
         next->size - next->used >= lenstr_len &&
         next->used < PROTO_REPLY_CHUNK_BYTES * 4) {
         memmove(next->buf + lenstr_len, next->buf, next->used);
@@ -526,6 +738,7 @@ void setDeferredAggregateLen(client *c, void *node, long length, char prefix) {
         /* Take over the allocation's internal fragmentation */
         buf->size = zmalloc_usable(buf) - sizeof(clientReplyBlock);
         buf->used = lenstr_len;
+        buf->obj = NULL;
         memcpy(buf->buf, lenstr, lenstr_len);
         listNodeValue(ln) = buf;
         c->reply_bytes += buf->size;
@@ -605,8 +818,7 @@ void addReplyHumanLongDouble(client *c, long double d) {
 /* Add a long long as integer reply or bulk len / multi bulk count.
  * Basically this is used to output <prefix><long long><crlf>. */
 void addReplyLongLongWithPrefix(client *c, long long ll, char prefix) {
-    char buf[128];
-    int len;
+    char buf[PROTO_HEADER_MAX_LEN];
 
     /* Things like $3\r\n or *2\r\n are emitted very often by the protocol
      * so we have a few shared objects to use if the integer is small
@@ -619,11 +831,7 @@ void addReplyLongLongWithPrefix(client *c, long long ll, char prefix) {
         return;
     }
 
-    buf[0] = prefix;
-    len = ll2string(buf+1,sizeof(buf)-1,ll);
-    buf[len+1] = '\r';
-    buf[len+2] = '\n';
-    addReplyProto(c,buf,len+3);
+    addReplyProto(c,buf,protoWriteHeader(buf,prefix,ll));
 }
 
 void addReplyLongLong(client *c, long long ll) {
@@ -709,7 +917,11 @@ void addReplyBulkLen(client *c, robj *obj) {
 /* Add a Redis Object as a bulk reply */
 void addReplyBulk(client *c, robj *obj) {
     addReplyBulkLen(c,obj);
-    addReply(c,obj);
+    if (replyCanReferenceObject(c,obj)) {
+        if (prepareClientToWrite(c) == C_OK) _addReplyObjectRefToList(c,obj);
+    } else {
+        addReply(c,obj);
+    }
     addReply(c,shared.crlf);
 }
 
@@ -811,7 +1023,7 @@ void addReplySubcommandSyntaxError(client *c) {
 void AddReplyFromClient(client *dst, client *src) {
     if (prepareClientToWrite(dst) != C_OK)
         return;
-    addReplyProto(dst,src->buf, src->bufpos);
+    if (src->bufpos) addReplyProto(dst,src->buf,src->bufpos);
     if (listLength(src->reply))
         listJoin(dst->reply,src->reply);
     dst->reply_bytes += src->reply_bytes;
@@ -826,7 +1038,10 @@ void copyClientOutputBuffer(client *dst, client *src) {
     listRelease(dst->reply);
     dst->sentlen = 0;
     dst->reply = listDup(src->reply);
-    memcpy(dst->buf,src->buf,src->bufpos);
+    if (src->bufpos) {
+        acquireClientReplyBuffer(dst);
+        memcpy(dst->buf,src->buf,src->bufpos);
+    }
     dst->bufpos = src->bufpos;
     dst->reply_bytes = src->reply_bytes;
 }
@@ -1031,12 +1246,44 @@ void acceptUnixHandler(aeEventLoop *el, int fd, void *privdata, int mask) {
 
 static void freeClientArgv(client *c) {
     int j;
-    for (j = 0; j < c->argc; j++)
-        decrRefCount(c->argv[j]);
+    for (j = 0; j < c->argc; j++) {
+        robj *o = c->argv[j];
+
+        /* Keep the short arguments nobody else references for the next
+         * commands, see createClientArgObject(). */
+        if (o->encoding == OBJ_ENCODING_EMBSTR && o->refcount == 1 &&
+            c->argv_cache_len < CLIENT_ARGV_CACHE_SIZE)
+        {
+            c->argv_cache[c->argv_cache_len++] = o;
+        } else {
+            decrRefCount(o);
+        }
+    }
     c->argc = 0;
     c->cmd = NULL;
 }
 
+/* Make c->argv big enough for 'argc' arguments. The array of the previous
+ * command is reused if possible, unless it is way bigger than needed. */
+static void resizeClientArgv(client *c, int argc) {
+    if (c->argv) {
+        size_t size = zmalloc_usable(c->argv)/sizeof(robj*);
+        if (size >= (size_t)argc && (size <= 64 || size <= (size_t)argc*2))
+            return;
+        zfree(c->argv);
+    }
+    c->argv = zmalloc(sizeof(robj*)*argc);
+}
+
+/* Create the string object of an argument of the command of 'c', reusing
+ * the objects of the arguments of the previous commands: this saves an
+ * allocation for every argument of the usual short commands. */
+static robj *createClientArgObject(client *c, const char *ptr, size_t len) {
+    if (c->argv_cache_len)
+        return recycleStringObject(c->argv_cache[--c->argv_cache_len],ptr,len);
+    return createStringObject(ptr,len);
+}
+
 /* Close all the slaves connections. This is useful in chained replication
  * when we resync with our own master and want to force all our slaves to
  * resync with us as well. */
@@ -1168,7 +1415,9 @@ void freeClient(client *c) {
             replicationGetSlaveName(c));
     }
 
-    /* Free the query buffer */
+    /* Free the query buffer, giving it back to the pool if possible. */
+    sdsclear(c->querybuf);
+    releaseClientQueryBuffer(c);
     sdsfree(c->querybuf);
     sdsfree(c->pending_querybuf);
     c->querybuf = NULL;
@@ -1232,7 +1481,11 @@ void freeClient(client *c) {
     /* Release other dynamically allocated client structure fields,
      * and finally release the client structure itself. */
     if (c->name) decrRefCount(c->name);
+    c->bufpos = 0;
+    releaseClientReplyBuffer(c);
     zfree(c->argv);
+    while (c->argv_cache_len)
+        decrRefCount(c->argv_cache[--c->argv_cache_len]);
     freeClientMultiState(c);
     sdsfree(c->peerid);
     zfree(c);
@@ -1291,6 +1544,96 @@ client *lookupClientByID(uint64_t id) {
     return (c == raxNotFound) ? NULL : c;
 }
 
+/* Mark 'nwritten' bytes of the pending replies of 'c' as sent, releasing
+ * the reply blocks that were fully sent (and the empty ones). */
+static void _clientRepliesSent(client *c, size_t nwritten) {
+    if (c->bufpos > 0) {
+        size_t len = c->bufpos - c->sentlen;
+        if (nwritten < len) {
+            c->sentlen += nwritten;
+            return;
+        }
+        /* If the buffer was sent, set bufpos to zero to continue with
+         * the remainder of the reply. */
+        nwritten -= len;
+        c->bufpos = 0;
+        c->sentlen = 0;
+    }
+
+    while(listLength(c->reply)) {
+        clientReplyBlock *o = listNodeValue(listFirst(c->reply));
+        size_t len = replyBlockLen(o) - c->sentlen;
+        if (nwritten < len) {
+            c->sentlen += nwritten;
+            return;
+        }
+        /* If we fully sent the object on head go to the next one */
+        nwritten -= len;
+        c->reply_bytes -= replyBlockBytes(o);
+        listDelNode(c->reply,listFirst(c->reply));
+        c->sentlen = 0;
+        /* If there are no longer objects in the list, we expect
+         * the count of reply bytes to be exactly zero. */
+        if (listLength(c->reply) == 0)
+            serverAssert(c->reply_bytes == 0);
+    }
+}
+
+/* Write the pending replies of 'c' gathering c->buf and the blocks of the
+ * reply list in a single connWritev() call, so that pipelined clients and
+ * replicas with many reply blocks are served with a single syscall. At most
+ * about NET_MAX_WRITES_PER_EVENT bytes are gathered at once.
+ *
+ * Returns the number of bytes written, or the connWritev() return value
+ * if nothing was written. */
+static ssize_t _writevToClient(client *c) {
+    struct iovec iov[NET_MAX_WRITEV_IOVCNT];
+    int iovcnt = 0;
+    size_t iovlen = 0, offset = c->sentlen;
+    ssize_t nwritten = 0;
+
+    if (c->bufpos > 0) {
+        iov[iovcnt].iov_base = c->buf + offset;
+        iov[iovcnt].iov_len = c->bufpos - offset;
+        iovlen += iov[iovcnt++].iov_len;
+        offset = 0;
+    }
+
+    /* Blocks referencing an object send the object first, then the
+     * content of their buffer: every block may need two buffers. */
+    listIter li;
+    listNode *ln;
+    listRewind(c->reply,&li);
+    while((ln = listNext(&li)) && iovcnt < NET_MAX_WRITEV_IOVCNT-1 &&
+          iovlen < NET_MAX_WRITES_PER_EVENT)
+    {
+        clientReplyBlock *o = listNodeValue(ln);
+        size_t reflen = o->obj ? sdslen(o->obj->ptr) : 0;
+
+        if (offset < reflen) {
+            iov[iovcnt].iov_base = (char*)o->obj->ptr + offset;
+            iov[iovcnt].iov_len = reflen - offset;
+            iovlen += iov[iovcnt++].iov_len;
+            offset = 0;
+        } else {
+            offset -= reflen;
+        }
+        if (offset < o->used) {
+            iov[iovcnt].iov_base = o->buf + offset;
+            iov[iovcnt].iov_len = o->used - offset;
+            iovlen += iov[iovcnt++].iov_len;
+        }
+        offset = 0;
+    }
+
+    if (iovcnt) {
+        nwritten = connWritev(c->conn,iov,iovcnt);
+        if (nwritten <= 0) return nwritten;
+    }
+    _clientRepliesSent(c,nwritten);
+    return nwritten;
+}
+
 /* Write data in output buffers to client. Return C_OK if the client
  * is still valid after the call, C_ERR if it was freed because of some
  * error.  If handler_installed is set, it will attempt to clear the
@@ -1304,48 +1647,12 @@ int writeToClient(client *c, int handler_installed) {
     server.stat_total_writes_processed++;
 
     ssize_t nwritten = 0, totwritten = 0;
-    size_t objlen;
-    clientReplyBlock *o;
 
     while(clientHasPendingReplies(c)) {
-        if (c->bufpos > 0) {
-            nwritten = connWrite(c->conn,c->buf+c->sentlen,c->bufpos-c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If the buffer was sent, set bufpos to zero to continue with
-             * the remainder of the reply. */
-            if ((int)c->sentlen == c->bufpos) {
-                c->bufpos = 0;
-                c->sentlen = 0;
-            }
-        } else {
-            o = listNodeValue(listFirst(c->reply));
-            objlen = o->used;
-
-            if (objlen == 0) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                continue;
-            }
+        nwritten = _writevToClient(c);
+        if (nwritten <= 0) break;
+        totwritten += nwritten;
 
-            nwritten = connWrite(c->conn, o->buf + c->sentlen, objlen - c->sentlen);
-            if (nwritten <= 0) break;
-            c->sentlen += nwritten;
-            totwritten += nwritten;
-
-            /* If we fully sent the object on head go to the next one */
-            if (c->sentlen == objlen) {
-                c->reply_bytes -= o->size;
-                listDelNode(c->reply,listFirst(c->reply));
-                c->sentlen = 0;
-                /* If there are no longer objects in the list, we expect
-                 * the count of reply bytes to be exactly zero. */
-                if (listLength(c->reply) == 0)
-                    serverAssert(c->reply_bytes == 0);
-            }
-        }
         /* Note that we avoid to send more than NET_MAX_WRITES_PER_EVENT
          * bytes, in a single threaded server it's a good idea to serve
          * other clients as well, even if a very large request comes from
@@ -1506,6 +1813,12 @@ void unprotectClient(client *c) {
     }
 }
 
+/* Return a pointer to the first 'ch' character in the part of the query
+ * buffer that was not parsed yet, or NULL if there is none. */
+static inline char *queryBufferFind(client *c, int ch) {
+    return protoFindByte(c->querybuf+c->qb_pos,sdslen(c->querybuf)-c->qb_pos,ch);
+}
+
 /* Like processMultibulkBuffer(), but for the inline protocol instead of RESP,
  * this function consumes the client query buffer and creates a command ready
  * to be executed inside the client structure. Returns C_OK if the command
@@ -1520,7 +1833,7 @@ int processInlineBuffer(client *c) {
     size_t querylen;
 
     /* Search for end of line */
-    newline = strchr(c->querybuf+c->qb_pos,'\n');
+    newline = queryBufferFind(c,'\n');
 
     /* Nothing to do without a \r\n */
     if (newline == NULL) {
@@ -1569,10 +1882,7 @@ int processInlineBuffer(client *c) {
     c->qb_pos += querylen+linefeed_chars;
 
     /* Setup argv array on client structure */
-    if (argc) {
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*)*argc);
-    }
+    if (argc) resizeClientArgv(c,argc);
 
     /* Create redis objects for all arguments. */
     for (c->argc = 0, j = 0; j < argc; j++) {
@@ -1637,7 +1947,7 @@ int processMultibulkBuffer(client *c) {
         serverAssertWithInfo(c,NULL,c->argc == 0);
 
         /* Multi bulk length cannot be read without a \r\n */
-        newline = strchr(c->querybuf+c->qb_pos,'\r');
+        newline = queryBufferFind(c,'\r');
         if (newline == NULL) {
             if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                 addReplyError(c,"Protocol error: too big mbulk count string");
@@ -1653,7 +1963,7 @@ int processMultibulkBuffer(client *c) {
         /* We know for sure there is a whole line since newline != NULL,
          * so go ahead and find out the multi bulk length. */
         serverAssertWithInfo(c,NULL,c->querybuf[c->qb_pos] == '*');
-        ok = string2ll(c->querybuf+1+c->qb_pos,newline-(c->querybuf+1+c->qb_pos),&ll);
+        ok = protoString2ll(c->querybuf+1+c->qb_pos,newline-(c->querybuf+1+c->qb_pos),&ll);
         if (!ok || ll > 1024*1024) {
             addReplyError(c,"Protocol error: invalid multibulk length");
             setProtocolError("invalid mbulk count",c);
@@ -1667,15 +1977,14 @@ int processMultibulkBuffer(client *c) {
         c->multibulklen = ll;
 
         /* Setup argv array on client structure */
-        if (c->argv) zfree(c->argv);
-        c->argv = zmalloc(sizeof(robj*)*c->multibulklen);
+        resizeClientArgv(c,c->multibulklen);
     }
 
     serverAssertWithInfo(c,NULL,c->multibulklen > 0);
     while(c->multibulklen) {
         /* Read bulk length if unknown */
         if (c->bulklen == -1) {
-            newline = strchr(c->querybuf+c->qb_pos,'\r');
+            newline = queryBufferFind(c,'\r');
             if (newline == NULL) {
                 if (sdslen(c->querybuf)-c->qb_pos > PROTO_INLINE_MAX_SIZE) {
                     addReplyError(c,
@@ -1698,7 +2007,7 @@ int processMultibulkBuffer(client *c) {
                 return C_ERR;
             }
 
-            ok = string2ll(c->querybuf+c->qb_pos+1,newline-(c->querybuf+c->qb_pos+1),&ll);
+            ok = protoString2ll(c->querybuf+c->qb_pos+1,newline-(c->querybuf+c->qb_pos+1),&ll);
             if (!ok || ll < 0 ||
                 (!(c->flags & CLIENT_MASTER) && ll > server.proto_max_bulk_len)) {
                 addReplyError(c,"Protocol error: invalid bulk length");
@@ -1748,7 +2057,7 @@ int processMultibulkBuffer(client *c) {
                 sdsclear(c->querybuf);
             } else {
                 c->argv[c->argc++] =
-                    createStringObject(c->querybuf+c->qb_pos,c->bulklen);
+                    createClientArgObject(c,c->querybuf+c->qb_pos,c->bulklen);
                 c->qb_pos += c->bulklen+2;
             }
             c->bulklen = -1;
@@ -1886,9 +2195,12 @@ void processInputBuffer(client *c) {
             resetClient(c);
         } else {
             /* If we are in the context of an I/O thread, we can't really
-             * execute the command here. All we can do is to flag the client
-             * as one that needs to process the command. */
+             * execute the command here, unless it is one of the read only
+             * commands I/O threads are allowed to serve. Otherwise all we
+             * can do is to flag the client as one that needs to process
+             * the command. */
             if (c->flags & CLIENT_PENDING_READ) {
+                if (ioThreadTryProcessCommand(c) == C_OK) continue;
                 c->flags |= CLIENT_PENDING_COMMAND;
                 break;
             }
@@ -1903,10 +2215,19 @@ void processInputBuffer(client *c) {
         }
     }
 
-    /* Trim to pos */
+    /* Trim to pos. This is done lazily: the parsed part is just dropped if
+     * there is nothing left to parse, and the unparsed part is moved at the
+     * start of the buffer only once it is smaller than the parsed part, so
+     * that the cost of the copy is amortized. */
     if (c->qb_pos) {
-        sdsrange(c->querybuf,c->qb_pos,-1);
-        c->qb_pos = 0;
+        size_t qblen = sdslen(c->querybuf);
+        if (c->qb_pos == qblen) {
+            sdsclear(c->querybuf);
+            c->qb_pos = 0;
+        } else if (c->qb_pos >= qblen - c->qb_pos) {
+            sdsrange(c->querybuf,c->qb_pos,-1);
+            c->qb_pos = 0;
+        }
     }
 }
 
@@ -1932,13 +2253,15 @@ void readQueryFromClient(connection *conn) {
     if (c->reqtype == PROTO_REQ_MULTIBULK && c->multibulklen && c->bulklen != -1
         && c->bulklen >= PROTO_MBULK_BIG_ARG)
     {
-        ssize_t remaining = (size_t)(c->bulklen+2)-sdslen(c->querybuf);
+        ssize_t remaining = (size_t)(c->bulklen+2)-
+                            (sdslen(c->querybuf)-c->qb_pos);
 
         /* Note that the 'remaining' variable may be zero in some edge case,
          * for example once we resume a blocked client after CLIENT PAUSE. */
         if (remaining > 0 && remaining < readlen) readlen = remaining;
     }
 
+    acquireClientQueryBuffer(c);
     qblen = sdslen(c->querybuf);
     if (c->querybuf_peak < qblen) c->querybuf_peak = qblen;
     c->querybuf = sdsMakeRoomFor(c->querybuf, readlen);
@@ -1967,10 +2290,10 @@ void readQueryFromClient(connection *conn) {
     c->lastinteraction = server.unixtime;
     if (c->flags & CLIENT_MASTER) c->read_reploff += nread;
     server.stat_net_input_bytes += nread;
-    if (sdslen(c->querybuf) > server.client_max_querybuf_len) {
+    if (sdslen(c->querybuf)-c->qb_pos > server.client_max_querybuf_len) {
         sds ci = catClientInfoString(sdsempty(),c), bytes = sdsempty();
 
-        bytes = sdscatrepr(bytes,c->querybuf,64);
+        bytes = sdscatrepr(bytes,c->querybuf+c->qb_pos,64);
         serverLog(LL_WARNING,"Closing client that reached max query buffer length: %s (qbuf initial bytes: %s)", ci, bytes);
         sdsfree(ci);
         sdsfree(bytes);
@@ -2324,7 +2647,11 @@ NULL
         if (getLongLongFromObjectOrReply(c,c->argv[2],&id,NULL)
             != C_OK) return;
         struct client *target = lookupClientByID(id);
-        if (target && target->flags & CLIENT_BLOCKED) {
+        /* A background ZUNIONSTORE/ZINTERSTORE can't be interrupted: the
+         * command will be executed anyway once the result is ready. */
+        if (target && target->flags & CLIENT_BLOCKED &&
+            target->btype != BLOCKED_ZSETSTORE)
+        {
             if (unblock_error)
                 addReplyError(target,
                     "-UNBLOCKED client unblocked via CLIENT UNBLOCK");
@@ -2916,15 +3243,221 @@ int tio_debug = 0;
 #define IO_THREADS_OP_READ 0
 #define IO_THREADS_OP_WRITE 1
 
+/* Bounds of the number of iterations threads busy wait for new work (or for
+ * the work to be completed, in the case of the main thread) before going to
+ * sleep. The budget of every I/O thread adapts between the two: it doubles
+ * when work arrives while spinning, and halves every time the thread has to
+ * sleep, so that threads spin under load and are almost free when idle. */
+#define IO_THREADS_SPIN_MIN (1<<10)
+#define IO_THREADS_SPIN_MAX (1<<20)
+
 pthread_t io_threads[IO_THREADS_MAX_NUM];
 pthread_mutex_t io_threads_mutex[IO_THREADS_MAX_NUM];
+pthread_cond_t io_threads_cond[IO_THREADS_MAX_NUM];
 _Atomic unsigned long io_threads_pending[IO_THREADS_MAX_NUM];
+_Atomic int io_threads_sleeping[IO_THREADS_MAX_NUM];
 int io_threads_op;      /* IO_THREADS_OP_WRITE or IO_THREADS_OP_READ. */
 
-/* This is the list of clients each thread will serve when threaded I/O is
+/* Used by the main thread to sleep while waiting for the I/O threads to
+ * complete a long batch of work. */
+pthread_mutex_t io_threads_done_mutex = PTHREAD_MUTEX_INITIALIZER;
+pthread_cond_t io_threads_done_cond = PTHREAD_COND_INITIALIZER;
+_Atomic int io_threads_main_sleeping = 0;
+
+/* Per thread counters reported by INFO. Written only by the owning thread. */
+_Atomic long long io_threads_cpu_usec[IO_THREADS_MAX_NUM];
+_Atomic long long io_threads_jobs[IO_THREADS_MAX_NUM];
+_Atomic long long io_threads_sleeps[IO_THREADS_MAX_NUM];
+_Atomic long long io_threads_steals[IO_THREADS_MAX_NUM];
+
+/* This is the queue of clients each thread will serve when threaded I/O is
  * used. We spawn io_threads_num-1 threads, since one is the main thread
- * itself. */
-list *io_threads_list[IO_THREADS_MAX_NUM];
+ * itself.
+ *
+ * Queues are filled by the main thread before handing the work to the
+ * threads, and then consumed by claiming clients with an atomic increment
+ * of 'next': this way a thread that is done with its own queue can steal
+ * the clients not yet served from the queues of the other threads. */
+typedef struct ioThreadQueue {
+    client **clients;
+    size_t len;             /* Number of clients in the queue. */
+    size_t size;            /* Number of allocated slots. */
+    _Atomic size_t next;    /* Index of the next client to serve. */
+    size_t load;            /* Estimated cost of the queued clients. */
+} ioThreadQueue;
+
+ioThreadQueue io_threads_queue[IO_THREADS_MAX_NUM];
+
+/* Fixed cost of serving a client, in bytes, used when distributing clients
+ * among threads: it accounts for the system call and the other per client
+ * work, that don't depend on the amount of data to transfer. */
+#define IO_THREADS_CLIENT_COST 1024
+
+/* Stats of the commands executed by every I/O thread, and the pointer to the
+ * stats of the current thread (NULL for the main thread, which updates the
+ * server stats directly). */
+ioThreadStats io_threads_stats[IO_THREADS_MAX_NUM];
+_Thread_local ioThreadStats *io_thread_stats = NULL;
+
+/* Set by the main thread for the duration of a threaded read, if the I/O
+ * threads are allowed to execute commands. See ioThreadTryProcessCommand(). */
+static int io_threads_do_commands_now = 0;
+
+/* Remember the CPU time consumed so far by the I/O thread 'id', that must be
+ * the calling thread. */
+static void ioThreadUpdateCpuTime(long id) {
+#if defined(CLOCK_THREAD_CPUTIME_ID)
+    struct timespec ts;
+    if (clock_gettime(CLOCK_THREAD_CPUTIME_ID,&ts) == 0)
+        io_threads_cpu_usec[id] = (long long)ts.tv_sec*1000000 +
+                                  ts.tv_nsec/1000;
+#else
+    UNUSED(id);
+#endif
+}
+
+/* Return the estimated cost of serving the client 'c' for the threaded
+ * operation 'op': the bytes we expect to transfer, plus a fixed cost. */
+static size_t ioThreadClientCost(client *c, int op) {
+    size_t cost = IO_THREADS_CLIENT_COST;
+    if (op == IO_THREADS_OP_WRITE) {
+        size_t pending = c->bufpos + getClientOutputBufferMemoryUsage(c);
+        /* See the NET_MAX_WRITES_PER_EVENT limit in writeToClient(). */
+        if (!(c->flags & CLIENT_SLAVE) && pending > NET_MAX_WRITES_PER_EVENT)
+            pending = NET_MAX_WRITES_PER_EVENT;
+        cost += pending;
+    } else if (c->reqtype == PROTO_REQ_MULTIBULK && c->bulklen != -1 &&
+               c->bulklen >= PROTO_MBULK_BIG_ARG)
+    {
+        /* We are in the middle of reading a big argument: up to its
+         * length can be read in a single call. */
+        cost += c->bulklen;
+    } else {
+        cost += PROTO_IOBUF_LEN;
+    }
+    return cost;
+}
+
+/* Queue the client 'c' in the queue with the smallest estimated load, so
+ * that a single client with a big payload doesn't get other clients queued
+ * behind it. */
+static void ioThreadsQueueClient(client *c, int op) {
+    int target_id = 0;
+    for (int j = 1; j < server.io_threads_num; j++) {
+        if (io_threads_queue[j].load < io_threads_queue[target_id].load)
+            target_id = j;
+    }
+
+    ioThreadQueue *q = &io_threads_queue[target_id];
+    if (q->len == q->size) {
+        q->size = q->size ? q->size*2 : 16;
+        q->clients = zrealloc(q->clients,sizeof(client*)*q->size);
+    }
+    q->clients[q->len++] = c;
+    q->load += ioThreadClientCost(c,op);
+}
+
+/* Serve the client 'c' according to the current threaded operation. */
+static void ioThreadServeClient(client *c) {
+    if (io_threads_op == IO_THREADS_OP_WRITE) {
+        writeToClient(c,0);
+    } else if (io_threads_op == IO_THREADS_OP_READ) {
+        readQueryFromClient(c->conn);
+    } else {
+        serverPanic("io_threads_op value is unknown");
+    }
+}
+
+/* Serve the clients of the queue of the thread 'id', then help the other
+ * threads stealing the clients they didn't serve yet. This is called both
+ * by the I/O threads and by the main thread (id 0). */
+static void ioThreadServeQueues(long id) {
+    ioThreadQueue *q = &io_threads_queue[id];
+    size_t i;
+
+    while ((i = q->next++) < q->len) ioThreadServeClient(q->clients[i]);
+
+    for (int j = 1; j < server.io_threads_num; j++) {
+        ioThreadQueue *victim = &io_threads_queue[(id+j) % server.io_threads_num];
+        while (victim->next < victim->len &&
+               (i = victim->next++) < victim->len)
+        {
+            ioThreadServeClient(victim->clients[i]);
+            io_threads_steals[id]++;
+        }
+    }
+}
+
+/* Reset the queues once all the threads are done. */
+static void ioThreadsResetQueues(void) {
+    for (int j = 0; j < server.io_threads_num; j++) {
+        io_threads_queue[j].len = 0;
+        io_threads_queue[j].next = 0;
+        io_threads_queue[j].load = 0;
+    }
+}
+
+/* Release the objects referenced by the reply blocks the I/O threads freed
+ * while writing to their clients. Must be called by the main thread, when
+ * the I/O threads are idle. */
+static void ioThreadsReleaseObjects(void) {
+    for (int j = 1; j < server.io_threads_num; j++) {
+        ioThreadStats *st = &io_threads_stats[j];
+        for (size_t i = 0; i < st->numrelease; i++)
+            decrRefCountLazyfreeSafe(st->release[i]);
+        st->numrelease = 0;
+    }
+}
+
+/* Hand the work queued in io_threads_queue[] to the I/O threads, waking up
+ * the ones that are sleeping. */
+static void ioThreadsStartWork(void) {
+    for (int j = 1; j < server.io_threads_num; j++) {
+        int count = io_threads_queue[j].len;
+        if (count == 0) continue;
+        io_threads_pending[j] = count;
+        if (io_threads_sleeping[j]) {
+            pthread_mutex_lock(&io_threads_mutex[j]);
+            pthread_cond_signal(&io_threads_cond[j]);
+            pthread_mutex_unlock(&io_threads_mutex[j]);
+        }
+    }
+}
+
+static unsigned long ioThreadsPendingWork(void) {
+    unsigned long pending = 0;
+    for (int j = 1; j < server.io_threads_num; j++)
+        pending += io_threads_pending[j];
+    return pending;
+}
+
+/* Wait for all the I/O threads to end their work. Like the I/O threads do
+ * while waiting for work, we busy wait for a while and then go to sleep. */
+static void ioThreadsWaitForCompletion(void) {
+    for (int j = 0; j < IO_THREADS_SPIN_MAX; j++)
+        if (ioThreadsPendingWork() == 0) return;
+
+    pthread_mutex_lock(&io_threads_done_mutex);
+    io_threads_main_sleeping = 1;
+    while (ioThreadsPendingWork() != 0)
+        pthread_cond_wait(&io_threads_done_cond,&io_threads_done_mutex);
+    io_threads_main_sleeping = 0;
+    pthread_mutex_unlock(&io_threads_done_mutex);
+}
+
+/* Append the I/O threads stats to the INFO CPU section. */
+sds genIOThreadsInfoString(sds info) {
+    for (int j = 1; j < server.io_threads_num; j++) {
+        long long cpu_usec = io_threads_cpu_usec[j];
+        info = sdscatprintf(info,
+            "io_thread_%d:used_cpu=%lld.%06lld,jobs=%lld,sleeps=%lld,"
+            "steals=%lld\r\n",
+            j, cpu_usec/1000000, cpu_usec%1000000,
+            (long long)io_threads_jobs[j], (long long)io_threads_sleeps[j],
+            (long long)io_threads_steals[j]);
+    }
+    return info;
+}
 
 void *IOThreadMain(void *myid) {
     /* The ID is the thread number (from 0 to server.iothreads_num-1), and is
@@ -2935,42 +3468,53 @@ void *IOThreadMain(void *myid) {
     snprintf(thdname, sizeof(thdname), "io_thd_%ld", id);
     redis_set_thread_title(thdname);
     redisSetCpuAffinity(server.server_cpulist);
+    io_thread_stats = &io_threads_stats[id];
+
+    unsigned long spin = IO_THREADS_SPIN_MIN;
 
     while(1) {
-        /* Wait for start */
-        for (int j = 0; j < 1000000; j++) {
+        /* Wait for start, busy waiting for a while since under load new
+         * work is likely to arrive very soon. */
+        unsigned long j;
+        for (j = 0; j < spin; j++) {
             if (io_threads_pending[id] != 0) break;
         }
 
-        /* Give the main thread a chance to stop this thread. */
-        if (io_threads_pending[id] == 0) {
+        if (io_threads_pending[id] != 0) {
+            if (spin < IO_THREADS_SPIN_MAX) spin *= 2;
+        } else {
+            /* Nothing to do: sleep until the main thread hands us some
+             * work. The flag is checked by the main thread after setting
+             * the pending count, so we can't miss the wake up. */
+            ioThreadUpdateCpuTime(id);
             pthread_mutex_lock(&io_threads_mutex[id]);
+            io_threads_sleeping[id] = 1;
+            while (io_threads_pending[id] == 0)
+                pthread_cond_wait(&io_threads_cond[id],&io_threads_mutex[id]);
+            io_threads_sleeping[id] = 0;
             pthread_mutex_unlock(&io_threads_mutex[id]);
-            continue;
+            io_threads_sleeps[id]++;
+            if (spin > IO_THREADS_SPIN_MIN) spin /= 2;
         }
 
         serverAssert(io_threads_pending[id] != 0);
 
-        if (tio_debug) printf("[%ld] %d to handle\n", id, (int)listLength(io_threads_list[id]));
+        if (tio_debug) printf("[%ld] %d to handle\n", id, (int)io_threads_queue[id].len);
 
-        /* Process: note that the main thread will never touch our list
-         * before we drop the pending count to 0. */
-        listIter li;
-        listNode *ln;
-        listRewind(io_threads_list[id],&li);
-        while((ln = listNext(&li))) {
-            client *c = listNodeValue(ln);
-            if (io_threads_op == IO_THREADS_OP_WRITE) {
-                writeToClient(c,0);
-            } else if (io_threads_op == IO_THREADS_OP_READ) {
-                readQueryFromClient(c->conn);
-            } else {
-                serverPanic("io_threads_op value is unknown");
-            }
-        }
-        listEmpty(io_threads_list[id]);
+        /* Process: note that the main thread will never touch the queues
+         * before all the threads drop the pending count to 0. */
+        ioThreadServeQueues(id);
+        io_threads_jobs[id]++;
+        ioThreadUpdateCpuTime(id);
         io_threads_pending[id] = 0;
 
+        /* Wake up the main thread if it is sleeping waiting for us. */
+        if (io_threads_main_sleeping) {
+            pthread_mutex_lock(&io_threads_done_mutex);
+            pthread_cond_signal(&io_threads_done_cond);
+            pthread_mutex_unlock(&io_threads_done_mutex);
+        }
+
         if (tio_debug) printf("[%ld] Done\n", id);
     }
 }
@@ -2992,14 +3536,18 @@ void initThreadedIO(void) {
     /* Spawn and initialize the I/O threads. */
     for (int i = 0; i < server.io_threads_num; i++) {
         /* Things we do for all the threads including the main thread. */
-        io_threads_list[i] = listCreate();
+        io_threads_queue[i].clients = NULL;
+        io_threads_queue[i].len = io_threads_queue[i].size = 0;
+        io_threads_queue[i].next = 0;
+        io_threads_queue[i].load = 0;
         if (i == 0) continue; /* Thread 0 is the main thread. */
 
         /* Things we do only for the additional threads. */
         pthread_t tid;
         pthread_mutex_init(&io_threads_mutex[i],NULL);
+        pthread_cond_init(&io_threads_cond[i],NULL);
         io_threads_pending[i] = 0;
-        pthread_mutex_lock(&io_threads_mutex[i]); /* Thread will be stopped. */
+        io_threads_sleeping[i] = 0;
         if (pthread_create(&tid,NULL,IOThreadMain,(void*)(long)i) != 0) {
             serverLog(LL_WARNING,"Fatal: Can't initialize IO thread.");
             exit(1);
@@ -3008,12 +3556,13 @@ void initThreadedIO(void) {
     }
 }
 
+/* Note that starting and stopping threaded I/O just changes the way
+ * pending clients are served: idle I/O threads sleep on their condition
+ * variable anyway, so there is nothing to do with the threads themselves. */
 void startThreadedIO(void) {
     if (tio_debug) { printf("S"); fflush(stdout); }
     if (tio_debug) printf("--- STARTING THREADED IO ---\n");
     serverAssert(server.io_threads_active == 0);
-    for (int j = 1; j < server.io_threads_num; j++)
-        pthread_mutex_unlock(&io_threads_mutex[j]);
     server.io_threads_active = 1;
 }
 
@@ -3026,8 +3575,6 @@ void stopThreadedIO(void) {
         (int) listLength(server.clients_pending_read),
         (int) listLength(server.clients_pending_write));
     serverAssert(server.io_threads_active == 1);
-    for (int j = 1; j < server.io_threads_num; j++)
-        pthread_mutex_lock(&io_threads_mutex[j]);
     server.io_threads_active = 0;
 }
 
@@ -3037,6 +3584,10 @@ void stopThreadedIO(void) {
  * we need to handle in parallel, however the I/O threading is disabled
  * globally for reads as well if we have too little pending clients.
  *
+ * Since idle I/O threads sleep, and only the threads that actually have
+ * clients to serve are woken up, it is worth using them as soon as there
+ * is more than a single client to serve.
+ *
  * The function returns 0 if the I/O threading should be used becuase there
  * are enough active threads, otherwise 1 is returned and the I/O threads
  * could be possibly stopped (if already active) as a side effect. */
@@ -3046,7 +3597,7 @@ int stopThreadedIOIfNeeded(void) {
     /* Return ASAP if IO threads are disabled (single threaded mode). */
     if (server.io_threads_num == 1) return 1;
 
-    if (pending < (server.io_threads_num*2)) {
+    if (pending < 2) {
         if (server.io_threads_active) stopThreadedIO();
         return 1;
     } else {
@@ -3069,42 +3620,29 @@ int handleClientsWithPendingWritesUsingThreads(void) {
 
     if (tio_debug) printf("%d TOTAL WRITE pending clients\n", processed);
 
-    /* Distribute the clients across N different lists. */
+    /* Distribute the clients across N different queues, according to
+     * the amount of data they have to write. */
     listIter li;
     listNode *ln;
     listRewind(server.clients_pending_write,&li);
-    int item_id = 0;
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
         c->flags &= ~CLIENT_PENDING_WRITE;
-        int target_id = item_id % server.io_threads_num;
-        listAddNodeTail(io_threads_list[target_id],c);
-        item_id++;
+        ioThreadsQueueClient(c,IO_THREADS_OP_WRITE);
     }
 
     /* Give the start condition to the waiting threads, by setting the
      * start condition atomic var. */
     io_threads_op = IO_THREADS_OP_WRITE;
-    for (int j = 1; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        io_threads_pending[j] = count;
-    }
+    ioThreadsStartWork();
 
     /* Also use the main thread to process a slice of clients. */
-    listRewind(io_threads_list[0],&li);
-    while((ln = listNext(&li))) {
-        client *c = listNodeValue(ln);
-        writeToClient(c,0);
-    }
-    listEmpty(io_threads_list[0]);
+    ioThreadServeQueues(0);
 
     /* Wait for all the other threads to end their work. */
-    while(1) {
-        unsigned long pending = 0;
-        for (int j = 1; j < server.io_threads_num; j++)
-            pending += io_threads_pending[j];
-        if (pending == 0) break;
-    }
+    ioThreadsWaitForCompletion();
+    ioThreadsResetQueues();
+    ioThreadsReleaseObjects();
     if (tio_debug) printf("I/O WRITE All threads finshed\n");
 
     /* Run the list of clients again to install the write handler where
@@ -3129,6 +3667,190 @@ int handleClientsWithPendingWritesUsingThreads(void) {
     return processed;
 }
 
+/* ==========================================================================
+ * Threaded command execution
+ *
+ * During a threaded read the main thread does nothing but waiting for the
+ * I/O threads, so the dataset is effectively read only. We take advantage
+ * of this to let the I/O threads directly execute the read only commands
+ * they parse, as long as such commands have no side effect other than
+ * updating the client output buffer:
+ *
+ * - The command must be flagged as read-only and access a single key,
+ *   that should not have an associated expire (expiring it is a write).
+ * - The client must be a plain client, not in a transaction, not tracking
+ *   keys, and allowed to access any key (we avoid the ACL keys check).
+ * - Features requiring global side effects on reads (MONITOR, keymiss
+ *   notifications, LFU counters, cluster redirections, modules command
+ *   filters) disable threaded execution altogether.
+ *
+ * Such commands write no shared state. The LRU clock of the accessed
+ * objects is a bitfield sharing its word with the type and encoding, so the
+ * I/O threads don't update it: ioThreadsMergeStats() does it later.
+ *
+ * List commands are never executed by I/O threads: reading a compressed
+ * quicklist node decompresses it in place.
+ *
+ * Everything else is left to the main thread as usual.
+ * ========================================================================== */
+
+/* Return 1 if the current state of the server allows I/O threads to execute
+ * commands during the next threaded read, otherwise 0. */
+static int ioThreadsCanProcessCommands(void) {
+    return server.io_threads_do_commands &&
+           !server.loading &&
+           !server.lua_timedout &&
+           !server.cluster_enabled &&
+           listLength(server.monitors) == 0 &&
+           !(server.notify_keyspace_events & NOTIFY_KEY_MISS) &&
+           !(server.maxmemory_policy & MAXMEMORY_FLAG_LFU) &&
+           !(server.masterhost && server.repl_state != REPL_STATE_CONNECTED &&
+             server.repl_serve_stale_data == 0) &&
+           !moduleHasCommandFilters();
+}
+
+/* Return 1 if 'cmd' can be executed by I/O threads. */
+static int ioThreadCanExecuteCommand(struct redisCommand *cmd) {
+    return (cmd->flags & CMD_READONLY) &&
+           !(cmd->flags & (CMD_WRITE|CMD_MODULE|CMD_ADMIN|CMD_PUBSUB|
+                           CMD_RANDOM|CMD_CATEGORY_LIST)) &&
+           cmd->getkeys_proc == NULL &&
+           cmd->firstkey == 1 && cmd->lastkey == 1;
+}
+
+/* Account the command just executed by the client 'c', taking 'duration'
+ * microseconds. This is what call() does for the commands executed by the
+ * main thread: I/O threads just remember the command in their own stats,
+ * to be merged later by ioThreadsMergeStats(). */
+static void ioThreadRecordCommand(client *c, long long duration) {
+    int slowlog = !(c->cmd->flags & CMD_SKIP_SLOWLOG);
+    ioThreadStats *st = io_thread_stats;
+
+    if (st == NULL) {
+        if (slowlog) {
+            char *latency_event = (c->cmd->flags & CMD_FAST) ?
+                                  "fast-command" : "command";
+            latencyAddSampleIfNeeded(latency_event,duration/1000);
+            slowlogPushEntryIfNeeded(c,c->argv,c->argc,duration);
+        }
+        c->cmd->microseconds += duration;
+        c->cmd->calls++;
+        server.stat_numcommands++;
+        server.stat_io_commands_processed++;
+        return;
+    }
+
+    if (st->numsamples == st->samples_size) {
+        st->samples_size = st->samples_size ? st->samples_size*2 : 64;
+        st->samples = zrealloc(st->samples,
+            sizeof(ioThreadCommandSample)*st->samples_size);
+    }
+    ioThreadCommandSample *sample = st->samples+st->numsamples++;
+    sample->cmd = c->cmd;
+    sample->duration = duration;
+    sample->c = c;
+    sample->argv = NULL;
+    sample->argc = 0;
+
+    /* The arguments are owned by the client, and are going to be released
+     * as soon as we return: retain them if the slowlog needs them. */
+    if (slowlog && server.slowlog_log_slower_than >= 0 &&
+        duration >= server.slowlog_log_slower_than)
+    {
+        sample->argv = zmalloc(sizeof(robj*)*c->argc);
+        sample->argc = c->argc;
+        for (int j = 0; j < c->argc; j++) {
+            sample->argv[j] = c->argv[j];
+            incrRefCount(c->argv[j]);
+        }
+    }
+}
+
+/* Merge the stats collected by the I/O threads into the server stats. Must
+ * be called by the main thread, when the I/O threads are idle, before any
+ * client served by the I/O threads may be released. */
+static void ioThreadsMergeStats(void) {
+    for (int j = 1; j < server.io_threads_num; j++) {
+        ioThreadStats *st = &io_threads_stats[j];
+
+        server.stat_keyspace_hits += st->keyspace_hits;
+        server.stat_keyspace_misses += st->keyspace_misses;
+        st->keyspace_hits = 0;
+        st->keyspace_misses = 0;
+
+        /* The keyspace did not change since the threads accessed these
+         * objects, so they are still alive. */
+        for (size_t i = 0; i < st->numtouched; i++)
+            st->touched[i]->lru = LRU_CLOCK();
+        st->numtouched = 0;
+
+        for (size_t i = 0; i < st->numsamples; i++) {
+            ioThreadCommandSample *sample = st->samples+i;
+            struct redisCommand *cmd = sample->cmd;
+
+            if (!(cmd->flags & CMD_SKIP_SLOWLOG)) {
+                char *latency_event = (cmd->flags & CMD_FAST) ?
+                                      "fast-command" : "command";
+                latencyAddSampleIfNeeded(latency_event,sample->duration/1000);
+            }
+            if (sample->argv) {
+                slowlogPushEntryIfNeeded(sample->c,sample->argv,sample->argc,
+                                         sample->duration);
+                for (int k = 0; k < sample->argc; k++)
+                    decrRefCount(sample->argv[k]);
+                zfree(sample->argv);
+            }
+            cmd->microseconds += sample->duration;
+            cmd->calls++;
+        }
+        server.stat_numcommands += st->numsamples;
+        server.stat_io_commands_processed += st->numsamples;
+        st->numsamples = 0;
+    }
+}
+
+/* Called by processInputBuffer() for clients with a pending threaded read,
+ * once a command is ready in the client argument vector. If the command can
+ * be served without the main thread, it is executed right away and the
+ * client is reset: in this case C_OK is returned. Otherwise C_ERR is
+ * returned and the command is left to the main thread.
+ *
+ * Note that this function is executed by the I/O threads concurrently: it
+ * must only read the server state, or write state owned by the client. */
+int ioThreadTryProcessCommand(client *c) {
+    if (!io_threads_do_commands_now) return C_ERR;
+    if (c->flags & (CLIENT_MULTI|CLIENT_BLOCKED|CLIENT_TRACKING|
+                    CLIENT_PUBSUB|CLIENT_MONITOR|CLIENT_MASTER|CLIENT_SLAVE))
+        return C_ERR;
+    if (!c->authenticated) return C_ERR;
+    if (c->user && !(c->user->flags & USER_FLAG_ALLKEYS)) return C_ERR;
+
+    struct redisCommand *cmd = lookupCommand(c->argv[0]->ptr);
+    if (cmd == NULL || !ioThreadCanExecuteCommand(cmd)) return C_ERR;
+    if ((cmd->arity > 0 && cmd->arity != c->argc) ||
+        (c->argc < -cmd->arity)) return C_ERR;
+
+    /* Keys with an expire may need to be deleted by the lookup. */
+    if (getExpire(c->db,c->argv[1]) != -1) return C_ERR;
+
+    c->cmd = cmd;
+    if (ACLCheckCommandPerm(c,NULL) != ACL_OK) {
+        c->cmd = NULL;
+        return C_ERR;
+    }
+
+    /* Execute the command the same way call() would do for a read only
+     * command, that has nothing to propagate. */
+    c->lastcmd = cmd;
+    ustime_t start = ustime();
+    c->cmd->proc(c);
+    ustime_t duration = ustime()-start;
+    c->woff = server.master_repl_offset;
+    ioThreadRecordCommand(c,duration);
+    resetClient(c);
+    return C_OK;
+}
+
 /* Return 1 if we want to handle the client read later using threaded I/O.
  * This is called by the readable handler of the event loop.
  * As a side effect of calling this function the client is put in the
@@ -3160,43 +3882,42 @@ int handleClientsWithPendingReadsUsingThreads(void) {
 
     if (tio_debug) printf("%d TOTAL READ pending clients\n", processed);
 
-    /* Distribute the clients across N different lists. */
+    /* Distribute the clients across N different queues. */
     listIter li;
     listNode *ln;
     listRewind(server.clients_pending_read,&li);
-    int item_id = 0;
     while((ln = listNext(&li))) {
         client *c = listNodeValue(ln);
-        int target_id = item_id % server.io_threads_num;
-        listAddNodeTail(io_threads_list[target_id],c);
-        item_id++;
+        ioThreadsQueueClient(c,IO_THREADS_OP_READ);
     }
 
+    /* While the I/O threads run the main thread is just waiting for them,
+     * so the keyspace can't change: if allowed, let the threads execute the
+     * read only commands they parse. Incremental rehashing is suspended
+     * so that lookups don't modify the dictionaries. */
+    io_threads_do_commands_now = ioThreadsCanProcessCommands();
+    if (io_threads_do_commands_now) dictDisableRehashStep();
+
     /* Give the start condition to the waiting threads, by setting the
      * start condition atomic var. */
     io_threads_op = IO_THREADS_OP_READ;
-    for (int j = 1; j < server.io_threads_num; j++) {
-        int count = listLength(io_threads_list[j]);
-        io_threads_pending[j] = count;
-    }
+    ioThreadsStartWork();
 
     /* Also use the main thread to process a slice of clients. */
-    listRewind(io_threads_list[0],&li);
-    while((ln = listNext(&li))) {
-        client *c = listNodeValue(ln);
-        readQueryFromClient(c->conn);
-    }
-    listEmpty(io_threads_list[0]);
+    ioThreadServeQueues(0);
 
     /* Wait for all the other threads to end their work. */
-    while(1) {
-        unsigned long pending = 0;
-        for (int j = 1; j < server.io_threads_num; j++)
-            pending += io_threads_pending[j];
-        if (pending == 0) break;
-    }
+    ioThreadsWaitForCompletion();
+    ioThreadsResetQueues();
+    ioThreadsReleaseObjects();
     if (tio_debug) printf("I/O READ All threads finshed\n");
 
+    if (io_threads_do_commands_now) {
+        io_threads_do_commands_now = 0;
+        dictEnableRehashStep();
+        ioThreadsMergeStats();
+    }
+
     /* Run the list of clients again to process the new buffers. */
     while(listLength(server.clients_pending_read)) {
         ln = listFirst(server.clients_pending_read);
@@ -3204,6 +3925,10 @@ int handleClientsWithPendingReadsUsingThreads(void) {
         c->flags &= ~CLIENT_PENDING_READ;
         listDelNode(server.clients_pending_read,ln);
 
+        /* Install the write handler for the replies accumulated while
+         * the client was served by the I/O threads. */
+        if (clientHasPendingReplies(c)) clientInstallWriteHandler(c);
+
         if (c->flags & CLIENT_PENDING_COMMAND) {
             c->flags &= ~CLIENT_PENDING_COMMAND;
             if (processCommandAndResetClient(c) == C_ERR) {
@@ -29,6 +29,7 @@
  */
 
 #include "server.h"
+#include "atomicvar.h"
 #include <math.h>
 #include <ctype.h>
 
@@ -81,8 +82,7 @@ robj *createRawStringObject(const char *ptr, size_t len) {
 /* Create a string object with encoding OBJ_ENCODING_EMBSTR, that is
  * an object where the sds string is actually an unmodifiable string
  * allocated in the same chunk as the object itself. */
-robj *createEmbeddedStringObject(const char *ptr, size_t len) {
-    robj *o = zmalloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1);
+static robj *initEmbeddedStringObject(robj *o, const char *ptr, size_t len) {
     struct sdshdr8 *sh = (void*)(o+1);
 
     o->type = OBJ_STRING;
@@ -109,6 +109,26 @@ robj *createEmbeddedStringObject(const char *ptr, size_t len) {
     return o;
 }
 
+robj *createEmbeddedStringObject(const char *ptr, size_t len) {
+    robj *o = zmalloc(sizeof(robj)+sizeof(struct sdshdr8)+len+1);
+    return initEmbeddedStringObject(o,ptr,len);
+}
+
+/* Create a string object with encoding OBJ_ENCODING_INLINE, that is an
+ * object where the string is stored inside the 'ptr' field itself. The
+ * string must be at most OBJ_INLINE_STRING_MAX bytes and must not contain
+ * null terminators. The unused bytes of the field are always zero, so two
+ * inline objects are equal if their 'ptr' fields are. */
+robj *createInlineStringObject(const char *ptr, size_t len) {
+    robj *o = createObject(OBJ_STRING,NULL);
+
+    serverAssert(len <= OBJ_INLINE_STRING_MAX);
+    o->encoding = OBJ_ENCODING_INLINE;
+    memset(&o->ptr,0,sizeof(o->ptr));
+    memcpy(inlineStringPtr(o),ptr,len);
+    return o;
+}
+
 /* Create a string object with EMBSTR encoding if it is smaller than
  * OBJ_ENCODING_EMBSTR_SIZE_LIMIT, otherwise the RAW encoding is
  * used.
@@ -123,6 +143,20 @@ robj *createStringObject(const char *ptr, size_t len) {
         return createRawStringObject(ptr,len);
 }
 
+/* Like createStringObject(), but reusing the allocation of 'o', an EMBSTR
+ * object with a refcount of 1 that is no longer referenced anywhere, when
+ * it is big enough for the new string. Otherwise 'o' is released. */
+robj *recycleStringObject(robj *o, const char *ptr, size_t len) {
+    serverAssert(o->encoding == OBJ_ENCODING_EMBSTR && o->refcount == 1);
+    if (len <= OBJ_ENCODING_EMBSTR_SIZE_LIMIT &&
+        zmalloc_usable(o) >= sizeof(robj)+sizeof(struct sdshdr8)+len+1)
+    {
+        return initEmbeddedStringObject(o,ptr,len);
+    }
+    decrRefCount(o);
+    return createStringObject(ptr,len);
+}
+
 /* Create a string object from a long long value. When possible returns a
  * shared integer object, or at least an integer encoded one.
  *
@@ -201,8 +235,9 @@ robj *dupStringObject(const robj *o) {
     case OBJ_ENCODING_EMBSTR:
         return createEmbeddedStringObject(o->ptr,sdslen(o->ptr));
     case OBJ_ENCODING_INT:
+    case OBJ_ENCODING_INLINE:
         d = createObject(OBJ_STRING, NULL);
-        d->encoding = OBJ_ENCODING_INT;
+        d->encoding = o->encoding;
         d->ptr = o->ptr;
         return d;
     default:
@@ -239,10 +274,17 @@ robj *createIntsetObject(void) {
     return o;
 }
 
+robj *createSetListpackObject(void) {
+    unsigned char *lp = lpNew();
+    robj *o = createObject(OBJ_SET,lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
+    return o;
+}
+
 robj *createHashObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(OBJ_HASH, zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+    unsigned char *lp = lpNew();
+    robj *o = createObject(OBJ_HASH, lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -257,10 +299,10 @@ robj *createZsetObject(void) {
     return o;
 }
 
-robj *createZsetZiplistObject(void) {
-    unsigned char *zl = ziplistNew();
-    robj *o = createObject(OBJ_ZSET,zl);
-    o->encoding = OBJ_ENCODING_ZIPLIST;
+robj *createZsetListpackObject(void) {
+    unsigned char *lp = lpNew();
+    robj *o = createObject(OBJ_ZSET,lp);
+    o->encoding = OBJ_ENCODING_LISTPACK;
     return o;
 }
 
@@ -300,6 +342,9 @@ void freeSetObject(robj *o) {
     case OBJ_ENCODING_INTSET:
         zfree(o->ptr);
         break;
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
+        break;
     default:
         serverPanic("Unknown set encoding type");
     }
@@ -314,8 +359,8 @@ void freeZsetObject(robj *o) {
         zslFree(zs->zsl);
         zfree(zs);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
         break;
     default:
         serverPanic("Unknown sorted set encoding");
@@ -327,8 +372,8 @@ void freeHashObject(robj *o) {
     case OBJ_ENCODING_HT:
         dictRelease((dict*) o->ptr);
         break;
-    case OBJ_ENCODING_ZIPLIST:
-        zfree(o->ptr);
+    case OBJ_ENCODING_LISTPACK:
+        lpFree(o->ptr);
         break;
     default:
         serverPanic("Unknown hash encoding type");
@@ -350,7 +395,8 @@ void incrRefCount(robj *o) {
     if (o->refcount < OBJ_FIRST_SPECIAL_REFCOUNT) {
         o->refcount++;
     } else {
-        if (o->refcount == OBJ_SHARED_REFCOUNT) {
+        if (o->refcount == OBJ_SHARED_REFCOUNT ||
+            o->refcount == OBJ_INTERNED_REFCOUNT) {
             /* Nothing to do: this refcount is immutable. */
         } else if (o->refcount == OBJ_STATIC_REFCOUNT) {
             serverPanic("You tried to retain an object allocated in the stack");
@@ -373,7 +419,8 @@ void decrRefCount(robj *o) {
         zfree(o);
     } else {
         if (o->refcount <= 0) serverPanic("decrRefCount against refcount <= 0");
-        if (o->refcount != OBJ_SHARED_REFCOUNT) o->refcount--;
+        if (o->refcount != OBJ_SHARED_REFCOUNT &&
+            o->refcount != OBJ_INTERNED_REFCOUNT) o->refcount--;
     }
 }
 
@@ -419,6 +466,9 @@ int isObjectRepresentableAsLongLong(robj *o, long long *llval) {
     if (o->encoding == OBJ_ENCODING_INT) {
         if (llval) *llval = (long) o->ptr;
         return C_OK;
+    } else if (o->encoding == OBJ_ENCODING_INLINE) {
+        char *s = inlineStringPtr(o);
+        return string2ll(s,strlen(s),llval) ? C_OK : C_ERR;
     } else {
         return isSdsRepresentableAsLongLong(o->ptr,llval);
     }
@@ -437,7 +487,7 @@ void trimStringObjectIfNeeded(robj *o) {
 }
 
 /* Try to encode a string object in order to save space */
-robj *tryObjectEncoding(robj *o) {
+static robj *encodeStringObject(robj *o) {
     long value;
     sds s = o->ptr;
     size_t len;
@@ -488,6 +538,15 @@ robj *tryObjectEncoding(robj *o) {
         }
     }
 
+    /* Very short strings are stored inside the object itself: for values
+     * of a few bytes the separate sds allocation (or the sds header of the
+     * EMBSTR encoding) would use more memory than the string itself. */
+    if (len <= OBJ_INLINE_STRING_MAX && memchr(s,'\0',len) == NULL) {
+        robj *inl = createInlineStringObject(s,len);
+        decrRefCount(o);
+        return inl;
+    }
+
     /* If the string is small and is still RAW encoded,
      * try the EMBSTR encoding which is more efficient.
      * In this representation the object and the SDS string are allocated
@@ -516,6 +575,184 @@ robj *tryObjectEncoding(robj *o) {
     return o;
 }
 
+/* Interning of string values.
+ *
+ * When intern-values-max-len is not zero, string values up to that length
+ * are stored once: all the keys having the same value reference the same
+ * object. Interned objects have the special OBJ_INTERNED_REFCOUNT reference
+ * count, so that like the shared integers they are never modified in place,
+ * and can be referenced by other threads (lazy free, I/O threads) without
+ * races on the reference count.
+ *
+ * Instead the keys referencing an interned object are counted in the
+ * internedValue structure holding it: the count is incremented when the
+ * value is stored in the keyspace (see dbAdd() and dbOverwrite()) and
+ * decremented by the destructor of the keyspace values, that may run in the
+ * lazyfree thread, so the count is atomic. When it drops to zero, the value
+ * is evicted from the pool by evictUnusedInternedValues(), called by
+ * serverCron(), and freed in the lazyfree thread. Other references, like
+ * the ones of the arguments of the command being executed, never outlive
+ * the command: the code retaining objects for longer, like the slow log,
+ * must copy the interned ones.
+ *
+ * The memory of the pool is reported by MEMORY STATS as "interned.values".
+ * To bound it, only the values that are seen at least twice are interned,
+ * and the pool has at most OBJ_INTERN_POOL_MAX values. Values that were not
+ * interned yet are remembered by a small table of hashes: a value is
+ * interned when the slot of its hash already contains it. This way unique
+ * values are not interned, while the few values used by many keys are
+ * interned almost immediately.
+ *
+ * Note that, like shared integers, interned objects have no LRU/LFU field of
+ * their own: this is why interning is disabled with the maxmemory policies
+ * using it. */
+typedef struct internedValue {
+    robj o;             /* First, so that the two pointers are the same. */
+    unsigned long keys; /* Keys referencing the value, atomic. */
+} internedValue;
+
+/* Create the interned copy of the string object 'o'. */
+static robj *createInternedValue(robj *o) {
+    internedValue *iv = zmalloc(sizeof(*iv));
+
+    iv->o.type = OBJ_STRING;
+    iv->o.lru = o->lru;
+    iv->o.refcount = OBJ_INTERNED_REFCOUNT;
+    if (o->encoding == OBJ_ENCODING_INT) {
+        iv->o.encoding = OBJ_ENCODING_INT;
+        iv->o.ptr = o->ptr;
+    } else {
+        char buf[LONG_STR_SIZE], *s;
+        size_t len;
+
+        s = stringObjectPtrLen(o,&len,buf);
+        iv->o.encoding = OBJ_ENCODING_RAW;
+        iv->o.ptr = sdsnewlen(s,len);
+    }
+    iv->keys = 0;
+    return &iv->o;
+}
+
+/* Free an interned value evicted from the pool. */
+void freeInternedValue(robj *o) {
+    if (o->encoding == OBJ_ENCODING_RAW) sdsfree(o->ptr);
+    zfree(o);
+}
+
+static size_t internedValueMemory(robj *o) {
+    return sizeof(internedValue)+getStringObjectSdsUsedMemory(o);
+}
+
+/* Count a key referencing the interned value 'o'. Only called by the main
+ * thread. */
+void retainInternedValue(robj *o) {
+    atomicIncr(((internedValue*)o)->keys,1);
+}
+
+/* Drop a key referencing the interned value 'o'. This is called by the
+ * destructor of the keyspace values, also in the lazyfree thread, so the
+ * unused value is not evicted here, but flagged for serverCron(). */
+void releaseInternedValue(robj *o) {
+    internedValue *iv = (internedValue*)o;
+    unsigned long keys;
+
+    atomicDecr(iv->keys,1);
+    atomicGet(iv->keys,keys);
+    if (keys == 0) atomicSet(server.interned_values_unused,1);
+}
+
+/* Evict from the pool the interned values no key references anymore. The
+ * values are freed in the lazyfree thread, after the jobs queued before,
+ * that may still be releasing keys referencing them. */
+void evictUnusedInternedValues(void) {
+    dict *evicted = NULL;
+    dictIterator *di;
+    dictEntry *de;
+    int unused;
+
+    /* Like the keyspace in databasesCron(), the pool is rehashed even when
+     * it is not used, so that it can shrink after evictions. */
+    if (dictIsRehashing(server.interned_values))
+        dictRehashMilliseconds(server.interned_values,1);
+
+    atomicGet(server.interned_values_unused,unused);
+    if (!unused) return;
+    atomicSet(server.interned_values_unused,0);
+
+    di = dictGetSafeIterator(server.interned_values);
+    while ((de = dictNext(di)) != NULL) {
+        robj *o = dictGetKey(de);
+        unsigned long keys;
+
+        atomicGet(((internedValue*)o)->keys,keys);
+        if (keys) continue;
+        dictDelete(server.interned_values,o);
+        server.interned_values_mem -= internedValueMemory(o);
+        if (evicted == NULL)
+            evicted = dictCreate(&internedValuesDictType,NULL);
+        dictAdd(evicted,o,NULL);
+    }
+    dictReleaseIterator(di);
+    if (evicted) {
+        if (htNeedsResize(server.interned_values))
+            dictResize(server.interned_values);
+        freeInternedValuesAsync(evicted);
+    }
+}
+
+/* Return the interned version of the string object 'o' if the value is
+ * interned, or it gets interned now. In this case 'o' is released and the
+ * returned object should be used in its place. */
+static robj *tryInternStringValue(robj *o) {
+    char buf[LONG_STR_SIZE], *s;
+    size_t len;
+    dictEntry *de;
+
+    /* Like for shared integers, values are not shared when the maxmemory
+     * policy needs every object to have its own LRU/LFU field. */
+    if (o->refcount != 1 ||
+        (server.maxmemory &&
+         (server.maxmemory_policy & MAXMEMORY_FLAG_NO_SHARED_INTEGERS)))
+        return o;
+
+    s = stringObjectPtrLen(o,&len,buf);
+    if (len > server.intern_values_max_len) return o;
+
+    if ((de = dictFind(server.interned_values,o)) != NULL) {
+        decrRefCount(o);
+        return dictGetKey(de);
+    }
+    if (dictSize(server.interned_values) >= OBJ_INTERN_POOL_MAX) return o;
+
+    if (server.intern_candidates == NULL)
+        server.intern_candidates =
+            zcalloc(sizeof(uint64_t)*OBJ_INTERN_CANDIDATES);
+    uint64_t hash = dictGenHashFunction(s,len);
+    uint64_t *slot = server.intern_candidates+(hash&(OBJ_INTERN_CANDIDATES-1));
+    if (*slot != hash) {
+        *slot = hash;
+        return o;
+    }
+    *slot = 0;
+
+    robj *io = createInternedValue(o);
+    decrRefCount(o);
+    dictAdd(server.interned_values,io,NULL);
+    server.interned_values_mem += internedValueMemory(io);
+    /* The caller may not store the value at all: check it later. */
+    atomicSet(server.interned_values_unused,1);
+    return io;
+}
+
+/* Try to encode a string object in order to save space. This function is
+ * called for the string values about to be stored in the key space: if value
+ * interning is enabled, the returned object may be shared with other keys. */
+robj *tryObjectEncoding(robj *o) {
+    o = encodeStringObject(o);
+    if (server.intern_values_max_len) o = tryInternStringValue(o);
+    return o;
+}
+
 /* Get a decoded version of an encoded object (returned as a new object).
  * If the object is already raw-encoded just increment the ref count. */
 robj *getDecodedObject(robj *o) {
@@ -531,6 +768,9 @@ robj *getDecodedObject(robj *o) {
         ll2string(buf,32,(long)o->ptr);
         dec = createStringObject(buf,strlen(buf));
         return dec;
+    } else if (o->type == OBJ_STRING && o->encoding == OBJ_ENCODING_INLINE) {
+        char *s = inlineStringPtr(o);
+        return createStringObject(s,strlen(s));
     } else {
         serverPanic("Unknown encoding type");
     }
@@ -549,24 +789,12 @@ robj *getDecodedObject(robj *o) {
 
 int compareStringObjectsWithFlags(robj *a, robj *b, int flags) {
     serverAssertWithInfo(NULL,a,a->type == OBJ_STRING && b->type == OBJ_STRING);
-    char bufa[128], bufb[128], *astr, *bstr;
+    char bufa[LONG_STR_SIZE], bufb[LONG_STR_SIZE], *astr, *bstr;
     size_t alen, blen, minlen;
 
     if (a == b) return 0;
-    if (sdsEncodedObject(a)) {
-        astr = a->ptr;
-        alen = sdslen(astr);
-    } else {
-        alen = ll2string(bufa,sizeof(bufa),(long) a->ptr);
-        astr = bufa;
-    }
-    if (sdsEncodedObject(b)) {
-        bstr = b->ptr;
-        blen = sdslen(bstr);
-    } else {
-        blen = ll2string(bufb,sizeof(bufb),(long) b->ptr);
-        bstr = bufb;
-    }
+    astr = stringObjectPtrLen(a,&alen,bufa);
+    bstr = stringObjectPtrLen(b,&blen,bufb);
     if (flags & REDIS_COMPARE_COLL) {
         return strcoll(astr,bstr);
     } else {
@@ -594,10 +822,14 @@ int collateStringObjects(robj *a, robj *b) {
  * this function is faster then checking for (compareStringObject(a,b) == 0)
  * because it can perform some more optimization. */
 int equalStringObjects(robj *a, robj *b) {
-    if (a->encoding == OBJ_ENCODING_INT &&
-        b->encoding == OBJ_ENCODING_INT){
+    if ((a->encoding == OBJ_ENCODING_INT &&
+         b->encoding == OBJ_ENCODING_INT) ||
+        (a->encoding == OBJ_ENCODING_INLINE &&
+         b->encoding == OBJ_ENCODING_INLINE))
+    {
         /* If both strings are integer encoded just check if the stored
-         * long is the same. */
+         * long is the same. The same is true for inline strings, since
+         * the bytes after the null terminator are always zero. */
         return a->ptr == b->ptr;
     } else {
         return compareStringObjects(a,b) == 0;
@@ -608,11 +840,33 @@ size_t stringObjectLen(robj *o) {
     serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
     if (sdsEncodedObject(o)) {
         return sdslen(o->ptr);
+    } else if (o->encoding == OBJ_ENCODING_INLINE) {
+        return strlen(inlineStringPtr(o));
     } else {
         return sdigits10((long)o->ptr);
     }
 }
 
+/* Return a pointer to the bytes of the string object 'o', whatever its
+ * encoding is, and set '*len' to the string length. Integer encoded objects
+ * are converted into 'buf', that must be at least LONG_STR_SIZE bytes.
+ * The returned string is always null terminated. */
+char *stringObjectPtrLen(robj *o, size_t *len, char *buf) {
+    serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
+    if (sdsEncodedObject(o)) {
+        *len = sdslen(o->ptr);
+        return o->ptr;
+    } else if (o->encoding == OBJ_ENCODING_INLINE) {
+        *len = strlen(inlineStringPtr(o));
+        return inlineStringPtr(o);
+    } else if (o->encoding == OBJ_ENCODING_INT) {
+        *len = ll2string(buf,LONG_STR_SIZE,(long)o->ptr);
+        return buf;
+    } else {
+        serverPanic("Unknown string encoding");
+    }
+}
+
 int getDoubleFromObject(const robj *o, double *target) {
     double value;
 
@@ -623,6 +877,10 @@ int getDoubleFromObject(const robj *o, double *target) {
         if (sdsEncodedObject(o)) {
             if (!string2d(o->ptr, sdslen(o->ptr), &value))
                 return C_ERR;
+        } else if (o->encoding == OBJ_ENCODING_INLINE) {
+            const char *s = inlineStringPtr(o);
+            if (!string2d(s, strlen(s), &value))
+                return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
         } else {
@@ -657,6 +915,10 @@ int getLongDoubleFromObject(robj *o, long double *target) {
         if (sdsEncodedObject(o)) {
             if (!string2ld(o->ptr, sdslen(o->ptr), &value))
                 return C_ERR;
+        } else if (o->encoding == OBJ_ENCODING_INLINE) {
+            const char *s = inlineStringPtr(o);
+            if (!string2ld(s, strlen(s), &value))
+                return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
         } else {
@@ -690,6 +952,9 @@ int getLongLongFromObject(robj *o, long long *target) {
         serverAssertWithInfo(NULL,o,o->type == OBJ_STRING);
         if (sdsEncodedObject(o)) {
             if (string2ll(o->ptr,sdslen(o->ptr),&value) == 0) return C_ERR;
+        } else if (o->encoding == OBJ_ENCODING_INLINE) {
+            char *s = inlineStringPtr(o);
+            if (string2ll(s,strlen(s),&value) == 0) return C_ERR;
         } else if (o->encoding == OBJ_ENCODING_INT) {
             value = (long)o->ptr;
         } else {
@@ -740,6 +1005,8 @@ char *strEncoding(int encoding) {
     case OBJ_ENCODING_INTSET: return "intset";
     case OBJ_ENCODING_SKIPLIST: return "skiplist";
     case OBJ_ENCODING_EMBSTR: return "embstr";
+    case OBJ_ENCODING_INLINE: return "inline";
+    case OBJ_ENCODING_LISTPACK: return "listpack";
     default: return "unknown";
     }
 }
@@ -783,7 +1050,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
     size_t asize = 0, elesize = 0, samples = 0;
 
     if (o->type == OBJ_STRING) {
-        if(o->encoding == OBJ_ENCODING_INT) {
+        if(o->encoding == OBJ_ENCODING_INT ||
+           o->encoding == OBJ_ENCODING_INLINE) {
             asize = sizeof(*o);
         } else if(o->encoding == OBJ_ENCODING_RAW) {
             asize = sdsAllocSize(o->ptr)+sizeof(*o);
@@ -822,12 +1090,14 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             intset *is = o->ptr;
             asize = sizeof(*o)+sizeof(*is)+is->encoding*is->length;
+        } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+lpBytes(o->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (o->type == OBJ_ZSET) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_SKIPLIST) {
             d = ((zset*)o->ptr)->dict;
             zskiplist *zsl = ((zset*)o->ptr)->zsl;
@@ -836,9 +1106,16 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
                     (sizeof(struct dictEntry*)*dictSlots(d))+
                     zmalloc_size(zsl->header);
             while(znode != NULL && samples < sample_size) {
-                elesize += sdsAllocSize(znode->ele);
-                elesize += sizeof(struct dictEntry) + zmalloc_size(znode);
-                samples++;
+                zskiplistEntry *entries = zslNodeEntries(znode);
+                unsigned int j;
+
+                /* Every node holds many elements. */
+                elesize += zmalloc_size(znode);
+                for (j = 0; j < znode->count; j++) {
+                    elesize += sizeof(struct dictEntry) +
+                               sdsZmallocSize(entries[j].ele);
+                    samples++;
+                }
                 znode = znode->level[0].forward;
             }
             if (samples) asize += (double)elesize/samples*dictSize(d);
@@ -846,8 +1123,8 @@ size_t objectComputeSize(robj *o, size_t sample_size) {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            asize = sizeof(*o)+(ziplistBlobLen(o->ptr));
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            asize = sizeof(*o)+(lpBytes(o->ptr));
         } else if (o->encoding == OBJ_ENCODING_HT) {
             d = o->ptr;
             di = dictGetIterator(d);
@@ -990,6 +1267,8 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mh->clients_normal = server.stat_clients_type_memory[CLIENT_TYPE_MASTER]+
                          server.stat_clients_type_memory[CLIENT_TYPE_PUBSUB]+
                          server.stat_clients_type_memory[CLIENT_TYPE_NORMAL];
+    /* Plus the buffers idle clients gave back to the pools. */
+    mh->clients_normal += getClientBufferPoolSize();
     mem_total += mh->clients_slaves;
     mem_total += mh->clients_normal;
 
@@ -1013,6 +1292,16 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
     mh->lua_caches = mem;
     mem_total+=mem;
 
+    /* Interned values are shared by keys, so they are accounted as
+     * overhead. */
+    mem = server.interned_values_mem +
+        dictSize(server.interned_values) * sizeof(dictEntry) +
+        dictSlots(server.interned_values) * sizeof(dictEntry*);
+    if (server.intern_candidates)
+        mem += sizeof(uint64_t)*OBJ_INTERN_CANDIDATES;
+    mh->interned_values = mem;
+    mem_total+=mem;
+
     for (j = 0; j < server.dbnum; j++) {
         redisDb *db = server.db+j;
         long long keyscount = dictSize(db->dict);
@@ -1023,16 +1312,32 @@ struct redisMemOverhead *getMemoryOverheadData(void) {
         mh->db[mh->num_dbs].dbid = j;
 
         mem = dictSize(db->dict) * sizeof(dictEntry) +
+              expireIndexSize(db->expires) * sizeof(dbEntryExpire) +
               dictSlots(db->dict) * sizeof(dictEntry*) +
               dictSize(db->dict) * sizeof(robj);
         mh->db[mh->num_dbs].overhead_ht_main = mem;
         mem_total+=mem;
 
-        mem = dictSize(db->expires) * sizeof(dictEntry) +
-              dictSlots(db->expires) * sizeof(dictEntry*);
+        /* Upper bound of the expires index size: the list pointers are in
+         * the keyspace entries, then every bucket has a node with a child
+         * pointer in its parent, and no more than the whole element. */
+        mem = sizeof(expireIndex) +
+              raxSize(db->expires->buckets) *
+                (sizeof(expireBucket)+EXPIRE_INDEX_KEYLEN) +
+              db->expires->buckets->numnodes *
+                (sizeof(raxNode)+sizeof(raxNode*));
         mh->db[mh->num_dbs].overhead_ht_expires = mem;
         mem_total+=mem;
 
+        /* The prefix index has no values: approximate it counting, for
+         * every node, the pointer in its parent and a few bytes of key. */
+        mem = 0;
+        if (db->prefix_index)
+            mem = db->prefix_index->numnodes *
+                  (sizeof(raxNode)+sizeof(raxNode*)+4);
+        mh->db[mh->num_dbs].overhead_prefix_index = mem;
+        mem_total+=mem;
+
         mh->num_dbs++;
     }
 
@@ -1313,11 +1618,12 @@ NULL
         size_t usage = objectComputeSize(dictGetVal(de),samples);
         usage += sdsAllocSize(dictGetKey(de));
         usage += sizeof(dictEntry);
+        if (dbEntryHasExpire(de)) usage += sizeof(dbEntryExpire);
         addReplyLongLong(c,usage);
     } else if (!strcasecmp(c->argv[1]->ptr,"stats") && c->argc == 2) {
         struct redisMemOverhead *mh = getMemoryOverheadData();
 
-        addReplyMapLen(c,25+mh->num_dbs);
+        addReplyMapLen(c,27+mh->num_dbs);
 
         addReplyBulkCString(c,"peak.allocated");
         addReplyLongLong(c,mh->peak_allocated);
@@ -1343,17 +1649,28 @@ NULL
         addReplyBulkCString(c,"lua.caches");
         addReplyLongLong(c,mh->lua_caches);
 
+        addReplyBulkCString(c,"interned.values");
+        addReplyLongLong(c,mh->interned_values);
+
+        addReplyBulkCString(c,"interned.values.count");
+        addReplyLongLong(c,dictSize(server.interned_values));
+
         for (size_t j = 0; j < mh->num_dbs; j++) {
             char dbname[32];
             snprintf(dbname,sizeof(dbname),"db.%zd",mh->db[j].dbid);
             addReplyBulkCString(c,dbname);
-            addReplyMapLen(c,2);
+            addReplyMapLen(c,server.keyspace_prefix_index ? 3 : 2);
 
             addReplyBulkCString(c,"overhead.hashtable.main");
             addReplyLongLong(c,mh->db[j].overhead_ht_main);
 
             addReplyBulkCString(c,"overhead.hashtable.expires");
             addReplyLongLong(c,mh->db[j].overhead_ht_expires);
+
+            if (server.keyspace_prefix_index) {
+                addReplyBulkCString(c,"overhead.prefix-index");
+                addReplyLongLong(c,mh->db[j].overhead_prefix_index);
+            }
         }
 
         addReplyBulkCString(c,"overhead.total");
@@ -0,0 +1,374 @@
+/*
+ * Copyright (c) 2026, the redis-analysis contributors
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions are met:
+ *
+ *   * Redistributions of source code must retain the above copyright notice,
+ *     this list of conditions and the following disclaimer.
+ *   * Redistributions in binary form must reproduce the above copyright
+ *     notice, this list of conditions and the following disclaimer in the
+ *     documentation and/or other materials provided with the distribution.
+ *   * Neither the name of Redis nor the names of its contributors may be used
+ *     to endorse or promote products derived from this software without
+ *     specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS"
+ * AND ANY EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE
+ * IMPLIED WARRANTIES OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE
+ * ARE DISCLAIMED. IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE
+ * LIABLE FOR ANY DIRECT, INDIRECT, INCIDENTAL, SPECIAL, EXEMPLARY, OR
+ * CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO, PROCUREMENT OF
+ * SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+ * INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN
+ * CONTRACT, STRICT LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE)
+ * ARISING IN ANY WAY OUT OF THE USE OF THIS SOFTWARE, EVEN IF ADVISED OF THE
+ * POSSIBILITY OF SUCH DAMAGE.
+ */
+
+/* Helpers for the hot spots of the protocol path: searching the line
+ * terminators in the query buffer, parsing the multibulk counts and bulk
+ * lengths, and formatting the headers of replies.
+ *
+ * The search uses memchr() when the libc is known to vectorize it (glibc),
+ * since it can't be beaten there. With other libcs, on x86_64, it uses SSE2,
+ * that is always available there, or AVX2 when the CPU supports it, as
+ * detected at runtime. Integers are parsed four or eight digits at a time
+ * with a SWAR (SIMD within a register) algorithm on little endian systems. */
+
+#include <stdint.h>
+#include <string.h>
+
+#include "protoscan.h"
+#include "util.h"
+#include "config.h"
+
+#if !defined(HAVE_PROTOSCAN_SIMD) && \
+    defined(__x86_64__) && defined(__GNUC__) && !defined(__GLIBC__)
+#define HAVE_PROTOSCAN_SIMD 1
+#endif
+
+#ifdef HAVE_PROTOSCAN_SIMD
+#include <immintrin.h>
+#endif
+
+/* ----------------------------------------------------------------------------
+ * Byte search
+ * --------------------------------------------------------------------------*/
+
+#ifdef HAVE_PROTOSCAN_SIMD
+static char *protoFindByteSSE2(const char *s, size_t len, int c) {
+    const __m128i needle = _mm_set1_epi8((char)c);
+    size_t j = 0;
+
+    for (; j+16 <= len; j += 16) {
+        __m128i chunk = _mm_loadu_si128((const __m128i*)(s+j));
+        int mask = _mm_movemask_epi8(_mm_cmpeq_epi8(chunk,needle));
+        if (mask) return (char*)s+j+__builtin_ctz(mask);
+    }
+    for (; j < len; j++)
+        if (s[j] == (char)c) return (char*)s+j;
+    return NULL;
+}
+
+__attribute__((target("avx2")))
+static char *protoFindByteAVX2(const char *s, size_t len, int c) {
+    const __m256i needle = _mm256_set1_epi8((char)c);
+    size_t j = 0;
+
+    for (; j+32 <= len; j += 32) {
+        __m256i chunk = _mm256_loadu_si256((const __m256i*)(s+j));
+        unsigned mask = _mm256_movemask_epi8(_mm256_cmpeq_epi8(chunk,needle));
+        if (mask) return (char*)s+j+__builtin_ctz(mask);
+    }
+    return protoFindByteSSE2(s+j,len-j,c);
+}
+
+static char *protoFindByteResolve(const char *s, size_t len, int c);
+static char *(*protoFindByteImpl)(const char *s, size_t len, int c) =
+    protoFindByteResolve;
+
+/* Select the implementation the first time the search is used. Concurrent
+ * callers may both resolve it, but they store the same pointer. */
+static char *protoFindByteResolve(const char *s, size_t len, int c) {
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2"))
+        protoFindByteImpl = protoFindByteAVX2;
+    else
+        protoFindByteImpl = protoFindByteSSE2;
+    return protoFindByteImpl(s,len,c);
+}
+#endif
+
+/* Return a pointer to the first occurrence of the byte 'c' in the first
+ * 'len' bytes of 's', or NULL if there is none, like memchr(). */
+char *protoFindByte(const char *s, size_t len, int c) {
+#ifdef HAVE_PROTOSCAN_SIMD
+    return protoFindByteImpl(s,len,c);
+#else
+    return memchr(s,c,len);
+#endif
+}
+
+/* ----------------------------------------------------------------------------
+ * Integers parsing and formatting
+ * --------------------------------------------------------------------------*/
+
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+/* Parse the eight digits at 'p' into 'value'. Returns 0 if any of the
+ * bytes is not a digit. */
+static inline int protoParse8Digits(const char *p, uint64_t *value) {
+    uint64_t x;
+    memcpy(&x,p,8);
+
+    /* Every byte must be in the 0x30-0x39 range: the high nibble is 3,
+     * and adding 6 does not carry into it. */
+    if ((((x & 0xF0F0F0F0F0F0F0F0ULL) |
+          (((x + 0x0606060606060606ULL) & 0xF0F0F0F0F0F0F0F0ULL) >> 4))) !=
+        0x3333333333333333ULL) return 0;
+
+    /* Combine the digits in pairs, then in groups of four, then in the
+     * final eight digits number. The first digit is in the lowest byte. */
+    x -= 0x3030303030303030ULL;
+    x = (x * 10) + (x >> 8);
+    x = (((x & 0x000000FF000000FFULL) * (100 + (1000000ULL << 32))) +
+         (((x >> 16) & 0x000000FF000000FFULL) * (1 + (10000ULL << 32)))) >> 32;
+    *value = x;
+    return 1;
+}
+
+/* Like protoParse8Digits(), for four digits. */
+static inline int protoParse4Digits(const char *p, uint64_t *value) {
+    uint32_t x;
+    memcpy(&x,p,4);
+
+    if ((((x & 0xF0F0F0F0U) | (((x + 0x06060606U) & 0xF0F0F0F0U) >> 4))) !=
+        0x33333333U) return 0;
+
+    x -= 0x30303030U;
+    x = (x * 10) + (x >> 8);
+    *value = (x & 0xFF) * 100 + ((x >> 16) & 0xFF);
+    return 1;
+}
+
+/* The part of protoString2ll() parsing numbers of at least eight digits,
+ * the sign being already consumed. Not inlined so that the short numbers
+ * path does not pay for the registers this needs. */
+__attribute__((noinline))
+static int protoString2llSWAR(const char *p, const char *end, int negative,
+                              long long *value)
+{
+    uint64_t v = 0, chunk;
+
+    while (end-p >= 8) {
+        if (!protoParse8Digits(p,&chunk)) return 0;
+        v = v*100000000 + chunk;
+        p += 8;
+    }
+    for (; p < end; p++) {
+        unsigned digit = (unsigned char)*p - '0';
+        if (digit > 9) return 0;
+        v = v*10 + digit;
+    }
+    if (value != NULL) *value = negative ? -(long long)v : (long long)v;
+    return 1;
+}
+#endif
+
+/* Same as string2ll(), with the same strict rules about the accepted
+ * strings, but faster for numbers of up to 18 digits, that can't overflow,
+ * and that is what multibulk counts and bulk lengths always are. */
+int protoString2ll(const char *s, size_t slen, long long *value) {
+    const char *p = s, *end = s+slen;
+    int negative = 0;
+    uint64_t v = 0;
+
+    if (slen && p[0] == '-') {
+        negative = 1;
+        p++;
+    }
+    /* Empty numbers, numbers starting with 0 (or just 0) and numbers that
+     * may overflow are handled by string2ll(). */
+    if (p == end || end-p > 18 || p[0] == '0')
+        return string2ll(s,slen,value);
+
+#if (BYTE_ORDER == LITTLE_ENDIAN)
+    /* Short numbers, like most bulk lengths, just use the loop below, or
+     * parse four digits at once. */
+    if (end-p >= 8) return protoString2llSWAR(p,end,negative,value);
+    if (end-p >= 4) {
+        if (!protoParse4Digits(p,&v)) return 0;
+        p += 4;
+    }
+#endif
+    for (; p < end; p++) {
+        unsigned digit = (unsigned char)*p - '0';
+        if (digit > 9) return 0;
+        v = v*10 + digit;
+    }
+    if (value != NULL) *value = negative ? -(long long)v : (long long)v;
+    return 1;
+}
+
+/* Write the protocol header made of 'prefix', 'll' and CRLF, for instance
+ * "$1234\r\n", in 'buf', that must be at least PROTO_HEADER_MAX_LEN bytes.
+ * Returns the length of the header. */
+size_t protoWriteHeader(char *buf, char prefix, long long ll) {
+    size_t len;
+
+    buf[0] = prefix;
+    len = ll2string(buf+1,PROTO_HEADER_MAX_LEN-1,ll);
+    buf[len+1] = '\r';
+    buf[len+2] = '\n';
+    return len+3;
+}
+
+#ifdef REDIS_TEST
+#include <assert.h>
+#define UNUSED(x) (void)(x)
+#include <stdio.h>
+#include <stdlib.h>
+#include <sys/time.h>
+
+static long long usec(void) {
+    struct timeval tv;
+    gettimeofday(&tv,NULL);
+    return (((long long)tv.tv_sec)*1000000)+tv.tv_usec;
+}
+
+static void test_protoFindByte(void) {
+    char buf[256];
+
+    for (int j = 0; j < 100000; j++) {
+        size_t len = rand() % sizeof(buf);
+        for (size_t k = 0; k < len; k++) buf[k] = 'a' + rand() % 26;
+        if (len && rand() % 2) buf[rand() % len] = '\r';
+        if (len && rand() % 2) buf[rand() % len] = '\r';
+        assert(protoFindByte(buf,len,'\r') == memchr(buf,'\r',len));
+    }
+}
+
+static void test_protoString2ll(void) {
+    char *valid[] = {"0", "1", "-1", "9", "12345678", "123456789",
+        "-12345678", "1234567890123456", "123456789012345678",
+        "-123456789012345678", "9223372036854775807",
+        "-9223372036854775808"};
+    char *invalid[] = {"", "-", "+1", " 1", "1 ", "01", "-0", "1234567a",
+        "12345678a", "1234a5678", "123456789012345:78",
+        "9223372036854775808", "-9223372036854775809", "1\r"};
+    long long v1, v2;
+    char buf[32];
+
+    for (size_t j = 0; j < sizeof(valid)/sizeof(char*); j++) {
+        assert(protoString2ll(valid[j],strlen(valid[j]),&v1) == 1);
+        assert(string2ll(valid[j],strlen(valid[j]),&v2) == 1);
+        assert(v1 == v2);
+    }
+    for (size_t j = 0; j < sizeof(invalid)/sizeof(char*); j++) {
+        assert(protoString2ll(invalid[j],strlen(invalid[j]),&v1) == 0);
+        assert(string2ll(invalid[j],strlen(invalid[j]),&v2) == 0);
+    }
+    for (int j = 0; j < 100000; j++) {
+        long long ll = ((long long)rand() << 32 | rand()) >> (rand() % 63);
+        if (rand() % 2) ll = -ll;
+        size_t len = ll2string(buf,sizeof(buf),ll);
+        assert(protoString2ll(buf,len,&v1) == 1 && v1 == ll);
+    }
+}
+
+static void test_protoWriteHeader(void) {
+    char buf[PROTO_HEADER_MAX_LEN];
+    size_t len;
+
+    len = protoWriteHeader(buf,'$',1234);
+    assert(len == 7 && memcmp(buf,"$1234\r\n",7) == 0);
+    len = protoWriteHeader(buf,'*',-1);
+    assert(len == 5 && memcmp(buf,"*-1\r\n",5) == 0);
+    len = protoWriteHeader(buf,':',-9223372036854775807LL-1);
+    assert(len == 23 && memcmp(buf,":-9223372036854775808\r\n",23) == 0);
+}
+
+/* Compare the helpers with the libc functions they replace, using a
+ * pipeline of SET commands with values of different sizes. */
+static void benchmark(void) {
+    const int iterations = 200;
+    size_t len = 0, numlines = 0;
+    char *pipeline = malloc(1024*1024), lenbuf[PROTO_HEADER_MAX_LEN];
+    long long start, v, sum = 0;
+    char *p;
+
+    while (len < 1024*1024 - 512) {
+        int vlen = rand() % 400;
+        len += snprintf(pipeline+len,1024*1024-len,
+            "*3\r\n$3\r\nSET\r\n$8\r\nkey:%04d\r\n$%d\r\n",rand()%10000,vlen);
+        memset(pipeline+len,'x',vlen);
+        len += vlen;
+        memcpy(pipeline+len,"\r\n",2);
+        len += 2;
+    }
+
+    for (int i = 0; i < 2; i++) {
+        start = usec();
+        for (int j = 0; j < iterations; j++) {
+            size_t pos = 0;
+            numlines = 0;
+            while ((p = i ? protoFindByte(pipeline+pos,len-pos,'\r') :
+                            memchr(pipeline+pos,'\r',len-pos)) != NULL)
+            {
+                pos = p-pipeline+2;
+                numlines++;
+            }
+        }
+        printf("CRLF search (%s): %zu lines, %lld usec\n",
+            i ? "protoFindByte" : "memchr", numlines*iterations,
+            usec()-start);
+    }
+
+    /* Lengths from 1 to 12 digits. */
+    static char numbers[4096][PROTO_HEADER_MAX_LEN];
+    static size_t numlens[4096];
+    for (int j = 0; j < 4096; j++) {
+        long long ll = 1 + rand() % 9;
+        for (int k = j % 12; k > 0; k--) ll = ll*10 + rand() % 10;
+        numlens[j] = ll2string(numbers[j],sizeof(numbers[j]),ll);
+    }
+    for (int i = 0; i < 2; i++) {
+        start = usec();
+        for (int j = 0; j < iterations*10; j++) {
+            for (int k = 0; k < 4096; k++) {
+                if (i) protoString2ll(numbers[k],numlens[k],&v);
+                else string2ll(numbers[k],numlens[k],&v);
+                sum += v;
+            }
+        }
+        printf("Length parsing (%s): %d numbers, %lld usec\n",
+            i ? "protoString2ll" : "string2ll", iterations*10*4096,
+            usec()-start);
+    }
+
+    for (int i = 0; i < 2; i++) {
+        start = usec();
+        for (int j = 0; j < 10000000; j++) {
+            size_t l = i ? protoWriteHeader(lenbuf,'$',j) :
+                (size_t)snprintf(lenbuf,sizeof(lenbuf),"$%d\r\n",j);
+            sum += l;
+        }
+        printf("Header formatting (%s): 10000000 headers, %lld usec\n",
+            i ? "protoWriteHeader" : "snprintf", usec()-start);
+    }
+    printf("(checksum %lld)\n", sum);
+    free(pipeline);
+}
+
+int protoscanTest(int argc, char **argv) {
+    UNUSED(argc);
+    UNUSED(argv);
+
+    test_protoFindByte();
+    test_protoString2ll();
+    test_protoWriteHeader();
+    benchmark();
+    return 0;
+}
+#endif
@@ -463,6 +463,9 @@ ssize_t rdbSaveStringObject(rio *rdb, robj *obj) {
      * object is already integer encoded. */
     if (obj->encoding == OBJ_ENCODING_INT) {
         return rdbSaveLongLongAsStringObject(rdb,(long)obj->ptr);
+    } else if (obj->encoding == OBJ_ENCODING_INLINE) {
+        char *s = inlineStringPtr(obj);
+        return rdbSaveRawString(rdb,(unsigned char*)s,strlen(s));
     } else {
         serverAssertWithInfo(NULL,obj,sdsEncodedObject(obj));
         return rdbSaveRawString(rdb,obj->ptr,sdslen(obj->ptr));
@@ -639,20 +642,22 @@ int rdbSaveObjectType(rio *rdb, robj *o) {
     case OBJ_SET:
         if (o->encoding == OBJ_ENCODING_INTSET)
             return rdbSaveType(rdb,RDB_TYPE_SET_INTSET);
+        else if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_SET_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_SET);
         else
             serverPanic("Unknown set encoding");
     case OBJ_ZSET:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_ZSET_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_ZSET_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_SKIPLIST)
             return rdbSaveType(rdb,RDB_TYPE_ZSET_2);
         else
             serverPanic("Unknown sorted set encoding");
     case OBJ_HASH:
-        if (o->encoding == OBJ_ENCODING_ZIPLIST)
-            return rdbSaveType(rdb,RDB_TYPE_HASH_ZIPLIST);
+        if (o->encoding == OBJ_ENCODING_LISTPACK)
+            return rdbSaveType(rdb,RDB_TYPE_HASH_LISTPACK);
         else if (o->encoding == OBJ_ENCODING_HT)
             return rdbSaveType(rdb,RDB_TYPE_HASH);
         else
@@ -829,6 +834,11 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         } else if (o->encoding == OBJ_ENCODING_INTSET) {
             size_t l = intsetBlobLen((intset*)o->ptr);
 
+            if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
+            nwritten += n;
+        } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
+
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
         } else {
@@ -836,8 +846,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
         }
     } else if (o->type == OBJ_ZSET) {
         /* Save a sorted set value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -854,7 +864,8 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
              * element will always be the smaller, so adding to the skiplist
              * will always immediately stop at the head, making the insertion
              * O(1) instead of O(log(N)). */
-            zskiplistNode *zn = zsl->tail;
+            zskiplistPos pos;
+            zskiplistEntry *zn = zslLast(zsl,&pos);
             while (zn != NULL) {
                 if ((n = rdbSaveRawString(rdb,
                     (unsigned char*)zn->ele,sdslen(zn->ele))) == -1)
@@ -865,15 +876,15 @@ ssize_t rdbSaveObject(rio *rdb, robj *o, robj *key) {
                 if ((n = rdbSaveBinaryDoubleValue(rdb,zn->score)) == -1)
                     return -1;
                 nwritten += n;
-                zn = zn->backward;
+                zn = zslPrev(&pos);
             }
         } else {
             serverPanic("Unknown sorted set encoding");
         }
     } else if (o->type == OBJ_HASH) {
         /* Save a hash value */
-        if (o->encoding == OBJ_ENCODING_ZIPLIST) {
-            size_t l = ziplistBlobLen((unsigned char*)o->ptr);
+        if (o->encoding == OBJ_ENCODING_LISTPACK) {
+            size_t l = lpBytes((unsigned char*)o->ptr);
 
             if ((n = rdbSaveRawString(rdb,o->ptr,l)) == -1) return -1;
             nwritten += n;
@@ -1213,7 +1224,7 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
         /* Write the RESIZE DB opcode. */
         uint64_t db_size, expires_size;
         db_size = dictSize(db->dict);
-        expires_size = dictSize(db->expires);
+        expires_size = expireIndexSize(db->expires);
         if (rdbSaveType(rdb,RDB_OPCODE_RESIZEDB) == -1) goto werr;
         if (rdbSaveLen(rdb,db_size) == -1) goto werr;
         if (rdbSaveLen(rdb,expires_size) == -1) goto werr;
@@ -1225,7 +1236,7 @@ int rdbSaveRio(rio *rdb, int *error, int rdbflags, rdbSaveInfo *rsi) {
             long long expire;
 
             initStaticStringObject(key,keystr);
-            expire = getExpire(db,&key);
+            expire = dbEntryGetExpire(de);
             if (rdbSaveKeyValuePair(rdb,&key,o,expire) == -1) goto werr;
 
             /* When this RDB is produced as part of an AOF rewrite, move
@@ -1456,6 +1467,43 @@ robj *rdbLoadCheckModuleValue(rio *rdb, char *modulename) {
     return createStringObject("module-dummy-value",18);
 }
 
+/* Sorted sets and hashes were stored as ziplists by older versions: convert
+ * the ziplist 'zl' into a listpack with the same elements, in the same order,
+ * freeing the ziplist. */
+static unsigned char *rdbZiplistToListpack(unsigned char *zl) {
+    unsigned char *lp = lpNew();
+    unsigned char *p = ziplistIndex(zl,0);
+    unsigned char *vstr;
+    unsigned int vlen;
+    long long vll;
+    char buf[LONG_STR_SIZE];
+
+    while (p != NULL) {
+        if (!ziplistGet(p,&vstr,&vlen,&vll))
+            rdbExitReportCorruptRDB("Ziplist with invalid entry");
+        if (vstr == NULL) {
+            vlen = ll2string(buf,sizeof(buf),vll);
+            vstr = (unsigned char*)buf;
+        }
+        lp = lpAppend(lp,vstr,vlen);
+        p = ziplistNext(zl,p);
+    }
+    zfree(zl);
+    return lp;
+}
+
+/* Cheap sanity check of a listpack loaded from an RDB file: the header must
+ * agree with the length of the blob, that must be terminated by the EOF byte,
+ * and the listpack must not be empty. When 'pairs' is true (hashes and
+ * sorted sets) it must also contain key/value or element/score pairs, while
+ * sets store a single entry per member. */
+static void rdbVerifyListpackBlob(unsigned char *lp, size_t len, int pairs) {
+    if (len < 7 || lpBytes(lp) != len || lp[len-1] != 0xFF)
+        rdbExitReportCorruptRDB("Listpack length mismatch");
+    if (lpFirst(lp) == NULL || (pairs && lpLength(lp) % 2 != 0))
+        rdbExitReportCorruptRDB("Listpack with invalid number of elements");
+}
+
 /* Load a Redis object of the specified type from the specified file.
  * On success a newly allocated object is returned, otherwise NULL. */
 robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
@@ -1516,16 +1564,31 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 /* Fetch integer value from element. */
                 if (isSdsRepresentableAsLongLong(sdsele,&llval) == C_OK) {
                     o->ptr = intsetAdd(o->ptr,llval,NULL);
+                } else if (len <= server.set_max_listpack_entries) {
+                    setTypeConvert(o,OBJ_ENCODING_LISTPACK);
                 } else {
                     setTypeConvert(o,OBJ_ENCODING_HT);
                     dictExpand(o->ptr,len);
                 }
             }
 
+            /* Use a regular set as soon as an element is too big to be
+             * stored in a listpack. */
+            if (o->encoding == OBJ_ENCODING_LISTPACK &&
+                sdslen(sdsele) > server.set_max_listpack_value)
+            {
+                setTypeConvert(o,OBJ_ENCODING_HT);
+                dictExpand(o->ptr,len);
+            }
+
             /* This will also be called when the set was just converted
-             * to a regular hash table encoded set. */
+             * to a listpack or to a regular hash table encoded set. */
             if (o->encoding == OBJ_ENCODING_HT) {
                 dictAdd((dict*)o->ptr,sdsele,NULL);
+            } else if (o->encoding == OBJ_ENCODING_LISTPACK) {
+                o->ptr = lpAppend(o->ptr,(unsigned char*)sdsele,
+                                  sdslen(sdsele));
+                sdsfree(sdsele);
             } else {
                 sdsfree(sdsele);
             }
@@ -1547,7 +1610,6 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
         while(zsetlen--) {
             sds sdsele;
             double score;
-            zskiplistNode *znode;
 
             if ((sdsele = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) {
                 decrRefCount(o);
@@ -1571,14 +1633,13 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
             /* Don't care about integer-encoded strings. */
             if (sdslen(sdsele) > maxelelen) maxelelen = sdslen(sdsele);
 
-            znode = zslInsert(zs->zsl,score,sdsele);
-            dictAdd(zs->dict,sdsele,&znode->score);
+            zsetInsert(zs,score,sdsele);
         }
 
         /* Convert *after* loading, since sorted sets are not stored ordered. */
-        if (zsetLength(o) <= server.zset_max_ziplist_entries &&
-            maxelelen <= server.zset_max_ziplist_value)
-                zsetConvert(o,OBJ_ENCODING_ZIPLIST);
+        if (zsetLength(o) <= server.zset_max_listpack_entries &&
+            maxelelen <= server.zset_max_listpack_value)
+                zsetConvert(o,OBJ_ENCODING_LISTPACK);
     } else if (rdbtype == RDB_TYPE_HASH) {
         uint64_t len;
         int ret;
@@ -1590,11 +1651,11 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
         o = createHashObject();
 
         /* Too many entries? Use a hash table. */
-        if (len > server.hash_max_ziplist_entries)
+        if (len > server.hash_max_listpack_entries)
             hashTypeConvert(o, OBJ_ENCODING_HT);
 
-        /* Load every field and value into the ziplist */
-        while (o->encoding == OBJ_ENCODING_ZIPLIST && len > 0) {
+        /* Load every field and value into the listpack */
+        while (o->encoding == OBJ_ENCODING_LISTPACK && len > 0) {
             len--;
             /* Load raw strings */
             if ((field = rdbGenericLoadStringObject(rdb,RDB_LOAD_SDS,NULL)) == NULL) {
@@ -1607,15 +1668,13 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 return NULL;
             }
 
-            /* Add pair to ziplist */
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)field,
-                    sdslen(field), ZIPLIST_TAIL);
-            o->ptr = ziplistPush(o->ptr, (unsigned char*)value,
-                    sdslen(value), ZIPLIST_TAIL);
+            /* Add pair to listpack */
+            o->ptr = lpAppend(o->ptr, (unsigned char*)field, sdslen(field));
+            o->ptr = lpAppend(o->ptr, (unsigned char*)value, sdslen(value));
 
             /* Convert to hash table if size threshold is exceeded */
-            if (sdslen(field) > server.hash_max_ziplist_value ||
-                sdslen(value) > server.hash_max_ziplist_value)
+            if (sdslen(field) > server.hash_max_listpack_value ||
+                sdslen(value) > server.hash_max_listpack_value)
             {
                 sdsfree(field);
                 sdsfree(value);
@@ -1670,11 +1729,15 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
     } else if (rdbtype == RDB_TYPE_HASH_ZIPMAP  ||
                rdbtype == RDB_TYPE_LIST_ZIPLIST ||
                rdbtype == RDB_TYPE_SET_INTSET   ||
+               rdbtype == RDB_TYPE_SET_LISTPACK ||
                rdbtype == RDB_TYPE_ZSET_ZIPLIST ||
-               rdbtype == RDB_TYPE_HASH_ZIPLIST)
+               rdbtype == RDB_TYPE_HASH_ZIPLIST ||
+               rdbtype == RDB_TYPE_ZSET_LISTPACK ||
+               rdbtype == RDB_TYPE_HASH_LISTPACK)
     {
+        size_t encoded_len;
         unsigned char *encoded =
-            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,NULL);
+            rdbGenericLoadStringObject(rdb,RDB_LOAD_PLAIN,&encoded_len);
         if (encoded == NULL) return NULL;
         o = createObject(OBJ_STRING,encoded); /* Obj type fixed below. */
 
@@ -1686,10 +1749,10 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
          * converted. */
         switch(rdbtype) {
             case RDB_TYPE_HASH_ZIPMAP:
-                /* Convert to ziplist encoded hash. This must be deprecated
+                /* Convert to listpack encoded hash. This must be deprecated
                  * when loading dumps created by Redis 2.4 gets deprecated. */
                 {
-                    unsigned char *zl = ziplistNew();
+                    unsigned char *lp = lpNew();
                     unsigned char *zi = zipmapRewind(o->ptr);
                     unsigned char *fstr, *vstr;
                     unsigned int flen, vlen;
@@ -1698,17 +1761,17 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                     while ((zi = zipmapNext(zi, &fstr, &flen, &vstr, &vlen)) != NULL) {
                         if (flen > maxlen) maxlen = flen;
                         if (vlen > maxlen) maxlen = vlen;
-                        zl = ziplistPush(zl, fstr, flen, ZIPLIST_TAIL);
-                        zl = ziplistPush(zl, vstr, vlen, ZIPLIST_TAIL);
+                        lp = lpAppend(lp, fstr, flen);
+                        lp = lpAppend(lp, vstr, vlen);
                     }
 
                     zfree(o->ptr);
-                    o->ptr = zl;
+                    o->ptr = lp;
                     o->type = OBJ_HASH;
-                    o->encoding = OBJ_ENCODING_ZIPLIST;
+                    o->encoding = OBJ_ENCODING_LISTPACK;
 
-                    if (hashTypeLength(o) > server.hash_max_ziplist_entries ||
-                        maxlen > server.hash_max_ziplist_value)
+                    if (hashTypeLength(o) > server.hash_max_listpack_entries ||
+                        maxlen > server.hash_max_listpack_value)
                     {
                         hashTypeConvert(o, OBJ_ENCODING_HT);
                     }
@@ -1725,16 +1788,33 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
                 if (intsetLen(o->ptr) > server.set_max_intset_entries)
                     setTypeConvert(o,OBJ_ENCODING_HT);
                 break;
+            case RDB_TYPE_SET_LISTPACK:
+                rdbVerifyListpackBlob(o->ptr,encoded_len,0);
+                o->type = OBJ_SET;
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (setTypeSize(o) > server.set_max_listpack_entries)
+                    setTypeConvert(o,OBJ_ENCODING_HT);
+                break;
             case RDB_TYPE_ZSET_ZIPLIST:
+            case RDB_TYPE_ZSET_LISTPACK:
+                if (rdbtype == RDB_TYPE_ZSET_ZIPLIST)
+                    o->ptr = rdbZiplistToListpack(o->ptr);
+                else
+                    rdbVerifyListpackBlob(o->ptr,encoded_len,1);
                 o->type = OBJ_ZSET;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
-                if (zsetLength(o) > server.zset_max_ziplist_entries)
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (zsetLength(o) > server.zset_max_listpack_entries)
                     zsetConvert(o,OBJ_ENCODING_SKIPLIST);
                 break;
             case RDB_TYPE_HASH_ZIPLIST:
+            case RDB_TYPE_HASH_LISTPACK:
+                if (rdbtype == RDB_TYPE_HASH_ZIPLIST)
+                    o->ptr = rdbZiplistToListpack(o->ptr);
+                else
+                    rdbVerifyListpackBlob(o->ptr,encoded_len,1);
                 o->type = OBJ_HASH;
-                o->encoding = OBJ_ENCODING_ZIPLIST;
-                if (hashTypeLength(o) > server.hash_max_ziplist_entries)
+                o->encoding = OBJ_ENCODING_LISTPACK;
+                if (hashTypeLength(o) > server.hash_max_listpack_entries)
                     hashTypeConvert(o, OBJ_ENCODING_HT);
                 break;
             default:
@@ -1982,6 +2062,12 @@ robj *rdbLoadObject(int rdbtype, rio *rdb, sds key) {
             exit(1);
         }
         o = createModuleObject(mt,ptr);
+    } else if (rdbtype == RDB_TYPE_LIST_QUICKLIST_2 ||
+               rdbtype == RDB_TYPE_STREAM_LISTPACKS_2)
+    {
+        rdbReportReadError("RDB type %d is a list or stream encoding of "
+            "upstream Redis that this server can't load",rdbtype);
+        return NULL;
     } else {
         rdbReportReadError("Unknown RDB encoding type %d",rdbtype);
         return NULL;
@@ -2167,7 +2253,6 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
             if ((expires_size = rdbLoadLen(rdb,NULL)) == RDB_LENERR)
                 goto eoferr;
             dictExpand(db->dict,db_size);
-            dictExpand(db->expires,expires_size);
             continue; /* Read next opcode. */
         } else if (type == RDB_OPCODE_AUX) {
             /* AUX: generic string-string fields. Use to add state to RDB
@@ -2335,6 +2420,9 @@ int rdbLoadRio(rio *rdb, int rdbflags, rdbSaveInfo *rsi) {
 
             /* call key space notification on key loaded for modules only */
             moduleNotifyKeyspaceEvent(NOTIFY_LOADED, "loaded", &keyobj, db->id);
+
+            /* The key name was copied inside the keyspace entry. */
+            sdsfree(key);
         }
 
         /* Loading the database more slowly is useful in order to test
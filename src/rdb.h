@@ -37,8 +37,19 @@
 #include "server.h"
 
 /* The current RDB version. When the format changes in a way that is no longer
- * backward compatible this number gets incremented. */
-#define RDB_VERSION 9
+ * backward compatible this number gets incremented.
+ *
+ * This build writes the listpack types 16, 17 and 20, that upstream Redis
+ * introduced with RDB versions 10 (16, 17) and 11 (20). The version jumps
+ * from 9 to 11 so that readers that don't know type 20, including the
+ * Redis 6.x servers this tree derives from, refuse the file from its
+ * header instead of failing in the middle of the load. It does not make
+ * the files exchangeable with upstream: this build can't load the types
+ * 18 and 19 that upstream RDB 10/11 files use for every list and stream,
+ * and the files it writes were not verified against upstream readers,
+ * so RDB files should only be moved between servers built from this
+ * tree. */
+#define RDB_VERSION 11
 
 /* Defines related to the dump file format. To store 32 bits lengths for short
  * keys requires a lot of space, so we check the most significant 2 bits of
@@ -91,10 +102,19 @@
 #define RDB_TYPE_HASH_ZIPLIST  13
 #define RDB_TYPE_LIST_QUICKLIST 14
 #define RDB_TYPE_STREAM_LISTPACKS 15
+#define RDB_TYPE_HASH_LISTPACK 16
+#define RDB_TYPE_ZSET_LISTPACK 17
+/* Upstream Redis uses 18 and 19 for quicklists of listpacks and for a new
+ * stream format. This build can't load them: rdbLoadObject() refuses them
+ * with an explicit error. The numbers are skipped only so that the ids we
+ * share with upstream keep the same meaning. */
+#define RDB_TYPE_LIST_QUICKLIST_2 18 /* Not supported. */
+#define RDB_TYPE_STREAM_LISTPACKS_2 19 /* Not supported. */
+#define RDB_TYPE_SET_LISTPACK 20
 /* NOTE: WHEN ADDING NEW RDB TYPE, UPDATE rdbIsObjectType() BELOW */
 
 /* Test if a type is an object type. */
-#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 15))
+#define rdbIsObjectType(t) ((t >= 0 && t <= 7) || (t >= 9 && t <= 17) || t == 20)
 
 /* Special RDB opcodes (saved/loaded with rdbSaveType/rdbLoadType). */
 #define RDB_OPCODE_MODULE_AUX 247   /* Module auxiliary data. */
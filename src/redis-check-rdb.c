@@ -85,7 +85,11 @@ char *rdb_type_string[] = {
     "zset-ziplist",
     "hash-ziplist",
     "quicklist",
-    "stream"
+    "stream",
+    "hash-listpack",
+    "zset-listpack",
+    "","",
+    "set-listpack"
 };
 
 /* Show a few stats collected into 'rdbstate' */
@@ -273,7 +277,11 @@ int redis_check_rdb(char *rdbfilename, FILE *fp) {
             decrRefCount(auxval);
             continue; /* Read type again. */
         } else {
-            if (!rdbIsObjectType(type)) {
+            if (type == RDB_TYPE_LIST_QUICKLIST_2 ||
+                type == RDB_TYPE_STREAM_LISTPACKS_2) {
+                rdbCheckError("Unsupported upstream object type: %d", type);
+                goto err;
+            } else if (!rdbIsObjectType(type)) {
                 rdbCheckError("Invalid object type: %d", type);
                 goto err;
             }
@@ -190,13 +190,7 @@ void feedReplicationBacklogWithObject(robj *o) {
     void *p;
     size_t len;
 
-    if (o->encoding == OBJ_ENCODING_INT) {
-        len = ll2string(llstr,sizeof(llstr),(long)o->ptr);
-        p = llstr;
-    } else {
-        len = sdslen(o->ptr);
-        p = o->ptr;
-    }
+    p = stringObjectPtrLen(o,&len,llstr);
     feedReplicationBacklog(p,len);
 }
 
@@ -390,6 +384,9 @@ void replicationFeedMonitors(client *c, list *monitors, int dictid, robj **argv,
     for (j = 0; j < argc; j++) {
         if (argv[j]->encoding == OBJ_ENCODING_INT) {
             cmdrepr = sdscatprintf(cmdrepr, "\"%ld\"", (long)argv[j]->ptr);
+        } else if (argv[j]->encoding == OBJ_ENCODING_INLINE) {
+            char *s = inlineStringPtr(argv[j]);
+            cmdrepr = sdscatrepr(cmdrepr,s,strlen(s));
         } else {
             cmdrepr = sdscatrepr(cmdrepr,(char*)argv[j]->ptr,
                         sdslen(argv[j]->ptr));
@@ -1437,7 +1434,9 @@ redisDb *disklessLoadMakeBackups(void) {
     for (int i=0; i<server.dbnum; i++) {
         backups[i] = server.db[i];
         server.db[i].dict = dictCreate(&dbDictType,NULL);
-        server.db[i].expires = dictCreate(&keyptrDictType,NULL);
+        server.db[i].expires = expireIndexCreate();
+        if (server.keyspace_prefix_index)
+            server.db[i].prefix_index = raxNew();
     }
     return backups;
 }
@@ -1459,7 +1458,9 @@ void disklessLoadRestoreBackups(redisDb *backup, int restore, int empty_db_flags
         emptyDbGeneric(server.db,-1,empty_db_flags,replicationEmptyDbCallback);
         for (int i=0; i<server.dbnum; i++) {
             dictRelease(server.db[i].dict);
-            dictRelease(server.db[i].expires);
+            expireIndexRelease(server.db[i].expires);
+            if (server.db[i].prefix_index)
+                raxFree(server.db[i].prefix_index);
             server.db[i] = backup[i];
         }
     } else {
@@ -1467,7 +1468,8 @@ void disklessLoadRestoreBackups(redisDb *backup, int restore, int empty_db_flags
         emptyDbGeneric(backup,-1,empty_db_flags|EMPTYDB_BACKUP,replicationEmptyDbCallback);
         for (int i=0; i<server.dbnum; i++) {
             dictRelease(backup[i].dict);
-            dictRelease(backup[i].expires);
+            expireIndexRelease(backup[i].expires);
+            if (backup[i].prefix_index) raxFree(backup[i].prefix_index);
         }
     }
     zfree(backup);
@@ -2772,6 +2774,7 @@ void replicationCacheMaster(client *c) {
      * offsets, including pending transactions, already populated arguments,
      * pending outputs to the master. */
     sdsclear(server.master->querybuf);
+    server.master->qb_pos = 0;
     sdsclear(server.master->pending_querybuf);
     server.master->read_reploff = server.master->reploff;
     if (c->flags & CLIENT_MULTI) discardTransaction(c);
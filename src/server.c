@@ -33,6 +33,8 @@
 #include "bio.h"
 #include "latency.h"
 #include "atomicvar.h"
+#include "protoscan.h"
+#include "aeshash.h"
 
 #include <time.h>
 #include <signal.h>
@@ -1194,6 +1196,20 @@ void dictObjectDestructor(void *privdata, void *val)
     decrRefCount(val);
 }
 
+/* Destructor of the keyspace values: the interned ones count the keys
+ * referencing them instead of their references, see object.c. This may be
+ * called by the lazyfree thread. */
+void dictDbValDestructor(void *privdata, void *val)
+{
+    DICT_NOTUSED(privdata);
+
+    if (val == NULL) return; /* Lazy freeing will set value to NULL. */
+    if (((robj*)val)->refcount == OBJ_INTERNED_REFCOUNT)
+        releaseInternedValue(val);
+    else
+        decrRefCount(val);
+}
+
 void dictSdsDestructor(void *privdata, void *val)
 {
     DICT_NOTUSED(privdata);
@@ -1213,10 +1229,31 @@ uint64_t dictObjHash(const void *key) {
     return dictGenHashFunction(o->ptr, sdslen((sds)o->ptr));
 }
 
+/* Keys embedded in the dictionary entries are sds strings built in place,
+ * see sdsnewinplace(). */
+size_t dictSdsEmbedLen(const void *key) {
+    return sdsinplacesize(sdslen((sds)key));
+}
+
+void *dictSdsEmbed(void *buf, const void *key) {
+    return sdsnewinplace(buf,key,sdslen((sds)key));
+}
+
 uint64_t dictSdsHash(const void *key) {
     return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
 }
 
+/* Hash of the keys of the keyspace: the function is selected by the
+ * hash-function config, that can't change at runtime since the entries
+ * store the hash of their keys. The config is loaded before the databases
+ * are created, so no key is ever hashed with a different function. */
+uint64_t dictSdsKeyspaceHash(const void *key) {
+    if (server.hash_function == HASH_FUNCTION_AESHASH)
+        return aeshash((unsigned char*)key, sdslen((char*)key),
+                       dictGetHashFunctionSeed());
+    return dictGenHashFunction((unsigned char*)key, sdslen((char*)key));
+}
+
 uint64_t dictSdsCaseHash(const void *key) {
     return dictGenCaseHashFunction((unsigned char*)key, sdslen((char*)key));
 }
@@ -1266,6 +1303,21 @@ uint64_t dictEncObjHash(const void *key) {
     }
 }
 
+/* Hash and compare string objects of any encoding without decoding them. */
+uint64_t dictStringObjHash(const void *key) {
+    char buf[LONG_STR_SIZE];
+    size_t len;
+    char *s = stringObjectPtrLen((robj*)key,&len,buf);
+    return dictGenHashFunction((unsigned char*)s,len);
+}
+
+int dictStringObjKeyCompare(void *privdata, const void *key1,
+        const void *key2)
+{
+    UNUSED(privdata);
+    return equalStringObjects((robj*)key1,(robj*)key2);
+}
+
 /* Generic hash table type where keys are Redis Objects, Values
  * dummy pointers. */
 dictType objectKeyPointerValueDictType = {
@@ -1277,6 +1329,17 @@ dictType objectKeyPointerValueDictType = {
     NULL                       /* val destructor */
 };
 
+/* Pool of interned string values: keys are interned string objects, that
+ * are freed by evictUnusedInternedValues(), and there are no values. */
+dictType internedValuesDictType = {
+    dictStringObjHash,         /* hash function */
+    NULL,                      /* key dup */
+    NULL,                      /* val dup */
+    dictStringObjKeyCompare,   /* key compare */
+    NULL,                      /* key destructor */
+    NULL                       /* val destructor */
+};
+
 /* Like objectKeyPointerValueDictType(), but values can be destroyed, if
  * not NULL, calling zfree(). */
 dictType objectKeyHeapPointerValueDictType = {
@@ -1310,12 +1373,15 @@ dictType zsetDictType = {
 
 /* Db->dict, keys are sds strings, vals are Redis objects. */
 dictType dbDictType = {
-    dictSdsHash,                /* hash function */
+    dictSdsKeyspaceHash,        /* hash function */
     NULL,                       /* key dup */
     NULL,                       /* val dup */
     dictSdsKeyCompare,          /* key compare */
-    dictSdsDestructor,          /* key destructor */
-    dictObjectDestructor   /* val destructor */
+    NULL,                       /* key destructor, the key is embedded */
+    dictDbValDestructor,        /* val destructor */
+    dictSdsEmbedLen,            /* key embed len */
+    dictSdsEmbed,               /* key embed */
+    dictDbExpandAsync           /* expand async */
 };
 
 /* server.lua_scripts sha (as sds string) -> scripts (as robj) cache. */
@@ -1328,16 +1394,6 @@ dictType shaScriptObjectDictType = {
     dictObjectDestructor        /* val destructor */
 };
 
-/* Db->expires */
-dictType keyptrDictType = {
-    dictSdsHash,                /* hash function */
-    NULL,                       /* key dup */
-    NULL,                       /* val dup */
-    dictSdsKeyCompare,          /* key compare */
-    NULL,                       /* key destructor */
-    NULL                        /* val destructor */
-};
-
 /* Command table. sds string -> command struct pointer. */
 dictType commandTableDictType = {
     dictSdsCaseHash,            /* hash function */
@@ -1348,7 +1404,7 @@ dictType commandTableDictType = {
     NULL                        /* val destructor */
 };
 
-/* Hash type hash table (note that small hashes are represented with ziplists) */
+/* Hash type hash table (note that small hashes are represented with listpacks) */
 dictType hashDictType = {
     dictSdsHash,                /* hash function */
     NULL,                       /* key dup */
@@ -1441,8 +1497,6 @@ int htNeedsResize(dict *dict) {
 void tryResizeHashTables(int dbid) {
     if (htNeedsResize(server.db[dbid].dict))
         dictResize(server.db[dbid].dict);
-    if (htNeedsResize(server.db[dbid].expires))
-        dictResize(server.db[dbid].expires);
 }
 
 /* Our hash table implementation performs rehashing incrementally while
@@ -1458,14 +1512,198 @@ int incrementallyRehash(int dbid) {
         dictRehashMilliseconds(server.db[dbid].dict,1);
         return 1; /* already used our millisecond for this loop... */
     }
-    /* Expires */
-    if (dictIsRehashing(server.db[dbid].expires)) {
-        dictRehashMilliseconds(server.db[dbid].expires,1);
-        return 1; /* already used our millisecond for this loop... */
-    }
     return 0;
 }
 
+/* Growing the dictionary of a big keyspace requires to allocate and zero a
+ * table of many megabytes, that blocks the server for a noticeable time.
+ * With async-rehashing enabled such tables are allocated by a bio thread:
+ * meanwhile the dictionary keeps accepting keys over the 1:1 load factor,
+ * and the new table is installed by databasesCron() once it is ready. */
+#define DICT_ASYNC_EXPAND_MIN_SIZE (1<<20) /* In buckets. */
+
+typedef struct dictExpandJob {
+    dict *d;            /* Only compared, the dict may be gone meanwhile.
+                           NULL if the job was cancelled. */
+    unsigned long size;
+    dictEntry **table;  /* Set by the bio thread when done. */
+} dictExpandJob;
+
+static list *dict_expand_jobs = NULL;
+static pthread_mutex_t dict_expand_mutex = PTHREAD_MUTEX_INITIALIZER;
+
+/* The expandAsync() method of the keyspace dictionary type. */
+int dictDbExpandAsync(dict *d, unsigned long size) {
+    listIter li;
+    listNode *ln;
+
+    if (!server.async_rehashing || size < DICT_ASYNC_EXPAND_MIN_SIZE)
+        return 0;
+
+    if (dict_expand_jobs == NULL) dict_expand_jobs = listCreate();
+    listRewind(dict_expand_jobs,&li);
+    while((ln = listNext(&li))) {
+        dictExpandJob *job = listNodeValue(ln);
+        if (job->d == d) return 1; /* Already requested. */
+    }
+
+    dictExpandJob *job = zmalloc(sizeof(*job));
+    job->d = d;
+    job->size = size;
+    job->table = NULL;
+    listAddNodeTail(dict_expand_jobs,job);
+    bioCreateBackgroundJob(BIO_HT_ALLOC,job,NULL,NULL);
+    return 1;
+}
+
+/* Cancel the pending expand requests of 'd', that is going to be emptied or
+ * released. This must be called before the dict is released, otherwise a
+ * new dict allocated at the same address could get the table. The tables
+ * of cancelled jobs are freed by dictInstallExpandedTables() when ready. */
+void dictCancelExpandJobs(dict *d) {
+    listIter li;
+    listNode *ln;
+
+    if (dict_expand_jobs == NULL) return;
+    listRewind(dict_expand_jobs,&li);
+    while((ln = listNext(&li))) {
+        dictExpandJob *job = listNodeValue(ln);
+        if (job->d == d) job->d = NULL;
+    }
+}
+
+void dictAllocTableFromBioThread(void *arg) {
+    dictExpandJob *job = arg;
+    dictEntry **table = zcalloc(job->size*sizeof(dictEntry*));
+
+    pthread_mutex_lock(&dict_expand_mutex);
+    job->table = table;
+    pthread_mutex_unlock(&dict_expand_mutex);
+}
+
+/* Install the tables allocated by the bio thread. Tables that are no longer
+ * useful, because the dictionary was emptied, resized or released while
+ * the allocation was in progress (see dictCancelExpandJobs()), are just
+ * freed. */
+void dictInstallExpandedTables(void) {
+    listIter li;
+    listNode *ln;
+
+    if (dict_expand_jobs == NULL || listLength(dict_expand_jobs) == 0) return;
+
+    listRewind(dict_expand_jobs,&li);
+    while((ln = listNext(&li))) {
+        dictExpandJob *job = listNodeValue(ln);
+        dictEntry **table;
+        dict *d = NULL;
+        int j;
+
+        pthread_mutex_lock(&dict_expand_mutex);
+        table = job->table;
+        pthread_mutex_unlock(&dict_expand_mutex);
+        if (table == NULL) continue;
+
+        for (j = 0; job->d && j < server.dbnum; j++) {
+            if (server.db[j].dict == job->d) {
+                d = job->d;
+                break;
+            }
+        }
+        if (d == NULL || dictSize(d) == 0 || dictSize(d) < dictSlots(d) ||
+            dictExpandWithTable(d,table,job->size) == DICT_ERR)
+        {
+            zfree(table);
+        }
+        zfree(job);
+        listDelNode(dict_expand_jobs,ln);
+    }
+}
+
+/* Background rehashing: while the main thread is blocked waiting for
+ * events nobody else accesses the keyspace, so a bio thread can use that
+ * time to rehash the dictionaries in bulk. The main thread hands the
+ * keyspace to the bio thread in beforeSleep() and takes it back in
+ * afterSleep(), waiting for the bucket the bio thread is moving, if any.
+ *
+ * The handoff is not performed when modules are loaded, since module
+ * threads may lock the GIL and access the keyspace while the main thread
+ * sleeps, nor when there are children, for the same copy-on-write reasons
+ * we don't rehash in databasesCron(). */
+#define BG_REHASH_BUCKETS_PER_STEP 100
+
+static struct {
+    pthread_mutex_t mutex;
+    pthread_cond_t cond;
+    int stop;       /* The main thread is awake: don't touch the keyspace. */
+    int running;    /* The bio thread is rehashing. */
+    int queued;     /* A job was created and not yet processed. */
+    int active;     /* Main thread only: handoff performed. */
+} bg_rehash = {PTHREAD_MUTEX_INITIALIZER, PTHREAD_COND_INITIALIZER,1,0,0,0};
+
+static int dbNeedsBackgroundRehash(dict *d) {
+    return dictIsRehashing(d) && d->iterators == 0;
+}
+
+void backgroundRehashFromBioThread(void) {
+    int j, stop;
+
+    pthread_mutex_lock(&bg_rehash.mutex);
+    bg_rehash.queued = 0;
+    if (bg_rehash.stop) {
+        pthread_mutex_unlock(&bg_rehash.mutex);
+        return;
+    }
+    bg_rehash.running = 1;
+    pthread_mutex_unlock(&bg_rehash.mutex);
+
+    for (j = 0; j < server.dbnum; j++) {
+        dict *d = server.db[j].dict;
+
+        while (dbNeedsBackgroundRehash(d)) {
+            atomicGet(bg_rehash.stop,stop);
+            if (stop) break;
+            dictRehash(d,BG_REHASH_BUCKETS_PER_STEP);
+        }
+    }
+
+    pthread_mutex_lock(&bg_rehash.mutex);
+    bg_rehash.running = 0;
+    pthread_cond_signal(&bg_rehash.cond);
+    pthread_mutex_unlock(&bg_rehash.mutex);
+}
+
+/* Called before sleeping: let the bio thread rehash if there is work. */
+void backgroundRehashStart(void) {
+    int j;
+
+    if (!server.async_rehashing || moduleCount() ||
+        hasActiveChildProcess()) return;
+    for (j = 0; j < server.dbnum; j++)
+        if (dbNeedsBackgroundRehash(server.db[j].dict)) break;
+    if (j == server.dbnum) return;
+
+    pthread_mutex_lock(&bg_rehash.mutex);
+    atomicSet(bg_rehash.stop,0);
+    if (!bg_rehash.queued) {
+        bg_rehash.queued = 1;
+        bioCreateBackgroundJob(BIO_REHASH,NULL,NULL,NULL);
+    }
+    pthread_mutex_unlock(&bg_rehash.mutex);
+    bg_rehash.active = 1;
+}
+
+/* Called after sleeping: take the keyspace back from the bio thread. A job
+ * that was not yet processed will find the stop flag set and do nothing. */
+void backgroundRehashStop(void) {
+    if (!bg_rehash.active) return;
+    pthread_mutex_lock(&bg_rehash.mutex);
+    atomicSet(bg_rehash.stop,1);
+    while (bg_rehash.running)
+        pthread_cond_wait(&bg_rehash.cond,&bg_rehash.mutex);
+    pthread_mutex_unlock(&bg_rehash.mutex);
+    bg_rehash.active = 0;
+}
+
 /* This function is called once a background process of some kind terminates,
  * as we want to avoid resizing the hash tables when there is a child in order
  * to play well with copy-on-write (otherwise when a resize happens lots of
@@ -1567,6 +1805,19 @@ int clientsCronResizeQueryBuffer(client *c) {
     return 0;
 }
 
+/* Idle clients give back their empty reply and query buffers to the pools,
+ * so that many idle connections don't keep tens of kilobytes each. Clients
+ * get buffers from the pools again as soon as they need them. */
+int clientsCronReleaseBuffers(client *c) {
+    time_t idletime = server.unixtime - c->lastinteraction;
+
+    if (idletime > 2) {
+        releaseClientReplyBuffer(c);
+        releaseClientQueryBuffer(c);
+    }
+    return 0; /* This function never terminates the client. */
+}
+
 /* This function is used in order to track clients using the biggest amount
  * of memory in the latest few seconds. This way we can provide such information
  * in the INFO output (clients section), without having to do an O(N) scan for
@@ -1621,6 +1872,7 @@ int clientsCronTrackClientsMemUsage(client *c) {
     mem += getClientOutputBufferMemoryUsage(c);
     mem += sdsAllocSize(c->querybuf);
     mem += sizeof(client);
+    if (c->buf) mem += PROTO_REPLY_CHUNK_BYTES;
     /* Now that we have the memory used by the client, remove the old
      * value from the old categoty, and add it back. */
     server.stat_clients_type_memory[c->client_cron_last_memory_type] -=
@@ -1691,6 +1943,7 @@ void clientsCron(void) {
          * terminated. */
         if (clientsCronHandleTimeout(c,now)) continue;
         if (clientsCronResizeQueryBuffer(c)) continue;
+        if (clientsCronReleaseBuffers(c)) continue;
         if (clientsCronTrackExpansiveClients(c)) continue;
         if (clientsCronTrackClientsMemUsage(c)) continue;
     }
@@ -1717,6 +1970,11 @@ void databasesCron(void) {
      * other processes saving the DB on disk. Otherwise rehashing is bad
      * as will cause a lot of copy-on-write of memory pages. */
     if (!hasActiveChildProcess()) {
+        /* Install the hash tables allocated in background, if any. This
+         * starts a rehashing as well, so it is deferred while there are
+         * children: the tables stay in their jobs until then. */
+        dictInstallExpandedTables();
+
         /* We use global counters so if we stop the computation at a given
          * DB we'll be able to start from the successive in the next
          * cron loop iteration. */
@@ -1954,7 +2212,7 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
 
             size = dictSlots(server.db[j].dict);
             used = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            vkeys = expireIndexSize(server.db[j].expires);
             if (used || vkeys) {
                 serverLog(LL_VERBOSE,"DB %d: %lld keys (%lld volatile) in %lld slots HT.",j,used,vkeys,size);
                 /* dictPrintStats(server.dict); */
@@ -1979,6 +2237,9 @@ int serverCron(struct aeEventLoop *eventLoop, long long id, void *clientData) {
     /* Handle background operations on Redis databases. */
     databasesCron();
 
+    /* Evict the interned values no key references anymore. */
+    evictUnusedInternedValues();
+
     /* Start a scheduled AOF rewrite if this was requested by the user while
      * a BGSAVE was in progress. */
     if (!hasActiveChildProcess() &&
@@ -2169,6 +2430,13 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
      * blocking commands. */
     if (moduleCount()) moduleHandleBlockedClients();
 
+    /* Store the results of the ZUNIONSTORE/ZINTERSTORE commands that were
+     * computed in background, and unblock the clients that called them. */
+    zsetStoreHandleCompletedJobs();
+
+    /* Drop the references that had to wait for the lazyfree thread. */
+    lazyfreeReleaseDeferredObjects();
+
     /* Try to process pending commands for clients that were just unblocked. */
     if (listLength(server.unblocked_clients))
         processUnblockedClients();
@@ -2204,6 +2472,9 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
     /* Close clients that need to be closed asynchronous */
     freeClientsInAsyncFreeQueue();
 
+    /* Let the bio thread rehash the keyspace while we sleep. */
+    backgroundRehashStart();
+
     /* Before we are going to sleep, let the threads access the dataset by
      * releasing the GIL. Redis main thread will not touch anything at this
      * time. */
@@ -2216,6 +2487,7 @@ void beforeSleep(struct aeEventLoop *eventLoop) {
 void afterSleep(struct aeEventLoop *eventLoop) {
     UNUSED(eventLoop);
 
+    backgroundRehashStop();
     if (!ProcessingEventsWhileBlocked) {
         if (moduleCount()) moduleAcquireGIL();
     }
@@ -2774,8 +3046,10 @@ void resetServerStats(void) {
     server.stat_numcommands = 0;
     server.stat_numconnections = 0;
     server.stat_expiredkeys = 0;
-    server.stat_expired_stale_perc = 0;
     server.stat_expired_time_cap_reached_count = 0;
+    server.stat_expired_lag_sum = 0;
+    server.stat_expired_lag_samples = 0;
+    server.stat_expired_lag_max = 0;
     server.stat_expire_cycle_time_used = 0;
     server.stat_evictedkeys = 0;
     server.stat_keyspace_misses = 0;
@@ -2794,7 +3068,12 @@ void resetServerStats(void) {
     server.stat_io_reads_processed = 0;
     server.stat_total_reads_processed = 0;
     server.stat_io_writes_processed = 0;
+    server.stat_io_commands_processed = 0;
     server.stat_total_writes_processed = 0;
+    server.stat_reply_buffer_pool_hits = 0;
+    server.stat_reply_buffer_pool_misses = 0;
+    server.stat_query_buffer_pool_hits = 0;
+    server.stat_query_buffer_pool_misses = 0;
     for (j = 0; j < STATS_METRIC_COUNT; j++) {
         server.inst_metric[j].idx = 0;
         server.inst_metric[j].last_sample_time = mstime();
@@ -2808,6 +3087,11 @@ void resetServerStats(void) {
     server.aof_delayed_fsync = 0;
 }
 
+/* Log the errors the event loop recovered from by itself. */
+static void aeApiErrorHandler(const char *msg) {
+    serverLog(LL_WARNING,"Event loop: %s",msg);
+}
+
 void initServer(void) {
     int j;
 
@@ -2851,6 +3135,8 @@ void initServer(void) {
 
     createSharedObjects();
     adjustOpenFilesLimit();
+    aeEnableIoUring(server.io_uring);
+    aeSetApiErrorProc(aeApiErrorHandler);
     server.el = aeCreateEventLoop(server.maxclients+CONFIG_FDSET_INCR);
     if (server.el == NULL) {
         serverLog(LL_WARNING,
@@ -2889,8 +3175,9 @@ void initServer(void) {
     /* Create the Redis databases, and initialize other internal state. */
     for (j = 0; j < server.dbnum; j++) {
         server.db[j].dict = dictCreate(&dbDictType,NULL);
-        server.db[j].expires = dictCreate(&keyptrDictType,NULL);
-        server.db[j].expires_cursor = 0;
+        server.db[j].expires = expireIndexCreate();
+        server.db[j].prefix_index =
+            server.keyspace_prefix_index ? raxNew() : NULL;
         server.db[j].blocking_keys = dictCreate(&keylistDictType,NULL);
         server.db[j].ready_keys = dictCreate(&objectKeyPointerValueDictType,NULL);
         server.db[j].watched_keys = dictCreate(&keylistDictType,NULL);
@@ -2900,6 +3187,10 @@ void initServer(void) {
         listSetFreeMethod(server.db[j].defrag_later,(void (*)(void*))sdsfree);
     }
     evictionPoolAlloc(); /* Initialize the LRU keys pool. */
+    server.interned_values = dictCreate(&internedValuesDictType,NULL);
+    server.intern_candidates = NULL;
+    server.interned_values_unused = 0;
+    server.interned_values_mem = 0;
     server.pubsub_channels = dictCreate(&keylistDictType,NULL);
     server.pubsub_patterns = listCreate();
     server.pubsub_patterns_dict = dictCreate(&keylistDictType,NULL);
@@ -2984,6 +3275,10 @@ void initServer(void) {
                 "blocked clients subsystem.");
     }
 
+    /* Create the pipe used by background ZUNIONSTORE/ZINTERSTORE jobs to
+     * awake the event loop. */
+    zsetStoreInit();
+
     /* Register before and after sleep handlers (note this needs to be done
      * before loading persistence since it is used by processEventsWhileBlocked. */
     aeSetBeforeSleepProc(server.el,beforeSleep);
@@ -4130,6 +4425,7 @@ sds genRedisInfoString(const char *section) {
             "arch_bits:%i\r\n"
             "multiplexing_api:%s\r\n"
             "atomicvar_api:%s\r\n"
+            "hash_function:%s\r\n"
             "gcc_version:%i.%i.%i\r\n"
             "process_id:%I\r\n"
             "run_id:%s\r\n"
@@ -4151,6 +4447,8 @@ sds genRedisInfoString(const char *section) {
             server.arch_bits,
             aeGetApiName(),
             REDIS_ATOMIC_API,
+            server.hash_function == HASH_FUNCTION_AESHASH ?
+                "aeshash" : "siphash",
 #ifdef __GNUC__
             __GNUC__,__GNUC_MINOR__,__GNUC_PATCHLEVEL__,
 #else
@@ -4420,9 +4718,11 @@ sds genRedisInfoString(const char *section) {
             "sync_partial_ok:%lld\r\n"
             "sync_partial_err:%lld\r\n"
             "expired_keys:%lld\r\n"
-            "expired_stale_perc:%.2f\r\n"
             "expired_time_cap_reached_count:%lld\r\n"
             "expire_cycle_cpu_milliseconds:%lld\r\n"
+            "expired_lag_avg_ms:%lld\r\n"
+            "expired_lag_max_ms:%lld\r\n"
+            "expired_pending_lag_ms:%lld\r\n"
             "evicted_keys:%lld\r\n"
             "keyspace_hits:%lld\r\n"
             "keyspace_misses:%lld\r\n"
@@ -4442,7 +4742,12 @@ sds genRedisInfoString(const char *section) {
             "total_reads_processed:%lld\r\n"
             "total_writes_processed:%lld\r\n"
             "io_threaded_reads_processed:%lld\r\n"
-            "io_threaded_writes_processed:%lld\r\n",
+            "io_threaded_writes_processed:%lld\r\n"
+            "io_threaded_commands_processed:%lld\r\n"
+            "reply_buffer_pool_hits:%lld\r\n"
+            "reply_buffer_pool_misses:%lld\r\n"
+            "query_buffer_pool_hits:%lld\r\n"
+            "query_buffer_pool_misses:%lld\r\n",
             server.stat_numconnections,
             server.stat_numcommands,
             getInstantaneousMetric(STATS_METRIC_COMMAND),
@@ -4455,9 +4760,12 @@ sds genRedisInfoString(const char *section) {
             server.stat_sync_partial_ok,
             server.stat_sync_partial_err,
             server.stat_expiredkeys,
-            server.stat_expired_stale_perc*100,
             server.stat_expired_time_cap_reached_count,
             server.stat_expire_cycle_time_used/1000,
+            server.stat_expired_lag_samples ?
+                server.stat_expired_lag_sum/server.stat_expired_lag_samples : 0,
+            server.stat_expired_lag_max,
+            activeExpirePendingLag(mstime()),
             server.stat_evictedkeys,
             server.stat_keyspace_hits,
             server.stat_keyspace_misses,
@@ -4477,7 +4785,12 @@ sds genRedisInfoString(const char *section) {
             server.stat_total_reads_processed,
             server.stat_total_writes_processed,
             server.stat_io_reads_processed,
-            server.stat_io_writes_processed);
+            server.stat_io_writes_processed,
+            server.stat_io_commands_processed,
+            server.stat_reply_buffer_pool_hits,
+            server.stat_reply_buffer_pool_misses,
+            server.stat_query_buffer_pool_hits,
+            server.stat_query_buffer_pool_misses);
     }
 
     /* Replication */
@@ -4621,6 +4934,7 @@ sds genRedisInfoString(const char *section) {
         (long)self_ru.ru_utime.tv_sec, (long)self_ru.ru_utime.tv_usec,
         (long)c_ru.ru_stime.tv_sec, (long)c_ru.ru_stime.tv_usec,
         (long)c_ru.ru_utime.tv_sec, (long)c_ru.ru_utime.tv_usec);
+        info = genIOThreadsInfoString(info);
     }
 
     /* Modules */
@@ -4667,7 +4981,7 @@ sds genRedisInfoString(const char *section) {
             long long keys, vkeys;
 
             keys = dictSize(server.db[j].dict);
-            vkeys = dictSize(server.db[j].expires);
+            vkeys = expireIndexSize(server.db[j].expires);
             if (keys || vkeys) {
                 info = sdscatprintf(info,
                     "db%d:keys=%lld,expires=%lld,avg_ttl=%lld\r\n",
@@ -5127,6 +5441,10 @@ int main(int argc, char **argv) {
             return sha1Test(argc, argv);
         } else if (!strcasecmp(argv[2], "util")) {
             return utilTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "protoscan")) {
+            return protoscanTest(argc, argv);
+        } else if (!strcasecmp(argv[2], "aeshash")) {
+            return aeshashTest(argc, argv);
         } else if (!strcasecmp(argv[2], "endianconv")) {
             return endianconvTest(argc, argv);
         } else if (!strcasecmp(argv[2], "crc64")) {
@@ -64,6 +64,7 @@ typedef long long ustime_t; /* microsecond time type. */
 #include "zmalloc.h" /* total memory usage aware version of malloc/free */
 #include "anet.h"    /* Networking the easy way */
 #include "ziplist.h" /* Compact list data structure */
+#include "listpack.h" /* Compact list data structure, no cascade updates */
 #include "intset.h"  /* Compact integer set structure */
 #include "version.h" /* Version macro */
 #include "util.h"    /* Misc functions useful in many places */
@@ -95,9 +96,13 @@ typedef long long ustime_t; /* microsecond time type. */
 #define CONFIG_MAX_LINE    1024
 #define CRON_DBS_PER_CALL 16
 #define NET_MAX_WRITES_PER_EVENT (1024*64)
+#define NET_MAX_WRITEV_IOVCNT 128 /* Buffers gathered by a single writev. */
 #define PROTO_SHARED_SELECT_CMDS 10
 #define OBJ_SHARED_INTEGERS 10000
 #define OBJ_SHARED_BULKHDR_LEN 32
+#define OBJ_INTERN_VALUE_MAX_LEN 4096 /* Max intern-values-max-len. */
+#define OBJ_INTERN_POOL_MAX 65536 /* Max number of interned values. */
+#define OBJ_INTERN_CANDIDATES 4096 /* Size of the interning candidates table. */
 #define LOG_MAX_LEN    1024 /* Default maximum length of syslog messages.*/
 #define AOF_REWRITE_ITEMS_PER_CMD 64
 #define AOF_READ_DIFF_INTERVAL_BYTES (1024*10)
@@ -137,6 +142,9 @@ typedef long long ustime_t; /* microsecond time type. */
 #define PROTO_MAX_QUERYBUF_LEN  (1024*1024*1024) /* 1GB max query buffer. */
 #define PROTO_IOBUF_LEN         (1024*16)  /* Generic I/O buffer size */
 #define PROTO_REPLY_CHUNK_BYTES (16*1024) /* 16k output buffer */
+#define CLIENT_ARGV_CACHE_SIZE 8 /* Argument objects kept for reuse. */
+#define PROTO_REPLY_REF_MIN_BYTES (16*1024) /* Reference bigger bulk values */
+#define PROTO_REPLY_REF_TAIL_BYTES 64 /* Room after a referenced value */
 #define PROTO_INLINE_MAX_SIZE   (1024*64) /* Max size of inline reads */
 #define PROTO_MBULK_BIG_ARG     (1024*32)
 #define LONG_STR_SIZE      21          /* Bytes needed for long -> str + '\0' */
@@ -273,7 +281,8 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define BLOCKED_MODULE 3  /* Blocked by a loadable module. */
 #define BLOCKED_STREAM 4  /* XREAD. */
 #define BLOCKED_ZSET 5    /* BZPOP et al. */
-#define BLOCKED_NUM 6     /* Number of blocked states. */
+#define BLOCKED_ZSETSTORE 6 /* ZUNIONSTORE/ZINTERSTORE computed in background. */
+#define BLOCKED_NUM 7     /* Number of blocked states. */
 
 /* Client request types */
 #define PROTO_REQ_INLINE 1
@@ -350,11 +359,17 @@ extern int configOOMScoreAdjValuesDefaults[CONFIG_OOM_COUNT];
 #define SUPERVISED_SYSTEMD 2
 #define SUPERVISED_UPSTART 3
 
+/* Hash function of the keyspace dicts, see the hash-function config. */
+#define HASH_FUNCTION_SIPHASH 0
+#define HASH_FUNCTION_AESHASH 1
+
 /* Anti-warning macro... */
 #define UNUSED(V) ((void) V)
 
 #define ZSKIPLIST_MAXLEVEL 32 /* Should be enough for 2^64 elements */
 #define ZSKIPLIST_P 0.25      /* Skiplist P = 1/4 */
+#define ZSKIPLIST_BLOCK 56    /* Elements per node, so that nodes with up
+                                 to 7 levels fit in 1024 bytes. */
 
 /* Append only defines */
 #define AOF_FSYNC_NO 0
@@ -609,6 +624,15 @@ typedef struct RedisModuleDigest {
 #define OBJ_ENCODING_EMBSTR 8  /* Embedded sds string encoding */
 #define OBJ_ENCODING_QUICKLIST 9 /* Encoded as linked list of ziplists */
 #define OBJ_ENCODING_STREAM 10 /* Encoded as a radix tree of listpacks */
+#define OBJ_ENCODING_INLINE 11 /* Short string stored in the ptr field */
+#define OBJ_ENCODING_LISTPACK 12 /* Encoded as a listpack */
+
+/* Strings up to OBJ_INLINE_STRING_MAX bytes not containing null terminators
+ * are stored, null terminated, inside the 'ptr' field of the object itself
+ * when encoded with OBJ_ENCODING_INLINE, so that they need no allocation
+ * other than the object header. */
+#define OBJ_INLINE_STRING_MAX (sizeof(void*)-1)
+#define inlineStringPtr(objptr) ((char*)&(objptr)->ptr)
 
 #define LRU_BITS 24
 #define LRU_CLOCK_MAX ((1<<LRU_BITS)-1) /* Max value of obj->lru */
@@ -616,7 +640,8 @@ typedef struct RedisModuleDigest {
 
 #define OBJ_SHARED_REFCOUNT INT_MAX     /* Global object never destroyed. */
 #define OBJ_STATIC_REFCOUNT (INT_MAX-1) /* Object allocated in the stack. */
-#define OBJ_FIRST_SPECIAL_REFCOUNT OBJ_STATIC_REFCOUNT
+#define OBJ_INTERNED_REFCOUNT (INT_MAX-2) /* Interned value, see object.c. */
+#define OBJ_FIRST_SPECIAL_REFCOUNT OBJ_INTERNED_REFCOUNT
 typedef struct redisObject {
     unsigned type:4;
     unsigned encoding:4;
@@ -646,27 +671,75 @@ char *getObjectTypeName(robj*);
 struct evictionPoolEntry; /* Defined in evict.c */
 
 /* This structure is used in order to represent the output buffer of a client,
- * which is actually a linked list of blocks like that, that is: client->reply. */
+ * which is actually a linked list of blocks like that, that is: client->reply.
+ *
+ * Big bulk values are not copied into the output buffer: the block just
+ * references the string object, that is sent before the content of 'buf'. */
 typedef struct clientReplyBlock {
     size_t size, used;
+    robj *obj;      /* Referenced string object, or NULL. */
     char buf[];
 } clientReplyBlock;
 
+/* Index of the keys with an expire, see the Expires API in db.c. The keys
+ * are linked in lists, one for every bucket of expire times, and the buckets
+ * are stored in a radix tree in time order. */
+typedef struct expireBucket {
+    dictEntry *head;            /* First key of the bucket list. */
+} expireBucket;
+
+typedef struct expireIndex {
+    rax *buckets;               /* Buckets by start time. */
+    unsigned long size;         /* Number of keys with an expire. */
+} expireIndex;
+
+#define expireIndexSize(ei) ((ei)->size)
+
 /* Redis database representation. There are multiple databases identified
  * by integers from 0 (the default database) up to the max configured
  * database. The database number is the 'id' field in the structure. */
 typedef struct redisDb {
     dict *dict;                 /* The keyspace for this DB */
-    dict *expires;              /* Timeout of keys with a timeout set */
+    expireIndex *expires;       /* Keys with a timeout set, by expire time */
+    rax *prefix_index;          /* Copy of all the keys, if keyspace-prefix-index. */
     dict *blocking_keys;        /* Keys with clients waiting for data (BLPOP)*/
     dict *ready_keys;           /* Blocked keys that received a PUSH */
     dict *watched_keys;         /* WATCHED keys for MULTI/EXEC CAS */
     int id;                     /* Database ID */
     long long avg_ttl;          /* Average TTL, just for stats */
-    unsigned long expires_cursor; /* Cursor of the active expire cycle. */
     list *defrag_later;         /* List of key names to attempt to defrag one by one, gradually. */
 } redisDb;
 
+/* The entries of the keyspace dictionary embed the sds of the key, so that
+ * the key name is in the same allocation (and usually the same cache line)
+ * of the entry. The entries of the keys with an expire are larger and store
+ * a dbEntryExpire between the entry and the sds header, so that once the
+ * entry of a key is found its TTL is known without any other lookup, while
+ * persistent keys don't pay for it. The same slot links the key in its
+ * bucket of the expires index, see expireIndexInsert().
+ *
+ * The sds header is right before the key, so the entry has the expire
+ * slot only if the header doesn't start right after the entry. */
+typedef struct dbEntryExpire {
+    long long when;             /* Unix time in milliseconds. */
+    dictEntry *next;            /* Next key of the expires index bucket. */
+    dictEntry **pprev;          /* Pointer to this entry in the bucket. */
+} dbEntryExpire;
+
+#define dbEntryExpireSlot(de) ((dbEntryExpire*)dictMetadata(de))
+
+static inline int dbEntryHasExpire(dictEntry *de) {
+    char *key = dictGetKey(de);
+    return key - sdsHdrSize(key[-1]) != (char*)dictMetadata(de);
+}
+
+/* Return the expire time of the key of the entry, or -1 if the key
+ * has no expire. */
+static inline long long dbEntryGetExpire(dictEntry *de) {
+    if (!dbEntryHasExpire(de)) return -1;
+    return dbEntryExpireSlot(de)->when;
+}
+
 /* Client MULTI/EXEC state */
 typedef struct multiCmd {
     robj **argv;
@@ -715,6 +788,10 @@ typedef struct blockingState {
     void *module_blocked_handle; /* RedisModuleBlockedClient structure.
                                     which is opaque for the Redis core, only
                                     handled in module.c. */
+
+    /* BLOCKED_ZSETSTORE */
+    void *zset_store_job;   /* Background job computing the result of the
+                               ZUNIONSTORE/ZINTERSTORE we are waiting for. */
 } blockingState;
 
 /* The following structure represents a node in the server.ready_keys list,
@@ -797,6 +874,10 @@ typedef struct client {
     size_t querybuf_peak;   /* Recent (100ms or more) peak of querybuf size. */
     int argc;               /* Num of arguments of current command. */
     robj **argv;            /* Arguments of current command. */
+    robj *argv_cache[CLIENT_ARGV_CACHE_SIZE]; /* Freed argument objects,
+                                                 to reuse for the next
+                                                 commands. */
+    int argv_cache_len;     /* Number of objects in argv_cache. */
     struct redisCommand *cmd, *lastcmd;  /* Last command executed. */
     user *user;             /* User associated with this connection. If the
                                user is set to NULL the connection can do
@@ -863,9 +944,10 @@ typedef struct client {
      * before adding it the new value. */
     uint64_t client_cron_last_memory_usage;
     int      client_cron_last_memory_type;
-    /* Response buffer */
+    /* Response buffer of PROTO_REPLY_CHUNK_BYTES, or NULL if idle clients
+     * gave it back to the pool, see clientsCronReleaseBuffers(). */
     int bufpos;
-    char buf[PROTO_REPLY_CHUNK_BYTES];
+    char *buf;
 } client;
 
 struct saveparam {
@@ -896,15 +978,22 @@ struct sharedObjectsStruct {
     sds minstring, maxstring;
 };
 
-/* ZSETs use a specialized version of Skiplists */
-typedef struct zskiplistNode {
+/* ZSETs use a specialized version of Skiplists, where every node holds up
+ * to ZSKIPLIST_BLOCK elements, see t_zset.c. */
+typedef struct zskiplistEntry {
     sds ele;
     double score;
+} zskiplistEntry;
+
+typedef struct zskiplistNode {
     struct zskiplistNode *backward;
+    unsigned int count;     /* Number of elements in the node. */
+    int height;             /* Number of levels. */
     struct zskiplistLevel {
         struct zskiplistNode *forward;
-        unsigned long span;
+        unsigned long span; /* Elements after the node, up to 'forward'. */
     } level[];
+    /* The elements array follows the levels. */
 } zskiplistNode;
 
 typedef struct zskiplist {
@@ -913,6 +1002,52 @@ typedef struct zskiplist {
     int level;
 } zskiplist;
 
+/* Position of an element in a skiplist. */
+typedef struct zskiplistPos {
+    zskiplistNode *node;
+    unsigned int offset;
+} zskiplistPos;
+
+#define zslNodeEntries(x) ((zskiplistEntry*)((x)->level+(x)->height))
+#define zslNodeFirst(x) (zslNodeEntries(x))
+#define zslNodeLast(x) (zslNodeEntries(x)+(x)->count-1)
+
+/* Skiplist iteration: zslFirst() and zslLast() return the first and last
+ * element, and zslNext() and zslPrev() the element after and before the
+ * position 'pos', updating it. They return NULL when there are no more
+ * elements, and then 'pos' should not be used anymore. */
+static inline zskiplistEntry *zslFirst(zskiplist *zsl, zskiplistPos *pos) {
+    pos->node = zsl->header->level[0].forward;
+    pos->offset = 0;
+    return pos->node ? zslNodeFirst(pos->node) : NULL;
+}
+
+static inline zskiplistEntry *zslLast(zskiplist *zsl, zskiplistPos *pos) {
+    pos->node = zsl->tail;
+    if (pos->node == NULL) return NULL;
+    pos->offset = pos->node->count-1;
+    return zslNodeEntries(pos->node)+pos->offset;
+}
+
+static inline zskiplistEntry *zslNext(zskiplistPos *pos) {
+    if (++pos->offset == pos->node->count) {
+        pos->node = pos->node->level[0].forward;
+        pos->offset = 0;
+        if (pos->node == NULL) return NULL;
+    }
+    return zslNodeEntries(pos->node)+pos->offset;
+}
+
+static inline zskiplistEntry *zslPrev(zskiplistPos *pos) {
+    if (pos->offset == 0) {
+        pos->node = pos->node->backward;
+        if (pos->node == NULL) return NULL;
+        pos->offset = pos->node->count;
+    }
+    pos->offset--;
+    return zslNodeEntries(pos->node)+pos->offset;
+}
+
 typedef struct zset {
     dict *dict;
     zskiplist *zsl;
@@ -961,6 +1096,7 @@ struct redisMemOverhead {
     size_t clients_normal;
     size_t aof_buffer;
     size_t lua_caches;
+    size_t interned_values;
     size_t overhead_total;
     size_t dataset;
     size_t total_keys;
@@ -980,6 +1116,7 @@ struct redisMemOverhead {
         size_t dbid;
         size_t overhead_ht_main;
         size_t overhead_ht_expires;
+        size_t overhead_prefix_index;
     } *db;
 };
 
@@ -1065,6 +1202,9 @@ struct redisServer {
     _Atomic unsigned int lruclock; /* Clock for LRU eviction */
     int shutdown_asap;          /* SHUTDOWN needed ASAP */
     int activerehashing;        /* Incremental rehash in serverCron() */
+    int async_rehashing;        /* Allocate big tables and rehash in bio. */
+    int keyspace_prefix_index;  /* Also index keys by prefix, using more memory. */
+    int hash_function;          /* HASH_FUNCTION_* of the keyspace dicts. */
     int active_defrag_running;  /* Active defragmentation running (holds current scan aggressiveness) */
     char *pidfile;              /* PID file path */
     int arch_bits;              /* 32 or 64 depending on sizeof(long) */
@@ -1081,6 +1221,9 @@ struct redisServer {
     int module_blocked_pipe[2]; /* Pipe used to awake the event loop if a
                                    client blocked on a module command needs
                                    to be processed. */
+    int zset_store_pipe[2];     /* Pipe used to awake the event loop when a
+                                   background ZUNIONSTORE/ZINTERSTORE is
+                                   done. */
     pid_t module_child_pid;     /* PID of module child */
     /* Networking */
     int port;                   /* TCP listening port */
@@ -1116,6 +1259,8 @@ struct redisServer {
                                    queries. Will still serve RESP2 queries. */
     int io_threads_num;         /* Number of IO threads to use. */
     int io_threads_do_reads;    /* Read and parse from IO threads? */
+    int io_threads_do_commands; /* Execute read only commands from IO threads? */
+    int io_uring;               /* Poll fds with io_uring if possible. */
     int io_threads_active;      /* Is IO threads currently active? */
     long long events_processed_while_blocked; /* processEventsWhileBlocked() */
 
@@ -1136,8 +1281,12 @@ struct redisServer {
     long long stat_numcommands;     /* Number of processed commands */
     long long stat_numconnections;  /* Number of connections received */
     long long stat_expiredkeys;     /* Number of expired keys */
-    double stat_expired_stale_perc; /* Percentage of keys probably expired */
     long long stat_expired_time_cap_reached_count; /* Early expire cylce stops.*/
+    long long stat_expired_lag_sum;     /* Sum of the ms keys were reclaimed
+                                           by the active expire after their
+                                           expire time. */
+    long long stat_expired_lag_samples; /* Keys accounted in the sum above. */
+    long long stat_expired_lag_max;     /* Max lag of a reclaimed key. */
     long long stat_expire_cycle_time_used; /* Cumulative microseconds used. */
     long long stat_evictedkeys;     /* Number of evicted keys (maxmemory) */
     long long stat_keyspace_hits;   /* Number of successful lookups of keys */
@@ -1168,6 +1317,11 @@ struct redisServer {
     long long stat_unexpected_error_replies; /* Number of unexpected (aof-loading, replica to master, etc.) error replies */
     long long stat_io_reads_processed; /* Number of read events processed by IO / Main threads */
     long long stat_io_writes_processed; /* Number of write events processed by IO / Main threads */
+    long long stat_io_commands_processed; /* Number of commands executed by IO / Main threads during threaded reads */
+    long long stat_reply_buffer_pool_hits;   /* Reply buffers taken from the pool. */
+    long long stat_reply_buffer_pool_misses; /* Reply buffers allocated. */
+    long long stat_query_buffer_pool_hits;   /* Query buffers taken from the pool. */
+    long long stat_query_buffer_pool_misses; /* Query buffers allocated. */
     _Atomic long long stat_total_reads_processed; /* Total number of read events processed */
     _Atomic long long stat_total_writes_processed; /* Total number of write events processed */
     /* The following two are used to track instantaneous metrics, like
@@ -1376,17 +1530,28 @@ struct redisServer {
     int sort_bypattern;
     int sort_store;
     /* Zip structure config, see redis.conf for more information  */
-    size_t hash_max_ziplist_entries;
-    size_t hash_max_ziplist_value;
+    size_t hash_max_listpack_entries;
+    size_t hash_max_listpack_value;
     size_t set_max_intset_entries;
-    size_t zset_max_ziplist_entries;
-    size_t zset_max_ziplist_value;
+    size_t set_max_listpack_entries;
+    size_t set_max_listpack_value;
+    size_t zset_max_listpack_entries;
+    size_t zset_max_listpack_value;
+    size_t zset_async_store_min_entries; /* Compute ZUNIONSTORE/ZINTERSTORE
+                                            in background from this many
+                                            input entries. 0 = never. */
     size_t hll_sparse_max_bytes;
     size_t stream_node_max_bytes;
     long long stream_node_max_entries;
     /* List parameters */
     int list_max_ziplist_size;
     int list_compress_depth;
+    /* Interning of string values */
+    size_t intern_values_max_len; /* Max length of interned values, 0 = off. */
+    dict *interned_values;      /* Pool of interned values. */
+    uint64_t *intern_candidates; /* Hashes of values seen once, see object.c */
+    int interned_values_unused; /* Some value may have no key, atomic. */
+    size_t interned_values_mem; /* Memory used by the interned objects. */
     /* time cache */
     _Atomic time_t unixtime;    /* Unix time sampled every cron cycle. */
     time_t timezone;            /* Cached timezone. As set by tzset(). */
@@ -1537,6 +1702,8 @@ typedef struct {
     int encoding;
     int ii; /* intset iterator */
     dictIterator *di;
+    unsigned char *lpi; /* listpack iterator */
+    sds lpele; /* Current listpack element, reused by setTypeNext(). */
 } setTypeIterator;
 
 /* Structure to hold hash iteration abstraction. Note that iteration over
@@ -1553,6 +1720,38 @@ typedef struct {
     dictEntry *de;
 } hashTypeIterator;
 
+/* Commands executed by I/O threads can't touch the global stats, so every
+ * thread accumulates them in its own structure: the main thread merges them
+ * into the server stats once all the threads are idle again. See the
+ * "Threaded command execution" section in networking.c. */
+typedef struct ioThreadCommandSample {
+    struct redisCommand *cmd;
+    long long duration;     /* Execution time in microseconds. */
+    client *c;              /* Client that executed the command. */
+    robj **argv;            /* Retained only if the command was slow enough */
+    int argc;               /* to be logged in the slowlog, otherwise NULL. */
+} ioThreadCommandSample;
+
+typedef struct ioThreadStats {
+    long long keyspace_hits;
+    long long keyspace_misses;
+    ioThreadCommandSample *samples;
+    size_t numsamples;      /* Samples collected since the last merge. */
+    size_t samples_size;    /* Number of allocated samples. */
+    /* I/O threads can't touch the objects reference count, so objects
+     * referenced by the reply blocks they release are queued here, and
+     * released later by the main thread. */
+    robj **release;
+    size_t numrelease;
+    size_t release_size;
+    /* The LRU clock shares its word with the type and encoding of the
+     * object, so I/O threads can't update it either: the objects accessed
+     * are queued here, and touched later by the main thread. */
+    robj **touched;
+    size_t numtouched;
+    size_t touched_size;
+} ioThreadStats;
+
 #include "stream.h"  /* Stream data type header file. */
 
 #define OBJ_HASH_KEY 1
@@ -1564,8 +1763,10 @@ typedef struct {
 
 extern struct redisServer server;
 extern struct sharedObjectsStruct shared;
+extern _Thread_local ioThreadStats *io_thread_stats;
 extern dictType objectKeyPointerValueDictType;
 extern dictType objectKeyHeapPointerValueDictType;
+extern dictType internedValuesDictType;
 extern dictType setDictType;
 extern dictType zsetDictType;
 extern dictType clusterNodesDictType;
@@ -1575,7 +1776,6 @@ extern dictType shaScriptObjectDictType;
 extern double R_Zero, R_PosInf, R_NegInf, R_Nan;
 extern dictType hashDictType;
 extern dictType replScriptCacheDictType;
-extern dictType keyptrDictType;
 extern dictType modulesDictType;
 
 /*-----------------------------------------------------------------------------
@@ -1600,6 +1800,7 @@ void moduleAcquireGIL(void);
 void moduleReleaseGIL(void);
 void moduleNotifyKeyspaceEvent(int type, const char *event, robj *key, int dbid);
 void moduleCallCommandFilters(client *c);
+int moduleHasCommandFilters(void);
 void ModuleForkDoneHandler(int exitcode, int bysignal);
 int TerminateModuleForkChild(int child_pid, int wait);
 ssize_t rdbSaveModulesAux(rio *rdb, int when);
@@ -1672,6 +1873,9 @@ void addReplyHelp(client *c, const char **help);
 void addReplySubcommandSyntaxError(client *c);
 void addReplyLoadedModules(client *c);
 void copyClientOutputBuffer(client *dst, client *src);
+void releaseClientReplyBuffer(client *c);
+void releaseClientQueryBuffer(client *c);
+size_t getClientBufferPoolSize(void);
 size_t sdsZmallocSize(sds s);
 size_t getStringObjectSdsUsedMemory(robj *o);
 void freeClientReplyValue(void *o);
@@ -1700,6 +1904,8 @@ int handleClientsWithPendingWrites(void);
 int handleClientsWithPendingWritesUsingThreads(void);
 int handleClientsWithPendingReadsUsingThreads(void);
 int stopThreadedIOIfNeeded(void);
+int ioThreadTryProcessCommand(client *c);
+sds genIOThreadsInfoString(sds info);
 int clientHasPendingReplies(client *c);
 void unlinkClient(client *c);
 int writeToClient(client *c, int handler_installed);
@@ -1748,6 +1954,7 @@ void unblockClientWaitingData(client *c);
 void popGenericCommand(client *c, int where);
 
 /* MULTI/EXEC/WATCH... */
+void watchForKey(client *c, robj *key);
 void unwatchAllKeys(client *c);
 void initClientMultiState(client *c);
 void freeClientMultiState(client *c);
@@ -1775,12 +1982,19 @@ robj *createObject(int type, void *ptr);
 robj *createStringObject(const char *ptr, size_t len);
 robj *createRawStringObject(const char *ptr, size_t len);
 robj *createEmbeddedStringObject(const char *ptr, size_t len);
+robj *createInlineStringObject(const char *ptr, size_t len);
+robj *recycleStringObject(robj *o, const char *ptr, size_t len);
 robj *dupStringObject(const robj *o);
 int isSdsRepresentableAsLongLong(sds s, long long *llval);
 int isObjectRepresentableAsLongLong(robj *o, long long *llongval);
 robj *tryObjectEncoding(robj *o);
+void retainInternedValue(robj *o);
+void releaseInternedValue(robj *o);
+void evictUnusedInternedValues(void);
+void freeInternedValue(robj *o);
 robj *getDecodedObject(robj *o);
 size_t stringObjectLen(robj *o);
+char *stringObjectPtrLen(robj *o, size_t *len, char *buf);
 robj *createStringObjectFromLongLong(long long value);
 robj *createStringObjectFromLongLongForValue(long long value);
 robj *createStringObjectFromLongDouble(long double value, int humanfriendly);
@@ -1788,9 +2002,10 @@ robj *createQuicklistObject(void);
 robj *createZiplistObject(void);
 robj *createSetObject(void);
 robj *createIntsetObject(void);
+robj *createSetListpackObject(void);
 robj *createHashObject(void);
 robj *createZsetObject(void);
-robj *createZsetZiplistObject(void);
+robj *createZsetListpackObject(void);
 robj *createStreamObject(void);
 robj *createModuleObject(moduleType *mt, void *value);
 int getLongFromObjectOrReply(client *c, robj *o, long *target, const char *msg);
@@ -1950,11 +2165,12 @@ typedef struct {
 
 zskiplist *zslCreate(void);
 void zslFree(zskiplist *zsl);
-zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele);
+void zslInsert(zskiplist *zsl, double score, sds ele);
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score);
-int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node);
-zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range);
-zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range);
+int zslDelete(zskiplist *zsl, double score, sds ele);
+zskiplistEntry *zslFirstInRange(zskiplist *zsl, zrangespec *range, zskiplistPos *pos);
+zskiplistEntry *zslLastInRange(zskiplist *zsl, zrangespec *range, zskiplistPos *pos);
+zskiplistEntry *zslGetElementByRank(zskiplist *zsl, unsigned long rank, zskiplistPos *pos);
 double zzlGetScore(unsigned char *sptr);
 void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
 void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr);
@@ -1962,22 +2178,26 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range);
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range);
 unsigned long zsetLength(const robj *zobj);
 void zsetConvert(robj *zobj, int encoding);
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen);
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen);
 int zsetScore(robj *zobj, sds member, double *score);
 unsigned long zslGetRank(zskiplist *zsl, double score, sds o);
 int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore);
 long zsetRank(robj *zobj, sds ele, int reverse);
 int zsetDel(robj *zobj, sds ele);
+void zsetInsert(zset *zs, double score, sds ele);
 void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey, robj *countarg);
-sds ziplistGetObject(unsigned char *sptr);
+void zsetStoreInit(void);
+void zsetStoreHandleCompletedJobs(void);
+void unblockClientFromZsetStore(client *c);
+sds lpGetObject(unsigned char *sptr);
 int zslValueGteMin(double value, zrangespec *spec);
 int zslValueLteMax(double value, zrangespec *spec);
 void zslFreeLexRange(zlexrangespec *spec);
 int zslParseLexRange(robj *min, robj *max, zlexrangespec *spec);
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range);
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range);
-zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range);
-zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range);
+zskiplistEntry *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range, zskiplistPos *pos);
+zskiplistEntry *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range, zskiplistPos *pos);
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec);
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec);
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
@@ -1989,6 +2209,8 @@ size_t freeMemoryGetNotCountedMemory();
 int freeMemoryIfNeeded(void);
 int freeMemoryIfNeededAndSafe(void);
 int processCommand(client *c);
+void rejectCommand(client *c, robj *reply);
+void rejectCommandFormat(client *c, const char *fmt, ...);
 void setupSignalHandlers(void);
 void removeSignalHandlers(void);
 struct redisCommand *lookupCommand(sds name);
@@ -2015,6 +2237,11 @@ void serverLogFromHandler(int level, const char *msg);
 void usage(void);
 void updateDictResizePolicy(void);
 int htNeedsResize(dict *dict);
+int dictDbExpandAsync(dict *d, unsigned long size);
+void dictInstallExpandedTables(void);
+void dictCancelExpandJobs(dict *d);
+void backgroundRehashStart(void);
+void backgroundRehashStop(void);
 void populateCommandTable(void);
 void resetCommandTableStats(void);
 void adjustOpenFilesLimit(void);
@@ -2062,7 +2289,7 @@ unsigned long hashTypeLength(const robj *o);
 hashTypeIterator *hashTypeInitIterator(robj *subject);
 void hashTypeReleaseIterator(hashTypeIterator *hi);
 int hashTypeNext(hashTypeIterator *hi);
-void hashTypeCurrentFromZiplist(hashTypeIterator *hi, int what,
+void hashTypeCurrentFromListpack(hashTypeIterator *hi, int what,
                                 unsigned char **vstr,
                                 unsigned int *vlen,
                                 long long *vll);
@@ -2101,9 +2328,21 @@ void propagateExpire(redisDb *db, robj *key, int lazy);
 int expireIfNeeded(redisDb *db, robj *key);
 long long getExpire(redisDb *db, robj *key);
 void setExpire(client *c, redisDb *db, robj *key, long long when);
+#define EXPIRE_INDEX_KEYLEN 9
+expireIndex *expireIndexCreate(void);
+void expireIndexRelease(expireIndex *ei);
+void expireIndexInsert(redisDb *db, dictEntry *de);
+void expireIndexRemove(redisDb *db, dictEntry *de);
+void expireIndexMoveEntry(dictEntry *de);
+int expireIndexGetSomeKeys(redisDb *db, dictEntry **des, int count, int soonest);
+long long expireIndexFirstFineTime(redisDb *db, long long now);
+dictEntry *expireIndexFirstDue(redisDb *db, long long now, int *coarse);
+#define expireIndexNext(de) (dbEntryExpireSlot(de)->next)
 int checkAlreadyExpired(long long when);
 robj *lookupKey(redisDb *db, robj *key, int flags);
 robj *lookupKeyRead(redisDb *db, robj *key);
+void lookupKeysRead(redisDb *db, robj **keys, int count, robj **vals);
+void dbPrefetchKeys(redisDb *db, robj **keys, int count, int step);
 robj *lookupKeyWrite(redisDb *db, robj *key);
 robj *lookupKeyReadOrReply(client *c, robj *key, robj *reply);
 robj *lookupKeyWriteOrReply(client *c, robj *key, robj *reply);
@@ -2146,10 +2385,15 @@ int parseScanCursorOrReply(client *c, robj *o, unsigned long *cursor);
 void slotToKeyAdd(sds key);
 void slotToKeyDel(sds key);
 void slotToKeyFlush(void);
+void prefixIndexAdd(redisDb *db, sds key);
+void prefixIndexDel(redisDb *db, sds key);
 int dbAsyncDelete(redisDb *db, robj *key);
 void emptyDbAsync(redisDb *db);
 void slotToKeyFlushAsync(void);
+void freeInternedValuesAsync(dict *d);
 size_t lazyfreeGetPendingObjectsCount(void);
+void decrRefCountLazyfreeSafe(robj *o);
+void lazyfreeReleaseDeferredObjects(void);
 void freeObjAsync(robj *o);
 
 /* API to get key arguments from commands */
@@ -2213,6 +2457,7 @@ int clientsCronHandleTimeout(client *c, mstime_t now_ms);
 
 /* expire.c -- Handling of expired keys */
 void activeExpireCycle(int type);
+long long activeExpirePendingLag(long long now);
 void expireSlaveKeys(void);
 void rememberSlaveKeyWithExpire(redisDb *db, robj *key);
 void flushSlaveKeysWithExpireList(void);
@@ -2227,6 +2472,7 @@ unsigned long LFUDecrAndReturn(robj *o);
 
 /* Keys hashing / comparison functions for dict.c hash tables. */
 uint64_t dictSdsHash(const void *key);
+uint64_t dictSdsKeyspaceHash(const void *key);
 int dictSdsKeyCompare(void *privdata, const void *key1, const void *key2);
 void dictSdsDestructor(void *privdata, void *val);
 
@@ -80,7 +80,8 @@ slowlogEntry *slowlogCreateEntry(client *c, robj **argv, int argc, long long dur
                  * end shared with string objects stored into keys. Having
                  * shared objects between any part of Redis, and the data
                  * structure holding the data, is a problem: FLUSHALL ASYNC
-                 * may release the shared string object and create a race. */
+                 * may release the shared string object and create a race.
+                 * Interned values are freed once no key references them. */
                 se->argv[j] = dupStringObject(argv[j]);
             }
         }
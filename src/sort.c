@@ -33,7 +33,7 @@
 #include "pqsort.h" /* Partial qsort for SORT+LIMIT */
 #include <math.h> /* isnan() */
 
-zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank);
+zskiplistEntry* zslGetElementByRank(zskiplist *zsl, unsigned long rank, zskiplistPos *pos);
 
 redisSortOperation *createSortOperation(int type, robj *pattern) {
     redisSortOperation *so = zmalloc(sizeof(*so));
@@ -405,7 +405,8 @@ void sortCommand(client *c) {
 
         zset *zs = sortval->ptr;
         zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zskiplistEntry *ln;
+        zskiplistPos pos;
         sds sdsele;
         int rangelen = vectorlen;
 
@@ -413,13 +414,15 @@ void sortCommand(client *c) {
         if (desc) {
             long zsetlen = dictSize(((zset*)sortval->ptr)->dict);
 
-            ln = zsl->tail;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,zsetlen-start);
+                ln = zslGetElementByRank(zsl,zsetlen-start,&pos);
+            else
+                ln = zslLast(zsl,&pos);
         } else {
-            ln = zsl->header->level[0].forward;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
+                ln = zslGetElementByRank(zsl,start+1,&pos);
+            else
+                ln = zslFirst(zsl,&pos);
         }
 
         while(rangelen--) {
@@ -429,7 +432,7 @@ void sortCommand(client *c) {
             vector[j].u.score = 0;
             vector[j].u.cmpobj = NULL;
             j++;
-            ln = desc ? ln->backward : ln->level[0].forward;
+            ln = desc ? zslPrev(&pos) : zslNext(&pos);
         }
         /* Fix start/end: output code is not aware of this optimization. */
         end -= start;
@@ -478,10 +481,18 @@ void sortCommand(client *c) {
                     {
                         int_conversion_error = 1;
                     }
+                } else if (byval->encoding == OBJ_ENCODING_INLINE) {
+                    char *eptr;
+
+                    vector[j].u.score = strtod(inlineStringPtr(byval),&eptr);
+                    if (eptr[0] != '\0' || errno == ERANGE ||
+                        isnan(vector[j].u.score))
+                    {
+                        int_conversion_error = 1;
+                    }
                 } else if (byval->encoding == OBJ_ENCODING_INT) {
                     /* Don't need to decode the object if it's
-                     * integer-encoded (the only encoding supported) so
-                     * far. We can just cast it */
+                     * integer-encoded. We can just cast it */
                     vector[j].u.score = (long)byval->ptr;
                 } else {
                     serverAssertWithInfo(c,sortval,1 != 1);
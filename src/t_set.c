@@ -36,12 +36,21 @@
 void sunionDiffGenericCommand(client *c, robj **setkeys, int setnum,
                               robj *dstkey, int op);
 
+/* Return true if a set holding 'size' elements, with a new element of
+ * 'len' bytes, can still be encoded as a listpack. */
+static int setTypeFitsListpack(size_t size, size_t len) {
+    return size <= server.set_max_listpack_entries &&
+           len <= server.set_max_listpack_value;
+}
+
 /* Factory method to return a set that *can* hold "value". When the object has
- * an integer-encodable value, an intset will be returned. Otherwise a regular
- * hash table. */
+ * an integer-encodable value, an intset will be returned. Small strings are
+ * stored in a listpack, otherwise a regular hash table is used. */
 robj *setTypeCreate(sds value) {
     if (isSdsRepresentableAsLongLong(value,NULL) == C_OK)
         return createIntsetObject();
+    if (setTypeFitsListpack(1,sdslen(value)))
+        return createSetListpackObject();
     return createSetObject();
 }
 
@@ -59,6 +68,20 @@ int setTypeAdd(robj *subject, sds value) {
             dictSetVal(ht,de,NULL);
             return 1;
         }
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = subject->ptr;
+        size_t len = sdslen(value);
+
+        if (lpFind(lp,lpFirst(lp),(unsigned char*)value,len,0) != NULL)
+            return 0;
+        if (setTypeFitsListpack(lpLength(lp)+1,len)) {
+            subject->ptr = lpAppend(lp,(unsigned char*)value,len);
+        } else {
+            /* Too big for a listpack: convert, then add. */
+            setTypeConvert(subject,OBJ_ENCODING_HT);
+            serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
+        }
+        return 1;
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             uint8_t success = 0;
@@ -66,17 +89,29 @@ int setTypeAdd(robj *subject, sds value) {
             if (success) {
                 /* Convert to regular set when the intset contains
                  * too many entries. */
-                if (intsetLen(subject->ptr) > server.set_max_intset_entries)
-                    setTypeConvert(subject,OBJ_ENCODING_HT);
+                size_t len = intsetLen(subject->ptr);
+                if (len > server.set_max_intset_entries) {
+                    setTypeConvert(subject,
+                        setTypeFitsListpack(len,LONG_STR_SIZE) ?
+                        OBJ_ENCODING_LISTPACK : OBJ_ENCODING_HT);
+                }
                 return 1;
             }
         } else {
-            /* Failed to get integer from object, convert to regular set. */
-            setTypeConvert(subject,OBJ_ENCODING_HT);
+            /* Failed to get integer from object, convert to a listpack
+             * if the new element fits, or to a regular set otherwise. */
+            size_t len = intsetLen(subject->ptr);
+            if (setTypeFitsListpack(len+1,sdslen(value))) {
+                setTypeConvert(subject,OBJ_ENCODING_LISTPACK);
+                subject->ptr = lpAppend(subject->ptr,(unsigned char*)value,
+                                        sdslen(value));
+            } else {
+                setTypeConvert(subject,OBJ_ENCODING_HT);
 
-            /* The set *was* an intset and this value is not integer
-             * encodable, so dictAdd should always work. */
-            serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
+                /* The set *was* an intset and this value is not integer
+                 * encodable, so dictAdd should always work. */
+                serverAssert(dictAdd(subject->ptr,sdsdup(value),NULL) == DICT_OK);
+            }
             return 1;
         }
     } else {
@@ -92,6 +127,14 @@ int setTypeRemove(robj *setobj, sds value) {
             if (htNeedsResize(setobj->ptr)) dictResize(setobj->ptr);
             return 1;
         }
+    } else if (setobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = setobj->ptr;
+        unsigned char *p = lpFind(lp,lpFirst(lp),(unsigned char*)value,
+                                  sdslen(value),0);
+        if (p != NULL) {
+            setobj->ptr = lpDelete(lp,p,NULL);
+            return 1;
+        }
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             int success;
@@ -108,6 +151,10 @@ int setTypeIsMember(robj *subject, sds value) {
     long long llval;
     if (subject->encoding == OBJ_ENCODING_HT) {
         return dictFind((dict*)subject->ptr,value) != NULL;
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = subject->ptr;
+        return lpFind(lp,lpFirst(lp),(unsigned char*)value,
+                      sdslen(value),0) != NULL;
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         if (isSdsRepresentableAsLongLong(value,&llval) == C_OK) {
             return intsetFind((intset*)subject->ptr,llval);
@@ -124,6 +171,9 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
     si->encoding = subject->encoding;
     if (si->encoding == OBJ_ENCODING_HT) {
         si->di = dictGetIterator(subject->ptr);
+    } else if (si->encoding == OBJ_ENCODING_LISTPACK) {
+        si->lpi = NULL;
+        si->lpele = NULL;
     } else if (si->encoding == OBJ_ENCODING_INTSET) {
         si->ii = 0;
     } else {
@@ -135,16 +185,32 @@ setTypeIterator *setTypeInitIterator(robj *subject) {
 void setTypeReleaseIterator(setTypeIterator *si) {
     if (si->encoding == OBJ_ENCODING_HT)
         dictReleaseIterator(si->di);
+    else if (si->encoding == OBJ_ENCODING_LISTPACK)
+        sdsfree(si->lpele);
     zfree(si);
 }
 
+/* Store the listpack element at 'p' into 'buf', reusing its allocation
+ * when possible, and return the resulting SDS string. */
+static sds setTypeListpackElement(sds buf, unsigned char *p) {
+    unsigned int slen;
+    long long lval;
+    unsigned char *vstr = lpGetValue(p,&slen,&lval);
+
+    if (buf == NULL) buf = sdsempty();
+    if (vstr) return sdscpylen(buf,(char*)vstr,slen);
+    sdsclear(buf);
+    return sdscatfmt(buf,"%I",lval);
+}
+
 /* Move to the next entry in the set. Returns the object at the current
  * position.
  *
  * Since set elements can be internally be stored as SDS strings or
  * simple arrays of integers, setTypeNext returns the encoding of the
  * set object you are iterating, and will populate the appropriate pointer
- * (sdsele) or (llele) accordingly.
+ * (sdsele) or (llele) accordingly. Listpack elements are returned as SDS
+ * strings owned by the iterator, only valid until the next call.
  *
  * Note that both the sdsele and llele pointers should be passed and cannot
  * be NULL since the function will try to defensively populate the non
@@ -157,6 +223,13 @@ int setTypeNext(setTypeIterator *si, sds *sdsele, int64_t *llele) {
         if (de == NULL) return -1;
         *sdsele = dictGetKey(de);
         *llele = -123456789; /* Not needed. Defensive. */
+    } else if (si->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = si->subject->ptr;
+        si->lpi = si->lpi ? lpNext(lp,si->lpi) : lpFirst(lp);
+        if (si->lpi == NULL) return -1;
+        si->lpele = setTypeListpackElement(si->lpele,si->lpi);
+        *sdsele = si->lpele;
+        *llele = -123456789; /* Not needed. Defensive. */
     } else if (si->encoding == OBJ_ENCODING_INTSET) {
         if (!intsetGet(si->subject->ptr,si->ii++,llele))
             return -1;
@@ -185,6 +258,7 @@ sds setTypeNextObject(setTypeIterator *si) {
         case OBJ_ENCODING_INTSET:
             return sdsfromlonglong(intele);
         case OBJ_ENCODING_HT:
+        case OBJ_ENCODING_LISTPACK:
             return sdsdup(sdsele);
         default:
             serverPanic("Unsupported encoding");
@@ -195,12 +269,14 @@ sds setTypeNextObject(setTypeIterator *si) {
 /* Return random element from a non empty set.
  * The returned element can be a int64_t value if the set is encoded
  * as an "intset" blob of integers, or an SDS string if the set
- * is a regular set.
+ * is a regular set or a listpack.
  *
  * The caller provides both pointers to be populated with the right
  * object. The return value of the function is the object->encoding
  * field of the object and is used by the caller to check if the
- * int64_t pointer or the redis object pointer was populated.
+ * int64_t pointer or the redis object pointer was populated. When the
+ * set is a listpack the SDS string is a new one, that the caller should
+ * free with sdsfree().
  *
  * Note that both the sdsele and llele pointers should be passed and cannot
  * be NULL since the function will try to defensively populate the non
@@ -210,6 +286,11 @@ int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
         dictEntry *de = dictGetFairRandomKey(setobj->ptr);
         *sdsele = dictGetKey(de);
         *llele = -123456789; /* Not needed. Defensive. */
+    } else if (setobj->encoding == OBJ_ENCODING_LISTPACK) {
+        unsigned char *lp = setobj->ptr;
+        unsigned char *p = lpSeek(lp,random() % lpLength(lp));
+        *sdsele = setTypeListpackElement(NULL,p);
+        *llele = -123456789; /* Not needed. Defensive. */
     } else if (setobj->encoding == OBJ_ENCODING_INTSET) {
         *llele = intsetRandom(setobj->ptr);
         *sdsele = NULL; /* Not needed. Defensive. */
@@ -222,6 +303,8 @@ int setTypeRandomElement(robj *setobj, sds *sdsele, int64_t *llele) {
 unsigned long setTypeSize(const robj *subject) {
     if (subject->encoding == OBJ_ENCODING_HT) {
         return dictSize((const dict*)subject->ptr);
+    } else if (subject->encoding == OBJ_ENCODING_LISTPACK) {
+        return lpLength(subject->ptr);
     } else if (subject->encoding == OBJ_ENCODING_INTSET) {
         return intsetLen((const intset*)subject->ptr);
     } else {
@@ -229,33 +312,48 @@ unsigned long setTypeSize(const robj *subject) {
     }
 }
 
-/* Convert the set to specified encoding. The resulting dict (when converting
- * to a hash table) is presized to hold the number of elements in the original
- * set. */
+/* Convert the set to specified encoding. An intset can be converted to a
+ * listpack or to a hash table, a listpack only to a hash table. The
+ * resulting dict (when converting to a hash table) is presized to hold the
+ * number of elements in the original set. */
 void setTypeConvert(robj *setobj, int enc) {
     setTypeIterator *si;
+    sds element;
     serverAssertWithInfo(NULL,setobj,setobj->type == OBJ_SET &&
-                             setobj->encoding == OBJ_ENCODING_INTSET);
+                             setobj->encoding != OBJ_ENCODING_HT &&
+                             setobj->encoding != enc);
 
     if (enc == OBJ_ENCODING_HT) {
-        int64_t intele;
         dict *d = dictCreate(&setDictType,NULL);
-        sds element;
 
         /* Presize the dict to avoid rehashing */
-        dictExpand(d,intsetLen(setobj->ptr));
+        dictExpand(d,setTypeSize(setobj));
 
         /* To add the elements we extract integers and create redis objects */
         si = setTypeInitIterator(setobj);
-        while (setTypeNext(si,&element,&intele) != -1) {
-            element = sdsfromlonglong(intele);
+        while ((element = setTypeNextObject(si)) != NULL)
             serverAssert(dictAdd(d,element,NULL) == DICT_OK);
-        }
         setTypeReleaseIterator(si);
 
+        freeSetObject(setobj);
         setobj->encoding = OBJ_ENCODING_HT;
-        zfree(setobj->ptr);
         setobj->ptr = d;
+    } else if (enc == OBJ_ENCODING_LISTPACK &&
+               setobj->encoding == OBJ_ENCODING_INTSET)
+    {
+        unsigned char *lp = lpNew();
+        int64_t intele;
+        int ii = 0;
+
+        while (intsetGet(setobj->ptr,ii++,&intele)) {
+            char buf[LONG_STR_SIZE];
+            int len = ll2string(buf,sizeof(buf),intele);
+            lp = lpAppend(lp,(unsigned char*)buf,len);
+        }
+
+        zfree(setobj->ptr);
+        setobj->encoding = OBJ_ENCODING_LISTPACK;
+        setobj->ptr = lp;
     } else {
         serverPanic("Unsupported set conversion");
     }
@@ -499,6 +597,7 @@ void spopWithCountCommand(client *c) {
                 addReplyBulkCBuffer(c,sdsele,sdslen(sdsele));
                 objele = createStringObject(sdsele,sdslen(sdsele));
                 setTypeRemove(set,sdsele);
+                if (encoding == OBJ_ENCODING_LISTPACK) sdsfree(sdsele);
             }
 
             /* Replicate/AOF this command as an SREM operation */
@@ -523,7 +622,7 @@ void spopWithCountCommand(client *c) {
             encoding = setTypeRandomElement(set,&sdsele,&llele);
             if (encoding == OBJ_ENCODING_INTSET) {
                 sdsele = sdsfromlonglong(llele);
-            } else {
+            } else if (encoding == OBJ_ENCODING_HT) {
                 sdsele = sdsdup(sdsele);
             }
             if (!newset) newset = setTypeCreate(sdsele);
@@ -595,6 +694,7 @@ void spopCommand(client *c) {
     } else {
         ele = createStringObject(sdsele,sdslen(sdsele));
         setTypeRemove(set,ele->ptr);
+        if (encoding == OBJ_ENCODING_LISTPACK) sdsfree(sdsele);
     }
 
     notifyKeyspaceEvent(NOTIFY_SET,"spop",c->argv[1],c->db->id);
@@ -670,6 +770,7 @@ void srandmemberWithCountCommand(client *c) {
                 addReplyBulkLongLong(c,llele);
             } else {
                 addReplyBulkCBuffer(c,ele,sdslen(ele));
+                if (encoding == OBJ_ENCODING_LISTPACK) sdsfree(ele);
             }
         }
         return;
@@ -737,6 +838,7 @@ void srandmemberWithCountCommand(client *c) {
                 objele = createStringObjectFromLongLong(llele);
             } else {
                 objele = createStringObject(ele,sdslen(ele));
+                if (encoding == OBJ_ENCODING_LISTPACK) sdsfree(ele);
             }
             /* Try to add the object to the dictionary. If it already exists
              * free it, otherwise increment the number of objects we have
@@ -784,6 +886,7 @@ void srandmemberCommand(client *c) {
         addReplyBulkLongLong(c,llele);
     } else {
         addReplyBulkCBuffer(c,ele,sdslen(ele));
+        if (encoding == OBJ_ENCODING_LISTPACK) sdsfree(ele);
     }
 }
 
@@ -872,7 +975,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
                 /* in order to compare an integer with an object we
                  * have to use the generic function, creating an object
                  * for this */
-                } else if (sets[j]->encoding == OBJ_ENCODING_HT) {
+                } else if (sets[j]->encoding != OBJ_ENCODING_INTSET) {
                     elesds = sdsfromlonglong(intobj);
                     if (!setTypeIsMember(sets[j],elesds)) {
                         sdsfree(elesds);
@@ -880,7 +983,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
                     }
                     sdsfree(elesds);
                 }
-            } else if (encoding == OBJ_ENCODING_HT) {
+            } else {
                 if (!setTypeIsMember(sets[j],elesds)) {
                     break;
                 }
@@ -890,7 +993,7 @@ void sinterGenericCommand(client *c, robj **setkeys,
         /* Only take action when all sets contain the member */
         if (j == setnum) {
             if (!dstkey) {
-                if (encoding == OBJ_ENCODING_HT)
+                if (encoding != OBJ_ENCODING_INTSET)
                     addReplyBulkCBuffer(c,elesds,sdslen(elesds));
                 else
                     addReplyBulkLongLong(c,intobj);
@@ -260,13 +260,7 @@ void getrangeCommand(client *c) {
     if ((o = lookupKeyReadOrReply(c,c->argv[1],shared.emptybulk)) == NULL ||
         checkType(c,o,OBJ_STRING)) return;
 
-    if (o->encoding == OBJ_ENCODING_INT) {
-        str = llbuf;
-        strlen = ll2string(llbuf,sizeof(llbuf),(long)o->ptr);
-    } else {
-        str = o->ptr;
-        strlen = sdslen(str);
-    }
+    str = stringObjectPtrLen(o,&strlen,llbuf);
 
     /* Convert negative indexes */
     if (start < 0 && end < 0 && start > end) {
@@ -289,18 +283,23 @@ void getrangeCommand(client *c) {
 }
 
 void mgetCommand(client *c) {
-    int j;
+    robj *vals[DICT_BATCH_SIZE];
+    int j, k, n;
 
     addReplyArrayLen(c,c->argc-1);
-    for (j = 1; j < c->argc; j++) {
-        robj *o = lookupKeyRead(c->db,c->argv[j]);
-        if (o == NULL) {
-            addReplyNull(c);
-        } else {
-            if (o->type != OBJ_STRING) {
+    for (j = 1; j < c->argc; j += n) {
+        n = c->argc-j < DICT_BATCH_SIZE ? c->argc-j : DICT_BATCH_SIZE;
+        lookupKeysRead(c->db,c->argv+j,n,vals);
+        for (k = 0; k < n; k++) {
+            robj *o = vals[k];
+            if (o == NULL) {
                 addReplyNull(c);
             } else {
-                addReplyBulk(c,o);
+                if (o->type != OBJ_STRING) {
+                    addReplyNull(c);
+                } else {
+                    addReplyBulk(c,o);
+                }
             }
         }
     }
@@ -314,6 +313,8 @@ void msetGenericCommand(client *c, int nx) {
         return;
     }
 
+    dbPrefetchKeys(c->db,c->argv+1,(c->argc-1)/2,2);
+
     /* Handle the NX flag. The MSETNX semantic is to return zero and don't
      * set anything if at least one key alerady exists. */
     if (nx) {
@@ -43,20 +43,34 @@
  * Note that the SDS string representing the element is the same in both
  * the hash table and skiplist in order to save memory. What we do in order
  * to manage the shared SDS string more easily is to free the SDS string
- * only in zslFreeNode(). The dictionary has no value free method set.
- * So we should always remove an element from the dictionary, and later from
- * the skiplist.
+ * only in the skiplist. The dictionary has no key free method set, and
+ * stores the score as the double value of its entries, since the elements
+ * are moved inside the skiplist. So we should always remove an element
+ * from the dictionary, and later from the skiplist.
  *
  * This skiplist implementation is almost a C translation of the original
  * algorithm described by William Pugh in "Skip Lists: A Probabilistic
- * Alternative to Balanced Trees", modified in three ways:
+ * Alternative to Balanced Trees", modified in four ways:
  * a) this implementation allows for repeated scores.
  * b) the comparison is not just by key (our 'score') but by satellite data.
  * c) there is a back pointer, so it's a doubly linked list with the back
  * pointers being only at "level 1". This allows to traverse the list
- * from tail to head, useful for ZREVRANGE. */
+ * from tail to head, useful for ZREVRANGE.
+ * d) every node is a block of up to ZSKIPLIST_BLOCK elements, stored in
+ * order in an array after the levels, and the spans count elements, not
+ * nodes. The nodes are searched by their last element, and then the
+ * element is searched inside the node. This way there are much less nodes
+ * to walk, every element costs just its score and the pointer to its SDS
+ * string, and ranges are read sequentially from memory.
+ *
+ * When an element is added to a full node, the node is split in two halves,
+ * or the element gets a new node if it is added at the head or the tail of
+ * the skiplist, so that adding elements in order fills the nodes. A node is
+ * removed when it gets empty, and a node that is almost empty after a
+ * deletion is merged with the next one if both fit in a single node. */
 
 #include "server.h"
+#include "bio.h"
 #include <math.h>
 
 /*-----------------------------------------------------------------------------
@@ -66,13 +80,16 @@
 int zslLexValueGteMin(sds value, zlexrangespec *spec);
 int zslLexValueLteMax(sds value, zlexrangespec *spec);
 
-/* Create a skiplist node with the specified number of levels.
- * The SDS string 'ele' is referenced by the node after the call. */
-zskiplistNode *zslCreateNode(int level, double score, sds ele) {
+/* Create a skiplist node with the specified number of levels, and room
+ * for 'size' elements. The header is the only node created with no room
+ * for elements. */
+zskiplistNode *zslCreateNode(int level, unsigned int size) {
     zskiplistNode *zn =
-        zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel));
-    zn->score = score;
-    zn->ele = ele;
+        zmalloc(sizeof(*zn)+level*sizeof(struct zskiplistLevel)+
+                size*sizeof(zskiplistEntry));
+    zn->backward = NULL;
+    zn->count = 0;
+    zn->height = level;
     return zn;
 }
 
@@ -84,7 +101,7 @@ zskiplist *zslCreate(void) {
     zsl = zmalloc(sizeof(*zsl));
     zsl->level = 1;
     zsl->length = 0;
-    zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL,0,NULL);
+    zsl->header = zslCreateNode(ZSKIPLIST_MAXLEVEL,0);
     for (j = 0; j < ZSKIPLIST_MAXLEVEL; j++) {
         zsl->header->level[j].forward = NULL;
         zsl->header->level[j].span = 0;
@@ -94,11 +111,12 @@ zskiplist *zslCreate(void) {
     return zsl;
 }
 
-/* Free the specified skiplist node. The referenced SDS string representation
- * of the element is freed too, unless node->ele is set to NULL before calling
- * this function. */
+/* Free the specified skiplist node, and the SDS strings of its elements. */
 void zslFreeNode(zskiplistNode *node) {
-    sdsfree(node->ele);
+    zskiplistEntry *entries = zslNodeEntries(node);
+    unsigned int j;
+
+    for (j = 0; j < node->count; j++) sdsfree(entries[j].ele);
     zfree(node);
 }
 
@@ -126,76 +144,106 @@ int zslRandomLevel(void) {
     return (level<ZSKIPLIST_MAXLEVEL) ? level : ZSKIPLIST_MAXLEVEL;
 }
 
-/* Insert a new node in the skiplist. Assumes the element does not already
- * exist (up to the caller to enforce that). The skiplist takes ownership
- * of the passed SDS string 'ele'. */
-zskiplistNode *zslInsert(zskiplist *zsl, double score, sds ele) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned int rank[ZSKIPLIST_MAXLEVEL];
-    int i, level;
+/* Compare the element 'e' with the one having the specified score and
+ * SDS string, in the order of the skiplist. */
+static inline int zslCompare(zskiplistEntry *e, double score, sds ele) {
+    if (e->score < score) return -1;
+    if (e->score > score) return 1;
+    return sdscmp(e->ele,ele);
+}
+
+/* Seek the node holding the element with the specified score and SDS
+ * string, or the node where it should be added: that is the first node
+ * whose last element is not smaller, or the tail if there is none.
+ *
+ * For every level, update[i] is set to the last node before it having the
+ * level i, and if 'rank' is not NULL, rank[i] is set to the number of
+ * elements up to update[i], the elements of update[i] included.
+ * The function returns NULL only if the skiplist is empty. */
+static zskiplistNode *zslSeek(zskiplist *zsl, double score, sds ele,
+                              zskiplistNode **update, unsigned long *rank)
+{
+    zskiplistNode *x = zsl->header;
+    int i;
 
-    serverAssert(!isnan(score));
-    x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        /* store rank that is crossed to reach the insert position */
-        rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < score ||
-                    (x->level[i].forward->score == score &&
-                    sdscmp(x->level[i].forward->ele,ele) < 0)))
+        /* store rank that is crossed to reach the node */
+        if (rank) rank[i] = i == (zsl->level-1) ? 0 : rank[i+1];
+        while (x->level[i].forward && x->level[i].forward != zsl->tail &&
+               zslCompare(zslNodeLast(x->level[i].forward),score,ele) < 0)
         {
-            rank[i] += x->level[i].span;
+            if (rank) rank[i] += x->level[i].span;
             x = x->level[i].forward;
         }
         update[i] = x;
     }
-    /* we assume the element is not already inside, since we allow duplicated
-     * scores, reinserting the same element should never happen since the
-     * caller of zslInsert() should test in the hash table if the element is
-     * already inside or not. */
+    return x->level[0].forward;
+}
+
+/* Return the position, in the node 'x', of the first element that is not
+ * smaller than the one with the specified score and SDS string, or
+ * x->count if all the elements are smaller. */
+static unsigned int zslNodeSearch(zskiplistNode *x, double score, sds ele) {
+    zskiplistEntry *entries = zslNodeEntries(x);
+    unsigned int lo = 0, hi = x->count;
+
+    while (lo < hi) {
+        unsigned int mid = (lo+hi)/2;
+        if (zslCompare(entries+mid,score,ele) < 0)
+            lo = mid+1;
+        else
+            hi = mid;
+    }
+    return lo;
+}
+
+/* Link a new node with no elements right after the node 'prev'. For every
+ * level up to ZSKIPLIST_MAXLEVEL, update[i] must be the last node up to
+ * 'prev' (included) having the level i, and rank[i] the number of elements
+ * up to update[i] included: for the levels the skiplist doesn't have yet
+ * they must be the header and 0. */
+static zskiplistNode *zslInsertNode(zskiplist *zsl, zskiplistNode *prev,
+                                    zskiplistNode **update,
+                                    unsigned long *rank)
+{
+    zskiplistNode *x;
+    int i, level;
+
     level = zslRandomLevel();
     if (level > zsl->level) {
-        for (i = zsl->level; i < level; i++) {
-            rank[i] = 0;
-            update[i] = zsl->header;
-            update[i]->level[i].span = zsl->length;
-        }
+        for (i = zsl->level; i < level; i++)
+            zsl->header->level[i].span = zsl->length;
         zsl->level = level;
     }
-    x = zslCreateNode(level,score,ele);
+    x = zslCreateNode(level,ZSKIPLIST_BLOCK);
     for (i = 0; i < level; i++) {
         x->level[i].forward = update[i]->level[i].forward;
         update[i]->level[i].forward = x;
 
-        /* update span covered by update[i] as x is inserted here */
+        /* update span covered by update[i] as x is inserted here, still
+         * without elements */
         x->level[i].span = update[i]->level[i].span - (rank[0] - rank[i]);
-        update[i]->level[i].span = (rank[0] - rank[i]) + 1;
-    }
-
-    /* increment span for untouched levels */
-    for (i = level; i < zsl->level; i++) {
-        update[i]->level[i].span++;
+        update[i]->level[i].span = rank[0] - rank[i];
     }
 
-    x->backward = (update[0] == zsl->header) ? NULL : update[0];
+    x->backward = (prev == zsl->header) ? NULL : prev;
     if (x->level[0].forward)
         x->level[0].forward->backward = x;
     else
         zsl->tail = x;
-    zsl->length++;
     return x;
 }
 
-/* Internal function used by zslDelete, zslDeleteRangeByScore and
- * zslDeleteRangeByRank. */
-void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
+/* Unlink and free the node 'x', that has no elements left. update[i] is
+ * the last node before 'x' having the level i, as zslSeek() reports it. */
+static void zslDeleteNode(zskiplist *zsl, zskiplistNode *x,
+                          zskiplistNode **update)
+{
     int i;
     for (i = 0; i < zsl->level; i++) {
         if (update[i]->level[i].forward == x) {
-            update[i]->level[i].span += x->level[i].span - 1;
+            update[i]->level[i].span += x->level[i].span;
             update[i]->level[i].forward = x->level[i].forward;
-        } else {
-            update[i]->level[i].span -= 1;
         }
     }
     if (x->level[0].forward) {
@@ -205,41 +253,177 @@ void zslDeleteNode(zskiplist *zsl, zskiplistNode *x, zskiplistNode **update) {
     }
     while(zsl->level > 1 && zsl->header->level[zsl->level-1].forward == NULL)
         zsl->level--;
-    zsl->length--;
+    zfree(x);
+}
+
+/* Move the last 'count' elements of the node 'x' to a new node linked right
+ * after it, and return the new node. update[] and rank[] are the ones
+ * zslSeek() reported for 'x', up to ZSKIPLIST_MAXLEVEL as zslInsertNode()
+ * requires. */
+static zskiplistNode *zslSplitNode(zskiplist *zsl, zskiplistNode *x,
+                                   unsigned int count,
+                                   zskiplistNode **update,
+                                   unsigned long *rank)
+{
+    zskiplistNode *prev[ZSKIPLIST_MAXLEVEL], *n;
+    unsigned long prevrank[ZSKIPLIST_MAXLEVEL];
+    int i;
+
+    for (i = 0; i < ZSKIPLIST_MAXLEVEL; i++) {
+        if (i < x->height) {
+            prev[i] = x;
+            prevrank[i] = rank[0]+x->count;
+        } else {
+            prev[i] = update[i];
+            prevrank[i] = rank[i];
+        }
+    }
+    n = zslInsertNode(zsl,x,prev,prevrank);
+
+    /* The elements move from 'x' to the new node: the spans of the links
+     * ending in 'x' lose them, and the ones of the links starting from
+     * 'x' gain them. The other links cover both nodes. */
+    memcpy(zslNodeEntries(n),zslNodeEntries(x)+x->count-count,
+           count*sizeof(zskiplistEntry));
+    n->count = count;
+    x->count -= count;
+    for (i = 0; i < x->height; i++) {
+        update[i]->level[i].span -= count;
+        x->level[i].span += count;
+    }
+    return n;
+}
+
+/* Delete 'count' elements of the node 'x' starting at position 'pos'. The
+ * SDS strings of the elements are not freed. update[i] is the last node
+ * before 'x' having the level i. If the node gets empty it is freed, and
+ * 1 is returned, otherwise 0 is returned. */
+static int zslDeleteEntries(zskiplist *zsl, zskiplistNode *x,
+                            unsigned int pos, unsigned int count,
+                            zskiplistNode **update)
+{
+    zskiplistEntry *entries = zslNodeEntries(x);
+    int i;
+
+    memmove(entries+pos,entries+pos+count,
+            (x->count-pos-count)*sizeof(zskiplistEntry));
+    x->count -= count;
+    for (i = 0; i < zsl->level; i++)
+        update[i]->level[i].span -= count;
+    zsl->length -= count;
+    if (x->count == 0) {
+        zslDeleteNode(zsl,x,update);
+        return 1;
+    }
+    return 0;
 }
 
-/* Delete an element with matching score/element from the skiplist.
- * The function returns 1 if the node was found and deleted, otherwise
- * 0 is returned.
- *
- * If 'node' is NULL the deleted node is freed by zslFreeNode(), otherwise
- * it is not freed (but just unlinked) and *node is set to the node pointer,
- * so that it is possible for the caller to reuse the node (including the
- * referenced SDS string at node->ele). */
-int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node) {
-    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+/* Move the elements of the node after 'x' into 'x' and free it, if 'x' is
+ * almost empty and they fit. update[i] is the last node before 'x' having
+ * the level i. */
+static void zslMergeNext(zskiplist *zsl, zskiplistNode *x,
+                         zskiplistNode **update)
+{
+    zskiplistNode *next = x->level[0].forward, *prev[ZSKIPLIST_MAXLEVEL];
+    unsigned int count;
     int i;
 
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < score ||
-                    (x->level[i].forward->score == score &&
-                     sdscmp(x->level[i].forward->ele,ele) < 0)))
-        {
-            x = x->level[i].forward;
+    if (x->count > ZSKIPLIST_BLOCK/4 || next == NULL ||
+        x->count+next->count > ZSKIPLIST_BLOCK) return;
+
+    /* This is the reverse of zslSplitNode(). */
+    count = next->count;
+    memcpy(zslNodeEntries(x)+x->count,zslNodeEntries(next),
+           count*sizeof(zskiplistEntry));
+    x->count += count;
+    next->count = 0;
+    for (i = 0; i < x->height; i++) {
+        update[i]->level[i].span += count;
+        x->level[i].span -= count;
+    }
+    for (i = 0; i < zsl->level; i++)
+        prev[i] = (i < x->height) ? x : update[i];
+    zslDeleteNode(zsl,next,prev);
+}
+
+/* Insert a new element in the skiplist. Assumes the element does not already
+ * exist (up to the caller to enforce that). The skiplist takes ownership
+ * of the passed SDS string 'ele'. */
+void zslInsert(zskiplist *zsl, double score, sds ele) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x, *n;
+    unsigned long rank[ZSKIPLIST_MAXLEVEL];
+    zskiplistEntry *entries;
+    unsigned int pos;
+    int i;
+
+    serverAssert(!isnan(score));
+    /* we assume the element is not already inside, since we allow duplicated
+     * scores, reinserting the same element should never happen since the
+     * caller of zslInsert() should test in the hash table if the element is
+     * already inside or not. */
+    x = zslSeek(zsl,score,ele,update,rank);
+    for (i = zsl->level; i < ZSKIPLIST_MAXLEVEL; i++) {
+        update[i] = zsl->header;
+        rank[i] = 0;
+    }
+
+    if (x == NULL) {
+        /* The skiplist is empty. */
+        x = zslInsertNode(zsl,zsl->header,update,rank);
+        pos = 0;
+    } else {
+        pos = zslNodeSearch(x,score,ele);
+        if (x->count == ZSKIPLIST_BLOCK) {
+            /* Split the full node in two halves, unless the element goes
+             * at the tail or at the head of the skiplist: then it gets a
+             * new node alone, so that the nodes are kept full when the
+             * elements are added in order. */
+            unsigned int count = x->count/2;
+
+            if (x == zsl->tail && pos == x->count) count = 0;
+            else if (x->backward == NULL && pos == 0) count = x->count;
+            n = zslSplitNode(zsl,x,count,update,rank);
+            if (pos > x->count || x->count == ZSKIPLIST_BLOCK) {
+                pos -= x->count;
+                for (i = 0; i < x->height; i++) update[i] = x;
+                x = n;
+            }
         }
-        update[i] = x;
     }
+
+    entries = zslNodeEntries(x);
+    memmove(entries+pos+1,entries+pos,
+            (x->count-pos)*sizeof(zskiplistEntry));
+    entries[pos].ele = ele;
+    entries[pos].score = score;
+    x->count++;
+
+    /* every link ending in x or going over it gains the element */
+    for (i = 0; i < zsl->level; i++)
+        update[i]->level[i].span++;
+    zsl->length++;
+}
+
+/* Delete an element with matching score/element from the skiplist.
+ * The function returns 1 if the element was found and deleted, otherwise
+ * 0 is returned. The SDS string stored in the skiplist for the element
+ * is freed. */
+int zslDelete(zskiplist *zsl, double score, sds ele) {
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+    zskiplistEntry *e;
+    unsigned int pos;
+
+    x = zslSeek(zsl,score,ele,update,NULL);
+    if (x == NULL) return 0;
+
     /* We may have multiple elements with the same score, what we need
      * is to find the element with both the right score and object. */
-    x = x->level[0].forward;
-    if (x && score == x->score && sdscmp(x->ele,ele) == 0) {
-        zslDeleteNode(zsl, x, update);
-        if (!node)
-            zslFreeNode(x);
-        else
-            *node = x;
+    pos = zslNodeSearch(x,score,ele);
+    e = zslNodeEntries(x)+pos;
+    if (pos < x->count && score == e->score && sdscmp(e->ele,ele) == 0) {
+        sdsfree(e->ele);
+        if (!zslDeleteEntries(zsl,x,pos,1,update))
+            zslMergeNext(zsl,x,update);
         return 1;
     }
     return 0; /* not found */
@@ -250,54 +434,49 @@ int zslDelete(zskiplist *zsl, double score, sds ele, zskiplistNode **node) {
  * This function does not update the score in the hash table side, the
  * caller should take care of it.
  *
- * Note that this function attempts to just update the node, in case after
- * the score update, the node would be exactly at the same position.
- * Otherwise the skiplist is modified by removing and re-adding a new
- * element, which is more costly.
- *
- * The function returns the updated element skiplist node pointer. */
-zskiplistNode *zslUpdateScore(zskiplist *zsl, double curscore, sds ele, double newscore) {
+ * Note that this function attempts to just update the element in place,
+ * in case after the score update, it would be exactly at the same position.
+ * Otherwise the element is removed and added again, which is more costly.
+ * The SDS string of the element stays the same in both cases. */
+void zslUpdateScore(zskiplist *zsl, double curscore, sds ele, double newscore) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    int i;
+    zskiplistEntry *entries, *prev, *next;
+    unsigned int pos;
 
     /* We need to seek to element to update to start: this is useful anyway,
-     * we'll have to update or remove it. */
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-                (x->level[i].forward->score < curscore ||
-                    (x->level[i].forward->score == curscore &&
-                     sdscmp(x->level[i].forward->ele,ele) < 0)))
-        {
-            x = x->level[i].forward;
-        }
-        update[i] = x;
-    }
-
-    /* Jump to our element: note that this function assumes that the
-     * element with the matching score exists. */
-    x = x->level[0].forward;
-    serverAssert(x && curscore == x->score && sdscmp(x->ele,ele) == 0);
+     * we'll have to update or remove it. Note that this function assumes
+     * that the element with the matching score exists. */
+    x = zslSeek(zsl,curscore,ele,update,NULL);
+    serverAssert(x != NULL);
+    pos = zslNodeSearch(x,curscore,ele);
+    entries = zslNodeEntries(x);
+    serverAssert(pos < x->count && curscore == entries[pos].score &&
+                 sdscmp(entries[pos].ele,ele) == 0);
 
-    /* If the node, after the score update, would be still exactly
+    /* If the element, after the score update, would be still exactly
      * at the same position, we can just update the score without
      * actually removing and re-inserting the element in the skiplist. */
-    if ((x->backward == NULL || x->backward->score < newscore) &&
-        (x->level[0].forward == NULL || x->level[0].forward->score > newscore))
+    if (pos > 0)
+        prev = entries+pos-1;
+    else
+        prev = x->backward ? zslNodeLast(x->backward) : NULL;
+    if (pos+1 < x->count)
+        next = entries+pos+1;
+    else
+        next = x->level[0].forward ? zslNodeFirst(x->level[0].forward) : NULL;
+    if ((prev == NULL || prev->score < newscore) &&
+        (next == NULL || next->score > newscore))
     {
-        x->score = newscore;
-        return x;
+        entries[pos].score = newscore;
+        return;
     }
 
-    /* No way to reuse the old node: we need to remove and insert a new
-     * one at a different place. */
-    zslDeleteNode(zsl, x, update);
-    zskiplistNode *newnode = zslInsert(zsl,newscore,x->ele);
-    /* We reused the old node x->ele SDS string, free the node now
-     * since zslInsert created a new one. */
-    x->ele = NULL;
-    zslFreeNode(x);
-    return newnode;
+    /* No way to reuse the old position: we need to remove the element and
+     * insert it at a different place, with the same SDS string. */
+    ele = entries[pos].ele;
+    if (!zslDeleteEntries(zsl,x,pos,1,update))
+        zslMergeNext(zsl,x,update);
+    zslInsert(zsl,newscore,ele);
 }
 
 int zslValueGteMin(double value, zrangespec *spec) {
@@ -317,18 +496,23 @@ int zslIsInRange(zskiplist *zsl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
     x = zsl->tail;
-    if (x == NULL || !zslValueGteMin(x->score,range))
+    if (x == NULL || !zslValueGteMin(zslNodeLast(x)->score,range))
         return 0;
     x = zsl->header->level[0].forward;
-    if (x == NULL || !zslValueLteMax(x->score,range))
+    if (!zslValueLteMax(zslNodeFirst(x)->score,range))
         return 0;
     return 1;
 }
 
-/* Find the first node that is contained in the specified range.
+/* Find the first element that is contained in the specified range, and
+ * store its position in '*pos'.
  * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range) {
+zskiplistEntry *zslFirstInRange(zskiplist *zsl, zrangespec *range,
+                                zskiplistPos *pos)
+{
     zskiplistNode *x;
+    zskiplistEntry *entries;
+    unsigned int j = 0;
     int i;
 
     /* If everything is out of range, return early. */
@@ -336,25 +520,34 @@ zskiplistNode *zslFirstInRange(zskiplist *zsl, zrangespec *range) {
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *OUT* of range. */
+        /* Go forward while the whole node is *OUT* of range. */
         while (x->level[i].forward &&
-            !zslValueGteMin(x->level[i].forward->score,range))
+            !zslValueGteMin(zslNodeLast(x->level[i].forward)->score,range))
                 x = x->level[i].forward;
     }
 
     /* This is an inner range, so the next node cannot be NULL. */
     x = x->level[0].forward;
     serverAssert(x != NULL);
+    entries = zslNodeEntries(x);
+    while (!zslValueGteMin(entries[j].score,range)) j++;
 
     /* Check if score <= max. */
-    if (!zslValueLteMax(x->score,range)) return NULL;
-    return x;
+    if (!zslValueLteMax(entries[j].score,range)) return NULL;
+    pos->node = x;
+    pos->offset = j;
+    return entries+j;
 }
 
-/* Find the last node that is contained in the specified range.
+/* Find the last element that is contained in the specified range, and
+ * store its position in '*pos'.
  * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range) {
+zskiplistEntry *zslLastInRange(zskiplist *zsl, zrangespec *range,
+                               zskiplistPos *pos)
+{
     zskiplistNode *x;
+    zskiplistEntry *entries;
+    unsigned int j;
     int i;
 
     /* If everything is out of range, return early. */
@@ -362,18 +555,75 @@ zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range) {
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *IN* range. */
+        /* Go forward while the node starts *IN* range. */
         while (x->level[i].forward &&
-            zslValueLteMax(x->level[i].forward->score,range))
+            zslValueLteMax(zslNodeFirst(x->level[i].forward)->score,range))
                 x = x->level[i].forward;
     }
 
-    /* This is an inner range, so this node cannot be NULL. */
-    serverAssert(x != NULL);
+    /* This is an inner range, so this node cannot be the header. */
+    serverAssert(x != zsl->header);
+    entries = zslNodeEntries(x);
+    j = x->count-1;
+    while (!zslValueLteMax(entries[j].score,range)) j--;
 
     /* Check if score >= min. */
-    if (!zslValueGteMin(x->score,range)) return NULL;
-    return x;
+    if (!zslValueGteMin(entries[j].score,range)) return NULL;
+    pos->node = x;
+    pos->offset = j;
+    return entries+j;
+}
+
+/* Range checks used by zslDeleteFrom(). */
+static int zslEntryLteMax(zskiplistEntry *e, void *range) {
+    return zslValueLteMax(e->score,range);
+}
+
+static int zslEntryLexLteMax(zskiplistEntry *e, void *range) {
+    return zslLexValueLteMax(e->ele,range);
+}
+
+/* Delete the elements starting at the position 'pos' of the node 'x',
+ * as long as 'inrange' is true for them, if not NULL, and no more than
+ * 'max' elements, removing them from the hash table 'dict' too.
+ * update[i] is the last node before 'x' having the level i.
+ * Returns the number of elements deleted. */
+static unsigned long zslDeleteFrom(zskiplist *zsl, zskiplistNode *x,
+                                   unsigned int pos, zskiplistNode **update,
+                                   dict *dict,
+                                   int (*inrange)(zskiplistEntry*, void*),
+                                   void *range, unsigned long max)
+{
+    unsigned long removed = 0;
+    int i;
+
+    while (x && removed < max) {
+        zskiplistEntry *entries = zslNodeEntries(x);
+        zskiplistNode *next = x->level[0].forward;
+        unsigned int j = pos;
+
+        while (j < x->count && removed+(j-pos) < max &&
+               (inrange == NULL || inrange(entries+j,range)))
+        {
+            dictDelete(dict,entries[j].ele);
+            sdsfree(entries[j].ele); /* The string is released here. */
+            j++;
+        }
+        removed += j-pos;
+        if (j < x->count) {
+            /* The range ends inside this node. */
+            zslDeleteEntries(zsl,x,pos,j-pos,update);
+            zslMergeNext(zsl,x,update);
+            break;
+        }
+        if (!zslDeleteEntries(zsl,x,pos,j-pos,update)) {
+            /* The node is still there, before the next one. */
+            for (i = 0; i < x->height; i++) update[i] = x;
+        }
+        x = next;
+        pos = 0;
+    }
+    return removed;
 }
 
 /* Delete all the elements with score between min and max from the skiplist.
@@ -382,69 +632,58 @@ zskiplistNode *zslLastInRange(zskiplist *zsl, zrangespec *range) {
  * sorted set, in order to remove the elements from the hash table too. */
 unsigned long zslDeleteRangeByScore(zskiplist *zsl, zrangespec *range, dict *dict) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long removed = 0;
+    zskiplistEntry *entries;
+    unsigned int j = 0;
     int i;
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (range->minex ?
-            x->level[i].forward->score <= range->min :
-            x->level[i].forward->score < range->min))
+        while (x->level[i].forward &&
+            !zslValueGteMin(zslNodeLast(x->level[i].forward)->score,range))
                 x = x->level[i].forward;
         update[i] = x;
     }
 
-    /* Current node is the last with score < or <= min. */
+    /* Current node is the first with a score >= or > min. */
     x = x->level[0].forward;
+    if (x == NULL) return 0;
+    entries = zslNodeEntries(x);
+    while (!zslValueGteMin(entries[j].score,range)) j++;
 
-    /* Delete nodes while in range. */
-    while (x &&
-           (range->maxex ? x->score < range->max : x->score <= range->max))
-    {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x); /* Here is where x->ele is actually released. */
-        removed++;
-        x = next;
-    }
-    return removed;
+    /* Delete elements while in range. */
+    return zslDeleteFrom(zsl,x,j,update,dict,zslEntryLteMax,range,ULONG_MAX);
 }
 
 unsigned long zslDeleteRangeByLex(zskiplist *zsl, zlexrangespec *range, dict *dict) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long removed = 0;
+    zskiplistEntry *entries;
+    unsigned int j = 0;
     int i;
 
-
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
         while (x->level[i].forward &&
-            !zslLexValueGteMin(x->level[i].forward->ele,range))
+            !zslLexValueGteMin(zslNodeLast(x->level[i].forward)->ele,range))
                 x = x->level[i].forward;
         update[i] = x;
     }
 
-    /* Current node is the last with score < or <= min. */
+    /* Current node is the first with an element >= or > min. */
     x = x->level[0].forward;
+    if (x == NULL) return 0;
+    entries = zslNodeEntries(x);
+    while (!zslLexValueGteMin(entries[j].ele,range)) j++;
 
-    /* Delete nodes while in range. */
-    while (x && zslLexValueLteMax(x->ele,range)) {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x); /* Here is where x->ele is actually released. */
-        removed++;
-        x = next;
-    }
-    return removed;
+    /* Delete elements while in range. */
+    return zslDeleteFrom(zsl,x,j,update,dict,zslEntryLexLteMax,range,
+                         ULONG_MAX);
 }
 
 /* Delete all the elements with rank between start and end from the skiplist.
  * Start and end are inclusive. Note that start and end need to be 1-based */
 unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned int end, dict *dict) {
     zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
-    unsigned long traversed = 0, removed = 0;
+    unsigned long traversed = 0;
     int i;
 
     x = zsl->header;
@@ -456,18 +695,11 @@ unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned
         update[i] = x;
     }
 
-    traversed++;
+    /* Current node is the one holding the start rank. */
     x = x->level[0].forward;
-    while (x && traversed <= end) {
-        zskiplistNode *next = x->level[0].forward;
-        zslDeleteNode(zsl,x,update);
-        dictDelete(dict,x->ele);
-        zslFreeNode(x);
-        removed++;
-        traversed++;
-        x = next;
-    }
-    return removed;
+    if (x == NULL) return 0;
+    return zslDeleteFrom(zsl,x,start-traversed-1,update,dict,NULL,NULL,
+                         end-start+1);
 }
 
 /* Find the rank for an element by both score and key.
@@ -475,46 +707,43 @@ unsigned long zslDeleteRangeByRank(zskiplist *zsl, unsigned int start, unsigned
  * Note that the rank is 1-based due to the span of zsl->header to the
  * first element. */
 unsigned long zslGetRank(zskiplist *zsl, double score, sds ele) {
-    zskiplistNode *x;
-    unsigned long rank = 0;
-    int i;
-
-    x = zsl->header;
-    for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward &&
-            (x->level[i].forward->score < score ||
-                (x->level[i].forward->score == score &&
-                sdscmp(x->level[i].forward->ele,ele) <= 0))) {
-            rank += x->level[i].span;
-            x = x->level[i].forward;
-        }
-
-        /* x might be equal to zsl->header, so test if obj is non-NULL */
-        if (x->ele && sdscmp(x->ele,ele) == 0) {
-            return rank;
-        }
-    }
+    zskiplistNode *update[ZSKIPLIST_MAXLEVEL], *x;
+    unsigned long rank[ZSKIPLIST_MAXLEVEL];
+    zskiplistEntry *e;
+    unsigned int pos;
+
+    x = zslSeek(zsl,score,ele,update,rank);
+    if (x == NULL) return 0;
+    pos = zslNodeSearch(x,score,ele);
+    e = zslNodeEntries(x)+pos;
+    if (pos < x->count && score == e->score && sdscmp(e->ele,ele) == 0)
+        return rank[0]+pos+1;
     return 0;
 }
 
-/* Finds an element by its rank. The rank argument needs to be 1-based. */
-zskiplistNode* zslGetElementByRank(zskiplist *zsl, unsigned long rank) {
+/* Finds an element by its rank, and store its position in '*pos'.
+ * The rank argument needs to be 1-based. */
+zskiplistEntry *zslGetElementByRank(zskiplist *zsl, unsigned long rank,
+                                    zskiplistPos *pos)
+{
     zskiplistNode *x;
     unsigned long traversed = 0;
     int i;
 
+    if (rank == 0 || rank > zsl->length) return NULL;
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        while (x->level[i].forward && (traversed + x->level[i].span) <= rank)
+        while (x->level[i].forward && (traversed + x->level[i].span) < rank)
         {
             traversed += x->level[i].span;
             x = x->level[i].forward;
         }
-        if (traversed == rank) {
-            return x;
-        }
     }
-    return NULL;
+
+    /* The element is in the node after the last one ending before it. */
+    pos->node = x->level[0].forward;
+    pos->offset = rank-traversed-1;
+    return zslNodeEntries(pos->node)+pos->offset;
 }
 
 /* Populate the rangespec according to the objects min and max. */
@@ -648,6 +877,7 @@ int zslLexValueLteMax(sds value, zlexrangespec *spec) {
         (sdscmplex(value,spec->max) <= 0);
 }
 
+
 /* Returns if there is a part of the zset is in the lex range. */
 int zslIsInLexRange(zskiplist *zsl, zlexrangespec *range) {
     zskiplistNode *x;
@@ -657,18 +887,23 @@ int zslIsInLexRange(zskiplist *zsl, zlexrangespec *range) {
     if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
         return 0;
     x = zsl->tail;
-    if (x == NULL || !zslLexValueGteMin(x->ele,range))
+    if (x == NULL || !zslLexValueGteMin(zslNodeLast(x)->ele,range))
         return 0;
     x = zsl->header->level[0].forward;
-    if (x == NULL || !zslLexValueLteMax(x->ele,range))
+    if (!zslLexValueLteMax(zslNodeFirst(x)->ele,range))
         return 0;
     return 1;
 }
 
-/* Find the first node that is contained in the specified lex range.
+/* Find the first element that is contained in the specified lex range, and
+ * store its position in '*pos'.
  * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range) {
+zskiplistEntry *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range,
+                                   zskiplistPos *pos)
+{
     zskiplistNode *x;
+    zskiplistEntry *entries;
+    unsigned int j = 0;
     int i;
 
     /* If everything is out of range, return early. */
@@ -676,25 +911,34 @@ zskiplistNode *zslFirstInLexRange(zskiplist *zsl, zlexrangespec *range) {
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *OUT* of range. */
+        /* Go forward while the whole node is *OUT* of range. */
         while (x->level[i].forward &&
-            !zslLexValueGteMin(x->level[i].forward->ele,range))
+            !zslLexValueGteMin(zslNodeLast(x->level[i].forward)->ele,range))
                 x = x->level[i].forward;
     }
 
     /* This is an inner range, so the next node cannot be NULL. */
     x = x->level[0].forward;
     serverAssert(x != NULL);
+    entries = zslNodeEntries(x);
+    while (!zslLexValueGteMin(entries[j].ele,range)) j++;
 
     /* Check if score <= max. */
-    if (!zslLexValueLteMax(x->ele,range)) return NULL;
-    return x;
+    if (!zslLexValueLteMax(entries[j].ele,range)) return NULL;
+    pos->node = x;
+    pos->offset = j;
+    return entries+j;
 }
 
-/* Find the last node that is contained in the specified range.
+/* Find the last element that is contained in the specified lex range, and
+ * store its position in '*pos'.
  * Returns NULL when no element is contained in the range. */
-zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
+zskiplistEntry *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range,
+                                  zskiplistPos *pos)
+{
     zskiplistNode *x;
+    zskiplistEntry *entries;
+    unsigned int j;
     int i;
 
     /* If everything is out of range, return early. */
@@ -702,22 +946,27 @@ zskiplistNode *zslLastInLexRange(zskiplist *zsl, zlexrangespec *range) {
 
     x = zsl->header;
     for (i = zsl->level-1; i >= 0; i--) {
-        /* Go forward while *IN* range. */
+        /* Go forward while the node starts *IN* range. */
         while (x->level[i].forward &&
-            zslLexValueLteMax(x->level[i].forward->ele,range))
+            zslLexValueLteMax(zslNodeFirst(x->level[i].forward)->ele,range))
                 x = x->level[i].forward;
     }
 
-    /* This is an inner range, so this node cannot be NULL. */
-    serverAssert(x != NULL);
+    /* This is an inner range, so this node cannot be the header. */
+    serverAssert(x != zsl->header);
+    entries = zslNodeEntries(x);
+    j = x->count-1;
+    while (!zslLexValueLteMax(entries[j].ele,range)) j--;
 
     /* Check if score >= min. */
-    if (!zslLexValueGteMin(x->ele,range)) return NULL;
-    return x;
+    if (!zslLexValueGteMin(entries[j].ele,range)) return NULL;
+    pos->node = x;
+    pos->offset = j;
+    return entries+j;
 }
 
 /*-----------------------------------------------------------------------------
- * Ziplist-backed sorted set API
+ * Listpack-backed sorted set API
  *----------------------------------------------------------------------------*/
 
 double zzlGetScore(unsigned char *sptr) {
@@ -728,7 +977,7 @@ double zzlGetScore(unsigned char *sptr) {
     double score;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(sptr,&vlen,&vlong);
 
     if (vstr) {
         memcpy(buf,vstr,vlen);
@@ -741,14 +990,14 @@ double zzlGetScore(unsigned char *sptr) {
     return score;
 }
 
-/* Return a ziplist element as an SDS string. */
-sds ziplistGetObject(unsigned char *sptr) {
+/* Return a listpack element as an SDS string. */
+sds lpGetObject(unsigned char *sptr) {
     unsigned char *vstr;
     unsigned int vlen;
     long long vlong;
 
     serverAssert(sptr != NULL);
-    serverAssert(ziplistGet(sptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(sptr,&vlen,&vlong);
 
     if (vstr) {
         return sdsnewlen((char*)vstr,vlen);
@@ -765,7 +1014,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
     unsigned char vbuf[32];
     int minlen, cmp;
 
-    serverAssert(ziplistGet(eptr,&vstr,&vlen,&vlong));
+    vstr = lpGetValue(eptr,&vlen,&vlong);
     if (vstr == NULL) {
         /* Store string representation of long long in buf. */
         vlen = ll2string((char*)vbuf,sizeof(vbuf),vlong);
@@ -779,7 +1028,7 @@ int zzlCompareElements(unsigned char *eptr, unsigned char *cstr, unsigned int cl
 }
 
 unsigned int zzlLength(unsigned char *zl) {
-    return ziplistLen(zl)/2;
+    return lpLength(zl)/2;
 }
 
 /* Move to next entry based on the values in eptr and sptr. Both are set to
@@ -788,9 +1037,9 @@ void zzlNext(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _eptr = ziplistNext(zl,*sptr);
+    _eptr = lpNext(zl,*sptr);
     if (_eptr != NULL) {
-        _sptr = ziplistNext(zl,_eptr);
+        _sptr = lpNext(zl,_eptr);
         serverAssert(_sptr != NULL);
     } else {
         /* No next entry. */
@@ -807,9 +1056,9 @@ void zzlPrev(unsigned char *zl, unsigned char **eptr, unsigned char **sptr) {
     unsigned char *_eptr, *_sptr;
     serverAssert(*eptr != NULL && *sptr != NULL);
 
-    _sptr = ziplistPrev(zl,*eptr);
+    _sptr = lpPrev(zl,*eptr);
     if (_sptr != NULL) {
-        _eptr = ziplistPrev(zl,_sptr);
+        _eptr = lpPrev(zl,_sptr);
         serverAssert(_eptr != NULL);
     } else {
         /* No previous entry. */
@@ -831,13 +1080,13 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
             (range->min == range->max && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-1); /* Last score. */
+    p = lpSeek(zl,-1); /* Last score. */
     if (p == NULL) return 0; /* Empty sorted set */
     score = zzlGetScore(p);
     if (!zslValueGteMin(score,range))
         return 0;
 
-    p = ziplistIndex(zl,1); /* First score. */
+    p = lpSeek(zl,1); /* First score. */
     serverAssert(p != NULL);
     score = zzlGetScore(p);
     if (!zslValueLteMax(score,range))
@@ -849,14 +1098,14 @@ int zzlIsInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the first element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -868,7 +1117,7 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     return NULL;
@@ -877,14 +1126,14 @@ unsigned char *zzlFirstInRange(unsigned char *zl, zrangespec *range) {
 /* Find pointer to the last element contained in the specified range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
     double score;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInRange(zl,range)) return NULL;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         score = zzlGetScore(sptr);
@@ -897,9 +1146,9 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -908,14 +1157,14 @@ unsigned char *zzlLastInRange(unsigned char *zl, zrangespec *range) {
 }
 
 int zzlLexValueGteMin(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueGteMin(value,spec);
     sdsfree(value);
     return res;
 }
 
 int zzlLexValueLteMax(unsigned char *p, zlexrangespec *spec) {
-    sds value = ziplistGetObject(p);
+    sds value = lpGetObject(p);
     int res = zslLexValueLteMax(value,spec);
     sdsfree(value);
     return res;
@@ -931,12 +1180,12 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
     if (cmp > 0 || (cmp == 0 && (range->minex || range->maxex)))
         return 0;
 
-    p = ziplistIndex(zl,-2); /* Last element. */
+    p = lpSeek(zl,-2); /* Last element. */
     if (p == NULL) return 0;
     if (!zzlLexValueGteMin(p,range))
         return 0;
 
-    p = ziplistIndex(zl,0); /* First element. */
+    p = lpSeek(zl,0); /* First element. */
     serverAssert(p != NULL);
     if (!zzlLexValueLteMax(p,range))
         return 0;
@@ -947,7 +1196,7 @@ int zzlIsInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the first element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -961,9 +1210,9 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
         }
 
         /* Move to next element. */
-        sptr = ziplistNext(zl,eptr); /* This element score. Skip it. */
+        sptr = lpNext(zl,eptr); /* This element score. Skip it. */
         serverAssert(sptr != NULL);
-        eptr = ziplistNext(zl,sptr); /* Next element. */
+        eptr = lpNext(zl,sptr); /* Next element. */
     }
 
     return NULL;
@@ -972,7 +1221,7 @@ unsigned char *zzlFirstInLexRange(unsigned char *zl, zlexrangespec *range) {
 /* Find pointer to the last element contained in the specified lex range.
  * Returns NULL when no element is contained in the range. */
 unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
-    unsigned char *eptr = ziplistIndex(zl,-2), *sptr;
+    unsigned char *eptr = lpSeek(zl,-2), *sptr;
 
     /* If everything is out of range, return early. */
     if (!zzlIsInLexRange(zl,range)) return NULL;
@@ -987,9 +1236,9 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 
         /* Move to previous element by moving to the score of previous element.
          * When this returns NULL, we know there also is no element. */
-        sptr = ziplistPrev(zl,eptr);
+        sptr = lpPrev(zl,eptr);
         if (sptr != NULL)
-            serverAssert((eptr = ziplistPrev(zl,sptr)) != NULL);
+            serverAssert((eptr = lpPrev(zl,sptr)) != NULL);
         else
             eptr = NULL;
     }
@@ -998,32 +1247,26 @@ unsigned char *zzlLastInLexRange(unsigned char *zl, zlexrangespec *range) {
 }
 
 unsigned char *zzlFind(unsigned char *zl, sds ele, double *score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpFirst(zl), *sptr;
 
-    while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
-        serverAssert(sptr != NULL);
-
-        if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele))) {
-            /* Matching element, pull out score. */
-            if (score != NULL) *score = zzlGetScore(sptr);
-            return eptr;
-        }
+    /* Compare only the elements, skipping the scores. */
+    eptr = lpFind(zl,eptr,(unsigned char*)ele,sdslen(ele),1);
+    if (eptr == NULL) return NULL;
 
-        /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
-    }
-    return NULL;
+    /* Matching element, pull out score. */
+    sptr = lpNext(zl,eptr);
+    serverAssert(sptr != NULL);
+    if (score != NULL) *score = zzlGetScore(sptr);
+    return eptr;
 }
 
-/* Delete (element,score) pair from ziplist. Use local copy of eptr because we
+/* Delete (element,score) pair from listpack. Use local copy of eptr because we
  * don't want to modify the one given as argument. */
 unsigned char *zzlDelete(unsigned char *zl, unsigned char *eptr) {
     unsigned char *p = eptr;
 
-    /* TODO: add function to ziplist API to delete N elements from offset. */
-    zl = ziplistDelete(zl,&p);
-    zl = ziplistDelete(zl,&p);
+    zl = lpDelete(zl,p,&p);
+    zl = lpDelete(zl,p,&p);
     return zl;
 }
 
@@ -1031,33 +1274,29 @@ unsigned char *zzlInsertAt(unsigned char *zl, unsigned char *eptr, sds ele, doub
     unsigned char *sptr;
     char scorebuf[128];
     int scorelen;
-    size_t offset;
 
     scorelen = d2string(scorebuf,sizeof(scorebuf),score);
     if (eptr == NULL) {
-        zl = ziplistPush(zl,(unsigned char*)ele,sdslen(ele),ZIPLIST_TAIL);
-        zl = ziplistPush(zl,(unsigned char*)scorebuf,scorelen,ZIPLIST_TAIL);
+        zl = lpAppend(zl,(unsigned char*)ele,sdslen(ele));
+        zl = lpAppend(zl,(unsigned char*)scorebuf,scorelen);
     } else {
-        /* Keep offset relative to zl, as it might be re-allocated. */
-        offset = eptr-zl;
-        zl = ziplistInsert(zl,eptr,(unsigned char*)ele,sdslen(ele));
-        eptr = zl+offset;
-
-        /* Insert score after the element. */
-        serverAssert((sptr = ziplistNext(zl,eptr)) != NULL);
-        zl = ziplistInsert(zl,sptr,(unsigned char*)scorebuf,scorelen);
+        /* Insert the element before eptr, then the score after it: 'sptr'
+         * is set by lpInsert() to the new element, so it remains valid even
+         * if the listpack is reallocated. */
+        zl = lpInsert(zl,(unsigned char*)ele,sdslen(ele),eptr,LP_BEFORE,&sptr);
+        zl = lpInsert(zl,(unsigned char*)scorebuf,scorelen,sptr,LP_AFTER,NULL);
     }
     return zl;
 }
 
-/* Insert (element,score) pair in ziplist. This function assumes the element is
+/* Insert (element,score) pair in listpack. This function assumes the element is
  * not yet present in the list. */
 unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
-    unsigned char *eptr = ziplistIndex(zl,0), *sptr;
+    unsigned char *eptr = lpSeek(zl,0), *sptr;
     double s;
 
     while (eptr != NULL) {
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
         s = zzlGetScore(sptr);
 
@@ -1076,7 +1315,7 @@ unsigned char *zzlInsert(unsigned char *zl, sds ele, double score) {
         }
 
         /* Move to next element. */
-        eptr = ziplistNext(zl,sptr);
+        eptr = lpNext(zl,sptr);
     }
 
     /* Push on tail of list when it was not yet inserted. */
@@ -1095,14 +1334,14 @@ unsigned char *zzlDeleteRangeByScore(unsigned char *zl, zrangespec *range, unsig
     eptr = zzlFirstInRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr
+     * to NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         score = zzlGetScore(sptr);
         if (zslValueLteMax(score,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1123,13 +1362,13 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
     eptr = zzlFirstInLexRange(zl,range);
     if (eptr == NULL) return zl;
 
-    /* When the tail of the ziplist is deleted, eptr will point to the sentinel
-     * byte and ziplistNext will return NULL. */
-    while ((sptr = ziplistNext(zl,eptr)) != NULL) {
+    /* When the tail of the listpack is deleted, lpDelete() sets eptr
+     * to NULL. */
+    while (eptr && (sptr = lpNext(zl,eptr)) != NULL) {
         if (zzlLexValueLteMax(eptr,range)) {
             /* Delete both the element and the score. */
-            zl = ziplistDelete(zl,&eptr);
-            zl = ziplistDelete(zl,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
+            zl = lpDelete(zl,eptr,&eptr);
             num++;
         } else {
             /* No longer in range. */
@@ -1146,7 +1385,7 @@ unsigned char *zzlDeleteRangeByLex(unsigned char *zl, zlexrangespec *range, unsi
 unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsigned int end, unsigned long *deleted) {
     unsigned int num = (end-start)+1;
     if (deleted) *deleted = num;
-    zl = ziplistDeleteRange(zl,2*(start-1),2*num);
+    zl = lpDeleteRange(zl,2*(start-1),2*num);
     return zl;
 }
 
@@ -1156,7 +1395,7 @@ unsigned char *zzlDeleteRangeByRank(unsigned char *zl, unsigned int start, unsig
 
 unsigned long zsetLength(const robj *zobj) {
     unsigned long length = 0;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         length = zzlLength(zobj->ptr);
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         length = ((const zset*)zobj->ptr)->zsl->length;
@@ -1169,11 +1408,13 @@ unsigned long zsetLength(const robj *zobj) {
 void zsetConvert(robj *zobj, int encoding) {
     zset *zs;
     zskiplistNode *node, *next;
+    zskiplistEntry *entries;
+    unsigned int j;
     sds ele;
     double score;
 
     if (zobj->encoding == encoding) return;
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -1187,35 +1428,34 @@ void zsetConvert(robj *zobj, int encoding) {
         zs->dict = dictCreate(&zsetDictType,NULL);
         zs->zsl = zslCreate();
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssertWithInfo(NULL,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(NULL,zobj,sptr != NULL);
 
         while (eptr != NULL) {
             score = zzlGetScore(sptr);
-            serverAssertWithInfo(NULL,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen((char*)vstr,vlen);
 
-            node = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&node->score) == DICT_OK);
+            zsetInsert(zs,score,ele);
             zzlNext(zl,&eptr,&sptr);
         }
 
-        zfree(zobj->ptr);
+        lpFree(zobj->ptr);
         zobj->ptr = zs;
         zobj->encoding = OBJ_ENCODING_SKIPLIST;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
-        unsigned char *zl = ziplistNew();
+        unsigned char *zl = lpNew();
 
-        if (encoding != OBJ_ENCODING_ZIPLIST)
+        if (encoding != OBJ_ENCODING_LISTPACK)
             serverPanic("Unknown target encoding");
 
         /* Approach similar to zslFree(), since we want to free the skiplist at
-         * the same time as creating the ziplist. */
+         * the same time as creating the listpack. */
         zs = zobj->ptr;
         dictRelease(zs->dict);
         node = zs->zsl->header->level[0].forward;
@@ -1223,7 +1463,9 @@ void zsetConvert(robj *zobj, int encoding) {
         zfree(zs->zsl);
 
         while (node) {
-            zl = zzlInsertAt(zl,NULL,node->ele,node->score);
+            entries = zslNodeEntries(node);
+            for (j = 0; j < node->count; j++)
+                zl = zzlInsertAt(zl,NULL,entries[j].ele,entries[j].score);
             next = node->level[0].forward;
             zslFreeNode(node);
             node = next;
@@ -1231,22 +1473,22 @@ void zsetConvert(robj *zobj, int encoding) {
 
         zfree(zs);
         zobj->ptr = zl;
-        zobj->encoding = OBJ_ENCODING_ZIPLIST;
+        zobj->encoding = OBJ_ENCODING_LISTPACK;
     } else {
         serverPanic("Unknown sorted set encoding");
     }
 }
 
-/* Convert the sorted set object into a ziplist if it is not already a ziplist
+/* Convert the sorted set object into a listpack if it is not already a listpack
  * and if the number of elements and the maximum element size is within the
  * expected ranges. */
-void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) return;
+void zsetConvertToListpackIfNeeded(robj *zobj, size_t maxelelen) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) return;
     zset *zset = zobj->ptr;
 
-    if (zset->zsl->length <= server.zset_max_ziplist_entries &&
-        maxelelen <= server.zset_max_ziplist_value)
-            zsetConvert(zobj,OBJ_ENCODING_ZIPLIST);
+    if (zset->zsl->length <= server.zset_max_listpack_entries &&
+        maxelelen <= server.zset_max_listpack_value)
+            zsetConvert(zobj,OBJ_ENCODING_LISTPACK);
 }
 
 /* Return (by reference) the score of the specified member of the sorted set
@@ -1256,13 +1498,13 @@ void zsetConvertToZiplistIfNeeded(robj *zobj, size_t maxelelen) {
 int zsetScore(robj *zobj, sds member, double *score) {
     if (!zobj || !member) return C_ERR;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         if (zzlFind(zobj->ptr, member, score) == NULL) return C_ERR;
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         dictEntry *de = dictFind(zs->dict, member);
         if (de == NULL) return C_ERR;
-        *score = *(double*)dictGetVal(de);
+        *score = dictGetDoubleVal(de);
     } else {
         serverPanic("Unknown sorted set encoding");
     }
@@ -1306,7 +1548,7 @@ int zsetScore(robj *zobj, sds member, double *score) {
  * start.
  *
  * The command as a side effect of adding a new element may convert the sorted
- * set internal encoding from ziplist to hashtable+skiplist.
+ * set internal encoding from listpack to hashtable+skiplist.
  *
  * Memory management of 'ele':
  *
@@ -1327,7 +1569,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     }
 
     /* Update the sorted set according to its encoding. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,&curscore)) != NULL) {
@@ -1358,8 +1600,8 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
             /* Optimize: check if the element is too large or the list
              * becomes too long *before* executing zzlInsert. */
             zobj->ptr = zzlInsert(zobj->ptr,ele,score);
-            if (zzlLength(zobj->ptr) > server.zset_max_ziplist_entries ||
-                sdslen(ele) > server.zset_max_ziplist_value)
+            if (zzlLength(zobj->ptr) > server.zset_max_listpack_entries ||
+                sdslen(ele) > server.zset_max_listpack_value)
                 zsetConvert(zobj,OBJ_ENCODING_SKIPLIST);
             if (newscore) *newscore = score;
             *flags |= ZADD_ADDED;
@@ -1370,7 +1612,6 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
         }
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
-        zskiplistNode *znode;
         dictEntry *de;
 
         de = dictFind(zs->dict,ele);
@@ -1380,7 +1621,7 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
                 *flags |= ZADD_NOP;
                 return 1;
             }
-            curscore = *(double*)dictGetVal(de);
+            curscore = dictGetDoubleVal(de);
 
             /* Prepare the score for the increment if needed. */
             if (incr) {
@@ -1394,18 +1635,16 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
 
             /* Remove and re-insert when score changes. */
             if (score != curscore) {
-                znode = zslUpdateScore(zs->zsl,curscore,ele,score);
+                zslUpdateScore(zs->zsl,curscore,ele,score);
                 /* Note that we did not removed the original element from
                  * the hash table representing the sorted set, so we just
                  * update the score. */
-                dictGetVal(de) = &znode->score; /* Update score ptr. */
+                dictSetDoubleVal(de,score);
                 *flags |= ZADD_UPDATED;
             }
             return 1;
         } else if (!xx) {
-            ele = sdsdup(ele);
-            znode = zslInsert(zs->zsl,score,ele);
-            serverAssert(dictAdd(zs->dict,ele,&znode->score) == DICT_OK);
+            zsetInsert(zs,score,sdsdup(ele));
             *flags |= ZADD_ADDED;
             if (newscore) *newscore = score;
             return 1;
@@ -1419,10 +1658,21 @@ int zsetAdd(robj *zobj, double score, sds ele, int *flags, double *newscore) {
     return 0; /* Never reached. */
 }
 
+/* Add the new element 'ele' with the specified score to the skiplist encoded
+ * sorted set 'zs', both in the skiplist and in the hash table. The element
+ * must not exist yet, and the sorted set takes the ownership of 'ele'. */
+void zsetInsert(zset *zs, double score, sds ele) {
+    dictEntry *de = dictAddRaw(zs->dict,ele,NULL);
+
+    serverAssert(de != NULL);
+    dictSetDoubleVal(de,score);
+    zslInsert(zs->zsl,score,ele);
+}
+
 /* Delete the element 'ele' from the sorted set, returning 1 if the element
  * existed and was deleted, 0 otherwise (the element was not there). */
 int zsetDel(robj *zobj, sds ele) {
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *eptr;
 
         if ((eptr = zzlFind(zobj->ptr,ele,NULL)) != NULL) {
@@ -1437,7 +1687,7 @@ int zsetDel(robj *zobj, sds ele) {
         de = dictUnlink(zs->dict,ele);
         if (de != NULL) {
             /* Get the score in order to delete from the skiplist later. */
-            score = *(double*)dictGetVal(de);
+            score = dictGetDoubleVal(de);
 
             /* Delete from the hash table and later from the skiplist.
              * Note that the order is important: deleting from the skiplist
@@ -1447,7 +1697,7 @@ int zsetDel(robj *zobj, sds ele) {
             dictFreeUnlinkedEntry(zs->dict,de);
 
             /* Delete from skiplist. */
-            int retval = zslDelete(zs->zsl,score,ele,NULL);
+            int retval = zslDelete(zs->zsl,score,ele);
             serverAssert(retval);
 
             if (htNeedsResize(zs->dict)) dictResize(zs->dict);
@@ -1476,18 +1726,18 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
 
     llen = zsetLength(zobj);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
-        eptr = ziplistIndex(zl,0);
+        eptr = lpSeek(zl,0);
         serverAssert(eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssert(sptr != NULL);
 
         rank = 1;
         while(eptr != NULL) {
-            if (ziplistCompare(eptr,(unsigned char*)ele,sdslen(ele)))
+            if (lpCompare(eptr,(unsigned char*)ele,sdslen(ele)))
                 break;
             rank++;
             zzlNext(zl,&eptr,&sptr);
@@ -1509,7 +1759,7 @@ long zsetRank(robj *zobj, sds ele, int reverse) {
 
         de = dictFind(zs->dict,ele);
         if (de != NULL) {
-            score = *(double*)dictGetVal(de);
+            score = dictGetDoubleVal(de);
             rank = zslGetRank(zsl,score,ele);
             /* Existing elements always have a rank. */
             serverAssert(rank != 0);
@@ -1601,12 +1851,12 @@ void zaddGenericCommand(client *c, int flags) {
     if (checkType(c,zobj,OBJ_ZSET)) goto cleanup;
     if (zobj == NULL) {
         if (xx) goto reply_to_client; /* No key + XX option: nothing to do. */
-        if (server.zset_max_ziplist_entries == 0 ||
-            server.zset_max_ziplist_value < sdslen(c->argv[scoreidx+1]->ptr))
+        if (server.zset_max_listpack_entries == 0 ||
+            server.zset_max_listpack_value < sdslen(c->argv[scoreidx+1]->ptr))
         {
             zobj = createZsetObject();
         } else {
-            zobj = createZsetZiplistObject();
+            zobj = createZsetListpackObject();
         }
         dbAdd(c->db,key,zobj);
     }
@@ -1734,7 +1984,7 @@ void zremrangeGenericCommand(client *c, int rangetype) {
     }
 
     /* Step 3: Perform the range deletion operation. */
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         switch(rangetype) {
         case ZRANGE_RANK:
             zobj->ptr = zzlDeleteRangeByRank(zobj->ptr,start+1,end+1,&deleted);
@@ -1817,6 +2067,10 @@ typedef struct {
                 dictIterator *di;
                 dictEntry *de;
             } ht;
+            struct {
+                unsigned char *lp;
+                unsigned char *p;
+            } lp;
         } set;
 
         /* Sorted set iterators. */
@@ -1827,7 +2081,8 @@ typedef struct {
             } zl;
             struct {
                 zset *zs;
-                zskiplistNode *node;
+                zskiplistPos pos;
+                zskiplistEntry *entry;
             } sl;
         } zset;
     } iter;
@@ -1871,21 +2126,24 @@ void zuiInitIterator(zsetopsrc *op) {
             it->ht.dict = op->subject->ptr;
             it->ht.di = dictGetIterator(op->subject->ptr);
             it->ht.de = dictNext(it->ht.di);
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            it->lp.lp = op->subject->ptr;
+            it->lp.p = lpFirst(it->lp.lp);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             it->zl.zl = op->subject->ptr;
-            it->zl.eptr = ziplistIndex(it->zl.zl,0);
+            it->zl.eptr = lpSeek(it->zl.zl,0);
             if (it->zl.eptr != NULL) {
-                it->zl.sptr = ziplistNext(it->zl.zl,it->zl.eptr);
+                it->zl.sptr = lpNext(it->zl.zl,it->zl.eptr);
                 serverAssert(it->zl.sptr != NULL);
             }
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             it->sl.zs = op->subject->ptr;
-            it->sl.node = it->sl.zs->zsl->header->level[0].forward;
+            it->sl.entry = zslFirst(it->sl.zs->zsl,&it->sl.pos);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -1904,12 +2162,14 @@ void zuiClearIterator(zsetopsrc *op) {
             UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dictReleaseIterator(it->ht.di);
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            UNUSED(it); /* skip */
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             UNUSED(it); /* skip */
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             UNUSED(it); /* skip */
@@ -1931,11 +2191,13 @@ unsigned long zuiLength(zsetopsrc *op) {
         } else if (op->encoding == OBJ_ENCODING_HT) {
             dict *ht = op->subject->ptr;
             return dictSize(ht);
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            return lpLength(op->subject->ptr);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             return zzlLength(op->subject->ptr);
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
             zset *zs = op->subject->ptr;
@@ -1980,28 +2242,36 @@ int zuiNext(zsetopsrc *op, zsetopval *val) {
 
             /* Move to next element. */
             it->ht.de = dictNext(it->ht.di);
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            if (it->lp.p == NULL)
+                return 0;
+            val->estr = lpGetValue(it->lp.p,&val->elen,&val->ell);
+            val->score = 1.0;
+
+            /* Move to next element. */
+            it->lp.p = lpNext(it->lp.lp,it->lp.p);
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
         iterzset *it = &op->iter.zset;
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             /* No need to check both, but better be explicit. */
             if (it->zl.eptr == NULL || it->zl.sptr == NULL)
                 return 0;
-            serverAssert(ziplistGet(it->zl.eptr,&val->estr,&val->elen,&val->ell));
+            val->estr = lpGetValue(it->zl.eptr,&val->elen,&val->ell);
             val->score = zzlGetScore(it->zl.sptr);
 
             /* Move to next element. */
             zzlNext(it->zl.zl,&it->zl.eptr,&it->zl.sptr);
         } else if (op->encoding == OBJ_ENCODING_SKIPLIST) {
-            if (it->sl.node == NULL)
+            if (it->sl.entry == NULL)
                 return 0;
-            val->ele = it->sl.node->ele;
-            val->score = it->sl.node->score;
+            val->ele = it->sl.entry->ele;
+            val->score = it->sl.entry->score;
 
             /* Move to next element. */
-            it->sl.node = it->sl.node->level[0].forward;
+            it->sl.entry = zslNext(&it->sl.pos);
         } else {
             serverPanic("Unknown sorted set encoding");
         }
@@ -2097,13 +2367,21 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             } else {
                 return 0;
             }
+        } else if (op->encoding == OBJ_ENCODING_LISTPACK) {
+            zuiSdsFromValue(val);
+            if (setTypeIsMember(op->subject,val->ele)) {
+                *score = 1.0;
+                return 1;
+            } else {
+                return 0;
+            }
         } else {
             serverPanic("Unknown set encoding");
         }
     } else if (op->type == OBJ_ZSET) {
         zuiSdsFromValue(val);
 
-        if (op->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (op->encoding == OBJ_ENCODING_LISTPACK) {
             if (zzlFind(op->subject->ptr,val->ele,score) != NULL) {
                 /* Score is already set by zzlFind. */
                 return 1;
@@ -2114,7 +2392,7 @@ int zuiFind(zsetopsrc *op, zsetopval *val, double *score) {
             zset *zs = op->subject->ptr;
             dictEntry *de;
             if ((de = dictFind(zs->dict,val->ele)) != NULL) {
-                *score = *(double*)dictGetVal(de);
+                *score = dictGetDoubleVal(de);
                 return 1;
             } else {
                 return 0;
@@ -2169,6 +2447,447 @@ dictType setAccumulatorDictType = {
     NULL                       /* val destructor */
 };
 
+/* ZUNIONSTORE and ZINTERSTORE with big inputs may block the server for a
+ * long time, so when the inputs have at least zset-async-store-min-entries
+ * elements in total, the command is executed this way:
+ *
+ * 1. The elements of every input are copied, with their score, in a flat
+ *    buffer, and a bio.c thread computes the result from these snapshots.
+ *    Meanwhile the client is blocked, and it watches the input keys like
+ *    WATCH does, so that we know if they are modified.
+ * 2. When the result is ready, the command is called again: if the inputs
+ *    were not modified, and are still the same objects, the result computed
+ *    in background is just stored into the destination key. Otherwise the
+ *    command is executed in the main thread as usually.
+ *
+ * This way the destination key is written, and the command propagated and
+ * notified, only once and atomically, as if the command was executed when
+ * the result is ready. If the client is unblocked before (because it is
+ * disconnected, or the instance turns into a replica) the command is not
+ * executed at all. While clients are paused the completed jobs wait, and
+ * when the command is called again the checks processCommand() performs on
+ * write commands (maxmemory, disk errors, min-replicas-to-write) are
+ * performed again, since the state may have changed meanwhile. */
+typedef struct zsetStoreEntry {
+    double score;
+    uint32_t size;      /* Size of the entry, padding included. */
+    uint32_t eleoff;    /* Offset of the element SDS from the entry. */
+} zsetStoreEntry;
+
+typedef struct zsetStoreSource {
+    unsigned char *buf; /* Snapshot of the input: zsetStoreEntry structures,
+                           each followed by its element SDS. */
+    size_t used;        /* Bytes used in buf. */
+    unsigned long len;  /* Number of elements. */
+    double weight;
+} zsetStoreSource;
+
+typedef struct zsetStoreJob {
+    client *c;          /* Blocked client, or NULL if it was unblocked. */
+    robj **argv;        /* The command to call again when done. */
+    int argc;
+    struct redisCommand *cmd;
+    uint64_t reply_flags; /* CLIENT_REPLY_SKIP if it was set. */
+    robj **inputs;      /* The input objects, in the order of the arguments.
+                           We take a reference so that they can't be freed
+                           and a new object created at the same address. */
+    long setnum;
+    int op;
+    int aggregate;
+    int valid;          /* The inputs were not modified. */
+    zsetStoreSource *src; /* Snapshots, sorted from the smallest input. */
+    robj *result;       /* Skiplist encoded sorted set filled by the job. */
+    size_t maxelelen;   /* Longest element of the result. */
+} zsetStoreJob;
+
+/* Score of an element of ZINTERSTORE, and number of inputs it was found
+ * in so far. */
+typedef struct zsetStoreInterAcc {
+    double score;
+    long seen;
+} zsetStoreInterAcc;
+
+static list *zsetStoreDoneJobs;   /* Jobs completed by the bio thread. */
+static pthread_mutex_t zsetStoreMutex = PTHREAD_MUTEX_INITIALIZER;
+static unsigned long zsetStorePendingJobs; /* Jobs not handled yet. */
+static zsetStoreJob *zsetStoreReadyJob; /* Job whose command is called. */
+
+#define zsetStoreEntryEle(e) ((sds)((char*)(e)+(e)->eleoff))
+
+/* Copy the elements of the input 'op' in the snapshot 'dst'. */
+static void zsetStoreSnapshot(zsetStoreSource *dst, zsetopsrc *op) {
+    zsetopval zval;
+    size_t alloc;
+
+    dst->buf = NULL;
+    dst->used = 0;
+    dst->len = 0;
+    dst->weight = op->weight;
+    if (zuiLength(op) == 0) return;
+
+    alloc = zuiLength(op)*(sizeof(zsetStoreEntry)+16);
+    dst->buf = zmalloc(alloc);
+    memset(&zval, 0, sizeof(zval));
+    zuiInitIterator(op);
+    while (zuiNext(op,&zval)) {
+        zsetStoreEntry *e;
+        size_t size;
+
+        zuiBufferFromValue(&zval);
+        size = sizeof(*e)+sdsinplacesize(zval.elen);
+        size = (size+7) & ~(size_t)7; /* Keep the entries aligned. */
+        if (dst->used+size > alloc) {
+            alloc = (dst->used+size)*2;
+            dst->buf = zrealloc(dst->buf,alloc);
+        }
+        e = (zsetStoreEntry*)(dst->buf+dst->used);
+        e->score = zval.score;
+        e->size = size;
+        e->eleoff = sdsnewinplace(e+1,zval.estr,zval.elen) - (char*)e;
+        dst->used += size;
+        dst->len++;
+    }
+    zuiClearIterator(op);
+    if (alloc > dst->used) dst->buf = zrealloc(dst->buf,dst->used);
+}
+
+/* Return true if the command should be executed in background. */
+static int zsetStoreInBackground(client *c, zsetopsrc *src, long setnum,
+                                 int op)
+{
+    unsigned long entries = 0;
+    long j;
+
+    if (server.zset_async_store_min_entries == 0 || zsetStoreReadyJob)
+        return 0;
+
+    /* The command must be executed immediately when it is part of a
+     * transaction, a script or the replication stream, and the client
+     * can't be blocked if it's already watching keys. In cluster mode the
+     * slot may be migrated while the job runs. */
+    if (c->flags & (CLIENT_MULTI|CLIENT_LUA|CLIENT_MASTER|CLIENT_MODULE) ||
+        listLength(c->watched_keys) || server.loading ||
+        server.cluster_enabled) return 0;
+
+    for (j = 0; j < setnum; j++) {
+        unsigned long len = zuiLength(&src[j]);
+
+        /* The intersection with an empty input is trivial. */
+        if (op == SET_OP_INTER && len == 0) return 0;
+        entries += len;
+    }
+    return entries >= server.zset_async_store_min_entries;
+}
+
+/* Snapshot the inputs, block the client and start the background job.
+ * 'src' is sorted in the process. */
+static void zsetStoreStartJob(client *c, zsetopsrc *src, long setnum, int op,
+                              int aggregate)
+{
+    zsetStoreJob *job = zcalloc(sizeof(*job));
+    long j;
+
+    job->c = c;
+    job->argc = c->argc;
+    job->argv = zmalloc(sizeof(robj*)*c->argc);
+    for (j = 0; j < c->argc; j++) {
+        job->argv[j] = c->argv[j];
+        incrRefCount(job->argv[j]);
+    }
+    job->cmd = c->cmd;
+    job->reply_flags = c->flags & CLIENT_REPLY_SKIP;
+    job->setnum = setnum;
+    job->op = op;
+    job->aggregate = aggregate;
+    job->inputs = zmalloc(sizeof(robj*)*setnum);
+    for (j = 0; j < setnum; j++) {
+        job->inputs[j] = src[j].subject;
+        if (src[j].subject) incrRefCount(src[j].subject);
+        watchForKey(c,c->argv[3+j]);
+    }
+
+    qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
+    job->src = zmalloc(sizeof(zsetStoreSource)*setnum);
+    for (j = 0; j < setnum; j++) zsetStoreSnapshot(&job->src[j],&src[j]);
+    job->result = createZsetObject();
+
+    c->bpop.timeout = 0;
+    c->bpop.zset_store_job = job;
+    blockClient(c,BLOCKED_ZSETSTORE);
+    zsetStorePendingJobs++;
+    bioCreateBackgroundJob(BIO_ZSET_STORE,job,NULL,NULL);
+}
+
+/* Return true if the result of the job can be stored: the command was not
+ * modified, and the inputs 'src' (in the order of the arguments) are the
+ * ones the job snapshotted. */
+static int zsetStoreJobIsValid(zsetStoreJob *job, zsetopsrc *src,
+                               long setnum)
+{
+    long j;
+
+    if (!job->valid || job->setnum != setnum) return 0;
+    for (j = 0; j < setnum; j++)
+        if (src[j].subject != job->inputs[j]) return 0;
+    return 1;
+}
+
+/* Compute the result of the job. Called by the bio.c thread, so it can
+ * only access the job and the snapshots. */
+void zsetStoreFromBioThread(void *arg) {
+    zsetStoreJob *job = arg;
+    zsetStoreSource *src = job->src;
+    long setnum = job->setnum, j;
+    zset *dstzset = job->result->ptr;
+    dict *accumulator = dictCreate(&setAccumulatorDictType,NULL);
+    zsetStoreEntry *e;
+    unsigned char *p;
+    dictEntry *de, *existing;
+    double score;
+
+    if (job->op == SET_OP_INTER) {
+        /* Accumulate the scores of the elements of the smallest input,
+         * counting in how many inputs every element was found. Inputs are
+         * processed in order, so an element is only updated if it was found
+         * in all the previous ones. */
+        zsetStoreInterAcc *acc, *a;
+        unsigned long k = 0;
+
+        acc = zmalloc(sizeof(*acc)*src[0].len);
+        dictExpand(accumulator,src[0].len);
+        for (p = src[0].buf; p < src[0].buf+src[0].used; p += e->size) {
+            e = (zsetStoreEntry*)p;
+            score = src[0].weight * e->score;
+            if (isnan(score)) score = 0;
+            acc[k].score = score;
+            acc[k].seen = 1;
+            dictAdd(accumulator,zsetStoreEntryEle(e),&acc[k]);
+            k++;
+        }
+        for (j = 1; j < setnum; j++) {
+            for (p = src[j].buf; p < src[j].buf+src[j].used; p += e->size) {
+                e = (zsetStoreEntry*)p;
+                de = dictFind(accumulator,zsetStoreEntryEle(e));
+                if (de == NULL) continue;
+
+                a = dictGetVal(de);
+                if (a->seen != j) continue;
+                score = e->score*src[j].weight;
+                zunionInterAggregate(&a->score,score,job->aggregate);
+                a->seen++;
+            }
+        }
+
+        /* Only the elements present in every input are part of the
+         * result. */
+        k = 0;
+        for (p = src[0].buf; p < src[0].buf+src[0].used; p += e->size) {
+            e = (zsetStoreEntry*)p;
+            if (acc[k].seen == setnum) {
+                sds ele = zsetStoreEntryEle(e);
+                zsetInsert(dstzset,acc[k].score,sdsdup(ele));
+                if (sdslen(ele) > job->maxelelen) job->maxelelen = sdslen(ele);
+            }
+            k++;
+        }
+        zfree(acc);
+    } else if (job->op == SET_OP_UNION) {
+        dictIterator *di;
+
+        /* Our union is at least as large as the largest set. */
+        dictExpand(accumulator,src[setnum-1].len);
+        for (j = 0; j < setnum; j++) {
+            for (p = src[j].buf; p < src[j].buf+src[j].used; p += e->size) {
+                e = (zsetStoreEntry*)p;
+                score = src[j].weight * e->score;
+                if (isnan(score)) score = 0;
+
+                de = dictAddRaw(accumulator,zsetStoreEntryEle(e),&existing);
+                if (!existing) {
+                    dictSetDoubleVal(de,score);
+                } else {
+                    zunionInterAggregate(&existing->v.d,score,job->aggregate);
+                }
+            }
+        }
+
+        dictExpand(dstzset->dict,dictSize(accumulator));
+        di = dictGetIterator(accumulator);
+        while((de = dictNext(di)) != NULL) {
+            sds ele = dictGetKey(de);
+            zsetInsert(dstzset,dictGetDoubleVal(de),sdsdup(ele));
+            if (sdslen(ele) > job->maxelelen) job->maxelelen = sdslen(ele);
+        }
+        dictReleaseIterator(di);
+    } else {
+        serverPanic("Unknown operator");
+    }
+    dictRelease(accumulator);
+
+    /* The snapshots are no longer needed: free them here, not in the
+     * main thread. */
+    for (j = 0; j < setnum; j++) zfree(src[j].buf);
+    zfree(src);
+    job->src = NULL;
+
+    pthread_mutex_lock(&zsetStoreMutex);
+    listAddNodeTail(zsetStoreDoneJobs,job);
+    if (write(server.zset_store_pipe[1],"A",1) != 1) {
+        /* Ignore the error, this is best-effort. */
+    }
+    pthread_mutex_unlock(&zsetStoreMutex);
+}
+
+static void zsetStoreFreeJob(zsetStoreJob *job) {
+    long j;
+
+    for (j = 0; j < job->argc; j++) decrRefCount(job->argv[j]);
+    zfree(job->argv);
+    /* Inputs deleted in the meantime, and results not stored, may be huge:
+     * free them in background if needed. The inputs may also be referenced
+     * by a database the lazyfree thread is releasing: in that case our
+     * reference must be dropped later, see decrRefCountLazyfreeSafe(). */
+    for (j = 0; j < job->setnum; j++) {
+        if (job->inputs[j] == NULL) continue;
+        if (lazyfreeGetPendingObjectsCount() != 0)
+            decrRefCountLazyfreeSafe(job->inputs[j]);
+        else
+            freeObjAsync(job->inputs[j]);
+    }
+    zfree(job->inputs);
+    if (job->result) freeObjAsync(job->result);
+    zfree(job);
+}
+
+/* Called by unblockClient(): the client is no longer waiting for the
+ * result, if the job is not completed it is just discarded. */
+void unblockClientFromZsetStore(client *c) {
+    zsetStoreJob *job = c->bpop.zset_store_job;
+
+    job->c = NULL;
+    c->bpop.zset_store_job = NULL;
+    unwatchAllKeys(c);
+    c->flags &= ~CLIENT_DIRTY_CAS;
+}
+
+/* The readable handler of the pipe, the byte is read in
+ * zsetStoreHandleCompletedJobs(). */
+static void zsetStorePipeReadable(aeEventLoop *el, int fd, void *privdata,
+                                  int mask)
+{
+    UNUSED(el);
+    UNUSED(fd);
+    UNUSED(privdata);
+    UNUSED(mask);
+}
+
+void zsetStoreInit(void) {
+    zsetStoreDoneJobs = listCreate();
+    if (pipe(server.zset_store_pipe) == -1) {
+        serverLog(LL_WARNING,
+            "Can't create the pipe for background ZUNIONSTORE/ZINTERSTORE: %s",
+            strerror(errno));
+        exit(1);
+    }
+    anetNonBlock(NULL,server.zset_store_pipe[0]);
+    anetNonBlock(NULL,server.zset_store_pipe[1]);
+    if (aeCreateFileEvent(server.el,server.zset_store_pipe[0],AE_READABLE,
+        zsetStorePipeReadable,NULL) == AE_ERR)
+    {
+        serverPanic("Error registering the readable event for the "
+                    "background ZUNIONSTORE/ZINTERSTORE pipe.");
+    }
+}
+
+/* Perform again the checks processCommand() performs before executing write
+ * commands, that the command of client 'c' passed when it was first called.
+ * Returns 1, after replying with the error, if the command can't write. */
+static int zsetStoreWriteDenied(client *c) {
+    if (server.maxmemory && freeMemoryIfNeededAndSafe() == C_ERR) {
+        rejectCommand(c,shared.oomerr);
+        return 1;
+    }
+
+    int deny_write_type = writeCommandsDeniedByDiskError();
+    if (deny_write_type != DISK_ERROR_TYPE_NONE && server.masterhost == NULL) {
+        if (deny_write_type == DISK_ERROR_TYPE_RDB)
+            rejectCommand(c,shared.bgsaveerr);
+        else
+            rejectCommandFormat(c,
+                "-MISCONF Errors writing to the AOF file: %s\r\n",
+                strerror(server.aof_last_write_errno));
+        return 1;
+    }
+
+    if (server.masterhost == NULL &&
+        server.repl_min_slaves_to_write &&
+        server.repl_min_slaves_max_lag &&
+        server.repl_good_slaves_count < server.repl_min_slaves_to_write)
+    {
+        rejectCommand(c,shared.noreplicaserr);
+        return 1;
+    }
+    return 0;
+}
+
+/* Called in beforeSleep(): for every completed job, unblock the client and
+ * call its command again, that will store the result of the job. */
+void zsetStoreHandleCompletedJobs(void) {
+    list *done;
+    listNode *ln;
+    char buf[1];
+
+    if (zsetStorePendingJobs == 0) return;
+
+    /* Like the active expire and the eviction, don't write while clients
+     * are paused: the completed jobs stay in zsetStoreDoneJobs. */
+    pthread_mutex_lock(&zsetStoreMutex);
+    while (read(server.zset_store_pipe[0],buf,1) == 1);
+    if (clientsArePaused()) {
+        pthread_mutex_unlock(&zsetStoreMutex);
+        return;
+    }
+    done = zsetStoreDoneJobs;
+    zsetStoreDoneJobs = listCreate();
+    pthread_mutex_unlock(&zsetStoreMutex);
+
+    while ((ln = listFirst(done)) != NULL) {
+        zsetStoreJob *job = ln->value;
+        client *c = job->c;
+
+        listDelNode(done,ln);
+        zsetStorePendingJobs--;
+        if (c) {
+            robj **argv = c->argv;
+            int argc = c->argc;
+
+            job->valid = !(c->flags & CLIENT_DIRTY_CAS);
+            unblockClient(c);
+
+            c->argv = job->argv;
+            c->argc = job->argc;
+            c->cmd = c->lastcmd = job->cmd;
+            c->flags |= job->reply_flags;
+            zsetStoreReadyJob = job;
+            server.current_client = c;
+            if (!zsetStoreWriteDenied(c)) call(c,CMD_CALL_PROPAGATE);
+            server.current_client = NULL;
+            zsetStoreReadyJob = NULL;
+            c->flags &= ~CLIENT_REPLY_SKIP;
+            c->argv = argv;
+            c->argc = argc;
+            c->cmd = NULL;
+
+            /* The destination key may unblock clients in BZPOPMIN and
+             * similar commands. */
+            if (listLength(server.ready_keys))
+                handleClientsBlockedOnKeys();
+        }
+        zsetStoreFreeJob(job);
+    }
+    listRelease(done);
+}
+
 void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     int i, j;
     long setnum;
@@ -2179,7 +2898,6 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
     size_t maxelelen = 0;
     robj *dstobj;
     zset *dstzset;
-    zskiplistNode *znode;
 
     /* expect setnum input keys to be given */
     if ((getLongFromObjectOrReply(c, c->argv[2], &setnum, NULL) != C_OK))
@@ -2260,6 +2978,23 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         }
     }
 
+    /* Store the result computed in background, unless the inputs were
+     * modified in the meantime, or start the background job if the inputs
+     * are big enough. See zsetStoreStartJob(). */
+    if (zsetStoreReadyJob &&
+        zsetStoreJobIsValid(zsetStoreReadyJob,src,setnum))
+    {
+        dstobj = zsetStoreReadyJob->result;
+        dstzset = dstobj->ptr;
+        maxelelen = zsetStoreReadyJob->maxelelen;
+        zsetStoreReadyJob->result = NULL;
+        goto store;
+    } else if (zsetStoreInBackground(c,src,setnum,op)) {
+        zsetStoreStartJob(c,src,setnum,op,aggregate);
+        zfree(src);
+        return;
+    }
+
     /* sort sets from the smallest to largest, this will improve our
      * algorithm's performance */
     qsort(src,setnum,sizeof(zsetopsrc),zuiCompareByCardinality);
@@ -2297,8 +3032,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 /* Only continue when present in every input. */
                 if (j == setnum) {
                     tmp = zuiNewSdsFromValue(&zval);
-                    znode = zslInsert(dstzset->zsl,score,tmp);
-                    dictAdd(dstzset->dict,tmp,&znode->score);
+                    zsetInsert(dstzset,score,tmp);
                     if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                 }
             }
@@ -2333,7 +3067,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
                 if (!existing) {
                     tmp = zuiNewSdsFromValue(&zval);
                     /* Remember the longest single element encountered,
-                     * to understand if it's possible to convert to ziplist
+                     * to understand if it's possible to convert to listpack
                      * at the end. */
                      if (sdslen(tmp) > maxelelen) maxelelen = sdslen(tmp);
                     /* Update the element with its initial score. */
@@ -2363,8 +3097,7 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         while((de = dictNext(di)) != NULL) {
             sds ele = dictGetKey(de);
             score = dictGetDoubleVal(de);
-            znode = zslInsert(dstzset->zsl,score,ele);
-            dictAdd(dstzset->dict,ele,&znode->score);
+            zsetInsert(dstzset,score,ele);
         }
         dictReleaseIterator(di);
         dictRelease(accumulator);
@@ -2372,8 +3105,9 @@ void zunionInterGenericCommand(client *c, robj *dstkey, int op) {
         serverPanic("Unknown operator");
     }
 
+store:
     if (dstzset->zsl->length) {
-        zsetConvertToZiplistIfNeeded(dstobj,maxelelen);
+        zsetConvertToListpackIfNeeded(dstobj,maxelelen);
         setKey(c,c->db,dstkey,dstobj);
         addReplyLongLong(c,zsetLength(dstobj));
         notifyKeyspaceEvent(NOTIFY_ZSET,
@@ -2445,7 +3179,7 @@ void zrangeGenericCommand(client *c, int reverse) {
     else
         addReplyArrayLen(c, rangelen);
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2453,16 +3187,16 @@ void zrangeGenericCommand(client *c, int reverse) {
         long long vlong;
 
         if (reverse)
-            eptr = ziplistIndex(zl,-2-(2*start));
+            eptr = lpSeek(zl,-2-(2*start));
         else
-            eptr = ziplistIndex(zl,2*start);
+            eptr = lpSeek(zl,2*start);
 
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         while (rangelen--) {
             serverAssertWithInfo(c,zobj,eptr != NULL && sptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
             if (vstr == NULL)
@@ -2480,18 +3214,21 @@ void zrangeGenericCommand(client *c, int reverse) {
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zskiplistEntry *ln;
+        zskiplistPos pos;
         sds ele;
 
         /* Check if starting point is trivial, before doing log(N) lookup. */
         if (reverse) {
-            ln = zsl->tail;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,llen-start);
+                ln = zslGetElementByRank(zsl,llen-start,&pos);
+            else
+                ln = zslLast(zsl,&pos);
         } else {
-            ln = zsl->header->level[0].forward;
             if (start > 0)
-                ln = zslGetElementByRank(zsl,start+1);
+                ln = zslGetElementByRank(zsl,start+1,&pos);
+            else
+                ln = zslFirst(zsl,&pos);
         }
 
         while(rangelen--) {
@@ -2500,7 +3237,7 @@ void zrangeGenericCommand(client *c, int reverse) {
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
             addReplyBulkCBuffer(c,ele,sdslen(ele));
             if (withscores) addReplyDouble(c,ln->score);
-            ln = reverse ? ln->backward : ln->level[0].forward;
+            ln = reverse ? zslPrev(&pos) : zslNext(&pos);
         }
     } else {
         serverPanic("Unknown sorted set encoding");
@@ -2570,7 +3307,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
     if ((zobj = lookupKeyReadOrReply(c,key,shared.emptyarray)) == NULL ||
         checkType(c,zobj,OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2593,7 +3330,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2620,9 +3357,7 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
                 if (!zslValueLteMax(score,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
-             * succeed */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             rangelen++;
             if (withscores && c->resp > 2) addReplyArrayLen(c,2);
@@ -2643,13 +3378,14 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zskiplistEntry *ln;
+        zskiplistPos pos;
 
         /* If reversed, get the last node in range as starting point. */
         if (reverse) {
-            ln = zslLastInRange(zsl,&range);
+            ln = zslLastInRange(zsl,&range,&pos);
         } else {
-            ln = zslFirstInRange(zsl,&range);
+            ln = zslFirstInRange(zsl,&range,&pos);
         }
 
         /* No "first" element in the specified interval. */
@@ -2667,9 +3403,9 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
          * checking the score because that is done in the next loop. */
         while (ln && offset--) {
             if (reverse) {
-                ln = ln->backward;
+                ln = zslPrev(&pos);
             } else {
-                ln = ln->level[0].forward;
+                ln = zslNext(&pos);
             }
         }
 
@@ -2688,9 +3424,9 @@ void genericZrangebyscoreCommand(client *c, int reverse) {
 
             /* Move to next node */
             if (reverse) {
-                ln = ln->backward;
+                ln = zslPrev(&pos);
             } else {
-                ln = ln->level[0].forward;
+                ln = zslNext(&pos);
             }
         }
     } else {
@@ -2725,7 +3461,7 @@ void zcountCommand(client *c) {
     if ((zobj = lookupKeyReadOrReply(c, key, shared.czero)) == NULL ||
         checkType(c, zobj, OBJ_ZSET)) return;
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         double score;
@@ -2740,7 +3476,7 @@ void zcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         score = zzlGetScore(sptr);
         serverAssertWithInfo(c,zobj,zslValueLteMax(score,&range));
 
@@ -2759,11 +3495,12 @@ void zcountCommand(client *c) {
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
-        zskiplistNode *zn;
+        zskiplistEntry *zn;
+        zskiplistPos pos;
         unsigned long rank;
 
         /* Find first element in range */
-        zn = zslFirstInRange(zsl, &range);
+        zn = zslFirstInRange(zsl, &range, &pos);
 
         /* Use rank of first element, if any, to determine preliminary count */
         if (zn != NULL) {
@@ -2771,7 +3508,7 @@ void zcountCommand(client *c) {
             count = (zsl->length - (rank - 1));
 
             /* Find last element in range */
-            zn = zslLastInRange(zsl, &range);
+            zn = zslLastInRange(zsl, &range, &pos);
 
             /* Use rank of last element, if any, to determine the actual count */
             if (zn != NULL) {
@@ -2806,7 +3543,7 @@ void zlexcountCommand(client *c) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
 
@@ -2821,7 +3558,7 @@ void zlexcountCommand(client *c) {
         }
 
         /* First element is in range */
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
         serverAssertWithInfo(c,zobj,zzlLexValueLteMax(eptr,&range));
 
         /* Iterate over elements in range */
@@ -2837,11 +3574,12 @@ void zlexcountCommand(client *c) {
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
-        zskiplistNode *zn;
+        zskiplistEntry *zn;
+        zskiplistPos pos;
         unsigned long rank;
 
         /* Find first element in range */
-        zn = zslFirstInLexRange(zsl, &range);
+        zn = zslFirstInLexRange(zsl, &range, &pos);
 
         /* Use rank of first element, if any, to determine preliminary count */
         if (zn != NULL) {
@@ -2849,7 +3587,7 @@ void zlexcountCommand(client *c) {
             count = (zsl->length - (rank - 1));
 
             /* Find last element in range */
-            zn = zslLastInLexRange(zsl, &range);
+            zn = zslLastInLexRange(zsl, &range, &pos);
 
             /* Use rank of last element, if any, to determine the actual count */
             if (zn != NULL) {
@@ -2919,7 +3657,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
         return;
     }
 
-    if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+    if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
         unsigned char *zl = zobj->ptr;
         unsigned char *eptr, *sptr;
         unsigned char *vstr;
@@ -2942,7 +3680,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
         /* Get score pointer for the first element. */
         serverAssertWithInfo(c,zobj,eptr != NULL);
-        sptr = ziplistNext(zl,eptr);
+        sptr = lpNext(zl,eptr);
 
         /* We don't know in advance how many matching elements there are in the
          * list, so we push this object that will represent the multi-bulk
@@ -2967,9 +3705,7 @@ void genericZrangebylexCommand(client *c, int reverse) {
                 if (!zzlLexValueLteMax(eptr,&range)) break;
             }
 
-            /* We know the element exists, so ziplistGet should always
-             * succeed. */
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
 
             rangelen++;
             if (vstr == NULL) {
@@ -2988,13 +3724,14 @@ void genericZrangebylexCommand(client *c, int reverse) {
     } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
         zset *zs = zobj->ptr;
         zskiplist *zsl = zs->zsl;
-        zskiplistNode *ln;
+        zskiplistEntry *ln;
+        zskiplistPos pos;
 
         /* If reversed, get the last node in range as starting point. */
         if (reverse) {
-            ln = zslLastInLexRange(zsl,&range);
+            ln = zslLastInLexRange(zsl,&range,&pos);
         } else {
-            ln = zslFirstInLexRange(zsl,&range);
+            ln = zslFirstInLexRange(zsl,&range,&pos);
         }
 
         /* No "first" element in the specified interval. */
@@ -3013,9 +3750,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
          * checking the score because that is done in the next loop. */
         while (ln && offset--) {
             if (reverse) {
-                ln = ln->backward;
+                ln = zslPrev(&pos);
             } else {
-                ln = ln->level[0].forward;
+                ln = zslNext(&pos);
             }
         }
 
@@ -3032,9 +3769,9 @@ void genericZrangebylexCommand(client *c, int reverse) {
 
             /* Move to next node */
             if (reverse) {
-                ln = ln->backward;
+                ln = zslPrev(&pos);
             } else {
-                ln = ln->level[0].forward;
+                ln = zslNext(&pos);
             }
         }
     } else {
@@ -3183,7 +3920,7 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
 
     /* Remove the element. */
     do {
-        if (zobj->encoding == OBJ_ENCODING_ZIPLIST) {
+        if (zobj->encoding == OBJ_ENCODING_LISTPACK) {
             unsigned char *zl = zobj->ptr;
             unsigned char *eptr, *sptr;
             unsigned char *vstr;
@@ -3191,26 +3928,27 @@ void genericZpopCommand(client *c, robj **keyv, int keyc, int where, int emitkey
             long long vlong;
 
             /* Get the first or last element in the sorted set. */
-            eptr = ziplistIndex(zl,where == ZSET_MAX ? -2 : 0);
+            eptr = lpSeek(zl,where == ZSET_MAX ? -2 : 0);
             serverAssertWithInfo(c,zobj,eptr != NULL);
-            serverAssertWithInfo(c,zobj,ziplistGet(eptr,&vstr,&vlen,&vlong));
+            vstr = lpGetValue(eptr,&vlen,&vlong);
             if (vstr == NULL)
                 ele = sdsfromlonglong(vlong);
             else
                 ele = sdsnewlen(vstr,vlen);
 
             /* Get the score. */
-            sptr = ziplistNext(zl,eptr);
+            sptr = lpNext(zl,eptr);
             serverAssertWithInfo(c,zobj,sptr != NULL);
             score = zzlGetScore(sptr);
         } else if (zobj->encoding == OBJ_ENCODING_SKIPLIST) {
             zset *zs = zobj->ptr;
             zskiplist *zsl = zs->zsl;
-            zskiplistNode *zln;
+            zskiplistEntry *zln;
+            zskiplistPos pos;
 
             /* Get the first or last element in the sorted set. */
-            zln = (where == ZSET_MAX ? zsl->tail :
-                                       zsl->header->level[0].forward);
+            zln = (where == ZSET_MAX ? zslLast(zsl,&pos) :
+                                       zslFirst(zsl,&pos));
 
             /* There must be an element in the sorted set. */
             serverAssertWithInfo(c,zobj,zln != NULL);
@@ -681,6 +681,26 @@ static int connTLSWrite(connection *conn_, const void *data, size_t data_len) {
     return ret;
 }
 
+/* OpenSSL has no gather write: coalesce the buffers into a single TLS record
+ * when they are small, otherwise just write the first one. */
+#define TLS_WRITEV_BUF_SIZE (16*1024)
+
+static int connTLSWritev(connection *conn_, const struct iovec *iov, int iovcnt) {
+    char buf[TLS_WRITEV_BUF_SIZE];
+    size_t len = 0;
+
+    if (iovcnt == 1 || iov[0].iov_len >= TLS_WRITEV_BUF_SIZE)
+        return connTLSWrite(conn_, iov[0].iov_base, iov[0].iov_len);
+
+    for (int j = 0; j < iovcnt && len < TLS_WRITEV_BUF_SIZE; j++) {
+        size_t chunk = iov[j].iov_len;
+        if (chunk > TLS_WRITEV_BUF_SIZE - len) chunk = TLS_WRITEV_BUF_SIZE - len;
+        memcpy(buf+len, iov[j].iov_base, chunk);
+        len += chunk;
+    }
+    return connTLSWrite(conn_, buf, len);
+}
+
 static int connTLSRead(connection *conn_, void *buf, size_t buf_len) {
     tls_connection *conn = (tls_connection *) conn_;
     int ret;
@@ -836,6 +856,7 @@ ConnectionType CT_TLS = {
     .blocking_connect = connTLSBlockingConnect,
     .read = connTLSRead,
     .write = connTLSWrite,
+    .writev = connTLSWritev,
     .close = connTLSClose,
     .set_write_handler = connTLSSetWriteHandler,
     .set_read_handler = connTLSSetReadHandler,